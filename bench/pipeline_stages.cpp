@@ -0,0 +1,338 @@
+// Per-stage benchmark of the tone mapping pipeline at several synthetic
+// resolutions: EXR decode, the reference stages, the fused engine, the other
+// tone operators, every operator through its baked LUT, the image writers and,
+// on a software EGL backend, GL upload / dispatch / readback.
+// Prints a table and writes the results as JSON for regression tracking.
+//
+//    bench_pipeline [--sizes 1,4,16,100] [--repeats N] [--json file] [--no-gl] [--egl backend]
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include <OpenEXR/ImfHeader.h>
+
+#include "../utils/io.h"
+#include "../cpu/cpu_hdr.h"
+#include "../gpu/opengles_hdr.h"
+
+typedef chrono::steady_clock bench_clock;
+
+struct stage_result
+{
+   string stage;
+   int width, height;
+   double best_seconds, mean_seconds;
+   double bytes;
+};
+
+// Best and mean of repeats runs of run(), each preceded by an untimed setup()
+void timeStage(int repeats, const function<void()> &setup, const function<void()> &run,
+               double &best, double &mean) {
+   best = 1e30;
+   mean = 0.0;
+   for (int r = 0; r < repeats; ++r) {
+      setup();
+      bench_clock::time_point start = bench_clock::now();
+      run();
+      double seconds = chrono::duration<double>(bench_clock::now() - start).count();
+      best = min(best, seconds);
+      mean += seconds / repeats;
+   }
+}
+
+// Same tonal spread as the kernel microbenchmark: -14 to +8 stops with a slight tint
+void fillSynthetic(Rgba *pixels, size_t count) {
+   mt19937 rng(2024);
+   uniform_real_distribution<float> stops(-14.0f, 8.0f), tint(-0.5f, 0.5f);
+
+   for (size_t i = 0; i < count; ++i) {
+      float base = stops(rng);
+      pixels[i].r = exp2(base + tint(rng));
+      pixels[i].g = exp2(base);
+      pixels[i].b = exp2(base + tint(rng));
+      pixels[i].a = 1.0f;
+   }
+}
+
+string jsonEscape(const string &text) {
+   string escaped;
+   for (char c : text) {
+      if (c == '"' || c == '\\')
+         escaped += '\\';
+      escaped += c;
+   }
+   return escaped;
+}
+
+int main(int argc, char *argv[]) {
+   vector<double> megapixels = { 1, 4, 16, 100 };
+   int repeats = 3;
+   string json_path = "bench_pipeline.json";
+   bool use_gl = true;
+   egl_backend_type egl_backend = EGL_BACKEND_SURFACELESS;
+
+   for (int i = 1; i < argc; ++i) {
+      string arg = argv[i];
+      if (arg == "--sizes" && i + 1 < argc) {
+         megapixels.clear();
+         stringstream list(argv[++i]);
+         for (string size; getline(list, size, ',');)
+            megapixels.push_back(atof(size.c_str()));
+      }
+      else if (arg == "--repeats" && i + 1 < argc && atoi(argv[i + 1]) > 0)
+         repeats = atoi(argv[++i]);
+      else if (arg == "--json" && i + 1 < argc)
+         json_path = argv[++i];
+      else if (arg == "--no-gl")
+         use_gl = false;
+      else if (arg == "--egl" && i + 1 < argc && parseEglBackendType(argv[i + 1], egl_backend))
+         ++i;
+      else if (arg == "--gl-pack" && i + 1 < argc && selectGlPackFormat(argv[i + 1]))
+         ++i;
+      else {
+         fprintf(stderr, "Usage: %s [--sizes 1,4,16,100] [--repeats N] [--json file] [--no-gl] [--egl auto|gbm|device|surfaceless]"
+                 " [--gl-pack draw|ppm8|ppm10|ppm16]\n", argv[0]);
+         return EXIT_FAILURE;
+      }
+   }
+
+   const char *tmp = getenv("TMPDIR");
+   string scratch = string(tmp ? tmp : "/tmp") + "/bench_pipeline." + to_string(getpid());
+
+   // The reference stages report the scene statistics on cout, keep them out of the table
+   streambuf *console = cout.rdbuf(NULL);
+
+   setExrDecodeThreads(0);
+   unique_ptr<GLRenderer> renderer;
+   if (use_gl) {
+      renderer.reset(new GLRenderer(egl_backend));
+      if (!renderer->valid()) {
+         fprintf(stderr, "No usable EGL backend, skipping the GL stages\n");
+         renderer.reset();
+      }
+   }
+
+   vector<stage_result> results;
+   printf("%-31s %11s %10s %10s %12s\n", "stage", "size", "best ms", "MP/s", "MB/s");
+
+   for (double mp : megapixels) {
+      // 3:2 frames, the shape of most plates
+      int width = max(1, (int)lround(sqrt(mp * 1e6 * 1.5)));
+      int height = max(1, (int)lround(mp * 1e6 / width));
+      size_t count = (size_t)width * height;
+
+      BufferPool &buffers = imageBufferPool();
+      shared_ptr<Rgba> source = buffers.acquire<Rgba>(count);
+      shared_ptr<Rgba> work = buffers.acquire<Rgba>(count);
+      shared_ptr<float> luminance = buffers.acquire<float>(count);
+      shared_ptr<unsigned char> rgb_8bit = buffers.acquire<unsigned char>(count * 3);
+      shared_ptr<unsigned short> rgb_10bit = buffers.acquire<unsigned short>(count * 3);
+      fillSynthetic(source.get(), count);
+
+      auto restore = [&] { memcpy(work.get(), source.get(), count * sizeof(Rgba)); };
+      auto nothing = [] {};
+      auto record = [&](const string &stage, double bytes, const function<void()> &setup, const function<void()> &run) {
+         stage_result result = { stage, width, height, 0.0, 0.0, bytes };
+         timeStage(repeats, setup, run, result.best_seconds, result.mean_seconds);
+         results.push_back(result);
+         printf("%-31s %5dx%-5d %10.2f %10.1f %12.1f\n", stage.c_str(), width, height, result.best_seconds * 1e3,
+                count / 1e6 / result.best_seconds, bytes / 1e6 / result.best_seconds);
+         fflush(stdout);
+      };
+
+      // Decode of a ZIP compressed scanline file written from the synthetic frame
+      string exr_path = scratch + ".exr";
+      {
+         RgbaOutputFile out(exr_path.c_str(), Header(width, height), WRITE_RGBA);
+         out.setFrameBuffer(source.get(), 1, width);
+         out.writePixels(height);
+      }
+      record("exr_decode", count * sizeof(Rgba), nothing, [&] {
+         ExrChunkReader reader(exr_path.c_str());
+         reader.readRows(work.get(), 0, height);
+      });
+      unlink(exr_path.c_str());
+
+      // Reference stages, bytes are what each one reads plus writes
+      float max_brightness = 0.0f, avg_brightness = 0.0f;
+      record("compute_luminance", count * (sizeof(Rgba) + sizeof(float)), nothing, [&] {
+         computeLuminance(source.get(), luminance.get(), width, height);
+      });
+      record("special_brightness", count * sizeof(float), nothing, [&] {
+         max_brightness = numeric_limits<float>::min();
+         computeSpecialBrightnessValues(luminance.get(), width, height, max_brightness, avg_brightness);
+      });
+      scaleLuminances(luminance.get(), avg_brightness, width, height);
+      record("compress_luminances", count * (2 * sizeof(Rgba) + sizeof(float)), restore, [&] {
+         compressLuminances(work.get(), luminance.get(), max_brightness, width, height);
+      });
+      record("correct_gamma", count * 2 * sizeof(Rgba), restore, [&] {
+         correctGamma(work.get(), width, height);
+      });
+
+      // Fused engine
+      scene_statistics stats;
+      record("scene_statistics", count * sizeof(Rgba), nothing, [&] {
+         statistics_accumulator acc;
+         accumulateSceneStatistics(source.get(), width, height, acc);
+         finishSceneStatistics(acc, stats, false);
+      });
+      record("scene_statistics_stride4", count / 16 * sizeof(Rgba), nothing, [&] {
+         statistics_accumulator acc;
+         accumulateSubsampledStatistics(source.get(), width, height, 4, acc);
+      });
+      histogramSettings().white_percentile = 99.9f;
+      record("scene_statistics_histogram", count * sizeof(Rgba), nothing, [&] {
+         statistics_accumulator acc;
+         scene_statistics percentile_stats;
+         accumulateSceneStatistics(source.get(), width, height, acc);
+         finishSceneStatistics(acc, percentile_stats, false);
+      });
+      histogramSettings().white_percentile = 100.0f;
+      record("tone_map_fused", count * (sizeof(Rgba) + 3 + 3 * sizeof(unsigned short)), nothing, [&] {
+         toneMapRows(source.get(), stats, rgb_8bit.get(), rgb_10bit.get(), width, height);
+      });
+      for (int op = 0; op < TONE_OPERATOR_COUNT; ++op) {
+         // Every other curve runs its scalar operator kernel
+         if (op == TONE_OPERATOR_REINHARD_EXTENDED)
+            continue;
+         toneCurveSelection().op = (tone_operator_type)op;
+         record(string("tone_map_") + tone_operators[op].name, count * (sizeof(Rgba) + 3 + 3 * sizeof(unsigned short)), nothing, [&] {
+            toneMapRows(source.get(), stats, rgb_8bit.get(), rgb_10bit.get(), width, height);
+         });
+      }
+
+      // Every curve again through its baked tables, the bake lands in the first repeat
+      toneLutSelection().enabled = true;
+      for (int op = 0; op < TONE_OPERATOR_COUNT; ++op) {
+         toneCurveSelection().op = (tone_operator_type)op;
+         record(string("tone_map_lut_") + tone_operators[op].name, count * (sizeof(Rgba) + 3 + 3 * sizeof(unsigned short)), nothing, [&] {
+            toneMapRows(source.get(), stats, rgb_8bit.get(), rgb_10bit.get(), width, height);
+         });
+      }
+      toneLutSelection().enabled = false;
+      toneCurveSelection().op = TONE_OPERATOR_REINHARD_EXTENDED;
+
+      // The default curve with every other transfer, the HDR ones against sRGB
+      toneCurveSelection().transfer_set = true;
+      for (transfer_type transfer : { TRANSFER_SRGB, TRANSFER_PQ, TRANSFER_HLG }) {
+         toneCurveSelection().transfer = transfer;
+         record(string("tone_map_") + transfer_functions[transfer].name, count * (sizeof(Rgba) + 3 + 3 * sizeof(unsigned short)), nothing, [&] {
+            toneMapRows(source.get(), stats, rgb_8bit.get(), rgb_10bit.get(), width, height);
+         });
+      }
+      toneCurveSelection().transfer_set = false;
+
+      // Local operator: the grid, then the default curve with the gain in front
+      localToneSettings().enabled = true;
+      shared_ptr<bilateral_grid> grid;
+      record("local_grid", count * sizeof(Rgba), nothing, [&] {
+         grid = startLocalGrid(width, height);
+         buildBilateralGrid(*grid, source.get(), width, height);
+      });
+      scene_statistics local_stats = stats;
+      local_stats.local_grid = grid;
+      record("tone_map_local", count * (sizeof(Rgba) + 3 + 3 * sizeof(unsigned short)), nothing, [&] {
+         toneMapRows(source.get(), local_stats, rgb_8bit.get(), rgb_10bit.get(), width, height);
+      });
+      localToneSettings().enabled = false;
+
+      // Half, quarter and eighth size proxies, reduced from the whole frame
+      for (pyramid_filter filter : { PYRAMID_FILTER_BOX, PYRAMID_FILTER_LANCZOS }) {
+         record(filter == PYRAMID_FILTER_BOX ? "pyramid_box" : "pyramid_lanczos", count * sizeof(Rgba) * 4 / 3, nothing, [&] {
+            image_pyramid pyramid(width, height, 3, filter);
+            reduceImagePyramid(pyramid, source.get(), height);
+         });
+      }
+
+      // Writers, bytes are the file size
+      string image_path = scratch + ".image";
+      record("write_ppm8", count * 3, nothing, [&] { writePPM8(image_path.c_str(), rgb_8bit.get(), width, height); });
+      record("write_ppm16", count * 6, nothing, [&] {
+         writePPM16(image_path.c_str(), rgb_10bit.get(), width, height);
+      });
+      record("write_dpx10", count * 4, nothing, [&] {
+         writeDPX10(image_path.c_str(), rgb_10bit.get(), width, height, dpxEncoding(TRANSFER_PQ));
+      });
+      if (count * 3 * sizeof(float) < (size_t)2 << 30) {
+         // The PFM dump holds a float copy of the frame, skip it where that gets silly
+         vector<float> rgb_float(count * 3);
+         for (size_t i = 0; i < count * 3; ++i)
+            rgb_float[i] = rgb_10bit.get()[i] / 1023.0f;
+         record("write_pfm", count * 3 * sizeof(float), nothing, [&] { writePFM(image_path.c_str(), rgb_float.data(), width, height); });
+      }
+      unlink(image_path.c_str());
+
+      // GL stages, each waits for the GPU so the time covers the work itself
+      if (renderer) {
+         shared_ptr<GLuint> packed = buffers.acquire<GLuint>(count);
+         renderer->uploadFrame(source.get(), width, height);
+         glFinish();
+
+         record("gl_upload", count * sizeof(Rgba), nothing, [&] {
+            renderer->uploadFrame(source.get(), width, height);
+            glFinish();
+         });
+         record("gl_dispatch", count * (sizeof(Rgba) + sizeof(GLuint)), nothing, [&] {
+            renderer->toneMapUploaded(width, height);
+            glFinish();
+         });
+         if (renderer->packed()) {
+            // The packed pass writes the file payload, read back as it is
+            size_t bytes = glPackedBufferSize(glPackFormat(), width, height);
+            shared_ptr<unsigned char> file = buffers.acquire<unsigned char>(bytes);
+            record("gl_readback_packed", bytes, nothing, [&] { renderer->readPacked(file.get(), width, height); });
+         }
+         else {
+            record("gl_readback", count * sizeof(GLuint), nothing, [&] {
+               renderer->readFrame(packed.get(), width, height);
+            });
+         }
+      }
+
+      // Keep the pool from holding every size at once
+      source.reset();
+      work.reset();
+      luminance.reset();
+      rgb_8bit.reset();
+      rgb_10bit.reset();
+      buffers.trim();
+   }
+
+   cout.rdbuf(console);
+
+   FILE *json = fopen(json_path.c_str(), "w");
+   if (!json) {
+      perror("Failed to write the JSON report");
+      return EXIT_FAILURE;
+   }
+
+   char date[32];
+   time_t now = time(NULL);
+   strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+   fprintf(json, "{\n  \"context\": {\n");
+   fprintf(json, "    \"date\": \"%s\",\n", date);
+   fprintf(json, "    \"hardware_threads\": %u,\n", thread::hardware_concurrency());
+   fprintf(json, "    \"cpu_threads\": %u,\n", cpuThreadPool().size());
+   fprintf(json, "    \"cpu_kernels\": \"%s\",\n", jsonEscape(cpuKernels().name).c_str());
+   fprintf(json, "    \"gl\": %s,\n", renderer ? "true" : "false");
+   fprintf(json, "    \"repeats\": %d\n  },\n  \"benchmarks\": [\n", repeats);
+   for (size_t i = 0; i < results.size(); ++i) {
+      const stage_result &r = results[i];
+      double pixels = (double)r.width * r.height;
+      fprintf(json, "    { \"name\": \"%s/%dx%d\", \"stage\": \"%s\", \"width\": %d, \"height\": %d, "
+                    "\"best_seconds\": %.9f, \"mean_seconds\": %.9f, \"megapixels_per_second\": %.3f, \"bytes_per_second\": %.0f }%s\n",
+              r.stage.c_str(), r.width, r.height, r.stage.c_str(), r.width, r.height, r.best_seconds, r.mean_seconds,
+              pixels / 1e6 / r.best_seconds, r.bytes / r.best_seconds, i + 1 < results.size() ? "," : "");
+   }
+   fprintf(json, "  ]\n}\n");
+   fclose(json);
+
+   printf("Results written to %s\n", json_path.c_str());
+   return EXIT_SUCCESS;
+}
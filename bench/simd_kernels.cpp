@@ -0,0 +1,104 @@
+// Microbenchmark of the CPU row kernels: every available kernel table against
+// the scalar one on the same synthetic HDR row set, single threaded.
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "../utils/io.h"
+#include "../cpu/cpu_hdr.h"
+
+typedef chrono::steady_clock bench_clock;
+
+const size_t bench_pixels = 4 * 1024 * 1024;
+const int bench_repeats = 3;
+
+// Best of bench_repeats runs, in nanoseconds per pixel
+template <typename Kernel>
+double timeKernel(Kernel kernel) {
+   double best = 1e30;
+   for (int r = 0; r < bench_repeats; ++r) {
+      bench_clock::time_point start = bench_clock::now();
+      kernel();
+      double ns = chrono::duration<double, nano>(bench_clock::now() - start).count();
+      best = min(best, ns / bench_pixels);
+   }
+   return best;
+}
+
+int main() {
+   vector<Rgba> source(bench_pixels);
+   mt19937 rng(2024);
+   uniform_real_distribution<float> stops(-14.0f, 8.0f), tint(-0.5f, 0.5f);
+
+   for (Rgba &pixel : source) {
+      float base = stops(rng);
+      pixel.r = exp2(base + tint(rng));
+      pixel.g = exp2(base);
+      pixel.b = exp2(base + tint(rng));
+      pixel.a = 1.0f;
+   }
+
+   vector<float> luminance(bench_pixels);
+   scalar_kernels.luminance(source.data(), luminance.data(), bench_pixels);
+   for (float &l : luminance)
+      l *= 6.2f;
+
+   const cpu_kernels *tables[] = {
+      &scalar_kernels,
+#ifdef HDR_SIMD_X86
+      &avx2_kernels, &avx512_kernels,
+#endif
+#ifdef HDR_SIMD_NEON
+      &neon_kernels,
+#endif
+   };
+
+   vector<unsigned short> reference_10bit(bench_pixels * 3), output_10bit(bench_pixels * 3);
+   scalar_kernels.tone_map(source.data(), bench_pixels, 6.2f, 1e-4f, 1.0f / 2.2f, NULL, reference_10bit.data());
+
+   double scalar_ns[8] = { 0 };
+   printf("%-8s %15s %15s %15s %15s %15s %15s %15s %15s %10s\n", "kernels", "luminance", "log_lum", "log_hist", "compress",
+          "gamma", "tone_map", "log2_lum", "scale_exp2", "max_diff");
+
+   for (const cpu_kernels *k : tables) {
+      if (k != &scalar_kernels && !selectCpuKernels(k->name)) {
+         printf("%-8s not supported on this CPU\n", k->name);
+         continue;
+      }
+
+      vector<Rgba> pixels = source;
+      vector<float> out(bench_pixels);
+      vector<Rgba> scaled(bench_pixels);
+      double log_sum = 0.0;
+      float max = 0.0f;
+      vector<uint32_t> histogram(luminance_histogram_bins);
+
+      double ns[8] = {
+         timeKernel([&] { k->luminance(source.data(), out.data(), bench_pixels); }),
+         timeKernel([&] { log_sum = 0.0; k->log_luminance(source.data(), bench_pixels, log_sum, max, NULL); }),
+         timeKernel([&] { log_sum = 0.0; k->log_luminance(source.data(), bench_pixels, log_sum, max, histogram.data()); }),
+         timeKernel([&] { pixels = source; k->compress(pixels.data(), luminance.data(), 1e-4f, bench_pixels); }),
+         timeKernel([&] { pixels = source; k->gamma(pixels.data(), 1.0f / 2.2f, bench_pixels); }),
+         timeKernel([&] { k->tone_map(source.data(), bench_pixels, 6.2f, 1e-4f, 1.0f / 2.2f, NULL, output_10bit.data()); }),
+         timeKernel([&] { k->log2_luminance(source.data(), out.data(), bench_pixels); }),
+         timeKernel([&] { k->scale_exp2(source.data(), out.data(), scaled.data(), bench_pixels); }),
+      };
+
+      int max_difference = 0;
+      for (size_t i = 0; i < output_10bit.size(); ++i)
+         max_difference = std::max(max_difference, abs(int(output_10bit[i]) - int(reference_10bit[i])));
+
+      if (k == &scalar_kernels)
+         copy(ns, ns + 8, scalar_ns);
+
+      // Time per pixel and speedup over the scalar kernels
+      printf("%-8s", k->name);
+      for (int s = 0; s < 8; ++s)
+         printf("  %5.2fns %4.1fx", ns[s], scalar_ns[s] / ns[s]);
+      printf(" %10d\n", max_difference);
+   }
+
+   selectCpuKernels("auto");
+   return EXIT_SUCCESS;
+}
@@ -2,53 +2,94 @@
 #include <fstream>
 #include <sstream>
 #include <cstdlib>
+#include <vector>
+#include <numeric>
+#include <chrono>
 
 #include <OpenEXR/ImfRgbaFile.h>
 #include <OpenEXR/ImfInputFile.h>
 #include <OpenEXR/ImfChannelList.h>
 #include <OpenEXR/ImfArray.h>
 
+#include "../utils/image_writer.h"
+#include "../utils/output_container.h"
+#include "../utils/exr_stream.h"
+#include "../utils/buffer_pool.h"
+#include "../utils/batch.h"
+#include "../utils/trace.h"
+#include "../utils/thread_pool.h"
+#include "../utils/sequence.h"
+#include "../utils/luminance_histogram.h"
+#include "cpu_simd.h"
+#include "cpu_lut.h"
+#include "cpu_tone_map.h"
+#include "cpu_local.h"
+#include "cpu_pyramid.h"
+
 using namespace OPENEXR_IMF_NAMESPACE;
 using namespace IMATH_NAMESPACE;
 using namespace std;
 
-void clampPixels(Array2D<Rgba> &p, int width, int height) {
-   for (int y = 0; y < height; ++y) {
-      for (int x = 0; x < width; ++x) {
-         Rgba& pixel = p[y][x];
-         half low = 0.0f;
-         half high = 1.0f;
-         pixel.r = clamp(pixel.r, low, high);
-         pixel.g = clamp(pixel.g, low, high);
-         pixel.b = clamp(pixel.b, low, high);
-      }
-   }
+template <typename BandFunction>
+void forEachBand(int height, BandFunction fn) {
+   size_t bands = (height + cpu_band_rows - 1) / cpu_band_rows;
+
+   cpuThreadPool().parallelFor(bands, [&](size_t band) {
+      int first_row = band * cpu_band_rows;
+      fn(band, first_row, min(height, first_row + cpu_band_rows));
+   });
 }
 
-void computeLuminance(Array2D<Rgba> &p, float *scene_luminance, int width, int height) {
-   for (int y = 0; y < height; ++y) {
-      for (int x = 0; x < width; ++x) {
-         const Rgba& pixel = p[y][x];
-         float luminance = 0.2126f * pixel.r + 0.7152f * pixel.g + 0.0722f * pixel.b;
-         *((scene_luminance + y * width) + x) = luminance;
+void clampPixels(Rgba *p, int width, int height) {
+   TraceScope trace("clamp");
+   forEachBand(height, [&](size_t, int first_row, int last_row) {
+      for (int y = first_row; y < last_row; ++y) {
+         for (int x = 0; x < width; ++x) {
+            Rgba& pixel = p[(size_t)y * width + x];
+            half low = 0.0f;
+            half high = 1.0f;
+            pixel.r = clamp(pixel.r, low, high);
+            pixel.g = clamp(pixel.g, low, high);
+            pixel.b = clamp(pixel.b, low, high);
+         }
       }
-   }
+   });
+}
+
+void computeLuminance(const Rgba *p, float *scene_luminance, int width, int height) {
+   TraceScope trace("compute_luminance");
+   forEachBand(height, [&](size_t, int first_row, int last_row) {
+      for (int y = first_row; y < last_row; ++y)
+         cpuKernels().luminance(p + (size_t)y * width, scene_luminance + (size_t)y * width, width);
+   });
 }
 
 void computeSpecialBrightnessValues(float *scene_luminance, int width, int height,
                                     float &max_scene_brightness,
                                     float &avg_scene_brightness) {
+   TraceScope trace("special_brightness");
    // Compute luminance and average
    double totalLuminance = 0.0;
-   int totalPixels = width * height;
+   double totalPixels = (double)width * height;
 
-   for (int y = 0; y < height; ++y) {
-      for (int x = 0; x < width; ++x) {
-            const float luminance = *((scene_luminance + y * width) + x);
-            if (luminance > max_scene_brightness)
-               max_scene_brightness = luminance;
-            totalLuminance += log(luminance);
+   vector<luminance_partial> partials((height + cpu_band_rows - 1) / cpu_band_rows);
+   forEachBand(height, [&](size_t band, int first_row, int last_row) {
+      luminance_partial partial = { 0.0, max_scene_brightness, {} };
+      for (int y = first_row; y < last_row; ++y) {
+         for (int x = 0; x < width; ++x) {
+               const float luminance = glsl::safeLuminance(*((scene_luminance + (size_t)y * width) + x));
+               if (luminance > partial.max)
+                  partial.max = luminance;
+               partial.log_sum += log(luminance);
+         }
       }
+      partials[band] = move(partial);
+   });
+
+   // Merge in band order so the result does not depend on the thread count
+   for (const luminance_partial &partial : partials) {
+      totalLuminance += partial.log_sum;
+      max_scene_brightness = max(max_scene_brightness, partial.max);
    }
 
    avg_scene_brightness = static_cast<float>(exp(totalLuminance / totalPixels));
@@ -57,104 +98,601 @@ void computeSpecialBrightnessValues(float *scene_luminance, int width, int heigh
 }
 
 void scaleLuminances(float *scene_luminance, float avg_scene_brightness, int width, int height) {
+   TraceScope trace("scale_luminances");
    float scaling_factor = 0.18f / avg_scene_brightness;
 
-   for (int y = 0; y < height; ++y) {
-      for (int x = 0; x < width; ++x) {
-         *((scene_luminance + y * width) + x) *= scaling_factor;
+   forEachBand(height, [&](size_t, int first_row, int last_row) {
+      for (int y = first_row; y < last_row; ++y) {
+         for (int x = 0; x < width; ++x) {
+            *((scene_luminance + (size_t)y * width) + x) *= scaling_factor;
+         }
       }
-   }
+   });
 }
 
-void compressLuminances(Array2D<Rgba> &p, float *scene_luminance, float max_scene_brightness, int width, int height) {
+void compressLuminances(Rgba *p, float *scene_luminance, float max_scene_brightness, int width, int height) {
+   TraceScope trace("compress_luminances");
    float whiteness_factor = 1.0f / (max_scene_brightness * max_scene_brightness);
 
-   for (int y = 0; y < height; ++y) {
-      for (int x = 0; x < width; ++x) {
-         float input_luminance = *((scene_luminance + y * width) + x);
-         float output_luminance = 
-            (input_luminance * (1.0f + (input_luminance * whiteness_factor))) / (1.0f + input_luminance);
-         float compression_factor = output_luminance / input_luminance;
-
-         Rgba& pixel = p[y][x];
-         pixel.r *= compression_factor;
-         pixel.g *= compression_factor;
-         pixel.b *= compression_factor;
+   forEachBand(height, [&](size_t, int first_row, int last_row) {
+      for (int y = first_row; y < last_row; ++y)
+         cpuKernels().compress(p + (size_t)y * width, scene_luminance + (size_t)y * width, whiteness_factor, width);
+   });
+}
+
+void correctGamma(Rgba *p, int width, int height) {
+   TraceScope trace("correct_gamma");
+   float gamma = 1.0f / 2.2f;
+
+   forEachBand(height, [&](size_t, int first_row, int last_row) {
+      for (int y = first_row; y < last_row; ++y)
+         cpuKernels().gamma(p + (size_t)y * width, gamma, width);
+   });
+}
+
+// Quantizes the (already display referred) pixels with the same truncation as
+// the fused path and writes them as binary P6
+bool cpu_save_8bit_image(const char name[], const Rgba *p, int width, int height) {
+   shared_ptr<unsigned char> rgb = imageBufferPool().acquire<unsigned char>((size_t)width * height * 3);
+
+   forEachBand(height, [&](size_t, int first_row, int last_row) {
+      for (int y = first_row; y < last_row; ++y) {
+         for (int x = 0; x < width; ++x) {
+            const Rgba& pixel = p[(size_t)y * width + x];
+            float channels[3] = { pixel.r, pixel.g, pixel.b };
+            quantizePixel(channels, ((size_t)y * width + x) * 3, rgb.get(), NULL);
+         }
       }
+   });
+
+   return writePPM8(name, rgb.get(), width, height);
+}
+
+bool cpu_save_10bit_image(const char name[], const Rgba *p, int width, int height) {
+   shared_ptr<unsigned short> rgb = imageBufferPool().acquire<unsigned short>((size_t)width * height * 3);
+
+   forEachBand(height, [&](size_t, int first_row, int last_row) {
+      for (int y = first_row; y < last_row; ++y) {
+         for (int x = 0; x < width; ++x) {
+            const Rgba& pixel = p[(size_t)y * width + x];
+            float channels[3] = { pixel.r, pixel.g, pixel.b };
+            quantizePixel(channels, ((size_t)y * width + x) * 3, NULL, rgb.get());
+         }
+      }
+   });
+
+   return writePPM16(name, rgb.get(), width, height, 1023);
+}
+
+// Linear float dump of the pixels for debugging
+bool cpu_save_float_image(const char name[], const Rgba *p, int width, int height) {
+   vector<float> rgb((size_t)width * height * 3);
+
+   forEachBand(height, [&](size_t, int first_row, int last_row) {
+      for (int y = first_row; y < last_row; ++y) {
+         for (int x = 0; x < width; ++x) {
+            const Rgba& pixel = p[(size_t)y * width + x];
+            float *out = &rgb[((size_t)y * width + x) * 3];
+            out[0] = pixel.r;
+            out[1] = pixel.g;
+            out[2] = pixel.b;
+         }
+      }
+   });
+
+   return writePFM(name, rgb.data(), width, height);
+}
+
+void reinhard_extended_algorithm(Rgba *pixels, int width, int height) {
+   // Row-major height x width plane, from the pool rather than the stack
+   shared_ptr<float> scene_luminance = imageBufferPool().acquire<float>((size_t)width * height);
+   float max_scene_brightness = std::numeric_limits<float>::min(), avg_scene_brightness = 0.0f;
+   computeLuminance(pixels, scene_luminance.get(), width, height);
+   computeSpecialBrightnessValues(scene_luminance.get(), width, height, max_scene_brightness, avg_scene_brightness);
+   scaleLuminances(scene_luminance.get(), avg_scene_brightness, width, height);
+   compressLuminances(pixels, scene_luminance.get(), max_scene_brightness, width, height);
+}
+
+/* Fused Reinhard extended engine
+ *
+ * The per-stage functions above walk the whole image once per stage and keep a
+ * full luminance plane around. The fused path touches the half pixels exactly
+ * twice: one reduction pass for the scene statistics and one apply pass that
+ * scales, compresses, gamma corrects and quantizes straight into the output
+ * buffers. The per-stage functions are kept as the reference implementation.
+ * Its statistics types and row kernels are in cpu_tone_map.h.
+ */
+void accumulateSceneStatistics(const Rgba *p, int width, int rows, statistics_accumulator &acc) {
+   TraceScope trace("statistics");
+   trace.setPixels((size_t)width * rows);
+   vector<luminance_partial> partials((rows + cpu_band_rows - 1) / cpu_band_rows);
+   forEachBand(rows, [&](size_t band, int first_row, int last_row) {
+      luminance_partial partial = { 0.0, acc.max, vector<uint32_t>(acc.histogram.size()) };
+      uint32_t *histogram = partial.histogram.empty() ? NULL : partial.histogram.data();
+      for (int y = first_row; y < last_row; ++y)
+         cpuKernels().log_luminance(p + (size_t)y * width, width, partial.log_sum, partial.max, histogram);
+      partials[band] = move(partial);
+   });
+
+   mergeLuminancePartials(partials, acc);
+   acc.pixels += (size_t)width * rows;
+}
+
+// Statistics of every stride-th pixel of every stride-th row, the sample grid
+// of the GPU reduction. The samples of a row are packed for the log kernel.
+void accumulateSubsampledStatistics(const Rgba *p, int width, int height, int stride, statistics_accumulator &acc) {
+   TraceScope trace("statistics_subsampled");
+   int columns = (width + stride - 1) / stride, sample_rows = (height + stride - 1) / stride;
+   trace.setPixels((size_t)columns * sample_rows);
+   vector<luminance_partial> partials((sample_rows + cpu_band_rows - 1) / cpu_band_rows);
+   forEachBand(sample_rows, [&](size_t band, int first_row, int last_row) {
+      vector<Rgba> samples(columns);
+      luminance_partial partial = { 0.0, acc.max, vector<uint32_t>(acc.histogram.size()) };
+      uint32_t *histogram = partial.histogram.empty() ? NULL : partial.histogram.data();
+      for (int y = first_row; y < last_row; ++y) {
+         const Rgba *row = p + (size_t)min(y * stride + stride / 2, height - 1) * width;
+         for (int x = 0; x < columns; ++x)
+            samples[x] = row[min(x * stride + stride / 2, width - 1)];
+         cpuKernels().log_luminance(samples.data(), columns, partial.log_sum, partial.max, histogram);
+      }
+      partials[band] = move(partial);
+   });
+
+   mergeLuminancePartials(partials, acc);
+   acc.pixels += (size_t)columns * sample_rows;
+}
+
+void finishSceneStatistics(const statistics_accumulator &acc, scene_statistics &stats, bool report = true) {
+   stats.max_brightness = histogramWhite(histogramSettings(), acc.histogram.empty() ? NULL : acc.histogram.data(), acc.max);
+   stats.avg_brightness = static_cast<float>(exp(acc.log_sum / (double)acc.pixels));
+   stats.histogram = acc.histogram;
+   const local_tone_settings &local = localToneSettings();
+   if (local.enabled)
+      stats.max_brightness = glsl::localToneWhite(stats.max_brightness, log2(stats.avg_brightness), local.compression);
+   if (!report)
+      return;
+   cout << "Maximum Scene Brightness: " << stats.max_brightness << endl;
+   cout << "Average Scene Brightness: " << stats.avg_brightness << endl;
+}
+
+void computeSceneStatistics(const Rgba *p, int width, int height, scene_statistics &stats) {
+   statistics_accumulator acc;
+   accumulateSceneStatistics(p, width, height, acc);
+   finishSceneStatistics(acc, stats);
+}
+
+// The grid of the local operator for an image, splatted chunk by chunk with
+// the statistics; NULL when the operator is off
+shared_ptr<bilateral_grid> startLocalGrid(int width, int height) {
+   if (!localToneSettings().enabled)
+      return NULL;
+   return make_shared<bilateral_grid>(width, height);
+}
+
+// Tone maps rows tightly packed at p with the selected curve. Either output
+// buffer may be NULL, both are interleaved RGB and start at the first row of p,
+// which is row first_row of the image, or of its pyramid level. With the local
+// operator every row goes through its gain first.
+void toneMapRows(const Rgba *p, const scene_statistics &stats,
+                 unsigned char *rgb_8bit, unsigned short *rgb_10bit,
+                 int width, int rows, int first_row = 0, int level = 0) {
+   TraceScope trace("tone_map");
+   trace.setPixels((size_t)width * rows);
+   traceCount("pixels_tone_mapped", (size_t)width * rows);
+
+   // Each file worker keeps its own tables, rebaked only when the curve or
+   // the scene maximum changes. The bands run on the pool threads, which
+   // read them through the row function and not their own thread_local copy.
+   thread_local tone_lut worker_lut;
+   const tone_map_row_function tone_map_row =
+      toneMapRowFunction(selectedToneCurve(TRANSFER_GAMMA22), toneLutSelection(), stats, width, worker_lut);
+
+   const bilateral_grid *grid = stats.local_grid.get();
+   const float anchor = log2(stats.avg_brightness);
+   forEachBand(rows, [&](size_t, int first_band_row, int last_band_row) {
+      local_tone_scratch scratch;
+      for (int y = first_band_row; y < last_band_row; ++y) {
+         size_t offset = (size_t)y * width * 3;
+         const Rgba *row = p + (size_t)y * width;
+         if (grid)
+            row = localToneRow(*grid, localToneSettings(), anchor, row, width, first_row + y, level, scratch);
+         tone_map_row(row, rgb_8bit ? rgb_8bit + offset : NULL, rgb_10bit ? rgb_10bit + offset : NULL);
+      }
+   });
+}
+
+void toneMapAndQuantize(const Rgba *p, const scene_statistics &stats,
+                        unsigned char *rgb_8bit, unsigned short *rgb_10bit,
+                        int width, int height) {
+   toneMapRows(p, stats, rgb_8bit, rgb_10bit, width, height);
+}
+
+void reinhard_extended_fused(const Rgba *pixels, unsigned char *rgb_8bit, unsigned short *rgb_10bit,
+                             int width, int height) {
+   scene_statistics stats;
+   computeSceneStatistics(pixels, width, height, stats);
+   toneMapAndQuantize(pixels, stats, rgb_8bit, rgb_10bit, width, height);
+}
+
+bool cpu_save_8bit_buffer(const char name[], const unsigned char *rgb, int width, int height) {
+   return writePPM8(name, rgb, width, height);
+}
+
+// In the selected container, encoded with the selected curve
+bool cpu_save_10bit_buffer(const char name[], const unsigned short *rgb, int width, int height) {
+   return write10bitOutput(name, rgb, width, height, selectedToneCurve(TRANSFER_GAMMA22).transfer);
+}
+
+// Tone maps the selected levels of a finished pyramid with the statistics of
+// the full image and writes them next to the full size outputs. Either output
+// name may be empty.
+bool cpu_save_pyramid(const image_pyramid &pyramid, const scene_statistics &stats,
+                      const string &output_8bit, const string &output_10bit) {
+   const pyramid_settings &settings = pyramidSettings();
+   BufferPool &buffers = imageBufferPool();
+   bool written = true;
+
+   for (const pyramid_level &level : pyramid.levels) {
+      if (!isPyramidOutput(settings, level.level))
+         continue;
+
+      size_t samples = (size_t)level.width * level.height * 3;
+      shared_ptr<unsigned char> rgb_8bit = output_8bit.empty() ? NULL : buffers.acquire<unsigned char>(samples);
+      shared_ptr<unsigned short> rgb_10bit = output_10bit.empty() ? NULL : buffers.acquire<unsigned short>(samples);
+      toneMapRows(level.pixels.get(), stats, rgb_8bit.get(), rgb_10bit.get(), level.width, level.height, 0, level.level);
+
+      if (rgb_8bit)
+         written &= writePPM8(pyramidOutputName(output_8bit, level.width, level.height).c_str(), rgb_8bit.get(), level.width, level.height);
+      if (rgb_10bit)
+         written &= write10bitOutput(pyramidOutputName(output_10bit, level.width, level.height).c_str(), rgb_10bit.get(),
+                                     level.width, level.height, selectedToneCurve(TRANSFER_GAMMA22).transfer);
    }
+   return written;
 }
 
-void correctGamma(Array2D<Rgba> &p, int width, int height) {
-   float gamma = 1.0f / 2.2f;
+// Largest per-channel code value difference between the reference path output and a fused 10-bit buffer
+int compareWithReference(const Rgba *reference, const unsigned short *rgb_10bit, int width, int height) {
+   int max_difference = 0;
 
    for (int y = 0; y < height; ++y) {
       for (int x = 0; x < width; ++x) {
-         Rgba& pixel = p[y][x];
-         pixel.r = pow(pixel.r, gamma);
-         pixel.g = pow(pixel.g, gamma);
-         pixel.b = pow(pixel.b, gamma);
+         const Rgba& pixel = reference[(size_t)y * width + x];
+         const unsigned short *fused = rgb_10bit + ((size_t)y * width + x) * 3;
+         float channels[3] = { pixel.r, pixel.g, pixel.b };
+
+         for (int c = 0; c < 3; ++c) {
+            int expected = int(1023.999f * clamp(channels[c], 0.0f, 1.0f));
+            max_difference = std::max(max_difference, abs(expected - int(fused[c])));
+         }
       }
    }
+
+   return max_difference;
+}
+
+/* Decode/compute overlap for in-memory images: a producer thread decodes the
+ * file chunk by chunk into p while the statistics of the chunks already
+ * decoded are reduced here, so the reduction pass is hidden behind the
+ * decompression. Tone mapping needs the finished statistics and runs after.
+ * Chunks are multiples of cpu_band_rows, the result matches a plain
+ * readPixels followed by computeSceneStatistics bit for bit. The pyramid, if
+ * any, is reduced from the same chunks.
+ */
+const int cpu_decode_chunk_rows = 256;
+
+void decodeWithStatistics(RgbaInputFile &file, Rgba *p, int width, int height, scene_statistics &stats,
+                          image_pyramid *pyramid = NULL) {
+   ExrChunkReader reader(file);
+   ChunkPrefetcher prefetcher(reader, lcm(cpu_decode_chunk_rows, reader.rowGranularity()), p);
+
+   statistics_accumulator acc;
+   shared_ptr<bilateral_grid> grid = startLocalGrid(width, height);
+   const Rgba *chunk;
+   int first_row, rows;
+   while (prefetcher.next(chunk, first_row, rows)) {
+      accumulateSceneStatistics(chunk, width, rows, acc);
+      if (grid)
+         splatBilateralGrid(*grid, chunk, width, first_row, rows);
+      if (pyramid)
+         reduceImagePyramid(*pyramid, p, first_row + rows);
+   }
+
+   finishSceneStatistics(acc, stats);
+   if (grid)
+      blurBilateralGrid(*grid);
+   stats.local_grid = grid;
 }
 
-void cpu_save_8bit_image(const char name[], Array2D<Rgba> &p, int width, int height) {
-   ofstream outputFile(name);
-   outputFile << "P3\n" << width << ' ' << height << "\n255\n";
+// Largest 10-bit difference the fused engine may show against the reference
+// path, which rounds differently in half precision between its stages
+const int cpu_verify_tolerance = 1;
+
+// Returns false when an output could not be written or the verification
+// against the reference path fails
+bool cpu_render_scene(RgbaInputFile &file, int width, int height, bool verify_against_reference = false) {
+   // The fused engine leaves its input untouched, so one read serves both
+   // outputs; the clamped images are made in place afterwards
+   BufferPool &buffers = imageBufferPool();
+   shared_ptr<Rgba> image = buffers.acquire<Rgba>((size_t)width * height);
+   shared_ptr<unsigned char> reinhard_8bit = buffers.acquire<unsigned char>((size_t)width * height * 3);
+   shared_ptr<unsigned short> reinhard_10bit = buffers.acquire<unsigned short>((size_t)width * height * 3);
+   Rgba *pixels = image.get();
+
+   scene_statistics stats;
+   shared_ptr<image_pyramid> pyramid = startImagePyramid(width, height);
+   decodeWithStatistics(file, pixels, width, height, stats, pyramid.get());
+   toneMapAndQuantize(pixels, stats, reinhard_8bit.get(), reinhard_10bit.get(), width, height);
+   exportSelectedToneLut(selectedToneCurve(TRANSFER_GAMMA22), stats.max_brightness, stats.avg_brightness);
+   exportSelectedHistogram(stats.histogram);
+   bool written = cpu_save_8bit_buffer("reinhard-extended-chapel-with-gamma-correction-8bit.ppm", reinhard_8bit.get(), width, height);
+   const string output_10bit = "reinhard-extended-chapel-with-gamma-correction" + output10bitSuffix();
+   written &= cpu_save_10bit_buffer(output_10bit.c_str(), reinhard_10bit.get(), width, height);
+   if (pyramid)
+      written &= cpu_save_pyramid(*pyramid, stats, "reinhard-extended-chapel-with-gamma-correction-8bit.ppm", output_10bit);
+
+   clampPixels(pixels, width, height);
+   written &= cpu_save_8bit_image("clamped-chapel-without-gamma-correction-8bit.ppm", pixels, width, height);
+   written &= cpu_save_10bit_image("clamped-chapel-without-gamma-correction-10bit.ppm", pixels, width, height);
+   correctGamma(pixels, width, height);
+   written &= cpu_save_8bit_image("clamped-chapel-with-gamma-correction-8bit.ppm", pixels, width, height);
+   written &= cpu_save_10bit_image("clamped-chapel-with-gamma-correction-10bit.ppm", pixels, width, height);
+
+   if (verify_against_reference) {
+      // Run the original per-stage path with the scalar kernels on the same pixels
+      // and report the drift of the fused engine
+      readPixels(file, pixels, width, height);
+
+      string kernels = cpuKernels().name;
+      selectCpuKernels("scalar");
+      reinhard_extended_algorithm(pixels, width, height);
+      correctGamma(pixels, width, height);
+      selectCpuKernels(kernels);
+      int difference = compareWithReference(pixels, reinhard_10bit.get(), width, height);
+      cout << "Fused vs reference max 10-bit difference: " << difference << endl;
+      return written && difference <= cpu_verify_tolerance;
+   }
+   return written;
+}
+/* Out-of-core tone mapping
+ *
+ * Streams the file twice in chunks of rows: pass 1 accumulates the scene
+ * statistics, pass 2 tone maps each chunk and appends it to the outputs while
+ * the next chunk decodes. Only two chunks of input and the output rows of one
+ * are resident, sized to fit memory_budget bytes. Chunks are whole multiples
+ * of cpu_band_rows (and of the tile height for tiled files), so the statistics
+ * and therefore the output match the in-memory fused path bit for bit.
+ * Pass 2 also reduces the pyramid, always with the box filter: a chunk is
+ * gone once the next one is in use, and Lanczos would read across the seam.
+ * The levels are resident on top of the budget, a third of the image at most.
+ */
+int streamingChunkRows(int width, int height, int granularity, size_t memory_budget) {
+   // Two input chunks (one decoding, one in use), 8-bit and 10-bit output rows
+   // and the scratch of the 10-bit writer, big endian samples or DPX words
+   size_t row_bytes = (size_t)width * (2 * sizeof(Rgba) + 3 + 3 * sizeof(unsigned short) + 3 * 2);
+   int unit = lcm(cpu_band_rows, max(granularity, 1));
+
+   size_t rows = memory_budget / row_bytes / unit * unit;
+   if (rows == 0) {
+      rows = unit;
+      cerr << "Memory budget is below one chunk of " << unit << " rows, using " << rows * row_bytes << " bytes" << endl;
+   }
+   return (int)min(rows, (size_t)((height + unit - 1) / unit * unit));
+}
 
-   for (int j = 0; j < height; j++) {
-      for (int i = 0; i < width; i++) {
-         const Rgba& pixel = p[j][i];
-         int ir = int(255.999 * pixel.r);
-         int ig = int(255.999 * pixel.g);
-         int ib = int(255.999 * pixel.b);
+bool cpu_render_streaming(const char *input, const char *output_8bit, const char *output_10bit, size_t memory_budget) {
+   ExrChunkReader reader(input);
+   int width = reader.width(), height = reader.height();
+   int chunk_rows = streamingChunkRows(width, height, reader.rowGranularity(), memory_budget);
 
-         outputFile << ir << ' ' << ig << ' ' << ib << '\n';
+   cout << "Streaming " << width << "x" << height << (reader.isTiled() ? " tiled" : " scanline")
+        << " image in chunks of " << chunk_rows << " rows" << endl;
+
+   // Both passes decode the next chunk on a producer thread while the current one is processed
+   const Rgba *chunk;
+   int first_row, rows;
+
+   // Pass 1: statistics
+   statistics_accumulator acc;
+   shared_ptr<bilateral_grid> grid = startLocalGrid(width, height);
+   {
+      ChunkPrefetcher prefetcher(reader, chunk_rows);
+      while (prefetcher.next(chunk, first_row, rows)) {
+         accumulateSceneStatistics(chunk, width, rows, acc);
+         if (grid)
+            splatBilateralGrid(*grid, chunk, width, first_row, rows);
       }
    }
 
-   outputFile.close();
+   scene_statistics stats;
+   finishSceneStatistics(acc, stats);
+   if (grid)
+      blurBilateralGrid(*grid);
+   stats.local_grid = grid;
+   exportSelectedToneLut(selectedToneCurve(TRANSFER_GAMMA22), stats.max_brightness, stats.avg_brightness);
+   exportSelectedHistogram(stats.histogram);
+
+   // Pass 2: tone map and append every chunk to the outputs
+   ImageStreamWriter writer_8bit(output_8bit, ppmHeader(width, height, 255));
+   const transfer_type transfer = selectedToneCurve(TRANSFER_GAMMA22).transfer;
+   ImageStreamWriter writer_10bit(output_10bit, output10bitHeader(width, height, transfer));
+   if (!writer_8bit.ok() || !writer_10bit.ok())
+      return false;
+
+   vector<unsigned char> rgb_8bit((size_t)width * chunk_rows * 3);
+   vector<unsigned short> rgb_10bit((size_t)width * chunk_rows * 3);
+
+   shared_ptr<image_pyramid> pyramid;
+   if (!pyramidSettings().levels.empty()) {
+      if (pyramidSettings().filter != PYRAMID_FILTER_BOX)
+         fprintf(stderr, "Streaming reduces the pyramid with the box filter\n");
+      pyramid = make_shared<image_pyramid>(width, height, pyramidDepth(pyramidSettings()), PYRAMID_FILTER_BOX);
+   }
+
+   ChunkPrefetcher prefetcher(reader, chunk_rows);
+   while (prefetcher.next(chunk, first_row, rows)) {
+      size_t samples = (size_t)width * rows * 3;
+      toneMapRows(chunk, stats, rgb_8bit.data(), rgb_10bit.data(), width, rows, first_row);
+      if (pyramid)
+         reduceImagePyramid(*pyramid, chunk - (ptrdiff_t)first_row * width, first_row + rows);
+
+      if (!writer_8bit.append(rgb_8bit.data(), samples) || !append10bitOutput(writer_10bit, rgb_10bit.data(), (size_t)width * rows))
+         return false;
+   }
+
+   return !pyramid || cpu_save_pyramid(*pyramid, stats, output_8bit, output_10bit);
 }
 
-void cpu_save_10bit_image(const char name[], Array2D<Rgba> &p, int width, int height) {
-   ofstream outputFile(name);
-   outputFile << "P3\n" << width << ' ' << height << "\n1023\n";
+/* Batch tone mapping
+ *
+ * Buffers come from the shared pool, so a run over same-sized plates
+ * allocates one set per file worker and recycles it for every later file.
+ * While one worker's compute holds the shared CPU pool the others decode,
+ * which keeps both the disks and the cores busy.
+ */
 
-   for (int j = 0; j < height; j++) {
-      for (int i = 0; i < width; i++) {
-         const Rgba& pixel = p[j][i];
-         int ir = int(1023.999 * pixel.r);
-         int ig = int(1023.999 * pixel.g);
-         int ib = int(1023.999 * pixel.b);
+// Writes <stem>-8bit.ppm and <stem>-10bit.ppm or .dpx, returns the pixel count or 0 on failure
+size_t cpu_tone_map_file(const batch_job &job) {
+   TraceScope trace("file", "batch");
+   try {
+      ExrChunkReader reader(job.input.c_str());
+      int width = reader.width(), height = reader.height();
+      size_t pixel_count = (size_t)width * height;
 
-         outputFile << ir << ' ' << ig << ' ' << ib << '\n';
+      BufferPool &buffers = imageBufferPool();
+      shared_ptr<Rgba> pixels = buffers.acquire<Rgba>(pixel_count);
+      shared_ptr<unsigned char> rgb_8bit = buffers.acquire<unsigned char>(pixel_count * 3);
+      shared_ptr<unsigned short> rgb_10bit = buffers.acquire<unsigned short>(pixel_count * 3);
+
+      statistics_accumulator acc;
+      shared_ptr<bilateral_grid> grid = startLocalGrid(width, height);
+      shared_ptr<image_pyramid> pyramid = startImagePyramid(width, height);
+      {
+         ChunkPrefetcher prefetcher(reader, lcm(cpu_decode_chunk_rows, reader.rowGranularity()), pixels.get());
+         const Rgba *chunk;
+         int first_row, rows;
+         while (prefetcher.next(chunk, first_row, rows)) {
+            accumulateSceneStatistics(chunk, width, rows, acc);
+            if (grid)
+               splatBilateralGrid(*grid, chunk, width, first_row, rows);
+            if (pyramid)
+               reduceImagePyramid(*pyramid, pixels.get(), first_row + rows);
+         }
       }
+
+      scene_statistics stats;
+      finishSceneStatistics(acc, stats, false);
+      if (grid)
+         blurBilateralGrid(*grid);
+      stats.local_grid = grid;
+      toneMapRows(pixels.get(), stats, rgb_8bit.get(), rgb_10bit.get(), width, height);
+
+      const string output_10bit = job.output_stem + output10bitSuffix();
+      if (!writePPM8((job.output_stem + "-8bit.ppm").c_str(), rgb_8bit.get(), width, height) ||
+          !write10bitOutput(output_10bit.c_str(), rgb_10bit.get(), width, height, selectedToneCurve(TRANSFER_GAMMA22).transfer))
+         return 0;
+      if (pyramid && !cpu_save_pyramid(*pyramid, stats, job.output_stem + "-8bit.ppm", output_10bit))
+         return 0;
+
+      trace.setPixels(pixel_count);
+      printf("%s: %dx%d, max %g, average %g\n", job.input.c_str(), width, height,
+             stats.max_brightness, stats.avg_brightness);
+      return pixel_count;
+   } catch (const exception &e) {
+      fprintf(stderr, "%s: %s\n", job.input.c_str(), e.what());
+      return 0;
    }
+}
 
-   outputFile.close();
-}
-
-void reinhard_extended_algorithm(Array2D<Rgba> &pixels, int width, int height) {
-   float scene_luminance[width][height], max_scene_brightness = std::numeric_limits<float>::min(), avg_scene_brightness = 0.0f;
-   computeLuminance(pixels, (float*)scene_luminance, width, height);
-   computeSpecialBrightnessValues((float*)scene_luminance, width, height, max_scene_brightness, avg_scene_brightness);
-   scaleLuminances((float*)scene_luminance, avg_scene_brightness, width, height);
-   compressLuminances(pixels, (float*)scene_luminance, max_scene_brightness, width, height);
-}
-
-void cpu_render_scene(RgbaInputFile &file, int width, int height) {
-   Array2D<Rgba> clamped_pixels(height, width);
-   readPixels(file, clamped_pixels, width, height);
-   clampPixels(clamped_pixels, width, height);
-   cpu_save_8bit_image("clamped-chapel-without-gamma-correction-8bit.ppm", clamped_pixels, width, height);
-   cpu_save_10bit_image("clamped-chapel-without-gamma-correction-10bit.ppm", clamped_pixels, width, height);
-   correctGamma(clamped_pixels, width, height);
-   cpu_save_8bit_image("clamped-chapel-with-gamma-correction-8bit.ppm", clamped_pixels, width, height);
-   cpu_save_10bit_image("clamped-chapel-with-gamma-correction-10bit.ppm", clamped_pixels, width, height);
-
-   Array2D<Rgba> reinhard_pixels(height, width);
-   readPixels(file, reinhard_pixels, width, height);
-   reinhard_extended_algorithm(reinhard_pixels, width, height);
-   correctGamma(reinhard_pixels, width, height);
-   cpu_save_8bit_image("reinhard-extended-chapel-with-gamma-correction-8bit.ppm", reinhard_pixels, width, height);
-   cpu_save_10bit_image("reinhard-extended-chapel-with-gamma-correction-10bit.ppm", reinhard_pixels, width, height);
-}
\ No newline at end of file
+bool cpu_render_batch(const vector<batch_job> &jobs, unsigned int workers) {
+   atomic<size_t> pixels(0), failed(0);
+   chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+   // The pool and kernels are created lazily, do it before the workers race for them
+   cpuThreadPool();
+   cpuKernels();
+
+   runBatchJobs(jobs.size(), workers, [&](unsigned int, size_t index) {
+      size_t written = cpu_tone_map_file(jobs[index]);
+      if (written)
+         pixels += written;
+      else
+         ++failed;
+   });
+
+   double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+   reportBatchThroughput(jobs.size() - failed, failed, pixels / 1e6, seconds);
+   return failed == 0;
+}
+
+/* Sequences
+ *
+ * Frames go through in order with the running statistics of
+ * utils/sequence.h. A full resolution measurement is reduced while the frame
+ * decodes, as in the batch path, a subsampled one runs on the decoded frame.
+ * Frames between measurements keep the statistics of the last one.
+ */
+bool cpu_render_sequence(const vector<sequence_frame> &frames, const adaptation_settings &settings) {
+   adaptation_state state;
+   scene_statistics stats;
+   size_t written = 0, pixels = 0;
+   chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+   for (size_t i = 0; i < frames.size(); ++i) {
+      TraceScope trace("frame", "sequence");
+      try {
+         ExrChunkReader reader(frames[i].input.c_str());
+         int width = reader.width(), height = reader.height();
+         size_t pixel_count = (size_t)width * height;
+
+         BufferPool &buffers = imageBufferPool();
+         shared_ptr<Rgba> image = buffers.acquire<Rgba>(pixel_count);
+         shared_ptr<unsigned short> rgb_10bit = buffers.acquire<unsigned short>(pixel_count * 3);
+
+         bool measure = measuresStatistics(settings, i) || !state.primed;
+         statistics_accumulator acc;
+         shared_ptr<bilateral_grid> grid = startLocalGrid(width, height);
+         shared_ptr<image_pyramid> pyramid = startImagePyramid(width, height);
+         {
+            ChunkPrefetcher prefetcher(reader, lcm(cpu_decode_chunk_rows, reader.rowGranularity()), image.get());
+            const Rgba *chunk;
+            int first_row, rows;
+            while (prefetcher.next(chunk, first_row, rows)) {
+               if (measure && settings.stats_stride == 1)
+                  accumulateSceneStatistics(chunk, width, rows, acc);
+               // The base layer is spatial, every frame needs its own
+               if (grid)
+                  splatBilateralGrid(*grid, chunk, width, first_row, rows);
+               if (pyramid)
+                  reduceImagePyramid(*pyramid, image.get(), first_row + rows);
+            }
+         }
+         if (grid)
+            blurBilateralGrid(*grid);
+         stats.local_grid = grid;
+         if (measure) {
+            if (settings.stats_stride > 1)
+               accumulateSubsampledStatistics(image.get(), width, height, settings.stats_stride, acc);
+            finishSceneStatistics(acc, stats, false);
+            adaptStatistics(state, settings, stats.max_brightness, stats.avg_brightness);
+         }
+
+         toneMapRows(image.get(), stats, NULL, rgb_10bit.get(), width, height);
+         const transfer_type transfer = selectedToneCurve(TRANSFER_GAMMA22).transfer;
+         if (!write10bitOutput(frames[i].output.c_str(), rgb_10bit.get(), width, height, transfer))
+            continue;
+         if (pyramid && !cpu_save_pyramid(*pyramid, stats, "", frames[i].output))
+            continue;
+
+         trace.setPixels(pixel_count);
+         ++written;
+         pixels += pixel_count;
+      } catch (const exception &e) {
+         fprintf(stderr, "%s: %s\n", frames[i].input.c_str(), e.what());
+      }
+   }
+
+   double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+   cout << "Tone mapped " << written << " of " << frames.size() << " frames in " << seconds << "s ("
+        << written / seconds << " fps, " << pixels / 1e6 / seconds << " MP/s)" << endl;
+   return written == frames.size();
+}
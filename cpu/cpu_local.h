@@ -0,0 +1,157 @@
+#pragma once
+
+#include <vector>
+
+#include "../utils/local_tone.h"
+#include "../utils/thread_pool.h"
+#include "../utils/trace.h"
+#include "cpu_simd.h"
+
+using namespace std;
+
+/* Bilateral grid for the local operator (utils/local_tone.h)
+ *
+ * Cells hold (sum of log2 luminance above local_grid_min_log2, weight) pairs,
+ * the luminance axis fastest so the two layers a pixel slices between are
+ * adjacent. Splatting runs over row chunks, each task owning one row of
+ * cells, so chunks of a streamed image can be added as they decode; the blur
+ * finishes the grid.
+ */
+struct bilateral_grid
+{
+   int width = 0, height = 0;   // cells, the depth is local_grid_depth
+   vector<float> cells;
+
+   bilateral_grid(int image_width, int image_height)
+      : width(localGridSize(image_width)), height(localGridSize(image_height)),
+        cells((size_t)width * height * local_grid_depth * 2, 0.0f) {}
+
+   float *cell(int x, int y, int z) { return &cells[(((size_t)y * width + x) * local_grid_depth + z) * 2]; }
+   const float *cell(int x, int y, int z) const { return &cells[(((size_t)y * width + x) * local_grid_depth + z) * 2]; }
+};
+
+// Adds rows [first_row, first_row + rows) of an image, tightly packed at p
+void splatBilateralGrid(bilateral_grid &grid, const Rgba *p, int width, int first_row, int rows) {
+   TraceScope trace("local_splat");
+   trace.setPixels((size_t)width * rows);
+   const int half_cell = local_grid_cell / 2;
+   int first_cell = (first_row + half_cell) / local_grid_cell;
+   int last_cell = (first_row + rows - 1 + half_cell) / local_grid_cell;
+
+   cpuThreadPool().parallelFor(last_cell - first_cell + 1, [&](size_t task) {
+      int gy = first_cell + (int)task;
+      int y_begin = max(first_row, gy * local_grid_cell - half_cell);
+      int y_end = min(first_row + rows, gy * local_grid_cell + half_cell);
+      vector<float> log_lum(width);
+      for (int y = y_begin; y < y_end; ++y) {
+         cpuKernels().log2_luminance(p + (size_t)(y - first_row) * width, log_lum.data(), width);
+         for (int x = 0; x < width; ++x) {
+            float level = log_lum[x] - local_grid_min_log2;
+            float *cell = grid.cell((x + half_cell) / local_grid_cell, gy, min((int)(level + 0.5f), local_grid_depth - 1));
+            cell[0] += level;
+            cell[1] += 1.0f;
+         }
+      }
+   });
+}
+
+// One [1 4 6 4 1] / 16 pass along an axis with the given stride in pairs, out
+// of range cells count as empty
+void blurBilateralAxis(const float *in, float *out, size_t stride, int length, size_t lines,
+                       const function<size_t(size_t)> &line_start) {
+   static const float taps[5] = { 1.0f / 16.0f, 4.0f / 16.0f, 6.0f / 16.0f, 4.0f / 16.0f, 1.0f / 16.0f };
+   cpuThreadPool().parallelFor(lines, [&](size_t line) {
+      size_t start = line_start(line);
+      for (int i = 0; i < length; ++i) {
+         float sum = 0.0f, weight = 0.0f;
+         for (int t = -2; t <= 2; ++t) {
+            if (i + t < 0 || i + t >= length)
+               continue;
+            const float *cell = in + (start + (i + t) * stride) * 2;
+            sum += taps[t + 2] * cell[0];
+            weight += taps[t + 2] * cell[1];
+         }
+         out[(start + i * stride) * 2] = sum;
+         out[(start + i * stride) * 2 + 1] = weight;
+      }
+   });
+}
+
+// Blurs along the luminance, x and y axes and scales the pairs to a weight of
+// one per fully covered cell
+void blurBilateralGrid(bilateral_grid &grid) {
+   TraceScope trace("local_blur");
+   const size_t depth = local_grid_depth, width = grid.width, height = grid.height;
+   vector<float> scratch(grid.cells.size());
+
+   blurBilateralAxis(grid.cells.data(), scratch.data(), 1, depth, width * height,
+                     [&](size_t line) { return line * depth; });
+   blurBilateralAxis(scratch.data(), grid.cells.data(), depth, width, height * depth,
+                     [&](size_t line) { return line / depth * width * depth + line % depth; });
+   blurBilateralAxis(grid.cells.data(), scratch.data(), width * depth, height, width * depth,
+                     [&](size_t line) { return line; });
+
+   const float area = 1.0f / (local_grid_cell * local_grid_cell);
+   for (size_t i = 0; i < scratch.size(); ++i)
+      grid.cells[i] = scratch[i] * area;
+}
+
+// The grid of a whole image in memory
+void buildBilateralGrid(bilateral_grid &grid, const Rgba *p, int width, int height) {
+   splatBilateralGrid(grid, p, width, 0, height);
+   blurBilateralGrid(grid);
+}
+
+// Per band buffers of localToneRow()
+struct local_tone_scratch
+{
+   vector<float> log_lum, exposure, columns;
+   vector<Rgba> row;
+};
+
+// Returns row scaled by the local gain of every pixel, in the scratch row; y
+// is the image row and anchor the log2 average. The row may come from a
+// pyramid level, whose pixels slice the grid at their full size position.
+// The log2 luminances and the gains run through the vector kernels. The slice
+// blends the two grid rows around y once per row, then each pixel only
+// between two columns.
+const Rgba *localToneRow(const bilateral_grid &grid, const local_tone_settings &settings, float anchor,
+                         const Rgba *row, int width, int y, int level, local_tone_scratch &scratch) {
+   const size_t column_size = local_grid_depth * 2;
+   scratch.log_lum.resize(width);
+   scratch.exposure.resize(width);
+   scratch.row.resize(width);
+   scratch.columns.resize(grid.width * column_size);
+   cpuKernels().log2_luminance(row, scratch.log_lum.data(), width);
+
+   const float inv_cell = 1.0f / local_grid_cell;
+   const float scale = (float)(1 << level), offset = 0.5f * scale - 0.5f;
+   float fy = min((y * scale + offset) * inv_cell, grid.height - 1.0f);
+   int y0 = min((int)fy, grid.height - 2);
+   fy -= y0;
+   const float *above = grid.cell(0, y0, 0), *below = grid.cell(0, y0 + 1, 0);
+   for (size_t i = 0; i < scratch.columns.size(); ++i)
+      scratch.columns[i] = above[i] + fy * (below[i] - above[i]);
+
+   for (int x = 0; x < width; ++x) {
+      float log_lum = scratch.log_lum[x];
+      float fx = min((x * scale + offset) * inv_cell, grid.width - 1.0f);
+      int x0 = min((int)fx, grid.width - 2);
+      fx -= x0;
+      float fz = min(log_lum - local_grid_min_log2, local_grid_depth - 1.0f);
+      int z0 = min((int)fz, local_grid_depth - 2);
+      fz -= z0;
+
+      // The (sum, weight) pairs of z0 and z0 + 1 are adjacent
+      const float *left = &scratch.columns[x0 * column_size + z0 * 2], *right = left + column_size;
+      float sum_left = left[0] + fz * (left[2] - left[0]), weight_left = left[1] + fz * (left[3] - left[1]);
+      float sum_right = right[0] + fz * (right[2] - right[0]), weight_right = right[1] + fz * (right[3] - right[1]);
+      float sum = sum_left + fx * (sum_right - sum_left), weight = weight_left + fx * (weight_right - weight_left);
+
+      float base = weight > 0.0f ? sum / weight + local_grid_min_log2 : log_lum;
+      scratch.exposure[x] = glsl::localToneExposure(log_lum, base, anchor, settings.compression, settings.detail);
+   }
+
+   cpuKernels().scale_exp2(row, scratch.exposure.data(), scratch.row.data(), width);
+   return scratch.row.data();
+}
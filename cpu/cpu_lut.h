@@ -0,0 +1,175 @@
+#pragma once
+
+#include "../utils/tone_lut.h"
+#include "cpu_simd.h"
+
+using namespace std;
+
+/* Row kernels for baked tone curves (utils/tone_lut.h)
+ *
+ * One instantiation per shape, with or without the cube stage, picked once
+ * per image by toneLutKernel(). The AVX2 version gathers both ends of the
+ * 1-D segments and the eight cube corners; NEON has no gather and uses the
+ * scalar loop.
+ */
+typedef void (*tone_lut_kernel)(const Rgba *pixels, size_t count, const tone_lut &lut, float exposure,
+                                unsigned char *rgb_8bit, unsigned short *rgb_10bit);
+
+template <tone_operator_shape Shape, bool Cube>
+void toneMapLutScalar(const Rgba *pixels, size_t count, const tone_lut &lut, float exposure,
+                      unsigned char *rgb_8bit, unsigned short *rgb_10bit) {
+   const float *channel = lut.channel.data(), *scale = lut.scale.data();
+   const bool convert = Shape == TONE_SHAPE_LUMINANCE && lut.primaries == OUTPUT_PRIMARIES_BT2020;
+
+   for (size_t i = 0; i < count; ++i) {
+      float in[3] = { pixels[i].r, pixels[i].g, pixels[i].b }, out[3];
+      float factor = exposure;
+      if (Shape == TONE_SHAPE_LUMINANCE)
+         factor = sampleToneTable(scale, (0.2126f * in[0] + 0.7152f * in[1] + 0.0722f * in[2]) * exposure);
+      glsl::vec3 scaled = glsl::vec3(in[0] * factor, in[1] * factor, in[2] * factor);
+      if (convert)
+         scaled = glsl::rec709ToRec2020(scaled);
+      out[0] = sampleToneTable(channel, scaled.r);
+      out[1] = sampleToneTable(channel, scaled.g);
+      out[2] = sampleToneTable(channel, scaled.b);
+
+      if (Cube) {
+         float graded[3];
+         sampleToneCube(lut.cube.data(), lut.cube_size, out, graded);
+         quantizePixel(graded, i * 3, rgb_8bit, rgb_10bit);
+      }
+      else
+         quantizePixel(out, i * 3, rgb_8bit, rgb_10bit);
+   }
+}
+
+#ifdef HDR_SIMD_X86
+
+HDR_TARGET_AVX2 inline __m256 lerpAvx2(__m256 a, __m256 b, __m256 t) {
+   return _mm256_fmadd_ps(t, _mm256_sub_ps(b, a), a);
+}
+
+HDR_TARGET_AVX2 inline __m256 sampleToneTableAvx2(const float *table, __m256 x) {
+   x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(tone_lut_min_input)), _mm256_set1_ps(tone_lut_max_input));
+
+   __m256i bits = _mm256_castps_si256(x);
+   __m256i row = _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127 + tone_lut_min_exponent));
+   __m256i column = _mm256_and_si256(_mm256_srli_epi32(bits, 15), _mm256_set1_epi32(tone_lut_segments - 1));
+   __m256i entry = _mm256_add_epi32(_mm256_mullo_epi32(row, _mm256_set1_epi32(tone_lut_row)), column);
+   __m256 fraction = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(bits, _mm256_set1_epi32(0x7fff))),
+                                   _mm256_set1_ps(1.0f / 32768.0f));
+
+   return lerpAvx2(_mm256_i32gather_ps(table, entry, 4), _mm256_i32gather_ps(table + 1, entry, 4), fraction);
+}
+
+// Trilinear lookup of all three channels, the same arithmetic as sampleToneCube
+HDR_TARGET_AVX2 inline void sampleToneCubeAvx2(const float *cube, int size, __m256 rgb[3]) {
+   const __m256 zero = _mm256_setzero_ps(), last = _mm256_set1_ps((float)(size - 1));
+   __m256i index[3];
+   __m256 fraction[3];
+   for (int c = 0; c < 3; ++c) {
+      __m256 position = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(rgb[c], last), zero), last);
+      index[c] = _mm256_min_epi32(_mm256_cvttps_epi32(position), _mm256_set1_epi32(size - 2));
+      fraction[c] = _mm256_sub_ps(position, _mm256_cvtepi32_ps(index[c]));
+   }
+
+   // Float offset of the first corner, then of the other seven
+   __m256i base = _mm256_mullo_epi32(index[2], _mm256_set1_epi32(size));
+   base = _mm256_mullo_epi32(_mm256_add_epi32(base, index[1]), _mm256_set1_epi32(size));
+   base = _mm256_slli_epi32(_mm256_add_epi32(base, index[0]), 2);
+   const int dr = 4, dg = size * 4, db = size * size * 4;
+
+   for (int c = 0; c < 3; ++c) {
+      const float *p = cube + c;
+      __m256 c00 = lerpAvx2(_mm256_i32gather_ps(p, base, 4), _mm256_i32gather_ps(p + dr, base, 4), fraction[0]);
+      __m256 c10 = lerpAvx2(_mm256_i32gather_ps(p + dg, base, 4), _mm256_i32gather_ps(p + dg + dr, base, 4), fraction[0]);
+      __m256 c01 = lerpAvx2(_mm256_i32gather_ps(p + db, base, 4), _mm256_i32gather_ps(p + db + dr, base, 4), fraction[0]);
+      __m256 c11 = lerpAvx2(_mm256_i32gather_ps(p + db + dg, base, 4), _mm256_i32gather_ps(p + db + dg + dr, base, 4), fraction[0]);
+      rgb[c] = lerpAvx2(lerpAvx2(c00, c10, fraction[1]), lerpAvx2(c01, c11, fraction[1]), fraction[2]);
+   }
+}
+
+// The matrix of glsl::rec709ToRec2020 on eight pixels
+HDR_TARGET_AVX2 inline void rec709ToRec2020Avx2(__m256 rgb[3]) {
+   static const float m[3][3] = { { 0.627403896f, 0.329283038f, 0.043313066f },
+                                  { 0.069097289f, 0.919540395f, 0.011362316f },
+                                  { 0.016391439f, 0.088013308f, 0.895595253f } };
+   __m256 out[3];
+   for (int row = 0; row < 3; ++row) {
+      out[row] = _mm256_mul_ps(rgb[0], _mm256_set1_ps(m[row][0]));
+      out[row] = _mm256_fmadd_ps(rgb[1], _mm256_set1_ps(m[row][1]), out[row]);
+      out[row] = _mm256_fmadd_ps(rgb[2], _mm256_set1_ps(m[row][2]), out[row]);
+   }
+   for (int c = 0; c < 3; ++c)
+      rgb[c] = out[c];
+}
+
+template <tone_operator_shape Shape, bool Cube>
+HDR_TARGET_AVX2 void toneMapLutAvx2(const Rgba *pixels, size_t count, const tone_lut &lut, float exposure,
+                                    unsigned char *rgb_8bit, unsigned short *rgb_10bit) {
+   const float *channel = lut.channel.data(), *scale = lut.scale.data();
+   const bool convert = Shape == TONE_SHAPE_LUMINANCE && lut.primaries == OUTPUT_PRIMARIES_BT2020;
+   const __m256 exposure_v = _mm256_set1_ps(exposure);
+   size_t i = 0;
+
+   for (; i + 8 <= count; i += 8) {
+      __m256 r, g, b, a;
+      loadPixelsAvx2(pixels + i, r, g, b, a);
+      __m256 factor = exposure_v;
+      if (Shape == TONE_SHAPE_LUMINANCE)
+         factor = sampleToneTableAvx2(scale, _mm256_mul_ps(luminanceAvx2(r, g, b), exposure_v));
+
+      __m256 scaled[3] = { _mm256_mul_ps(r, factor), _mm256_mul_ps(g, factor), _mm256_mul_ps(b, factor) };
+      if (convert)
+         rec709ToRec2020Avx2(scaled);
+      __m256 channels[3] = { sampleToneTableAvx2(channel, scaled[0]),
+                             sampleToneTableAvx2(channel, scaled[1]),
+                             sampleToneTableAvx2(channel, scaled[2]) };
+      if (Cube)
+         sampleToneCubeAvx2(lut.cube.data(), lut.cube_size, channels);
+
+      if (rgb_8bit) {
+         alignas(32) int codes[3][8];
+         for (int c = 0; c < 3; ++c)
+            _mm256_store_si256((__m256i*)codes[c], quantizeAvx2(channels[c], 255.0f));
+         for (int l = 0; l < 8; ++l)
+            for (int c = 0; c < 3; ++c)
+               rgb_8bit[(i + l) * 3 + c] = (unsigned char)codes[c][l];
+      }
+      if (rgb_10bit) {
+         alignas(32) int codes[3][8];
+         for (int c = 0; c < 3; ++c)
+            _mm256_store_si256((__m256i*)codes[c], quantizeAvx2(channels[c], 1023.0f));
+         for (int l = 0; l < 8; ++l)
+            for (int c = 0; c < 3; ++c)
+               rgb_10bit[(i + l) * 3 + c] = (unsigned short)codes[c][l];
+      }
+   }
+
+   toneMapLutScalar<Shape, Cube>(pixels + i, count - i, lut, exposure,
+                                 rgb_8bit ? rgb_8bit + i * 3 : NULL, rgb_10bit ? rgb_10bit + i * 3 : NULL);
+}
+
+#endif // HDR_SIMD_X86
+
+// The kernel for a baked lut, vectorized when the active kernel table is
+template <tone_operator_shape Shape, bool Cube>
+tone_lut_kernel toneLutKernelFor() {
+#ifdef HDR_SIMD_X86
+   if (&cpuKernels() != &scalar_kernels)
+      return toneMapLutAvx2<Shape, Cube>;
+#endif
+   return toneMapLutScalar<Shape, Cube>;
+}
+
+inline tone_lut_kernel toneLutKernel(const tone_lut &lut) {
+   bool cube = lut.cube_size > 0;
+   switch (lut.shape) {
+   case TONE_SHAPE_LUMINANCE:
+      return cube ? toneLutKernelFor<TONE_SHAPE_LUMINANCE, true>() : toneLutKernelFor<TONE_SHAPE_LUMINANCE, false>();
+   case TONE_SHAPE_PER_CHANNEL:
+      return cube ? toneLutKernelFor<TONE_SHAPE_PER_CHANNEL, true>() : toneLutKernelFor<TONE_SHAPE_PER_CHANNEL, false>();
+   default:
+      return toneLutKernelFor<TONE_SHAPE_GENERAL, true>();
+   }
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <OpenEXR/ImfRgbaFile.h>
+
+#include "../utils/pyramid.h"
+#include "../utils/buffer_pool.h"
+#include "../utils/thread_pool.h"
+#include "../utils/trace.h"
+
+using namespace OPENEXR_IMF_NAMESPACE;
+using namespace std;
+
+/* Output pyramid on the CPU (utils/pyramid.h)
+ *
+ * Every level down to the deepest one requested is kept as a half float
+ * image, reduced 2:1 from the level above. Reduction runs on the rows that
+ * are already available, so the levels fill in while the file decodes and
+ * each chunk is reduced while it is still in cache. The box filter averages
+ * 2x2 pixels; Lanczos-2 filters the eight source rows into one float row,
+ * then the eight columns of every output pixel, a block of output rows per
+ * task. Lanczos lags the decoded rows by four rows for its lower taps.
+ */
+struct pyramid_level
+{
+   int level, width, height;
+   int rows_done = 0;
+   shared_ptr<Rgba> pixels;
+};
+
+struct image_pyramid
+{
+   int width, height;   // of the full image
+   pyramid_filter filter;
+   vector<pyramid_level> levels;   // 1 down to the deepest requested level
+
+   image_pyramid(int image_width, int image_height, int depth, pyramid_filter filter)
+      : width(image_width), height(image_height), filter(filter) {
+      for (int level = 1; level <= depth; ++level) {
+         pyramid_level reduced;
+         reduced.level = level;
+         pyramidLevelSize(width, height, level, reduced.width, reduced.height);
+         reduced.pixels = imageBufferPool().acquire<Rgba>((size_t)reduced.width * reduced.height);
+         levels.push_back(reduced);
+      }
+   }
+};
+
+// Output rows of 2:1 reduction that only need the first available of height source rows
+inline int pyramidRowsReady(pyramid_filter filter, int available, int height, int level_height) {
+   if (available >= height)
+      return level_height;
+   if (filter == PYRAMID_FILTER_BOX)
+      return min(level_height, available / 2);
+   // Row y reads up to source row 2y + 4
+   return min(level_height, available >= 5 ? (available - 3) / 2 : 0);
+}
+
+inline void storePyramidPixel(Rgba &pixel, const float sum[4]) {
+   // The negative lobes of Lanczos can ring below black
+   pixel.r = max(sum[0], 0.0f);
+   pixel.g = max(sum[1], 0.0f);
+   pixel.b = max(sum[2], 0.0f);
+   pixel.a = sum[3];
+}
+
+void reduceBoxRow(const Rgba *source, int source_width, int source_height, Rgba *row, int width, int y) {
+   const Rgba *above = source + (size_t)min(2 * y, source_height - 1) * source_width;
+   const Rgba *below = source + (size_t)min(2 * y + 1, source_height - 1) * source_width;
+   for (int x = 0; x < width; ++x) {
+      int left = min(2 * x, source_width - 1), right = min(2 * x + 1, source_width - 1);
+      float sum[4] = {
+         0.25f * ((float)above[left].r + (float)above[right].r + (float)below[left].r + (float)below[right].r),
+         0.25f * ((float)above[left].g + (float)above[right].g + (float)below[left].g + (float)below[right].g),
+         0.25f * ((float)above[left].b + (float)above[right].b + (float)below[left].b + (float)below[right].b),
+         0.25f * ((float)above[left].a + (float)above[right].a + (float)below[left].a + (float)below[right].a)
+      };
+      storePyramidPixel(row[x], sum);
+   }
+}
+
+// columns is scratch for one filtered source row, four floats per pixel
+void reduceLanczosRow(const Rgba *source, int source_width, int source_height, Rgba *row, int width, int y,
+                      vector<float> &columns) {
+   const float *weights = pyramidLanczosWeights();
+   columns.assign((size_t)source_width * 4, 0.0f);
+
+   for (int t = 0; t < pyramid_lanczos_taps; ++t) {
+      const Rgba *tap = source + (size_t)min(max(2 * y - 3 + t, 0), source_height - 1) * source_width;
+      float weight = weights[t];
+      for (int x = 0; x < source_width; ++x) {
+         columns[x * 4] += weight * tap[x].r;
+         columns[x * 4 + 1] += weight * tap[x].g;
+         columns[x * 4 + 2] += weight * tap[x].b;
+         columns[x * 4 + 3] += weight * tap[x].a;
+      }
+   }
+
+   for (int x = 0; x < width; ++x) {
+      float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+      for (int t = 0; t < pyramid_lanczos_taps; ++t) {
+         const float *column = &columns[min(max(2 * x - 3 + t, 0), source_width - 1) * 4];
+         for (int c = 0; c < 4; ++c)
+            sum[c] += weights[t] * column[c];
+      }
+      storePyramidPixel(row[x], sum);
+   }
+}
+
+const int pyramid_block_rows = 16;
+
+/* Reduces every level row whose source rows are within the first
+ * available_rows rows of the image. image is indexed from the first row of
+ * the image, rows outside the available ones are never touched, so a
+ * streamed chunk can be passed as chunk - first_row * width. */
+void reduceImagePyramid(image_pyramid &pyramid, const Rgba *image, int available_rows) {
+   const Rgba *source = image;
+   int source_width = pyramid.width, source_height = pyramid.height, available = available_rows;
+
+   for (pyramid_level &level : pyramid.levels) {
+      int first_row = level.rows_done;
+      int ready = pyramidRowsReady(pyramid.filter, available, source_height, level.height);
+      if (ready > first_row) {
+         TraceScope trace("pyramid_reduce");
+         trace.setPixels((size_t)level.width * (ready - first_row));
+         Rgba *pixels = level.pixels.get();
+         size_t blocks = (ready - first_row + pyramid_block_rows - 1) / pyramid_block_rows;
+
+         cpuThreadPool().parallelFor(blocks, [&](size_t block) {
+            int begin = first_row + (int)block * pyramid_block_rows;
+            int end = min(ready, begin + pyramid_block_rows);
+            vector<float> columns;
+            for (int y = begin; y < end; ++y) {
+               Rgba *row = pixels + (size_t)y * level.width;
+               if (pyramid.filter == PYRAMID_FILTER_BOX)
+                  reduceBoxRow(source, source_width, source_height, row, level.width, y);
+               else
+                  reduceLanczosRow(source, source_width, source_height, row, level.width, y, columns);
+            }
+         });
+         level.rows_done = ready;
+      }
+
+      source = level.pixels.get();
+      source_width = level.width;
+      source_height = level.height;
+      available = level.rows_done;
+   }
+}
+
+// The pyramid of an image with the selected levels, NULL without one
+shared_ptr<image_pyramid> startImagePyramid(int width, int height) {
+   const pyramid_settings &settings = pyramidSettings();
+   if (settings.levels.empty())
+      return NULL;
+   return make_shared<image_pyramid>(width, height, pyramidDepth(settings), settings.filter);
+}
+
+inline bool isPyramidOutput(const pyramid_settings &settings, int level) {
+   return find(settings.levels.begin(), settings.levels.end(), level) != settings.levels.end();
+}
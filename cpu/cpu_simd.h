@@ -0,0 +1,1026 @@
+#pragma once
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <OpenEXR/ImfRgbaFile.h>
+
+#include "../utils/tone_operators.h"
+#include "../utils/tone_lut.h"
+#include "../utils/luminance_histogram.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HDR_SIMD_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HDR_SIMD_NEON 1
+#endif
+
+using namespace OPENEXR_IMF_NAMESPACE;
+using namespace std;
+
+/* Row kernels for the CPU tone mapping path
+ *
+ * Every kernel works on a contiguous run of Rgba pixels (one image row or part
+ * of one). The scalar versions are the original loop bodies and use libm. The
+ * vector versions convert halfs with F16C / NEON and replace log, exp and pow
+ * with the Cephes single precision polynomials below. Against libm, the
+ * polynomial pow(x, 1/2.2) has a maximum relative error of 1e-6 on
+ * [2^-24, 2^16], far below half a 10-bit code value; the vector outputs stay
+ * within one code value of the scalar path (bench/simd_kernels.cpp checks it).
+ *
+ * The kernel table is picked once at startup from the CPU features
+ * (AVX-512, then AVX2, then scalar on x86; NEON on AArch64) and can be forced
+ * with selectCpuKernels() for comparisons.
+ */
+struct cpu_kernels
+{
+   const char *name;
+
+   // luminance[i] = Rec.709 luminance of pixels[i]
+   void (*luminance)(const Rgba *pixels, float *luminance, size_t count);
+
+   // Adds the log of every pixel's safe luminance to log_sum, raises max to the
+   // largest one and, unless histogram is NULL, counts them into its bins
+   void (*log_luminance)(const Rgba *pixels, size_t count, double &log_sum, float &max, uint32_t *histogram);
+
+   // pixels[i].rgb *= Reinhard extended compression factor of scaled_luminance[i]
+   void (*compress)(Rgba *pixels, const float *scaled_luminance, float whiteness_factor, size_t count);
+
+   // pixels[i].rgb = pow(pixels[i].rgb, gamma)
+   void (*gamma)(Rgba *pixels, float gamma, size_t count);
+
+   // Fused scale, compress, gamma and quantize into interleaved RGB, either output may be NULL
+   void (*tone_map)(const Rgba *pixels, size_t count, float scaling_factor, float whiteness_factor,
+                    float gamma, unsigned char *rgb_8bit, unsigned short *rgb_10bit);
+
+   // log2_luminance[i] = log2 of the safe luminance of pixels[i], for the local operator
+   void (*log2_luminance)(const Rgba *pixels, float *log2_luminance, size_t count);
+
+   // out[i].rgb = pixels[i].rgb * exp2(exponent[i]), the alpha copied
+   void (*scale_exp2)(const Rgba *pixels, const float *exponent, Rgba *out, size_t count);
+};
+
+/* Scalar kernels */
+
+inline void luminanceScalar(const Rgba *pixels, float *luminance, size_t count) {
+   for (size_t i = 0; i < count; ++i)
+      luminance[i] = 0.2126f * pixels[i].r + 0.7152f * pixels[i].g + 0.0722f * pixels[i].b;
+}
+
+inline void logLuminanceScalar(const Rgba *pixels, size_t count, double &log_sum, float &max, uint32_t *histogram) {
+   for (size_t i = 0; i < count; ++i) {
+      float luminance = glsl::safeLuminance(0.2126f * pixels[i].r + 0.7152f * pixels[i].g + 0.0722f * pixels[i].b);
+      if (luminance > max)
+         max = luminance;
+      log_sum += log(luminance);
+      if (histogram)
+         ++histogram[glsl::luminanceBin(luminance)];
+   }
+}
+
+inline void compressScalar(Rgba *pixels, const float *scaled_luminance, float whiteness_factor, size_t count) {
+   for (size_t i = 0; i < count; ++i) {
+      float input_luminance = scaled_luminance[i];
+      float output_luminance =
+         (input_luminance * (1.0f + (input_luminance * whiteness_factor))) / (1.0f + input_luminance);
+      float compression_factor = output_luminance / input_luminance;
+
+      pixels[i].r *= compression_factor;
+      pixels[i].g *= compression_factor;
+      pixels[i].b *= compression_factor;
+   }
+}
+
+inline void gammaScalar(Rgba *pixels, float gamma, size_t count) {
+   for (size_t i = 0; i < count; ++i) {
+      pixels[i].r = pow(pixels[i].r, gamma);
+      pixels[i].g = pow(pixels[i].g, gamma);
+      pixels[i].b = pow(pixels[i].b, gamma);
+   }
+}
+
+inline void quantizePixel(const float rgb[3], size_t offset, unsigned char *rgb_8bit, unsigned short *rgb_10bit) {
+   for (int c = 0; c < 3; ++c) {
+      float v = rgb[c] < 0.0f ? 0.0f : (rgb[c] > 1.0f ? 1.0f : rgb[c]);
+      if (rgb_8bit)
+         rgb_8bit[offset + c] = (unsigned char)(255.999f * v);
+      if (rgb_10bit)
+         rgb_10bit[offset + c] = (unsigned short)(1023.999f * v);
+   }
+}
+
+inline void toneMapScalar(const Rgba *pixels, size_t count, float scaling_factor, float whiteness_factor,
+                          float gamma, unsigned char *rgb_8bit, unsigned short *rgb_10bit) {
+   for (size_t i = 0; i < count; ++i) {
+      float r = pixels[i].r, g = pixels[i].g, b = pixels[i].b;
+      float scaled_luminance = (0.2126f * r + 0.7152f * g + 0.0722f * b) * scaling_factor;
+
+      // Lout / Lin of the extended operator, written so that black pixels do not divide by zero
+      float compression_factor = (1.0f + scaled_luminance * whiteness_factor) / (1.0f + scaled_luminance);
+
+      float out[3] = { pow(std::max(r * compression_factor, 0.0f), gamma),
+                       pow(std::max(g * compression_factor, 0.0f), gamma),
+                       pow(std::max(b * compression_factor, 0.0f), gamma) };
+      quantizePixel(out, i * 3, rgb_8bit, rgb_10bit);
+   }
+}
+
+inline void log2LuminanceScalar(const Rgba *pixels, float *log2_luminance, size_t count) {
+   for (size_t i = 0; i < count; ++i)
+      log2_luminance[i] = log2(glsl::safeLuminance(0.2126f * pixels[i].r + 0.7152f * pixels[i].g + 0.0722f * pixels[i].b));
+}
+
+inline void scaleExp2Scalar(const Rgba *pixels, const float *exponent, Rgba *out, size_t count) {
+   for (size_t i = 0; i < count; ++i) {
+      float gain = exp2(exponent[i]);
+      out[i].r = pixels[i].r * gain;
+      out[i].g = pixels[i].g * gain;
+      out[i].b = pixels[i].b * gain;
+      out[i].a = pixels[i].a;
+   }
+}
+
+const cpu_kernels scalar_kernels = {
+   "scalar", luminanceScalar, logLuminanceScalar, compressScalar, gammaScalar, toneMapScalar,
+   log2LuminanceScalar, scaleExp2Scalar
+};
+
+/* Operator kernels
+ *
+ * One instantiation per tone operator and transfer function (see
+ * utils/tone_operators.h), the curve inlined into the loop. toneCurveKernel()
+ * picks the instantiation for a runtime selection, once per image. These are
+ * scalar; the default curve keeps the vector kernels above.
+ *
+ * The HDR transfers encode through a table in the bit indexed layout of
+ * utils/tone_lut.h, baked once from the formula the GPU runs, instead of
+ * evaluating it per channel: PQ alone is two pow() calls. The table stays
+ * within 3e-5 of the formula, a sixteenth of half a 10-bit code value.
+ */
+template <class Transfer>
+struct cpu_transfer
+{
+   static constexpr bool tabulated = false;
+   static float encode(float v) { return Transfer::encode(v); }
+};
+
+template <class Transfer>
+struct tabulated_transfer
+{
+   static constexpr bool tabulated = true;
+
+   static const float *table() {
+      static const vector<float> entries = [] {
+         vector<float> t(tone_lut_table_size);
+         for (int row = 0; row < tone_lut_binades; ++row)
+            for (int column = 0; column < tone_lut_row; ++column)
+               t[(size_t)row * tone_lut_row + column] = Transfer::encode(toneLutInput(row, column));
+         return t;
+      }();
+      return entries.data();
+   }
+
+   static float encode(float v) { return sampleToneTable(table(), v); }
+};
+
+template <> struct cpu_transfer<PqTransfer> : tabulated_transfer<PqTransfer> {};
+template <> struct cpu_transfer<HlgTransfer> : tabulated_transfer<HlgTransfer> {};
+
+#define HDR_TABULATED_TRANSFER(id, Transfer) cpu_transfer<Transfer>::tabulated,
+
+inline bool cpuTabulatesTransfer(transfer_type transfer) {
+   static const bool tabulated[] = { HDR_TRANSFER_FUNCTIONS(HDR_TABULATED_TRANSFER) };
+   return tabulated[transfer];
+}
+
+typedef void (*tone_curve_kernel)(const Rgba *pixels, size_t count, const glsl::ToneParams &params,
+                                  unsigned char *rgb_8bit, unsigned short *rgb_10bit);
+
+template <class Operator, class Transfer>
+void toneMapCurve(const Rgba *pixels, size_t count, const glsl::ToneParams &params,
+                  unsigned char *rgb_8bit, unsigned short *rgb_10bit) {
+   typedef cpu_transfer<Transfer> Encoder;
+   for (size_t i = 0; i < count; ++i) {
+      glsl::vec3 color = Operator::apply(glsl::vec3(pixels[i].r, pixels[i].g, pixels[i].b), params);
+      color = Transfer::toPrimaries(color);
+      float out[3] = { Encoder::encode(color.r), Encoder::encode(color.g), Encoder::encode(color.b) };
+      quantizePixel(out, i * 3, rgb_8bit, rgb_10bit);
+   }
+}
+
+#define HDR_CURVE_KERNEL(id, Transfer) toneMapCurve<Operator, Transfer>,
+#define HDR_OPERATOR_KERNELS(id, Operator) toneCurveKernelsFor<Operator>(),
+
+template <class Operator>
+const tone_curve_kernel *toneCurveKernelsFor() {
+   static const tone_curve_kernel kernels[] = { HDR_TRANSFER_FUNCTIONS(HDR_CURVE_KERNEL) };
+   return kernels;
+}
+
+inline tone_curve_kernel toneCurveKernel(const tone_curve &curve) {
+   static const tone_curve_kernel *const by_operator[] = { HDR_TONE_OPERATORS(HDR_OPERATOR_KERNELS) };
+   return by_operator[curve.op][curve.transfer];
+}
+
+/* Cephes single precision log / exp coefficients shared by the vector kernels */
+#define HDR_LOG_P0  7.0376836292E-2f
+#define HDR_LOG_P1 -1.1514610310E-1f
+#define HDR_LOG_P2  1.1676998740E-1f
+#define HDR_LOG_P3 -1.2420140846E-1f
+#define HDR_LOG_P4  1.4249322787E-1f
+#define HDR_LOG_P5 -1.6668057665E-1f
+#define HDR_LOG_P6  2.0000714765E-1f
+#define HDR_LOG_P7 -2.4999993993E-1f
+#define HDR_LOG_P8  3.3333331174E-1f
+#define HDR_EXP_P0  1.9875691500E-4f
+#define HDR_EXP_P1  1.3981999507E-3f
+#define HDR_EXP_P2  8.3334519073E-3f
+#define HDR_EXP_P3  4.1665795894E-2f
+#define HDR_EXP_P4  1.6666665459E-1f
+#define HDR_EXP_P5  5.0000001201E-1f
+#define HDR_LN2_HI  0.693359375f
+#define HDR_LN2_LO -2.12194440E-4f
+
+// Pixels converted per flush of the float log accumulators into the double sum
+const size_t log_flush_pixels = 1024;
+
+#ifdef HDR_SIMD_X86
+
+/* AVX2 + FMA + F16C kernels, 8 pixels per iteration */
+#define HDR_TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+
+// Loads 8 pixels and transposes them into one vector per channel
+HDR_TARGET_AVX2 inline void loadPixelsAvx2(const Rgba *pixels, __m256 &r, __m256 &g, __m256 &b, __m256 &a) {
+   const __m128i *src = (const __m128i*)pixels;
+   __m128i p01 = _mm_loadu_si128(src), p23 = _mm_loadu_si128(src + 1);
+   __m128i p45 = _mm_loadu_si128(src + 2), p67 = _mm_loadu_si128(src + 3);
+
+   // Each 128-bit lane holds one pixel: v0 = p0 | p4, v1 = p1 | p5, ...
+   __m256 v0 = _mm256_cvtph_ps(_mm_unpacklo_epi64(p01, p45));
+   __m256 v1 = _mm256_cvtph_ps(_mm_unpackhi_epi64(p01, p45));
+   __m256 v2 = _mm256_cvtph_ps(_mm_unpacklo_epi64(p23, p67));
+   __m256 v3 = _mm256_cvtph_ps(_mm_unpackhi_epi64(p23, p67));
+
+   __m256 t0 = _mm256_unpacklo_ps(v0, v1), t1 = _mm256_unpackhi_ps(v0, v1);
+   __m256 t2 = _mm256_unpacklo_ps(v2, v3), t3 = _mm256_unpackhi_ps(v2, v3);
+   r = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+   g = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+   b = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+   a = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+}
+
+// Inverse of loadPixelsAvx2
+HDR_TARGET_AVX2 inline void storePixelsAvx2(Rgba *pixels, __m256 r, __m256 g, __m256 b, __m256 a) {
+   __m256 t0 = _mm256_unpacklo_ps(r, g), t1 = _mm256_unpackhi_ps(r, g);
+   __m256 t2 = _mm256_unpacklo_ps(b, a), t3 = _mm256_unpackhi_ps(b, a);
+   __m128i h0 = _mm256_cvtps_ph(_mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0)), _MM_FROUND_TO_NEAREST_INT);
+   __m128i h1 = _mm256_cvtps_ph(_mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2)), _MM_FROUND_TO_NEAREST_INT);
+   __m128i h2 = _mm256_cvtps_ph(_mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0)), _MM_FROUND_TO_NEAREST_INT);
+   __m128i h3 = _mm256_cvtps_ph(_mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2)), _MM_FROUND_TO_NEAREST_INT);
+
+   __m128i *dst = (__m128i*)pixels;
+   _mm_storeu_si128(dst, _mm_unpacklo_epi64(h0, h1));
+   _mm_storeu_si128(dst + 1, _mm_unpacklo_epi64(h2, h3));
+   _mm_storeu_si128(dst + 2, _mm_unpackhi_epi64(h0, h1));
+   _mm_storeu_si128(dst + 3, _mm_unpackhi_epi64(h2, h3));
+}
+
+HDR_TARGET_AVX2 inline __m256 luminanceAvx2(__m256 r, __m256 g, __m256 b) {
+   __m256 lum = _mm256_mul_ps(r, _mm256_set1_ps(0.2126f));
+   lum = _mm256_fmadd_ps(g, _mm256_set1_ps(0.7152f), lum);
+   return _mm256_fmadd_ps(b, _mm256_set1_ps(0.0722f), lum);
+}
+
+// Natural log for positive normal inputs
+HDR_TARGET_AVX2 inline __m256 logAvx2(__m256 x) {
+   __m256i bits = _mm256_castps_si256(x);
+   __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+   __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)),
+                                                  _mm256_set1_epi32(0x3f800000)));
+
+   // Fold the mantissa into [sqrt(0.5), sqrt(2))
+   __m256 above = _mm256_cmp_ps(m, _mm256_set1_ps(1.41421356f), _CMP_GT_OQ);
+   m = _mm256_blendv_ps(m, _mm256_mul_ps(m, _mm256_set1_ps(0.5f)), above);
+   e = _mm256_add_ps(e, _mm256_and_ps(above, _mm256_set1_ps(1.0f)));
+
+   __m256 t = _mm256_sub_ps(m, _mm256_set1_ps(1.0f));
+   __m256 p = _mm256_set1_ps(HDR_LOG_P0);
+   p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(HDR_LOG_P1));
+   p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(HDR_LOG_P2));
+   p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(HDR_LOG_P3));
+   p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(HDR_LOG_P4));
+   p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(HDR_LOG_P5));
+   p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(HDR_LOG_P6));
+   p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(HDR_LOG_P7));
+   p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(HDR_LOG_P8));
+
+   __m256 t2 = _mm256_mul_ps(t, t);
+   __m256 y = _mm256_mul_ps(_mm256_mul_ps(p, t), t2);
+   y = _mm256_fmadd_ps(e, _mm256_set1_ps(HDR_LN2_LO), y);
+   y = _mm256_fnmadd_ps(t2, _mm256_set1_ps(0.5f), y);
+   return _mm256_fmadd_ps(e, _mm256_set1_ps(HDR_LN2_HI), _mm256_add_ps(t, y));
+}
+
+HDR_TARGET_AVX2 inline __m256 expAvx2(__m256 x) {
+   x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.3f)), _mm256_set1_ps(88.3f));
+   __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+   x = _mm256_fnmadd_ps(n, _mm256_set1_ps(HDR_LN2_HI), x);
+   x = _mm256_fnmadd_ps(n, _mm256_set1_ps(HDR_LN2_LO), x);
+
+   __m256 p = _mm256_set1_ps(HDR_EXP_P0);
+   p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(HDR_EXP_P1));
+   p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(HDR_EXP_P2));
+   p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(HDR_EXP_P3));
+   p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(HDR_EXP_P4));
+   p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(HDR_EXP_P5));
+   __m256 y = _mm256_fmadd_ps(p, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+
+   __m256i scale = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+   return _mm256_mul_ps(y, _mm256_castsi256_ps(scale));
+}
+
+// pow(x, exponent) for x > 0, zero otherwise
+HDR_TARGET_AVX2 inline __m256 powAvx2(__m256 x, __m256 exponent) {
+   __m256 positive = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GT_OQ);
+   __m256 safe = _mm256_max_ps(x, _mm256_set1_ps(std::numeric_limits<float>::min()));
+   return _mm256_and_ps(positive, expAvx2(_mm256_mul_ps(logAvx2(safe), exponent)));
+}
+
+HDR_TARGET_AVX2 inline void luminanceKernelAvx2(const Rgba *pixels, float *luminance, size_t count) {
+   size_t i = 0;
+   for (; i + 8 <= count; i += 8) {
+      __m256 r, g, b, a;
+      loadPixelsAvx2(pixels + i, r, g, b, a);
+      _mm256_storeu_ps(luminance + i, luminanceAvx2(r, g, b));
+   }
+   luminanceScalar(pixels + i, luminance + i, count - i);
+}
+
+// safeLuminance: max returns its second operand for NaN
+HDR_TARGET_AVX2 inline __m256 safeLuminanceAvx2(__m256 lum) {
+   return _mm256_min_ps(_mm256_max_ps(lum, _mm256_set1_ps(statistics_min_luminance)),
+                        _mm256_set1_ps(statistics_max_luminance));
+}
+
+HDR_TARGET_AVX2 inline void countLuminanceAvx2(__m256 lum, uint32_t *histogram) {
+   alignas(32) int bins[8];
+   __m256i bin = _mm256_sub_epi32(_mm256_srli_epi32(_mm256_castps_si256(lum), 20),
+                                  _mm256_set1_epi32((127 + luminance_histogram_min_exponent) * 8));
+   _mm256_store_si256((__m256i*)bins, _mm256_min_epi32(bin, _mm256_set1_epi32(luminance_histogram_bins - 1)));
+   for (int l = 0; l < 8; ++l)
+      ++histogram[bins[l]];
+}
+
+HDR_TARGET_AVX2 inline void logLuminanceKernelAvx2(const Rgba *pixels, size_t count, double &log_sum, float &max, uint32_t *histogram) {
+   __m256 vmax = _mm256_set1_ps(max);
+   size_t i = 0;
+
+   while (i + 8 <= count) {
+      __m256 acc = _mm256_setzero_ps();
+      size_t end = std::min(count, i + log_flush_pixels);
+
+      for (; i + 8 <= end; i += 8) {
+         __m256 r, g, b, a;
+         loadPixelsAvx2(pixels + i, r, g, b, a);
+         __m256 lum = safeLuminanceAvx2(luminanceAvx2(r, g, b));
+         vmax = _mm256_max_ps(vmax, lum);
+         acc = _mm256_add_ps(acc, logAvx2(lum));
+         if (histogram)
+            countLuminanceAvx2(lum, histogram);
+      }
+
+      float lanes[8];
+      _mm256_storeu_ps(lanes, acc);
+      for (int l = 0; l < 8; ++l)
+         log_sum += lanes[l];
+   }
+
+   float lanes[8];
+   _mm256_storeu_ps(lanes, vmax);
+   for (int l = 0; l < 8; ++l)
+      max = std::max(max, lanes[l]);
+
+   logLuminanceScalar(pixels + i, count - i, log_sum, max, histogram);
+}
+
+HDR_TARGET_AVX2 inline void compressKernelAvx2(Rgba *pixels, const float *scaled_luminance, float whiteness_factor, size_t count) {
+   const __m256 one = _mm256_set1_ps(1.0f), whiteness = _mm256_set1_ps(whiteness_factor);
+   size_t i = 0;
+   for (; i + 8 <= count; i += 8) {
+      __m256 r, g, b, a;
+      loadPixelsAvx2(pixels + i, r, g, b, a);
+      __m256 lum = _mm256_loadu_ps(scaled_luminance + i);
+      __m256 factor = _mm256_div_ps(_mm256_fmadd_ps(lum, whiteness, one), _mm256_add_ps(one, lum));
+      storePixelsAvx2(pixels + i, _mm256_mul_ps(r, factor), _mm256_mul_ps(g, factor), _mm256_mul_ps(b, factor), a);
+   }
+   compressScalar(pixels + i, scaled_luminance + i, whiteness_factor, count - i);
+}
+
+HDR_TARGET_AVX2 inline void gammaKernelAvx2(Rgba *pixels, float gamma, size_t count) {
+   const __m256 exponent = _mm256_set1_ps(gamma);
+   size_t i = 0;
+   for (; i + 8 <= count; i += 8) {
+      __m256 r, g, b, a;
+      loadPixelsAvx2(pixels + i, r, g, b, a);
+      storePixelsAvx2(pixels + i, powAvx2(r, exponent), powAvx2(g, exponent), powAvx2(b, exponent), a);
+   }
+   gammaScalar(pixels + i, gamma, count - i);
+}
+
+// Clamps to [0, 1], scales by max_code + 0.999 and truncates
+HDR_TARGET_AVX2 inline __m256i quantizeAvx2(__m256 v, float max_code) {
+   v = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+   return _mm256_cvttps_epi32(_mm256_mul_ps(v, _mm256_set1_ps(max_code + 0.999f)));
+}
+
+HDR_TARGET_AVX2 inline void toneMapKernelAvx2(const Rgba *pixels, size_t count, float scaling_factor, float whiteness_factor,
+                                              float gamma, unsigned char *rgb_8bit, unsigned short *rgb_10bit) {
+   const __m256 one = _mm256_set1_ps(1.0f), exponent = _mm256_set1_ps(gamma);
+   const __m256 scaling = _mm256_set1_ps(scaling_factor), whiteness = _mm256_set1_ps(whiteness_factor);
+   size_t i = 0;
+
+   for (; i + 8 <= count; i += 8) {
+      __m256 r, g, b, a;
+      loadPixelsAvx2(pixels + i, r, g, b, a);
+      __m256 lum = _mm256_mul_ps(luminanceAvx2(r, g, b), scaling);
+      __m256 factor = _mm256_div_ps(_mm256_fmadd_ps(lum, whiteness, one), _mm256_add_ps(one, lum));
+      __m256 channels[3] = { powAvx2(_mm256_mul_ps(r, factor), exponent),
+                             powAvx2(_mm256_mul_ps(g, factor), exponent),
+                             powAvx2(_mm256_mul_ps(b, factor), exponent) };
+
+      // Interleaving 3 channels has no cheap shuffle, go through a small staging block
+      if (rgb_8bit) {
+         alignas(32) int codes[3][8];
+         for (int c = 0; c < 3; ++c)
+            _mm256_store_si256((__m256i*)codes[c], quantizeAvx2(channels[c], 255.0f));
+         for (int l = 0; l < 8; ++l)
+            for (int c = 0; c < 3; ++c)
+               rgb_8bit[(i + l) * 3 + c] = (unsigned char)codes[c][l];
+      }
+      if (rgb_10bit) {
+         alignas(32) int codes[3][8];
+         for (int c = 0; c < 3; ++c)
+            _mm256_store_si256((__m256i*)codes[c], quantizeAvx2(channels[c], 1023.0f));
+         for (int l = 0; l < 8; ++l)
+            for (int c = 0; c < 3; ++c)
+               rgb_10bit[(i + l) * 3 + c] = (unsigned short)codes[c][l];
+      }
+   }
+
+   toneMapScalar(pixels + i, count - i, scaling_factor, whiteness_factor, gamma,
+                 rgb_8bit ? rgb_8bit + i * 3 : NULL, rgb_10bit ? rgb_10bit + i * 3 : NULL);
+}
+
+HDR_TARGET_AVX2 inline void log2LuminanceKernelAvx2(const Rgba *pixels, float *log2_luminance, size_t count) {
+   size_t i = 0;
+   for (; i + 8 <= count; i += 8) {
+      __m256 r, g, b, a;
+      loadPixelsAvx2(pixels + i, r, g, b, a);
+      __m256 lum = safeLuminanceAvx2(luminanceAvx2(r, g, b));
+      _mm256_storeu_ps(log2_luminance + i, _mm256_mul_ps(logAvx2(lum), _mm256_set1_ps(1.44269504f)));
+   }
+   log2LuminanceScalar(pixels + i, log2_luminance + i, count - i);
+}
+
+HDR_TARGET_AVX2 inline void scaleExp2KernelAvx2(const Rgba *pixels, const float *exponent, Rgba *out, size_t count) {
+   size_t i = 0;
+   for (; i + 8 <= count; i += 8) {
+      __m256 r, g, b, a;
+      loadPixelsAvx2(pixels + i, r, g, b, a);
+      __m256 gain = expAvx2(_mm256_mul_ps(_mm256_loadu_ps(exponent + i), _mm256_set1_ps(0.693147181f)));
+      storePixelsAvx2(out + i, _mm256_mul_ps(r, gain), _mm256_mul_ps(g, gain), _mm256_mul_ps(b, gain), a);
+   }
+   scaleExp2Scalar(pixels + i, exponent + i, out + i, count - i);
+}
+
+const cpu_kernels avx2_kernels = {
+   "avx2", luminanceKernelAvx2, logLuminanceKernelAvx2, compressKernelAvx2, gammaKernelAvx2, toneMapKernelAvx2,
+   log2LuminanceKernelAvx2, scaleExp2KernelAvx2
+};
+
+/* AVX-512 kernels, 16 pixels per iteration. The transpose relies on the
+ * AVX512BW 16-bit permutes, everything else is AVX512F. */
+#define HDR_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,fma,f16c")))
+
+// Half indices into (pixels 0..7 | pixels 8..15) selecting R then G, and B then A
+alignas(64) static const unsigned short avx512_gather_rg[32] = {
+    0,  4,  8, 12, 16, 20, 24, 28, 32, 36, 40, 44, 48, 52, 56, 60,
+    1,  5,  9, 13, 17, 21, 25, 29, 33, 37, 41, 45, 49, 53, 57, 61
+};
+alignas(64) static const unsigned short avx512_gather_ba[32] = {
+    2,  6, 10, 14, 18, 22, 26, 30, 34, 38, 42, 46, 50, 54, 58, 62,
+    3,  7, 11, 15, 19, 23, 27, 31, 35, 39, 43, 47, 51, 55, 59, 63
+};
+// Half indices into (RG | BA) rebuilding pixels 0..7 and pixels 8..15
+alignas(64) static const unsigned short avx512_scatter_lo[32] = {
+    0, 16, 32, 48,  1, 17, 33, 49,  2, 18, 34, 50,  3, 19, 35, 51,
+    4, 20, 36, 52,  5, 21, 37, 53,  6, 22, 38, 54,  7, 23, 39, 55
+};
+alignas(64) static const unsigned short avx512_scatter_hi[32] = {
+    8, 24, 40, 56,  9, 25, 41, 57, 10, 26, 42, 58, 11, 27, 43, 59,
+   12, 28, 44, 60, 13, 29, 45, 61, 14, 30, 46, 62, 15, 31, 47, 63
+};
+
+HDR_TARGET_AVX512 inline void loadPixelsAvx512(const Rgba *pixels, __m512 &r, __m512 &g, __m512 &b, __m512 &a) {
+   __m512i lo = _mm512_loadu_si512(pixels), hi = _mm512_loadu_si512(pixels + 8);
+   __m512i rg = _mm512_permutex2var_epi16(lo, _mm512_load_si512(avx512_gather_rg), hi);
+   __m512i ba = _mm512_permutex2var_epi16(lo, _mm512_load_si512(avx512_gather_ba), hi);
+   r = _mm512_cvtph_ps(_mm512_extracti64x4_epi64(rg, 0));
+   g = _mm512_cvtph_ps(_mm512_extracti64x4_epi64(rg, 1));
+   b = _mm512_cvtph_ps(_mm512_extracti64x4_epi64(ba, 0));
+   a = _mm512_cvtph_ps(_mm512_extracti64x4_epi64(ba, 1));
+}
+
+HDR_TARGET_AVX512 inline void storePixelsAvx512(Rgba *pixels, __m512 r, __m512 g, __m512 b, __m512 a) {
+   __m512i rg = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtps_ph(r, _MM_FROUND_TO_NEAREST_INT)),
+                                   _mm512_cvtps_ph(g, _MM_FROUND_TO_NEAREST_INT), 1);
+   __m512i ba = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtps_ph(b, _MM_FROUND_TO_NEAREST_INT)),
+                                   _mm512_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT), 1);
+   _mm512_storeu_si512(pixels, _mm512_permutex2var_epi16(rg, _mm512_load_si512(avx512_scatter_lo), ba));
+   _mm512_storeu_si512(pixels + 8, _mm512_permutex2var_epi16(rg, _mm512_load_si512(avx512_scatter_hi), ba));
+}
+
+HDR_TARGET_AVX512 inline __m512 luminanceAvx512(__m512 r, __m512 g, __m512 b) {
+   __m512 lum = _mm512_mul_ps(r, _mm512_set1_ps(0.2126f));
+   lum = _mm512_fmadd_ps(g, _mm512_set1_ps(0.7152f), lum);
+   return _mm512_fmadd_ps(b, _mm512_set1_ps(0.0722f), lum);
+}
+
+HDR_TARGET_AVX512 inline __m512 logAvx512(__m512 x) {
+   __m512i bits = _mm512_castps_si512(x);
+   __m512 e = _mm512_cvtepi32_ps(_mm512_sub_epi32(_mm512_srli_epi32(bits, 23), _mm512_set1_epi32(127)));
+   __m512 m = _mm512_castsi512_ps(_mm512_or_si512(_mm512_and_si512(bits, _mm512_set1_epi32(0x007fffff)),
+                                                  _mm512_set1_epi32(0x3f800000)));
+
+   __mmask16 above = _mm512_cmp_ps_mask(m, _mm512_set1_ps(1.41421356f), _CMP_GT_OQ);
+   m = _mm512_mask_mul_ps(m, above, m, _mm512_set1_ps(0.5f));
+   e = _mm512_mask_add_ps(e, above, e, _mm512_set1_ps(1.0f));
+
+   __m512 t = _mm512_sub_ps(m, _mm512_set1_ps(1.0f));
+   __m512 p = _mm512_set1_ps(HDR_LOG_P0);
+   p = _mm512_fmadd_ps(p, t, _mm512_set1_ps(HDR_LOG_P1));
+   p = _mm512_fmadd_ps(p, t, _mm512_set1_ps(HDR_LOG_P2));
+   p = _mm512_fmadd_ps(p, t, _mm512_set1_ps(HDR_LOG_P3));
+   p = _mm512_fmadd_ps(p, t, _mm512_set1_ps(HDR_LOG_P4));
+   p = _mm512_fmadd_ps(p, t, _mm512_set1_ps(HDR_LOG_P5));
+   p = _mm512_fmadd_ps(p, t, _mm512_set1_ps(HDR_LOG_P6));
+   p = _mm512_fmadd_ps(p, t, _mm512_set1_ps(HDR_LOG_P7));
+   p = _mm512_fmadd_ps(p, t, _mm512_set1_ps(HDR_LOG_P8));
+
+   __m512 t2 = _mm512_mul_ps(t, t);
+   __m512 y = _mm512_mul_ps(_mm512_mul_ps(p, t), t2);
+   y = _mm512_fmadd_ps(e, _mm512_set1_ps(HDR_LN2_LO), y);
+   y = _mm512_fnmadd_ps(t2, _mm512_set1_ps(0.5f), y);
+   return _mm512_fmadd_ps(e, _mm512_set1_ps(HDR_LN2_HI), _mm512_add_ps(t, y));
+}
+
+HDR_TARGET_AVX512 inline __m512 expAvx512(__m512 x) {
+   x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(-87.3f)), _mm512_set1_ps(88.3f));
+   __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+   x = _mm512_fnmadd_ps(n, _mm512_set1_ps(HDR_LN2_HI), x);
+   x = _mm512_fnmadd_ps(n, _mm512_set1_ps(HDR_LN2_LO), x);
+
+   __m512 p = _mm512_set1_ps(HDR_EXP_P0);
+   p = _mm512_fmadd_ps(p, x, _mm512_set1_ps(HDR_EXP_P1));
+   p = _mm512_fmadd_ps(p, x, _mm512_set1_ps(HDR_EXP_P2));
+   p = _mm512_fmadd_ps(p, x, _mm512_set1_ps(HDR_EXP_P3));
+   p = _mm512_fmadd_ps(p, x, _mm512_set1_ps(HDR_EXP_P4));
+   p = _mm512_fmadd_ps(p, x, _mm512_set1_ps(HDR_EXP_P5));
+   __m512 y = _mm512_fmadd_ps(p, _mm512_mul_ps(x, x), _mm512_add_ps(x, _mm512_set1_ps(1.0f)));
+
+   __m512i scale = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23);
+   return _mm512_mul_ps(y, _mm512_castsi512_ps(scale));
+}
+
+HDR_TARGET_AVX512 inline __m512 powAvx512(__m512 x, __m512 exponent) {
+   __mmask16 positive = _mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_GT_OQ);
+   __m512 safe = _mm512_max_ps(x, _mm512_set1_ps(std::numeric_limits<float>::min()));
+   return _mm512_maskz_mov_ps(positive, expAvx512(_mm512_mul_ps(logAvx512(safe), exponent)));
+}
+
+HDR_TARGET_AVX512 inline void luminanceKernelAvx512(const Rgba *pixels, float *luminance, size_t count) {
+   size_t i = 0;
+   for (; i + 16 <= count; i += 16) {
+      __m512 r, g, b, a;
+      loadPixelsAvx512(pixels + i, r, g, b, a);
+      _mm512_storeu_ps(luminance + i, luminanceAvx512(r, g, b));
+   }
+   luminanceScalar(pixels + i, luminance + i, count - i);
+}
+
+HDR_TARGET_AVX512 inline __m512 safeLuminanceAvx512(__m512 lum) {
+   return _mm512_min_ps(_mm512_max_ps(lum, _mm512_set1_ps(statistics_min_luminance)),
+                        _mm512_set1_ps(statistics_max_luminance));
+}
+
+HDR_TARGET_AVX512 inline void countLuminanceAvx512(__m512 lum, uint32_t *histogram) {
+   alignas(64) int bins[16];
+   __m512i bin = _mm512_sub_epi32(_mm512_srli_epi32(_mm512_castps_si512(lum), 20),
+                                  _mm512_set1_epi32((127 + luminance_histogram_min_exponent) * 8));
+   _mm512_store_si512(bins, _mm512_min_epi32(bin, _mm512_set1_epi32(luminance_histogram_bins - 1)));
+   for (int l = 0; l < 16; ++l)
+      ++histogram[bins[l]];
+}
+
+HDR_TARGET_AVX512 inline void logLuminanceKernelAvx512(const Rgba *pixels, size_t count, double &log_sum, float &max, uint32_t *histogram) {
+   __m512 vmax = _mm512_set1_ps(max);
+   size_t i = 0;
+
+   while (i + 16 <= count) {
+      __m512 acc = _mm512_setzero_ps();
+      size_t end = std::min(count, i + log_flush_pixels);
+
+      for (; i + 16 <= end; i += 16) {
+         __m512 r, g, b, a;
+         loadPixelsAvx512(pixels + i, r, g, b, a);
+         __m512 lum = safeLuminanceAvx512(luminanceAvx512(r, g, b));
+         vmax = _mm512_max_ps(vmax, lum);
+         acc = _mm512_add_ps(acc, logAvx512(lum));
+         if (histogram)
+            countLuminanceAvx512(lum, histogram);
+      }
+
+      float lanes[16];
+      _mm512_storeu_ps(lanes, acc);
+      for (int l = 0; l < 16; ++l)
+         log_sum += lanes[l];
+   }
+
+   max = std::max(max, _mm512_reduce_max_ps(vmax));
+   logLuminanceScalar(pixels + i, count - i, log_sum, max, histogram);
+}
+
+HDR_TARGET_AVX512 inline void compressKernelAvx512(Rgba *pixels, const float *scaled_luminance, float whiteness_factor, size_t count) {
+   const __m512 one = _mm512_set1_ps(1.0f), whiteness = _mm512_set1_ps(whiteness_factor);
+   size_t i = 0;
+   for (; i + 16 <= count; i += 16) {
+      __m512 r, g, b, a;
+      loadPixelsAvx512(pixels + i, r, g, b, a);
+      __m512 lum = _mm512_loadu_ps(scaled_luminance + i);
+      __m512 factor = _mm512_div_ps(_mm512_fmadd_ps(lum, whiteness, one), _mm512_add_ps(one, lum));
+      storePixelsAvx512(pixels + i, _mm512_mul_ps(r, factor), _mm512_mul_ps(g, factor), _mm512_mul_ps(b, factor), a);
+   }
+   compressScalar(pixels + i, scaled_luminance + i, whiteness_factor, count - i);
+}
+
+HDR_TARGET_AVX512 inline void gammaKernelAvx512(Rgba *pixels, float gamma, size_t count) {
+   const __m512 exponent = _mm512_set1_ps(gamma);
+   size_t i = 0;
+   for (; i + 16 <= count; i += 16) {
+      __m512 r, g, b, a;
+      loadPixelsAvx512(pixels + i, r, g, b, a);
+      storePixelsAvx512(pixels + i, powAvx512(r, exponent), powAvx512(g, exponent), powAvx512(b, exponent), a);
+   }
+   gammaScalar(pixels + i, gamma, count - i);
+}
+
+HDR_TARGET_AVX512 inline __m512i quantizeAvx512(__m512 v, float max_code) {
+   v = _mm512_min_ps(_mm512_max_ps(v, _mm512_setzero_ps()), _mm512_set1_ps(1.0f));
+   return _mm512_cvttps_epi32(_mm512_mul_ps(v, _mm512_set1_ps(max_code + 0.999f)));
+}
+
+HDR_TARGET_AVX512 inline void toneMapKernelAvx512(const Rgba *pixels, size_t count, float scaling_factor, float whiteness_factor,
+                                                  float gamma, unsigned char *rgb_8bit, unsigned short *rgb_10bit) {
+   const __m512 one = _mm512_set1_ps(1.0f), exponent = _mm512_set1_ps(gamma);
+   const __m512 scaling = _mm512_set1_ps(scaling_factor), whiteness = _mm512_set1_ps(whiteness_factor);
+   size_t i = 0;
+
+   for (; i + 16 <= count; i += 16) {
+      __m512 r, g, b, a;
+      loadPixelsAvx512(pixels + i, r, g, b, a);
+      __m512 lum = _mm512_mul_ps(luminanceAvx512(r, g, b), scaling);
+      __m512 factor = _mm512_div_ps(_mm512_fmadd_ps(lum, whiteness, one), _mm512_add_ps(one, lum));
+      __m512 channels[3] = { powAvx512(_mm512_mul_ps(r, factor), exponent),
+                             powAvx512(_mm512_mul_ps(g, factor), exponent),
+                             powAvx512(_mm512_mul_ps(b, factor), exponent) };
+
+      if (rgb_8bit) {
+         alignas(64) int codes[3][16];
+         for (int c = 0; c < 3; ++c)
+            _mm512_store_si512(codes[c], quantizeAvx512(channels[c], 255.0f));
+         for (int l = 0; l < 16; ++l)
+            for (int c = 0; c < 3; ++c)
+               rgb_8bit[(i + l) * 3 + c] = (unsigned char)codes[c][l];
+      }
+      if (rgb_10bit) {
+         alignas(64) int codes[3][16];
+         for (int c = 0; c < 3; ++c)
+            _mm512_store_si512(codes[c], quantizeAvx512(channels[c], 1023.0f));
+         for (int l = 0; l < 16; ++l)
+            for (int c = 0; c < 3; ++c)
+               rgb_10bit[(i + l) * 3 + c] = (unsigned short)codes[c][l];
+      }
+   }
+
+   toneMapScalar(pixels + i, count - i, scaling_factor, whiteness_factor, gamma,
+                 rgb_8bit ? rgb_8bit + i * 3 : NULL, rgb_10bit ? rgb_10bit + i * 3 : NULL);
+}
+
+HDR_TARGET_AVX512 inline void log2LuminanceKernelAvx512(const Rgba *pixels, float *log2_luminance, size_t count) {
+   size_t i = 0;
+   for (; i + 16 <= count; i += 16) {
+      __m512 r, g, b, a;
+      loadPixelsAvx512(pixels + i, r, g, b, a);
+      __m512 lum = safeLuminanceAvx512(luminanceAvx512(r, g, b));
+      _mm512_storeu_ps(log2_luminance + i, _mm512_mul_ps(logAvx512(lum), _mm512_set1_ps(1.44269504f)));
+   }
+   log2LuminanceScalar(pixels + i, log2_luminance + i, count - i);
+}
+
+HDR_TARGET_AVX512 inline void scaleExp2KernelAvx512(const Rgba *pixels, const float *exponent, Rgba *out, size_t count) {
+   size_t i = 0;
+   for (; i + 16 <= count; i += 16) {
+      __m512 r, g, b, a;
+      loadPixelsAvx512(pixels + i, r, g, b, a);
+      __m512 gain = expAvx512(_mm512_mul_ps(_mm512_loadu_ps(exponent + i), _mm512_set1_ps(0.693147181f)));
+      storePixelsAvx512(out + i, _mm512_mul_ps(r, gain), _mm512_mul_ps(g, gain), _mm512_mul_ps(b, gain), a);
+   }
+   scaleExp2Scalar(pixels + i, exponent + i, out + i, count - i);
+}
+
+const cpu_kernels avx512_kernels = {
+   "avx512", luminanceKernelAvx512, logLuminanceKernelAvx512, compressKernelAvx512, gammaKernelAvx512, toneMapKernelAvx512,
+   log2LuminanceKernelAvx512, scaleExp2KernelAvx512
+};
+
+#endif // HDR_SIMD_X86
+
+#ifdef HDR_SIMD_NEON
+
+/* NEON kernels, 4 pixels per iteration. vld4 / vst4 do the channel transpose. */
+inline void loadPixelsNeon(const Rgba *pixels, float32x4_t &r, float32x4_t &g, float32x4_t &b, float32x4_t &a) {
+   uint16x4x4_t h = vld4_u16((const uint16_t*)pixels);
+   r = vcvt_f32_f16(vreinterpret_f16_u16(h.val[0]));
+   g = vcvt_f32_f16(vreinterpret_f16_u16(h.val[1]));
+   b = vcvt_f32_f16(vreinterpret_f16_u16(h.val[2]));
+   a = vcvt_f32_f16(vreinterpret_f16_u16(h.val[3]));
+}
+
+inline void storePixelsNeon(Rgba *pixels, float32x4_t r, float32x4_t g, float32x4_t b, float32x4_t a) {
+   uint16x4x4_t h;
+   h.val[0] = vreinterpret_u16_f16(vcvt_f16_f32(r));
+   h.val[1] = vreinterpret_u16_f16(vcvt_f16_f32(g));
+   h.val[2] = vreinterpret_u16_f16(vcvt_f16_f32(b));
+   h.val[3] = vreinterpret_u16_f16(vcvt_f16_f32(a));
+   vst4_u16((uint16_t*)pixels, h);
+}
+
+inline float32x4_t luminanceNeon(float32x4_t r, float32x4_t g, float32x4_t b) {
+   float32x4_t lum = vmulq_n_f32(r, 0.2126f);
+   lum = vfmaq_n_f32(lum, g, 0.7152f);
+   return vfmaq_n_f32(lum, b, 0.0722f);
+}
+
+inline float32x4_t logNeon(float32x4_t x) {
+   int32x4_t bits = vreinterpretq_s32_f32(x);
+   float32x4_t e = vcvtq_f32_s32(vsubq_s32(vshrq_n_s32(bits, 23), vdupq_n_s32(127)));
+   float32x4_t m = vreinterpretq_f32_s32(vorrq_s32(vandq_s32(bits, vdupq_n_s32(0x007fffff)), vdupq_n_s32(0x3f800000)));
+
+   uint32x4_t above = vcgtq_f32(m, vdupq_n_f32(1.41421356f));
+   m = vbslq_f32(above, vmulq_n_f32(m, 0.5f), m);
+   e = vaddq_f32(e, vreinterpretq_f32_u32(vandq_u32(above, vreinterpretq_u32_f32(vdupq_n_f32(1.0f)))));
+
+   float32x4_t t = vsubq_f32(m, vdupq_n_f32(1.0f));
+   float32x4_t p = vdupq_n_f32(HDR_LOG_P0);
+   p = vfmaq_f32(vdupq_n_f32(HDR_LOG_P1), p, t);
+   p = vfmaq_f32(vdupq_n_f32(HDR_LOG_P2), p, t);
+   p = vfmaq_f32(vdupq_n_f32(HDR_LOG_P3), p, t);
+   p = vfmaq_f32(vdupq_n_f32(HDR_LOG_P4), p, t);
+   p = vfmaq_f32(vdupq_n_f32(HDR_LOG_P5), p, t);
+   p = vfmaq_f32(vdupq_n_f32(HDR_LOG_P6), p, t);
+   p = vfmaq_f32(vdupq_n_f32(HDR_LOG_P7), p, t);
+   p = vfmaq_f32(vdupq_n_f32(HDR_LOG_P8), p, t);
+
+   float32x4_t t2 = vmulq_f32(t, t);
+   float32x4_t y = vmulq_f32(vmulq_f32(p, t), t2);
+   y = vfmaq_n_f32(y, e, HDR_LN2_LO);
+   y = vfmsq_n_f32(y, t2, 0.5f);
+   return vfmaq_n_f32(vaddq_f32(t, y), e, HDR_LN2_HI);
+}
+
+inline float32x4_t expNeon(float32x4_t x) {
+   x = vminq_f32(vmaxq_f32(x, vdupq_n_f32(-87.3f)), vdupq_n_f32(88.3f));
+   float32x4_t n = vrndnq_f32(vmulq_n_f32(x, 1.44269504f));
+   x = vfmsq_n_f32(x, n, HDR_LN2_HI);
+   x = vfmsq_n_f32(x, n, HDR_LN2_LO);
+
+   float32x4_t p = vdupq_n_f32(HDR_EXP_P0);
+   p = vfmaq_f32(vdupq_n_f32(HDR_EXP_P1), p, x);
+   p = vfmaq_f32(vdupq_n_f32(HDR_EXP_P2), p, x);
+   p = vfmaq_f32(vdupq_n_f32(HDR_EXP_P3), p, x);
+   p = vfmaq_f32(vdupq_n_f32(HDR_EXP_P4), p, x);
+   p = vfmaq_f32(vdupq_n_f32(HDR_EXP_P5), p, x);
+   float32x4_t y = vfmaq_f32(vaddq_f32(x, vdupq_n_f32(1.0f)), p, vmulq_f32(x, x));
+
+   int32x4_t scale = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127)), 23);
+   return vmulq_f32(y, vreinterpretq_f32_s32(scale));
+}
+
+inline float32x4_t powNeon(float32x4_t x, float exponent) {
+   uint32x4_t positive = vcgtq_f32(x, vdupq_n_f32(0.0f));
+   float32x4_t safe = vmaxq_f32(x, vdupq_n_f32(std::numeric_limits<float>::min()));
+   float32x4_t result = expNeon(vmulq_n_f32(logNeon(safe), exponent));
+   return vreinterpretq_f32_u32(vandq_u32(positive, vreinterpretq_u32_f32(result)));
+}
+
+inline void luminanceKernelNeon(const Rgba *pixels, float *luminance, size_t count) {
+   size_t i = 0;
+   for (; i + 4 <= count; i += 4) {
+      float32x4_t r, g, b, a;
+      loadPixelsNeon(pixels + i, r, g, b, a);
+      vst1q_f32(luminance + i, luminanceNeon(r, g, b));
+   }
+   luminanceScalar(pixels + i, luminance + i, count - i);
+}
+
+// safeLuminance: unlike vmaxq, vmaxnmq returns the number for NaN
+inline float32x4_t safeLuminanceNeon(float32x4_t lum) {
+   return vminq_f32(vmaxnmq_f32(lum, vdupq_n_f32(statistics_min_luminance)), vdupq_n_f32(statistics_max_luminance));
+}
+
+inline void countLuminanceNeon(float32x4_t lum, uint32_t *histogram) {
+   uint32_t bins[4];
+   uint32x4_t bin = vsubq_u32(vshrq_n_u32(vreinterpretq_u32_f32(lum), 20),
+                              vdupq_n_u32((127 + luminance_histogram_min_exponent) * 8));
+   vst1q_u32(bins, vminq_u32(bin, vdupq_n_u32(luminance_histogram_bins - 1)));
+   for (int l = 0; l < 4; ++l)
+      ++histogram[bins[l]];
+}
+
+inline void logLuminanceKernelNeon(const Rgba *pixels, size_t count, double &log_sum, float &max, uint32_t *histogram) {
+   float32x4_t vmax = vdupq_n_f32(max);
+   size_t i = 0;
+
+   while (i + 4 <= count) {
+      float32x4_t acc = vdupq_n_f32(0.0f);
+      size_t end = std::min(count, i + log_flush_pixels);
+
+      for (; i + 4 <= end; i += 4) {
+         float32x4_t r, g, b, a;
+         loadPixelsNeon(pixels + i, r, g, b, a);
+         float32x4_t lum = safeLuminanceNeon(luminanceNeon(r, g, b));
+         vmax = vmaxq_f32(vmax, lum);
+         acc = vaddq_f32(acc, logNeon(lum));
+         if (histogram)
+            countLuminanceNeon(lum, histogram);
+      }
+
+      float lanes[4];
+      vst1q_f32(lanes, acc);
+      for (int l = 0; l < 4; ++l)
+         log_sum += lanes[l];
+   }
+
+   max = std::max(max, vmaxvq_f32(vmax));
+   logLuminanceScalar(pixels + i, count - i, log_sum, max, histogram);
+}
+
+inline void compressKernelNeon(Rgba *pixels, const float *scaled_luminance, float whiteness_factor, size_t count) {
+   size_t i = 0;
+   for (; i + 4 <= count; i += 4) {
+      float32x4_t r, g, b, a;
+      loadPixelsNeon(pixels + i, r, g, b, a);
+      float32x4_t lum = vld1q_f32(scaled_luminance + i);
+      float32x4_t factor = vdivq_f32(vfmaq_n_f32(vdupq_n_f32(1.0f), lum, whiteness_factor),
+                                     vaddq_f32(vdupq_n_f32(1.0f), lum));
+      storePixelsNeon(pixels + i, vmulq_f32(r, factor), vmulq_f32(g, factor), vmulq_f32(b, factor), a);
+   }
+   compressScalar(pixels + i, scaled_luminance + i, whiteness_factor, count - i);
+}
+
+inline void gammaKernelNeon(Rgba *pixels, float gamma, size_t count) {
+   size_t i = 0;
+   for (; i + 4 <= count; i += 4) {
+      float32x4_t r, g, b, a;
+      loadPixelsNeon(pixels + i, r, g, b, a);
+      storePixelsNeon(pixels + i, powNeon(r, gamma), powNeon(g, gamma), powNeon(b, gamma), a);
+   }
+   gammaScalar(pixels + i, gamma, count - i);
+}
+
+inline uint32x4_t quantizeNeon(float32x4_t v, float max_code) {
+   v = vminq_f32(vmaxq_f32(v, vdupq_n_f32(0.0f)), vdupq_n_f32(1.0f));
+   return vcvtq_u32_f32(vmulq_n_f32(v, max_code + 0.999f));
+}
+
+inline void toneMapKernelNeon(const Rgba *pixels, size_t count, float scaling_factor, float whiteness_factor,
+                              float gamma, unsigned char *rgb_8bit, unsigned short *rgb_10bit) {
+   size_t i = 0;
+
+   for (; i + 4 <= count; i += 4) {
+      float32x4_t r, g, b, a;
+      loadPixelsNeon(pixels + i, r, g, b, a);
+      float32x4_t lum = vmulq_n_f32(luminanceNeon(r, g, b), scaling_factor);
+      float32x4_t factor = vdivq_f32(vfmaq_n_f32(vdupq_n_f32(1.0f), lum, whiteness_factor),
+                                     vaddq_f32(vdupq_n_f32(1.0f), lum));
+      float32x4_t channels[3] = { powNeon(vmulq_f32(r, factor), gamma),
+                                  powNeon(vmulq_f32(g, factor), gamma),
+                                  powNeon(vmulq_f32(b, factor), gamma) };
+
+      if (rgb_8bit) {
+         uint8x8x3_t codes;
+         for (int c = 0; c < 3; ++c) {
+            uint16x4_t narrow = vmovn_u32(quantizeNeon(channels[c], 255.0f));
+            codes.val[c] = vmovn_u16(vcombine_u16(narrow, narrow));
+         }
+         // vst3 of 8 lanes would write 24 bytes, only the first 4 pixels are valid
+         unsigned char staging[24];
+         vst3_u8(staging, codes);
+         memcpy(rgb_8bit + i * 3, staging, 12);
+      }
+      if (rgb_10bit) {
+         uint16x4x3_t codes;
+         for (int c = 0; c < 3; ++c)
+            codes.val[c] = vmovn_u32(quantizeNeon(channels[c], 1023.0f));
+         vst3_u16(rgb_10bit + i * 3, codes);
+      }
+   }
+
+   toneMapScalar(pixels + i, count - i, scaling_factor, whiteness_factor, gamma,
+                 rgb_8bit ? rgb_8bit + i * 3 : NULL, rgb_10bit ? rgb_10bit + i * 3 : NULL);
+}
+
+inline void log2LuminanceKernelNeon(const Rgba *pixels, float *log2_luminance, size_t count) {
+   size_t i = 0;
+   for (; i + 4 <= count; i += 4) {
+      float32x4_t r, g, b, a;
+      loadPixelsNeon(pixels + i, r, g, b, a);
+      float32x4_t lum = safeLuminanceNeon(luminanceNeon(r, g, b));
+      vst1q_f32(log2_luminance + i, vmulq_n_f32(logNeon(lum), 1.44269504f));
+   }
+   log2LuminanceScalar(pixels + i, log2_luminance + i, count - i);
+}
+
+inline void scaleExp2KernelNeon(const Rgba *pixels, const float *exponent, Rgba *out, size_t count) {
+   size_t i = 0;
+   for (; i + 4 <= count; i += 4) {
+      float32x4_t r, g, b, a;
+      loadPixelsNeon(pixels + i, r, g, b, a);
+      float32x4_t gain = expNeon(vmulq_n_f32(vld1q_f32(exponent + i), 0.693147181f));
+      storePixelsNeon(out + i, vmulq_f32(r, gain), vmulq_f32(g, gain), vmulq_f32(b, gain), a);
+   }
+   scaleExp2Scalar(pixels + i, exponent + i, out + i, count - i);
+}
+
+const cpu_kernels neon_kernels = {
+   "neon", luminanceKernelNeon, logLuminanceKernelNeon, compressKernelNeon, gammaKernelNeon, toneMapKernelNeon,
+   log2LuminanceKernelNeon, scaleExp2KernelNeon
+};
+
+#endif // HDR_SIMD_NEON
+
+/* Dispatch */
+
+inline const cpu_kernels *bestCpuKernels() {
+#ifdef HDR_SIMD_X86
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+      return &avx512_kernels;
+   if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c"))
+      return &avx2_kernels;
+#endif
+#ifdef HDR_SIMD_NEON
+   return &neon_kernels;
+#endif
+   return &scalar_kernels;
+}
+
+// Set on first use, which may be from several threads at once
+inline const cpu_kernels *&activeCpuKernels() {
+   static const cpu_kernels *active = bestCpuKernels();
+   return active;
+}
+
+// Forces a kernel table by name ("auto", "scalar", "avx2", "avx512" or "neon").
+// Returns false when the name is unknown or the CPU lacks the instructions.
+inline bool selectCpuKernels(const string &name) {
+   const cpu_kernels *best = bestCpuKernels();
+
+   if (name == "auto")
+      activeCpuKernels() = best;
+   else if (name == "scalar")
+      activeCpuKernels() = &scalar_kernels;
+#ifdef HDR_SIMD_X86
+   else if (name == "avx2" && best != &scalar_kernels)
+      activeCpuKernels() = &avx2_kernels;
+   else if (name == "avx512" && best == &avx512_kernels)
+      activeCpuKernels() = &avx512_kernels;
+#endif
+#ifdef HDR_SIMD_NEON
+   else if (name == "neon")
+      activeCpuKernels() = &neon_kernels;
+#endif
+   else
+      return false;
+
+   return true;
+}
+
+inline const cpu_kernels &cpuKernels() {
+   return *activeCpuKernels();
+}
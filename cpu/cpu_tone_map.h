@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "../utils/tone_lut.h"
+#include "../utils/luminance_histogram.h"
+#include "cpu_simd.h"
+#include "cpu_lut.h"
+
+using namespace std;
+
+/* Statistics and row kernels of the CPU tone mapper
+ *
+ * The parts of the engine that work on rows already in memory: the band
+ * layout of the reductions, the scene statistics and the row kernel of a
+ * curve. No files, no pool and no command line drivers, so lib/hdrtonemap.cpp
+ * builds on this alone; cpu_hdr.h adds the rest.
+ */
+
+// Rows per band handed to the thread pool. The band layout does not depend on
+// the worker count, so reductions merge the same partials in the same order.
+const int cpu_band_rows = 64;
+
+// Per-band partial of the log-average / max luminance reduction, the
+// histogram is empty unless it is collected
+struct luminance_partial
+{
+   double log_sum;
+   float max;
+   vector<uint32_t> histogram;
+};
+
+struct bilateral_grid;
+
+struct scene_statistics
+{
+   float max_brightness = 1.0f;   // the white point, a percentile when one is selected
+   float avg_brightness = 1.0f;
+   vector<uint32_t> histogram;   // luminance histogram, empty unless collected
+   shared_ptr<const bilateral_grid> local_grid;   // base layer of the local operator, NULL when off
+};
+
+// Running log-sum / max / histogram over any number of row chunks. Chunks
+// that are multiples of cpu_band_rows merge the same partials in the same
+// order as a single pass over the whole image. The histogram is only counted
+// when the settings need it, unless the caller says otherwise.
+struct statistics_accumulator
+{
+   double log_sum = 0.0;
+   float max = std::numeric_limits<float>::min();
+   size_t pixels = 0;
+   vector<uint32_t> histogram;
+
+   explicit statistics_accumulator(bool count_histogram = collectsHistogram(histogramSettings()))
+      : histogram(count_histogram ? luminance_histogram_bins : 0) {}
+};
+
+// Folds band partials into the accumulator in band order
+inline void mergeLuminancePartials(const vector<luminance_partial> &partials, statistics_accumulator &acc) {
+   for (const luminance_partial &partial : partials) {
+      acc.log_sum += partial.log_sum;
+      acc.max = max(acc.max, partial.max);
+      for (size_t b = 0; b < partial.histogram.size(); ++b)
+         acc.histogram[b] += partial.histogram[b];
+   }
+}
+
+// Reinhard extended with gamma 2.2 has the vector kernels of cpu_simd.h
+const tone_curve cpu_default_tone_curve = { TONE_OPERATOR_REINHARD_EXTENDED, TRANSFER_GAMMA22 };
+
+typedef function<void(const Rgba *, unsigned char *, unsigned short *)> tone_map_row_function;
+
+// The row kernel of curve for rows of width pixels with the given statistics.
+// A baked curve reads lut, rebaked here when the curve or the scene maximum
+// changed, which has to outlive the returned function.
+inline tone_map_row_function toneMapRowFunction(const tone_curve &curve, const tone_lut_selection &selection,
+                                                const scene_statistics &stats, int width, tone_lut &lut) {
+   const float scaling_factor = 0.18f / stats.avg_brightness;
+   const float whiteness_factor = 1.0f / (stats.max_brightness * stats.max_brightness);
+   const float gamma = 1.0f / 2.2f;
+
+   // A luminance curve with a transfer the CPU encodes from a table anyway
+   // bakes to the same table plus the scale one, and gets the vector kernels
+   bool baked = selection.enabled ||
+                (cpuTabulatesTransfer(curve.transfer) && tone_operators[curve.op].shape == TONE_SHAPE_LUMINANCE);
+   if (baked) {
+      updateToneLut(lut, curve, stats.max_brightness, selection);
+      const tone_lut_kernel kernel = toneLutKernel(lut);
+      return [&lut, kernel, width, scaling_factor](const Rgba *row, unsigned char *row_8bit, unsigned short *row_10bit) {
+         kernel(row, width, lut, scaling_factor, row_8bit, row_10bit);
+      };
+   }
+   if (curve != cpu_default_tone_curve) {
+      const tone_curve_kernel kernel = toneCurveKernel(curve);
+      const glsl::ToneParams params = { scaling_factor, stats.max_brightness };
+      return [kernel, width, params](const Rgba *row, unsigned char *row_8bit, unsigned short *row_10bit) {
+         kernel(row, width, params, row_8bit, row_10bit);
+      };
+   }
+   const cpu_kernels &kernels = cpuKernels();
+   return [&kernels, width, scaling_factor, whiteness_factor, gamma](const Rgba *row, unsigned char *row_8bit, unsigned short *row_10bit) {
+      kernels.tone_map(row, width, scaling_factor, whiteness_factor, gamma, row_8bit, row_10bit);
+   };
+}
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <gbm.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+using namespace std;
+
+/* EGL backends
+ *
+ * Everything the GL path needs from EGL is a current GLES 3.1 context; the
+ * tone mapped image is rendered into an FBO, never into a window surface. The
+ * backends only differ in how they reach a display:
+ *
+ *  - gbm:          a DRM render node wrapped in a GBM device (the original path)
+ *  - device:       EGL_EXT_device_enumeration, first device that initializes
+ *  - surfaceless:  EGL_MESA_platform_surfaceless, works without any DRM node
+ *                  (llvmpipe on CI boxes and containers)
+ *
+ * A backend owns every object it creates and releases them in its destructor,
+ * so a failed init() needs no cleanup by the caller.
+ */
+enum egl_backend_type
+{
+   EGL_BACKEND_AUTO,
+   EGL_BACKEND_GBM,
+   EGL_BACKEND_DEVICE,
+   EGL_BACKEND_SURFACELESS
+};
+
+inline bool parseEglBackendType(const string &name, egl_backend_type &type) {
+   if (name == "auto")
+      type = EGL_BACKEND_AUTO;
+   else if (name == "gbm")
+      type = EGL_BACKEND_GBM;
+   else if (name == "device")
+      type = EGL_BACKEND_DEVICE;
+   else if (name == "surfaceless")
+      type = EGL_BACKEND_SURFACELESS;
+   else
+      return false;
+   return true;
+}
+
+inline bool hasEglExtension(EGLDisplay display, const char *extension) {
+   const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+   if (!extensions)
+      return false;
+
+   // Match whole names only, EGL_EXT_device_base is a prefix of other extensions
+   size_t length = strlen(extension);
+   for (const char *p = strstr(extensions, extension); p; p = strstr(p + 1, extension)) {
+      if ((p == extensions || p[-1] == ' ') && (p[length] == ' ' || p[length] == '\0'))
+         return true;
+   }
+   return false;
+}
+
+class EglBackend
+{
+public:
+   virtual ~EglBackend() { releaseEgl(); }
+
+   virtual const char *name() const = 0;
+
+   // Creates the display, context and (if needed) a drawable, and makes them current
+   virtual bool init() = 0;
+
+   EGLDisplay display() const { return egl_display; }
+   EGLContext context() const { return egl_context; }
+
+protected:
+   // Tears down the EGL objects, safe to call more than once
+   void releaseEgl() {
+      if (egl_display != EGL_NO_DISPLAY) {
+         eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+         if (egl_surface != EGL_NO_SURFACE)
+            eglDestroySurface(egl_display, egl_surface);
+         if (egl_context != EGL_NO_CONTEXT)
+            eglDestroyContext(egl_display, egl_context);
+         eglTerminate(egl_display);
+      }
+      egl_display = EGL_NO_DISPLAY;
+      egl_context = EGL_NO_CONTEXT;
+      egl_surface = EGL_NO_SURFACE;
+   }
+
+   // Initializes egl_display, creates a GLES 3 context and makes it current.
+   // Without EGL_KHR_surfaceless_context a 1x1 pbuffer (or the surface made
+   // by createFallbackSurface) is bound, rendering still goes to FBOs.
+   bool createContext(EGLint surface_type) {
+      if (egl_display == EGL_NO_DISPLAY) {
+         fprintf(stderr, "%s: Failed to get EGL display\n", name());
+         return false;
+      }
+
+      if (!eglInitialize(egl_display, NULL, NULL)) {
+         fprintf(stderr, "%s: Failed to initialize EGL\n", name());
+         egl_display = EGL_NO_DISPLAY;
+         return false;
+      }
+
+      EGLint config_attribs[] = {
+         EGL_SURFACE_TYPE, surface_type,
+         EGL_RED_SIZE, 10,
+         EGL_GREEN_SIZE, 10,
+         EGL_BLUE_SIZE, 10,
+         EGL_ALPHA_SIZE, 2,
+         EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
+         EGL_NONE
+      };
+
+      EGLConfig config = NULL;
+      EGLint num_configs = 0;
+      bool surfaceless = hasEglExtension(egl_display, "EGL_KHR_surfaceless_context");
+
+      if (!eglChooseConfig(egl_display, config_attribs, &config, 1, &num_configs) || num_configs < 1) {
+         // A config is only needed to back a surface
+         if (!surfaceless || !hasEglExtension(egl_display, "EGL_KHR_no_config_context")) {
+            fprintf(stderr, "%s: Failed to choose EGL config\n", name());
+            return false;
+         }
+         config = EGL_NO_CONFIG_KHR;
+      }
+
+      if (!eglBindAPI(EGL_OPENGL_ES_API)) {
+         fprintf(stderr, "%s: Failed to bind the OpenGL ES API\n", name());
+         return false;
+      }
+
+      EGLint context_attribs[] = {
+         EGL_CONTEXT_CLIENT_VERSION, 3,
+         EGL_NONE
+      };
+
+      egl_context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, context_attribs);
+      if (egl_context == EGL_NO_CONTEXT) {
+         fprintf(stderr, "%s: Failed to create EGL context\n", name());
+         return false;
+      }
+
+      if (!surfaceless) {
+         egl_surface = createFallbackSurface(config);
+         if (egl_surface == EGL_NO_SURFACE) {
+            fprintf(stderr, "%s: Failed to create EGL surface\n", name());
+            return false;
+         }
+      }
+
+      if (!eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context)) {
+         fprintf(stderr, "%s: Failed to make EGL context current\n", name());
+         return false;
+      }
+
+      return true;
+   }
+
+   virtual EGLSurface createFallbackSurface(EGLConfig config) {
+      EGLint pbuffer_attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+      return eglCreatePbufferSurface(egl_display, config, pbuffer_attribs);
+   }
+
+   EGLDisplay egl_display = EGL_NO_DISPLAY;
+   EGLContext egl_context = EGL_NO_CONTEXT;
+   EGLSurface egl_surface = EGL_NO_SURFACE;
+};
+
+class GbmEglBackend : public EglBackend
+{
+public:
+   explicit GbmEglBackend(const string &node) : drm_node(node) {}
+
+   ~GbmEglBackend() {
+      // The EGL objects have to go before the GBM objects they were created from
+      releaseEgl();
+      if (surface)
+         gbm_surface_destroy(surface);
+      if (gbm)
+         gbm_device_destroy(gbm);
+      if (drm_fd >= 0)
+         close(drm_fd);
+   }
+
+   const char *name() const { return "gbm"; }
+
+   bool init() {
+      // Open the DRM device
+      drm_fd = open(drm_node.c_str(), O_RDWR);
+      if (drm_fd < 0) {
+         perror("Failed to open DRM device");
+         return false;
+      }
+
+      // Create a GBM device
+      gbm = gbm_create_device(drm_fd);
+      if (!gbm) {
+         perror("Failed to create GBM device");
+         return false;
+      }
+
+      // Get an EGL display connection
+      egl_display = eglGetDisplay((EGLNativeDisplayType)gbm);
+      return createContext(EGL_WINDOW_BIT);
+   }
+
+protected:
+   // GBM has no pbuffers, fall back to a small window surface
+   EGLSurface createFallbackSurface(EGLConfig config) {
+      surface = gbm_surface_create(gbm, 16, 16, GBM_FORMAT_XRGB2101010, GBM_BO_USE_RENDERING);
+      if (!surface)
+         return EGL_NO_SURFACE;
+      return eglCreateWindowSurface(egl_display, config, (EGLNativeWindowType)surface, NULL);
+   }
+
+private:
+   string drm_node;
+   int drm_fd = -1;
+   struct gbm_device *gbm = NULL;
+   struct gbm_surface *surface = NULL;
+};
+
+class DeviceEglBackend : public EglBackend
+{
+public:
+   const char *name() const { return "device"; }
+
+   bool init() {
+      PFNEGLQUERYDEVICESEXTPROC queryDevices =
+         (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress("eglQueryDevicesEXT");
+      PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+         (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+      if (!hasEglExtension(EGL_NO_DISPLAY, "EGL_EXT_device_enumeration") ||
+          !hasEglExtension(EGL_NO_DISPLAY, "EGL_EXT_platform_device") || !queryDevices || !getPlatformDisplay) {
+         fprintf(stderr, "%s: EGL device enumeration is not supported\n", name());
+         return false;
+      }
+
+      EGLint count = 0;
+      queryDevices(0, NULL, &count);
+      vector<EGLDeviceEXT> devices(count);
+      if (count < 1 || !queryDevices(count, devices.data(), &count)) {
+         fprintf(stderr, "%s: No EGL devices found\n", name());
+         return false;
+      }
+
+      // Take the first device whose display comes up
+      for (EGLDeviceEXT device : devices) {
+         egl_display = getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, device, NULL);
+         if (egl_display != EGL_NO_DISPLAY && eglInitialize(egl_display, NULL, NULL))
+            return createContext(EGL_PBUFFER_BIT);
+      }
+
+      egl_display = EGL_NO_DISPLAY;
+      fprintf(stderr, "%s: None of the %d EGL devices could be initialized\n", name(), count);
+      return false;
+   }
+};
+
+class SurfacelessEglBackend : public EglBackend
+{
+public:
+   const char *name() const { return "surfaceless"; }
+
+   bool init() {
+      PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+         (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+      if (!hasEglExtension(EGL_NO_DISPLAY, "EGL_MESA_platform_surfaceless") || !getPlatformDisplay) {
+         fprintf(stderr, "%s: EGL_MESA_platform_surfaceless is not supported\n", name());
+         return false;
+      }
+
+      egl_display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+      return createContext(EGL_PBUFFER_BIT);
+   }
+};
+
+// Creates and initializes the requested backend. EGL_BACKEND_AUTO probes gbm,
+// then device, then surfaceless. Returns NULL when nothing could be set up.
+inline unique_ptr<EglBackend> createEglBackend(egl_backend_type type, const string &drm_node = "/dev/dri/renderD128") {
+   vector<egl_backend_type> candidates;
+   if (type == EGL_BACKEND_AUTO)
+      candidates = { EGL_BACKEND_GBM, EGL_BACKEND_DEVICE, EGL_BACKEND_SURFACELESS };
+   else
+      candidates = { type };
+
+   for (egl_backend_type candidate : candidates) {
+      unique_ptr<EglBackend> backend;
+      if (candidate == EGL_BACKEND_GBM)
+         backend.reset(new GbmEglBackend(drm_node));
+      else if (candidate == EGL_BACKEND_DEVICE)
+         backend.reset(new DeviceEglBackend());
+      else
+         backend.reset(new SurfacelessEglBackend());
+
+      if (backend->init())
+         return backend;
+   }
+
+   return NULL;
+}
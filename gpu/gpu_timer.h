@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstring>
+#include <deque>
+
+#include <EGL/egl.h>
+#include <GLES3/gl31.h>
+#include <GLES2/gl2ext.h>
+
+#include "../utils/trace.h"
+
+using namespace std;
+
+/* GPU stage timing
+ *
+ * Wraps GL_TIME_ELAPSED_EXT queries of EXT_disjoint_timer_query. Only one
+ * such query may be active at a time, so stages are timed back to back and
+ * never nested. Finished queries are collected without stalling the pipeline
+ * whenever a stage ends; flush() waits for the rest. Results from a disjoint
+ * period (clock change, power state) or longer than the wall time since
+ * submission are dropped. Does nothing while tracing
+ * is disabled or when the extension is missing.
+ */
+class GpuTimer
+{
+public:
+   GpuTimer() {
+      GLint count = 0;
+      glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+      for (GLint i = 0; i < count; ++i) {
+         const char *extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
+         if (extension && strcmp(extension, "GL_EXT_disjoint_timer_query") == 0)
+            getQueryObjectui64 = (PFNGLGETQUERYOBJECTUI64VEXTPROC)eglGetProcAddress("glGetQueryObjectui64vEXT");
+      }
+   }
+
+   ~GpuTimer() { flush(); }
+
+   GpuTimer(const GpuTimer&) = delete;
+   GpuTimer &operator=(const GpuTimer&) = delete;
+
+   bool supported() const { return getQueryObjectui64 != NULL; }
+
+   // False when timing is off or another stage is being timed
+   bool begin(const char *name, size_t pixels) {
+      if (!supported() || !tracingEnabled() || active)
+         return false;
+
+      pending_query query = { name, 0, traceNow(), pixels };
+      glGenQueries(1, &query.id);
+      glBeginQuery(GL_TIME_ELAPSED_EXT, query.id);
+      pending.push_back(query);
+      active = true;
+      return true;
+   }
+
+   void end() {
+      if (!active)
+         return;
+      glEndQuery(GL_TIME_ELAPSED_EXT);
+      active = false;
+      collect(false);
+   }
+
+   void flush() {
+      end();
+      collect(true);
+   }
+
+private:
+   struct pending_query
+   {
+      const char *name;
+      GLuint id;
+      long long submitted_us;
+      size_t pixels;
+   };
+
+   void collect(bool wait) {
+      while (!pending.empty()) {
+         pending_query &query = pending.front();
+         GLuint available = 0;
+         glGetQueryObjectuiv(query.id, GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+         if (!available && !wait)
+            return;
+
+         GLuint64 elapsed_ns = 0;
+         getQueryObjectui64(query.id, GL_QUERY_RESULT_EXT, &elapsed_ns);
+         GLint disjoint = 0;
+         glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+
+         // The work ran between submission and now, anything longer is a bogus
+         // result (llvmpipe reports one for the first compute dispatch)
+         long long elapsed_us = (long long)(elapsed_ns / 1000);
+         if (!disjoint && elapsed_us <= traceNow() - query.submitted_us)
+            traceGpuEvent(query.name, query.submitted_us, elapsed_us, query.pixels);
+
+         glDeleteQueries(1, &query.id);
+         pending.pop_front();
+      }
+   }
+
+   PFNGLGETQUERYOBJECTUI64VEXTPROC getQueryObjectui64 = NULL;
+   deque<pending_query> pending;
+   bool active = false;
+};
+
+// Times the GL commands issued in its scope on the GPU timeline
+class GpuTraceScope
+{
+public:
+   GpuTraceScope(GpuTimer *timer, const char *name, size_t pixels)
+      : timer(timer && timer->begin(name, pixels) ? timer : NULL) {}
+   ~GpuTraceScope() {
+      if (timer)
+         timer->end();
+   }
+
+   GpuTraceScope(const GpuTraceScope&) = delete;
+   GpuTraceScope &operator=(const GpuTraceScope&) = delete;
+
+private:
+   GpuTimer *timer;
+};
@@ -6,28 +6,33 @@
 #include <cstdlib>
 #include <bits/stdc++.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #include <OpenEXR/ImfRgbaFile.h>
 #include <OpenEXR/ImfInputFile.h>
 #include <OpenEXR/ImfChannelList.h>
 #include <OpenEXR/ImfArray.h>
 
-#include <gbm.h>
-#include <EGL/egl.h>
+#include "../utils/image_writer.h"
+#include "../utils/write_queue.h"
+#include "../utils/exr_stream.h"
+#include "../utils/tone_operators.h"
+#include "../utils/tone_lut.h"
+#include "../utils/sequence.h"
+#include "../utils/luminance_histogram.h"
+#include "../utils/local_tone.h"
+#include "../utils/pyramid.h"
+#include "egl_backend.h"
+#include "yuv_formats.h"
+#include "packed_output.h"
+#include "gpu_timer.h"
+
 #include <GLES3/gl31.h>
 
 using namespace OPENEXR_IMF_NAMESPACE;
 using namespace IMATH_NAMESPACE;
 using namespace std;
 
-struct color_rgba
-{
-   float	r;
-   float	g;
-   float	b;
-   float	a;
-};
-
 /* Shaders */
 static const char* vShader = "                  \n\
 #version 300 es                                 \n\
@@ -46,7 +51,10 @@ void main()                                     \n\
 	TexCoord = vec2(aTexCoord.x, aTexCoord.y);   \n\
 }";
 
-static const char* fShader = "                                                                              \n\
+/* Tone mapping fragment shader: the functions of the selected curve from
+ * toneCurveShaderSource() go between the prologue and toneMapPixel(), which
+ * the packed output pass shares. */
+static const char* fShaderPrologue = "                                                                      \n\
 #version 300 es                                                                                             \n\
 precision highp float;                                                                                      \n\
 out vec4 FragColor;                                                                                         \n\
@@ -57,72 +65,676 @@ in vec2 TexCoord;
 // texture sampler                                                                                          \n\
 uniform sampler2D texture1;                                                                                 \n\
                                                                                                             \n\
-float luminance(vec3 color)                                                                                 \n\
+// Written on the GPU by the statistics reduction                                                           \n\
+layout(std140) uniform SceneStats                                                                           \n\
+{                                                                                                           \n\
+	float meanBrightness;                                                                                      \n\
+	float maxSceneBrightness;                                                                                  \n\
+};";
+
+static const char* fShaderCurve = "                                                                         \n\
+// The tone mapped, encoded and clamped color of a linear pixel. pixel is its                               \n\
+// centre in output pixels, for the local operator.                                                         \n\
+vec3 toneMapPixel(vec3 in_color, vec2 pixel)                                                                \n\
+{                                                                                                           \n\
+#ifdef LOCAL_TONE                                                                                           \n\
+	in_color = applyLocalTone(in_color, pixel);                                                                \n\
+#endif                                                                                                      \n\
+	ToneParams params = ToneParams(0.18f / meanBrightness, maxSceneBrightness);                                \n\
+	vec3 out_color = TONE_OPERATOR(in_color, params);                                                          \n\
+#ifdef OUTPUT_BT2020                                                                                        \n\
+	out_color = rec709ToRec2020(out_color);                                                                    \n\
+#endif                                                                                                      \n\
+                                                                                                            \n\
+	return vec3(clamp(ENCODE_TRANSFER(out_color.r), 0.0f, 1.0f),                                               \n\
+	            clamp(ENCODE_TRANSFER(out_color.g), 0.0f, 1.0f),                                               \n\
+	            clamp(ENCODE_TRANSFER(out_color.b), 0.0f, 1.0f));                                              \n\
+}";
+
+static const char* fShaderMain = "                                                                          \n\
+void main()                                                                                                 \n\
+{                                                                                                           \n\
+	FragColor = vec4(toneMapPixel(texture(texture1, TexCoord).xyz, gl_FragCoord.xy), 1.0f);                    \n\
+}";
+
+/* LUT variant of toneMapPixel(): the curve baked on the GPU by lutBakeMain,
+ * picked by the TONE_LUT_* defines of toneLutDefines(). */
+static const char* fShaderLutCurve = "                                                                      \n\
+precision highp int;                                                                                        \n\
+                                                                                                            \n\
+// Baked curve, see utils/tone_lut.h: R32F tables, the channel rows then the                                \n\
+// scale rows, and an RGBA cube for the general shape or the display grade                                  \n\
+uniform highp sampler2D toneTables;                                                                         \n\
+uniform highp sampler3D toneCube;                                                                           \n\
+                                                                                                            \n\
+// Same bit indexing as the CPU: binade row, segment column, linear fraction                                \n\
+float sampleToneTable(int first_row, float x)                                                               \n\
 {                                                                                                           \n\
-	return dot(vec3(0.2126f, 0.7152f, 0.0722f), color);                                                      \n\
+	uint bits = clamp(floatBitsToUint(max(x, 0.0f)), TONE_LUT_MIN_BITS, TONE_LUT_MAX_BITS);                    \n\
+	int row = first_row + int(bits >> 23) - (127 + TONE_LUT_MIN_EXPONENT);                                     \n\
+	int column = int((bits >> 15) & uint(TONE_LUT_SEGMENTS - 1));                                              \n\
+	float a = texelFetch(toneTables, ivec2(column, row), 0).r;                                                 \n\
+	float b = texelFetch(toneTables, ivec2(column + 1, row), 0).r;                                             \n\
+	return mix(a, b, float(bits & 0x7fffu) / 32768.0f);                                                        \n\
 }                                                                                                           \n\
                                                                                                             \n\
-float gamma_correct(float f)                                                                                \n\
+vec3 toneMapPixel(vec3 in_color, vec2 pixel)                                                                \n\
 {                                                                                                           \n\
-    if (f <= 0.0031308f) {                                                                                  \n\
-        return f * 12.92f;                                                                                  \n\
-    } else {                                                                                                \n\
-        return 1.055f * pow(f, 1.0f / 2.4f) - 0.055f;                                                       \n\
-    }                                                                                                       \n\
+#ifdef LOCAL_TONE                                                                                           \n\
+	in_color = applyLocalTone(in_color, pixel);                                                                \n\
+#endif                                                                                                      \n\
+	float factor = 0.18f / meanBrightness;                                                                     \n\
+#ifdef TONE_LUT_LUMINANCE                                                                                   \n\
+	factor = sampleToneTable(TONE_LUT_BINADES, luminance(in_color) * factor);                                  \n\
+#endif                                                                                                      \n\
+	vec3 scaled = in_color * factor;                                                                           \n\
+#if defined(TONE_LUT_LUMINANCE) && defined(OUTPUT_BT2020)                                                   \n\
+	// The luminance scale commutes with the matrix, see utils/tone_lut.h                                      \n\
+	scaled = rec709ToRec2020(scaled);                                                                          \n\
+#endif                                                                                                      \n\
+	vec3 out_color = vec3(sampleToneTable(0, scaled.r),                                                        \n\
+	                      sampleToneTable(0, scaled.g),                                                        \n\
+	                      sampleToneTable(0, scaled.b));                                                       \n\
+#ifdef TONE_LUT_CUBE                                                                                        \n\
+	// Node centres sit half a texel in from the edges                                                         \n\
+	float size = float(textureSize(toneCube, 0).x);                                                            \n\
+	out_color = texture(toneCube, (clamp(out_color, 0.0f, 1.0f) * (size - 1.0f) + 0.5f) / size).rgb;           \n\
+#endif                                                                                                      \n\
+                                                                                                            \n\
+	return clamp(out_color, 0.0f, 1.0f);                                                                       \n\
+}";
+
+/* Packed output pass, see packed_output.h: the prologue, the curve source,
+ * toneMapPixel() and packMain. Each invocation tone maps the pixels behind
+ * three words of the file and stores them in file order. */
+static const char* packPrologue = "                                                                         \n\
+#version 310 es                                                                                             \n\
+precision highp float;                                                                                      \n\
+precision highp int;                                                                                        \n\
+                                                                                                            \n\
+layout(local_size_x = 64, local_size_y = 1, local_size_z = 1) in;                                           \n\
+                                                                                                            \n\
+layout(std140, binding = 0) uniform SceneStats                                                              \n\
+{                                                                                                           \n\
+	float meanBrightness;                                                                                      \n\
+	float maxSceneBrightness;                                                                                  \n\
+};                                                                                                          \n\
+                                                                                                            \n\
+// The converted frame, or one of its pyramid levels                                                        \n\
+layout(rgba32f, binding = 0) uniform readonly highp image2D converted;                                      \n\
+                                                                                                            \n\
+layout(std430, binding = 4) writeonly buffer PackedOutput                                                   \n\
+{                                                                                                           \n\
+	uint words[];                                                                                              \n\
+};";
+
+static const char* packMain = "                                                                             \n\
+uniform uint invocations;  // for this image                                                                \n\
+uniform uint first_word;   // of this image in the buffer                                                   \n\
+                                                                                                            \n\
+// Code values of the pixel at index in file order, zero past the end                                       \n\
+uvec3 codeValues(uint index, ivec2 size)                                                                    \n\
+{                                                                                                           \n\
+	if (index >= uint(size.x) * uint(size.y))                                                                  \n\
+		return uvec3(0u);                                                                                         \n\
+	ivec2 pos = ivec2(int(index % uint(size.x)), int(index / uint(size.x)));                                   \n\
+	vec3 color = toneMapPixel(imageLoad(converted, pos).rgb, vec2(pos) + 0.5f);                                \n\
+	// Same quantization as quantizePixel() on the CPU, 65535.999 rounds up in float                           \n\
+	return min(uvec3(color * (PACK_MAXVAL + 0.999f)), uvec3(PACK_MAXVAL));                                     \n\
+}                                                                                                           \n\
+                                                                                                            \n\
+// PPM samples and DPX words are big endian                                                                 \n\
+uint swap16(uint v)                                                                                         \n\
+{                                                                                                           \n\
+	return (v >> 8) | ((v & 0xffu) << 8);                                                                      \n\
 }                                                                                                           \n\
                                                                                                             \n\
+uint swap32(uint v)                                                                                         \n\
+{                                                                                                           \n\
+	return (swap16(v & 0xffffu) << 16) | swap16(v >> 16);                                                      \n\
+}                                                                                                           \n\
+                                                                                                            \n\
+// DPX packing method A: red in the top ten bits, two bits of padding                                       \n\
+uint dpxWord(uvec3 code)                                                                                    \n\
+{                                                                                                           \n\
+	return swap32((code.r << 22) | (code.g << 12) | (code.b << 2));                                            \n\
+}                                                                                                           \n\
+                                                                                                            \n\
+// Twelve bytes of the file per invocation, the first byte in the low bits                                  \n\
 void main()                                                                                                 \n\
 {                                                                                                           \n\
-	float meanBrightness = 0.0290084f;                                                                       \n\
-	float maxSceneBrightness = 223.974f;                                                                     \n\
+	uint group = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;                                     \n\
+	uint invocation = group * 64u + gl_LocalInvocationIndex;                                                   \n\
+	if (invocation >= invocations)                                                                             \n\
+		return;                                                                                                   \n\
+	ivec2 size = imageSize(converted);                                                                         \n\
+	uint word = first_word + invocation * 3u;                                                                  \n\
+#if defined(PACK_PPM8)                                                                                      \n\
+	uvec3 a = codeValues(invocation * 4u, size), b = codeValues(invocation * 4u + 1u, size);                   \n\
+	uvec3 c = codeValues(invocation * 4u + 2u, size), d = codeValues(invocation * 4u + 3u, size);              \n\
+	words[word] = a.r | (a.g << 8) | (a.b << 16) | (b.r << 24);                                                \n\
+	words[word + 1u] = b.g | (b.b << 8) | (c.r << 16) | (c.g << 24);                                           \n\
+	words[word + 2u] = c.b | (d.r << 8) | (d.g << 16) | (d.b << 24);                                           \n\
+#elif defined(PACK_DPX10)                                                                                   \n\
+	for (uint i = 0u; i < 3u; ++i)                                                                             \n\
+		words[word + i] = dpxWord(codeValues(invocation * 3u + i, size));                                         \n\
+#else                                                                                                       \n\
+	uvec3 a = codeValues(invocation * 2u, size), b = codeValues(invocation * 2u + 1u, size);                   \n\
+	words[word] = swap16(a.r) | (swap16(a.g) << 16);                                                           \n\
+	words[word + 1u] = swap16(a.b) | (swap16(b.r) << 16);                                                      \n\
+	words[word + 2u] = swap16(b.g) | (swap16(b.b) << 16);                                                      \n\
+#endif                                                                                                      \n\
+}";
+
+static const char* cShader = "                                                            \n\
+#version 310 es                                                                           \n\
+precision highp float;                                                                    \n\
+                                                                                          \n\
+layout(local_size_x = LOCAL_SIZE_X, local_size_y = LOCAL_SIZE_Y, local_size_z = 1) in;    \n\
+layout(rgba16f, binding = 0) uniform readonly highp image2D in_tex;                       \n\
+layout(rgba32f, binding = 1) uniform writeonly highp image2D out_tex;                     \n\
+                                                                                          \n\
+void main() {                                                                             \n\
+    // get position to read/write data from                                               \n\
+    ivec2 pos = ivec2(gl_GlobalInvocationID.xy);                                          \n\
+                                                                                          \n\
+    // Edge workgroups overhang the image                                                 \n\
+    if (any(greaterThanEqual(pos, imageSize(out_tex))))                                   \n\
+        return;                                                                           \n\
+                                                                                          \n\
+    // The EXR data is already linear RGBA                                                \n\
+    imageStore(out_tex, pos, imageLoad(in_tex, pos));                                     \n\
+}";
+
+/* Output pyramid: one level of the converted frame's mip chain from the level
+ * above, 2x2 box in linear light like the CPU. RGBA32F can neither be
+ * filtered nor rendered to on GLES, so glGenerateMipmap is not an option. */
+static const char* pyramidShader = "                                                      \n\
+#version 310 es                                                                           \n\
+precision highp float;                                                                    \n\
+                                                                                          \n\
+layout(local_size_x = LOCAL_SIZE_X, local_size_y = LOCAL_SIZE_Y, local_size_z = 1) in;    \n\
+layout(rgba32f, binding = 0) uniform readonly highp image2D source;                       \n\
+layout(rgba32f, binding = 1) uniform writeonly highp image2D level;                       \n\
+                                                                                          \n\
+void main() {                                                                             \n\
+    ivec2 pos = ivec2(gl_GlobalInvocationID.xy);                                          \n\
+    if (any(greaterThanEqual(pos, imageSize(level))))                                     \n\
+        return;                                                                           \n\
+                                                                                          \n\
+    // Odd sizes repeat the last row or column                                            \n\
+    ivec2 last = imageSize(source) - 1;                                                   \n\
+    ivec2 a = min(pos * 2, last), b = min(pos * 2 + 1, last);                             \n\
+    vec4 sum = imageLoad(source, a) + imageLoad(source, ivec2(b.x, a.y)) +                \n\
+               imageLoad(source, ivec2(a.x, b.y)) + imageLoad(source, b);                 \n\
+    imageStore(level, pos, vec4(max(sum.rgb * 0.25, 0.0), sum.a * 0.25));                \n\
+}";
+
+/* YUV ingest: converts planar (I420) and semi-planar (NV12, P010) camera
+ * frames to linear RGBA. The statistics and the transfers take Rec.709
+ * primaries, so BT.2020 frames are converted to them here. The format is
+ * picked by a YUV_* define, the matrix, range and primaries come in as
+ * uniforms. */
+static const char* yuvShader = "                                                                          \n\
+#version 310 es                                                                                           \n\
+precision highp float;                                                                                    \n\
+precision highp int;                                                                                      \n\
+                                                                                                          \n\
+layout(local_size_x = LOCAL_SIZE_X, local_size_y = LOCAL_SIZE_Y, local_size_z = 1) in;                    \n\
+layout(rgba32f, binding = 1) uniform writeonly highp image2D out_tex;                                     \n\
+                                                                                                          \n\
+// Chroma planes are subsampled 2x2 in every supported format                                             \n\
+#if defined(YUV_P010)                                                                                     \n\
+uniform highp usampler2D luma_plane;    // R16UI, 10-bit samples in the high bits                         \n\
+uniform highp usampler2D chroma_plane;  // RG16UI, interleaved Cb Cr                                      \n\
+#elif defined(YUV_NV12)                                                                                   \n\
+uniform highp sampler2D luma_plane;     // R8                                                             \n\
+uniform highp sampler2D chroma_plane;   // RG8, interleaved Cb Cr                                         \n\
+#else                                                                                                     \n\
+uniform highp sampler2D luma_plane;     // R8, I420                                                       \n\
+uniform highp sampler2D cb_plane;       // R8                                                             \n\
+uniform highp sampler2D cr_plane;       // R8                                                             \n\
+#endif                                                                                                    \n\
+                                                                                                          \n\
+uniform vec2 kr_kb;     // Luma weights of the red and blue primaries                                     \n\
+uniform vec4 range;     // Luma offset and scale, chroma offset and scale, in code values                 \n\
+uniform mat3 to_rec709; // Linear source primaries to the Rec.709 ones of the later stages                \n\
+                                                                                                          \n\
+vec3 fetchCodeValues(ivec2 pos) {                                                                         \n\
+    ivec2 chroma_pos = pos / 2;                                                                           \n\
+#if defined(YUV_P010)                                                                                     \n\
+    uint y = texelFetch(luma_plane, pos, 0).r >> 6;                                                       \n\
+    uvec2 c = texelFetch(chroma_plane, chroma_pos, 0).rg >> 6;                                            \n\
+    return vec3(float(y), vec2(c));                                                                       \n\
+#elif defined(YUV_NV12)                                                                                   \n\
+    return vec3(texelFetch(luma_plane, pos, 0).r, texelFetch(chroma_plane, chroma_pos, 0).rg) * 255.0;    \n\
+#else                                                                                                     \n\
+    return vec3(texelFetch(luma_plane, pos, 0).r,                                                         \n\
+                texelFetch(cb_plane, chroma_pos, 0).r,                                                    \n\
+                texelFetch(cr_plane, chroma_pos, 0).r) * 255.0;                                           \n\
+#endif                                                                                                    \n\
+}                                                                                                         \n\
+                                                                                                          \n\
+// Inverse of the BT.709 OETF, which BT.2020 shares                                                       \n\
+float linearize(float v) {                                                                                \n\
+    v = max(v, 0.0);                                                                                      \n\
+    return v < 0.081 ? v / 4.5 : pow((v + 0.099) / 1.099, 1.0 / 0.45);                                    \n\
+}                                                                                                         \n\
+                                                                                                          \n\
+void main() {                                                                                             \n\
+    ivec2 pos = ivec2(gl_GlobalInvocationID.xy);                                                          \n\
+                                                                                                          \n\
+    // Edge workgroups overhang the image                                                                 \n\
+    if (any(greaterThanEqual(pos, imageSize(out_tex))))                                                   \n\
+        return;                                                                                           \n\
+                                                                                                          \n\
+    vec3 code = fetchCodeValues(pos);                                                                     \n\
+    float y = (code.x - range.x) * range.y;                                                               \n\
+    vec2 c = (code.yz - range.z) * range.w;                                                               \n\
+                                                                                                          \n\
+    float kr = kr_kb.x, kb = kr_kb.y;                                                                     \n\
+    float r = y + 2.0 * (1.0 - kr) * c.y;                                                                 \n\
+    float b = y + 2.0 * (1.0 - kb) * c.x;                                                                 \n\
+    float g = (y - kr * r - kb * b) / (1.0 - kr - kb);                                                    \n\
+                                                                                                          \n\
+    // Colours outside the Rec.709 gamut are clipped to it                                                \n\
+    vec3 rgb = to_rec709 * vec3(linearize(r), linearize(g), linearize(b));                                \n\
+    imageStore(out_tex, pos, vec4(max(rgb, 0.0), 1.0));                                                   \n\
+}";
+
+/* Scene statistics reduction: every 16x16 workgroup reduces its tile to a
+ * partial, then a single workgroup folds the partials into the uniform block
+ * read by the tone mapping shader. Nothing is read back to the host. With the
+ * histogram, each workgroup counts its samples in shared memory and adds the
+ * counts to the Histogram buffer, which the final pass copies to the frame
+ * half and clears. Both shaders are prologue, histogram constants and
+ * luminance_histogram_source, then main. */
+static const char* statsPrologue = "                                                                            \n\
+#version 310 es                                                                                                 \n\
+precision highp float;                                                                                          \n\
+                                                                                                                \n\
+layout(local_size_x = 16, local_size_y = 16, local_size_z = 1) in;                                              \n\
+layout(rgba32f, binding = 0) uniform readonly highp image2D in_tex;                                             \n\
+                                                                                                                \n\
+// Every stride-th pixel of every stride-th row is sampled, 1 for all of them                                   \n\
+uniform int sample_stride;                                                                                      \n\
+uniform bool collect_histogram;                                                                                 \n\
+                                                                                                                \n\
+// One (sum of log luminance, max luminance) pair per workgroup                                                 \n\
+layout(std430, binding = 0) writeonly buffer Partials {                                                         \n\
+    vec2 partials[];                                                                                            \n\
+};                                                                                                              \n\
+                                                                                                                \n\
+shared float log_sum[256];                                                                                      \n\
+shared float max_lum[256];";
+
+// The buffer and shared counts need luminance_histogram_bins
+static const char* statsHistogram = "                                                                           \n\
+layout(std430, binding = 3) buffer Histogram {                                                                  \n\
+    uint counts[luminance_histogram_bins];        // being counted                                              \n\
+    uint frame_counts[luminance_histogram_bins];  // of the last measured frame                                 \n\
+};";
+
+static const char* statsMain = "                                                                                \n\
+shared uint group_histogram[luminance_histogram_bins];                                                          \n\
+                                                                                                                \n\
+void main() {                                                                                                   \n\
+    ivec2 size = imageSize(in_tex);                                                                             \n\
+    ivec2 grid = (size + sample_stride - 1) / sample_stride;                                                    \n\
+    ivec2 pos = ivec2(gl_GlobalInvocationID.xy);                                                                \n\
+    uint local = gl_LocalInvocationIndex;                                                                       \n\
+                                                                                                                \n\
+    if (collect_histogram) {                                                                                    \n\
+        for (uint i = local; i < uint(luminance_histogram_bins); i += 256u)                                     \n\
+            group_histogram[i] = 0u;                                                                            \n\
+        barrier();                                                                                              \n\
+    }                                                                                                           \n\
+                                                                                                                \n\
+    // Out of range invocations of edge groups add nothing                                                      \n\
+    log_sum[local] = 0.0f;                                                                                      \n\
+    max_lum[local] = 0.0f;                                                                                      \n\
+    if (pos.x < grid.x && pos.y < grid.y) {                                                                     \n\
+        ivec2 sample_pos = min(pos * sample_stride + sample_stride / 2, size - 1);                              \n\
+        float lum = safeLuminance(dot(vec3(0.2126f, 0.7152f, 0.0722f), imageLoad(in_tex, sample_pos).rgb));     \n\
+        log_sum[local] = log(lum);                                                                              \n\
+        max_lum[local] = lum;                                                                                   \n\
+        if (collect_histogram)                                                                                  \n\
+            atomicAdd(group_histogram[luminanceBin(lum)], 1u);                                                  \n\
+    }                                                                                                           \n\
+    barrier();                                                                                                  \n\
+                                                                                                                \n\
+    for (uint stride = 128u; stride > 0u; stride >>= 1) {                                                       \n\
+        if (local < stride) {                                                                                   \n\
+            log_sum[local] += log_sum[local + stride];                                                          \n\
+            max_lum[local] = max(max_lum[local], max_lum[local + stride]);                                      \n\
+        }                                                                                                       \n\
+        barrier();                                                                                              \n\
+    }                                                                                                           \n\
+                                                                                                                \n\
+    if (local == 0u)                                                                                            \n\
+        partials[gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x] = vec2(log_sum[0], max_lum[0]);      \n\
+                                                                                                                \n\
+    if (collect_histogram) {                                                                                    \n\
+        for (uint i = local; i < uint(luminance_histogram_bins); i += 256u) {                                   \n\
+            if (group_histogram[i] != 0u)                                                                       \n\
+                atomicAdd(counts[i], group_histogram[i]);                                                       \n\
+        }                                                                                                       \n\
+    }                                                                                                           \n\
+}";
+
+static const char* statsFinalPrologue = "                                                                       \n\
+#version 310 es                                                                                                 \n\
+precision highp float;                                                                                          \n\
+                                                                                                                \n\
+layout(local_size_x = 256, local_size_y = 1, local_size_z = 1) in;                                              \n\
+                                                                                                                \n\
+layout(std430, binding = 0) readonly buffer Partials {                                                          \n\
+    vec2 partials[];                                                                                            \n\
+};                                                                                                              \n\
+                                                                                                                \n\
+// Same layout as the SceneStats uniform block of the tone mapping shader, it                                   \n\
+// still holds the statistics of the previous frame for the adaptation                                          \n\
+layout(std430, binding = 1) buffer SceneStats {                                                                 \n\
+    float meanBrightness;                                                                                       \n\
+    float maxSceneBrightness;                                                                                   \n\
+};                                                                                                              \n\
+                                                                                                                \n\
+uniform uint partial_count;                                                                                     \n\
+uniform float pixel_count;                                                                                      \n\
+uniform float adapt_rate;     // 1 takes the new statistics as they are                                         \n\
+uniform float hysteresis;     // stops                                                                          \n\
+uniform bool collect_histogram;                                                                                 \n\
+uniform float white_percentile;   // 100 takes the maximum                                                      \n\
+uniform float local_compression;  // 1 without the local operator                                               \n\
+                                                                                                                \n\
+shared float log_sum[256];                                                                                      \n\
+shared float max_lum[256];";
+
+// adaptation_source and local_tone_source go after the histogram source, before main()
+static const char* statsFinalMain = "                                                                           \n\
+shared uint frame_histogram[luminance_histogram_bins];                                                          \n\
+                                                                                                                \n\
+void main() {                                                                                                   \n\
+    uint local = gl_LocalInvocationIndex;                                                                       \n\
+                                                                                                                \n\
+    // Hand the counts of this frame over and clear them for the next one                                       \n\
+    if (collect_histogram) {                                                                                    \n\
+        for (uint i = local; i < uint(luminance_histogram_bins); i += 256u) {                                   \n\
+            frame_histogram[i] = counts[i];                                                                     \n\
+            frame_counts[i] = counts[i];                                                                        \n\
+            counts[i] = 0u;                                                                                     \n\
+        }                                                                                                       \n\
+    }                                                                                                           \n\
+                                                                                                                \n\
+    float sum = 0.0f;                                                                                           \n\
+    float lum = 0.0f;                                                                                           \n\
+    for (uint i = local; i < partial_count; i += 256u) {                                                        \n\
+        sum += partials[i].x;                                                                                   \n\
+        lum = max(lum, partials[i].y);                                                                          \n\
+    }                                                                                                           \n\
+    log_sum[local] = sum;                                                                                       \n\
+    max_lum[local] = lum;                                                                                       \n\
+    barrier();                                                                                                  \n\
+                                                                                                                \n\
+    for (uint stride = 128u; stride > 0u; stride >>= 1) {                                                       \n\
+        if (local < stride) {                                                                                   \n\
+            log_sum[local] += log_sum[local + stride];                                                          \n\
+            max_lum[local] = max(max_lum[local], max_lum[local + stride]);                                      \n\
+        }                                                                                                       \n\
+        barrier();                                                                                              \n\
+    }                                                                                                           \n\
+                                                                                                                \n\
+    if (local != 0u)                                                                                            \n\
+        return;                                                                                                 \n\
+                                                                                                                \n\
+    float white = max_lum[0];                                                                                   \n\
+    if (collect_histogram && white_percentile < 100.0f)                                                         \n\
+        white = min(histogramPercentile(frame_histogram, white_percentile), white);                             \n\
+    if (local_compression < 1.0f)                                                                               \n\
+        white = localToneWhite(white, log_sum[0] / pixel_count * 1.442695f, local_compression);                 \n\
+                                                                                                                \n\
+    if (adapt_rate >= 1.0f) {                                                                                   \n\
+        meanBrightness = exp(log_sum[0] / pixel_count);                                                         \n\
+        maxSceneBrightness = white;                                                                             \n\
+    }                                                                                                           \n\
+    else {                                                                                                      \n\
+        // Log2 domain, as utils/sequence.h                                                                     \n\
+        float log_mean = log_sum[0] / pixel_count * 1.442695f;                                                  \n\
+        meanBrightness = exp2(adaptLog(log2(meanBrightness), log_mean, adapt_rate, hysteresis));                \n\
+        maxSceneBrightness = exp2(adaptLog(log2(maxSceneBrightness), log2(white), adapt_rate, hysteresis));     \n\
+    }                                                                                                           \n\
+}";
+
+/* Local tone mapping, see utils/local_tone.h. The splat runs one 16x16
+ * workgroup per grid column, the pixels nearest to it, and sums the levels in
+ * shared memory in 1/4096 stop fixed point, as GLES has no float atomics. The
+ * blur is the separable [1 4 6 4 1] / 16 of the CPU, one dispatch per axis
+ * between two cell buffers; the last one writes the slicing texture, whose
+ * texel z holds cells z and z + 1 so one fetch covers both layers. Both
+ * shaders are a prologue, the histogram constants and sources, then main. */
+static const char* localSplatPrologue = "                                                                      \n\
+#version 310 es                                                                                                 \n\
+precision highp float;                                                                                          \n\
+                                                                                                                \n\
+layout(local_size_x = 16, local_size_y = 16, local_size_z = 1) in;                                              \n\
+layout(rgba32f, binding = 0) uniform readonly highp image2D in_tex;                                             \n\
+                                                                                                                \n\
+// (sum of levels, weight) pairs, the luminance axis fastest                                                    \n\
+layout(std430, binding = 0) writeonly buffer Cells {                                                            \n\
+    vec2 cells[];                                                                                               \n\
+};";
+
+static const char* localSplatMain = "                                                                           \n\
+shared uint level_sum[LOCAL_GRID_DEPTH];                                                                        \n\
+shared uint level_count[LOCAL_GRID_DEPTH];                                                                      \n\
+                                                                                                                \n\
+void main() {                                                                                                   \n\
+    uint local = gl_LocalInvocationIndex;                                                                       \n\
+    if (local < uint(LOCAL_GRID_DEPTH)) {                                                                       \n\
+        level_sum[local] = 0u;                                                                                  \n\
+        level_count[local] = 0u;                                                                                \n\
+    }                                                                                                           \n\
+    barrier();                                                                                                  \n\
+                                                                                                                \n\
+    // Cell i gathers the pixels within half a cell of i * LOCAL_GRID_CELL                                      \n\
+    ivec2 pos = ivec2(gl_WorkGroupID.xy) * LOCAL_GRID_CELL - LOCAL_GRID_CELL / 2 + ivec2(gl_LocalInvocationID.xy);\n\
+    if (all(greaterThanEqual(pos, ivec2(0))) && all(lessThan(pos, imageSize(in_tex)))) {                        \n\
+        float lum = safeLuminance(dot(vec3(0.2126f, 0.7152f, 0.0722f), imageLoad(in_tex, pos).rgb));            \n\
+        float level = log2(lum) - LOCAL_GRID_MIN_LOG2;                                                          \n\
+        int z = min(int(level + 0.5f), LOCAL_GRID_DEPTH - 1);                                                   \n\
+        atomicAdd(level_sum[z], uint(level * 4096.0f + 0.5f));                                                  \n\
+        atomicAdd(level_count[z], 1u);                                                                          \n\
+    }                                                                                                           \n\
+    barrier();                                                                                                  \n\
+                                                                                                                \n\
+    if (local < uint(LOCAL_GRID_DEPTH)) {                                                                       \n\
+        uint column = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;                                 \n\
+        cells[column * uint(LOCAL_GRID_DEPTH) + local] = vec2(float(level_sum[local]) / 4096.0f, float(level_count[local]));\n\
+    }                                                                                                           \n\
+}";
+
+static const char* localBlurShader = "                                                                          \n\
+#version 310 es                                                                                                 \n\
+precision highp float;                                                                                          \n\
+                                                                                                                \n\
+layout(local_size_x = 64, local_size_y = 1, local_size_z = 1) in;                                               \n\
+                                                                                                                \n\
+layout(std430, binding = 0) readonly buffer Cells {                                                             \n\
+    vec2 cells[];                                                                                               \n\
+};                                                                                                              \n\
+layout(std430, binding = 1) writeonly buffer Blurred {                                                          \n\
+    vec2 blurred[];                                                                                             \n\
+};                                                                                                              \n\
+layout(rgba32f, binding = 0) uniform writeonly highp image3D local_grid;                                        \n\
+                                                                                                                \n\
+uniform ivec3 grid_size;  // depth, width and height in cells                                                   \n\
+uniform int axis;         // 0 luminance, 1 x, 2 y, the last pass writes local_grid                             \n\
+uniform float scale;      // 1, then one over the cell area on the last pass                                    \n\
+                                                                                                                \n\
+// Out of range cells count as empty                                                                            \n\
+vec2 blurCell(ivec3 cell) {                                                                                     \n\
+    const float taps[5] = float[5](1.0f / 16.0f, 4.0f / 16.0f, 6.0f / 16.0f, 4.0f / 16.0f, 1.0f / 16.0f);       \n\
+    vec2 sum = vec2(0.0f);                                                                                      \n\
+    for (int t = -2; t <= 2; ++t) {                                                                             \n\
+        ivec3 tap = cell;                                                                                       \n\
+        tap[axis] += t;                                                                                         \n\
+        if (tap[axis] < 0 || tap[axis] >= grid_size[axis])                                                      \n\
+            continue;                                                                                           \n\
+        sum += taps[t + 2] * cells[(tap.z * grid_size.y + tap.y) * grid_size.x + tap.x];                        \n\
+    }                                                                                                           \n\
+    return sum * scale;                                                                                         \n\
+}                                                                                                               \n\
+                                                                                                                \n\
+void main() {                                                                                                   \n\
+    int index = int(gl_GlobalInvocationID.x);                                                                   \n\
+    if (index >= grid_size.x * grid_size.y * grid_size.z)                                                       \n\
+        return;                                                                                                 \n\
+                                                                                                                \n\
+    ivec3 cell = ivec3(index % grid_size.x, (index / grid_size.x) % grid_size.y, index / (grid_size.x * grid_size.y));\n\
+    if (axis < 2) {                                                                                             \n\
+        blurred[index] = blurCell(cell);                                                                        \n\
+        return;                                                                                                 \n\
+    }                                                                                                           \n\
+    vec2 next = cell.x + 1 < grid_size.x ? blurCell(cell + ivec3(1, 0, 0)) : vec2(0.0f);                        \n\
+    imageStore(local_grid, cell, vec4(blurCell(cell), next));                                                   \n\
+}";
+
+// Slice of the tone mapping shader, after the curve source: the gain of
+// utils/local_tone.h on the trilinear base around the pixel
+static const char* fShaderLocal = "                                                                         \n\
+uniform highp sampler3D local_grid;                                                                         \n\
+uniform float local_scale;  // Full size pixels per output pixel, 2^level in the pyramid                    \n\
                                                                                                             \n\
-	// Convert RGB to luminance values                                                                       \n\
-	vec3 in_color = texture(texture1, TexCoord).xyz;                                                         \n\
-	float lum = luminance(in_color);                                                                         \n\
+// pixel is in output pixels, row 0 at the bottom like the texture                                          \n\
+vec3 applyLocalTone(vec3 color, vec2 pixel) {                                                               \n\
+	ivec3 size = textureSize(local_grid, 0);                                                                   \n\
+	float log_lum = log2(safeLuminance(luminance(color)));                                                     \n\
                                                                                                             \n\
-	// Scaled luminance value                                                                                \n\
-	float scaled_lum = lum * (0.18f / meanBrightness);                                                       \n\
+	vec2 f = min((pixel * local_scale - 0.5f) / float(LOCAL_GRID_CELL), vec2(size.yz) - 1.0f);                 \n\
+	ivec2 cell = min(ivec2(f), size.yz - 2);                                                                   \n\
+	f -= vec2(cell);                                                                                           \n\
+	float fz = min(log_lum - LOCAL_GRID_MIN_LOG2, float(size.x) - 1.0f);                                       \n\
+	int z = min(int(fz), size.x - 2);                                                                          \n\
+	fz -= float(z);                                                                                            \n\
                                                                                                             \n\
-	// Compression using Reinhard Operator                                                                   \n\
-	float whiteness_factor = 1.0f / (maxSceneBrightness * maxSceneBrightness);                               \n\
-	float final_lum = (scaled_lum * (1.0f + (scaled_lum * whiteness_factor))) / (1.0f + scaled_lum);         \n\
-	float compression_factor = final_lum / scaled_lum;                                                       \n\
-	vec3 out_color = in_color * compression_factor;                                                          \n\
+	vec4 n00 = texelFetch(local_grid, ivec3(z, cell), 0);                                                      \n\
+	vec4 n10 = texelFetch(local_grid, ivec3(z, cell + ivec2(1, 0)), 0);                                        \n\
+	vec4 n01 = texelFetch(local_grid, ivec3(z, cell + ivec2(0, 1)), 0);                                        \n\
+	vec4 n11 = texelFetch(local_grid, ivec3(z, cell + ivec2(1, 1)), 0);                                        \n\
+	vec4 node = mix(mix(n00, n10, f.x), mix(n01, n11, f.x), f.y);                                              \n\
+	vec2 sum_weight = mix(node.xy, node.zw, fz);                                                               \n\
                                                                                                             \n\
-	// Gamma correction                                                                                      \n\
-	float gamma = 1.0f / 2.4f;                                                                               \n\
-	FragColor = vec4(clamp(gamma_correct(out_color.r), 0.0f, 1.0f),                                          \n\
-                    clamp(gamma_correct(out_color.g), 0.0f, 1.0f),                                          \n\
-                    clamp(gamma_correct(out_color.b), 0.0f, 1.0f),                                          \n\
-                    1.0f);                                                                                  \n\
+	float base = sum_weight.y > 0.0f ? sum_weight.x / sum_weight.y + LOCAL_GRID_MIN_LOG2 : log_lum;            \n\
+	return color * exp2(localToneExposure(log_lum, base, log2(meanBrightness), LOCAL_COMPRESSION, LOCAL_DETAIL));\n\
+}";
+
+/* Tone curve baking for the LUT mode. lutCheckShader compares the scene
+ * maximum with the one the tables were baked for and writes the group count
+ * of the bake dispatch, which is zero when nothing changed, so sequences only
+ * rebake on a new maximum without the host reading the statistics back. The
+ * bake shader is the prologue, the curve source and lutBakeMain. */
+static const char* lutCheckShader = "                                                                           \n\
+#version 310 es                                                                                                 \n\
+precision highp float;                                                                                          \n\
+                                                                                                                \n\
+layout(local_size_x = 1, local_size_y = 1, local_size_z = 1) in;                                                \n\
+                                                                                                                \n\
+layout(std140, binding = 0) uniform SceneStats {                                                                \n\
+    float meanBrightness;                                                                                       \n\
+    float maxSceneBrightness;                                                                                   \n\
+};                                                                                                              \n\
+                                                                                                                \n\
+// The white point the tables hold, then the indirect bake dispatch                                             \n\
+layout(std430, binding = 2) buffer LutState {                                                                   \n\
+    float bakedWhite;                                                                                           \n\
+    uint baked;                                                                                                 \n\
+    uint bakeGroups[3];                                                                                         \n\
+};                                                                                                              \n\
+                                                                                                                \n\
+uniform uint bake_groups;                                                                                       \n\
+                                                                                                                \n\
+void main() {                                                                                                   \n\
+    // An empty dispatch when the tables already hold this frame's maximum                                      \n\
+    bool stale = baked == 0u || bakedWhite != maxSceneBrightness;                                               \n\
+    bakeGroups[0] = stale ? bake_groups : 0u;                                                                   \n\
+    bakedWhite = maxSceneBrightness;                                                                            \n\
+    baked = 1u;                                                                                                 \n\
 }";
 
-static const char* cShader = "                                          \n\
-#version 310 es                                                         \n\
-precision highp float;                                                  \n\
-                                                                        \n\
-layout(local_size_x = 1, local_size_y = 1, local_size_z = 1) in;        \n\
-layout(rgba32f, binding = 0) uniform readonly highp image2D in_tex;     \n\
-layout(rgba32f, binding = 1) uniform writeonly highp image2D out_tex;   \n\
-                                                                        \n\
-void main() {                                                           \n\
-    // get position to read/write data from                             \n\
-    ivec2 pos = ivec2(gl_GlobalInvocationID.xy);                        \n\
-                                                                        \n\
-    // get value stored in the image                                    \n\
-    vec4 in_val = imageLoad(in_tex, pos);                               \n\
-                                                                        \n\
-    /* Conversion logic from YUV to RGBA */                             \n\
-                                                                        \n\
-    // store new value in image                                         \n\
-    imageStore(out_tex, pos, in_val);                                   \n\
+static const char* lutBakePrologue = "                                                                          \n\
+#version 310 es                                                                                                 \n\
+precision highp float;                                                                                          \n\
+precision highp int;                                                                                            \n\
+                                                                                                                \n\
+layout(local_size_x = 64, local_size_y = 1, local_size_z = 1) in;                                               \n\
+                                                                                                                \n\
+layout(std140, binding = 0) uniform SceneStats {                                                                \n\
+    float meanBrightness;                                                                                       \n\
+    float maxSceneBrightness;                                                                                   \n\
+};                                                                                                              \n\
+                                                                                                                \n\
+layout(r32f, binding = 0) uniform writeonly highp image2D tone_tables;                                          \n\
+#ifdef TONE_LUT_GENERAL                                                                                         \n\
+layout(rgba16f, binding = 1) uniform writeonly highp image3D tone_cube;                                         \n\
+#endif                                                                                                          \n\
+#ifdef TONE_LUT_GRADE                                                                                           \n\
+uniform highp sampler3D grade_cube;                                                                             \n\
+#endif";
+
+static const char* lutBakeMain = "                                                                                          \n\
+// Same entries as bakeToneLut(), one invocation each: the table entries                                                    \n\
+// first, then the nodes of the general cube                                                                                \n\
+void main() {                                                                                                               \n\
+    int index = int(gl_GlobalInvocationID.x);                                                                               \n\
+    ToneParams params = ToneParams(1.0f, maxSceneBrightness);                                                               \n\
+    const int table_size = TONE_LUT_ROW * TONE_LUT_BINADES;                                                                 \n\
+                                                                                                                            \n\
+    if (index < table_size) {                                                                                               \n\
+        int row = index / TONE_LUT_ROW, column = index % TONE_LUT_ROW;                                                      \n\
+        float x = exp2(float(row + TONE_LUT_MIN_EXPONENT)) * (1.0f + float(column) / float(TONE_LUT_SEGMENTS));             \n\
+#if defined(TONE_LUT_LUMINANCE)                                                                                             \n\
+        imageStore(tone_tables, ivec2(column, row), vec4(ENCODE_TRANSFER(x)));                                              \n\
+        imageStore(tone_tables, ivec2(column, row + TONE_LUT_BINADES), vec4(TONE_OPERATOR(vec3(x), params).r / x));         \n\
+#elif defined(TONE_LUT_PER_CHANNEL)                                                                                         \n\
+        imageStore(tone_tables, ivec2(column, row), vec4(ENCODE_TRANSFER(TONE_OPERATOR(vec3(x), params).r)));               \n\
+#else                                                                                                                       \n\
+        float shaped = (log2(x) - TONE_LUT_SHAPER_MIN) / (TONE_LUT_SHAPER_MAX - TONE_LUT_SHAPER_MIN);                       \n\
+        imageStore(tone_tables, ivec2(column, row), vec4(clamp(shaped, 0.0f, 1.0f)));                                       \n\
+#endif                                                                                                                      \n\
+        return;                                                                                                             \n\
+    }                                                                                                                       \n\
+                                                                                                                            \n\
+#ifdef TONE_LUT_GENERAL                                                                                                     \n\
+    const int size = TONE_LUT_CUBE_SIZE;                                                                                    \n\
+    index -= table_size;                                                                                                    \n\
+    if (index >= size * size * size)                                                                                        \n\
+        return;                                                                                                             \n\
+                                                                                                                            \n\
+    ivec3 node = ivec3(index % size, (index / size) % size, index / (size * size));                                         \n\
+    vec3 x = exp2(TONE_LUT_SHAPER_MIN + (TONE_LUT_SHAPER_MAX - TONE_LUT_SHAPER_MIN) * vec3(node) / float(size - 1));        \n\
+    vec3 y = TONE_OPERATOR(x, params);                                                                                      \n\
+#ifdef OUTPUT_BT2020                                                                                                        \n\
+    y = rec709ToRec2020(y);                                                                                                 \n\
+#endif                                                                                                                      \n\
+    y = vec3(ENCODE_TRANSFER(y.r), ENCODE_TRANSFER(y.g), ENCODE_TRANSFER(y.b));                                             \n\
+#ifdef TONE_LUT_GRADE                                                                                                       \n\
+    float grade_size = float(textureSize(grade_cube, 0).x);                                                                 \n\
+    y = textureLod(grade_cube, (clamp(y, 0.0f, 1.0f) * (grade_size - 1.0f) + 0.5f) / grade_size, 0.0f).rgb;                 \n\
+#endif                                                                                                                      \n\
+    imageStore(tone_cube, node, vec4(y, 1.0f));                                                                             \n\
+#endif                                                                                                                      \n\
 }";
 
-// Identifiers for the GL objects
-GLuint VAO, EBO, VBO, toneMappingShaderProgram, computeShaderProgram, hdrTexture, convertedHdrTexture;
+// Vertex data of the full screen quad drawn by the tone mapping pass
+struct gl_quad
+{
+   GLuint vao, vbo, ebo;
+};
 
-void CreateRectangle()
+gl_quad CreateRectangle()
 {
+   gl_quad quad;
+
    // Vertex positions for the triangle
    float vertices[] = {
       // positions          // colors           // texture coords
@@ -138,18 +750,19 @@ void CreateRectangle()
    };
 
    // Specify a VAO for our triangle object
-   glGenVertexArrays(1, &VAO);
-   glBindVertexArray(VAO);
+   glGenVertexArrays(1, &quad.vao);
+   glBindVertexArray(quad.vao);
 
       // Specify a VBO to bind to the above VAO
-      glGenBuffers(1, &VBO);
-      glGenBuffers(1, &EBO);
+      glGenBuffers(1, &quad.vbo);
+      glGenBuffers(1, &quad.ebo);
 
-      glBindBuffer(GL_ARRAY_BUFFER, VBO);
+      glBindBuffer(GL_ARRAY_BUFFER, quad.vbo);
       // Loading up the data of the triangle into the VBO
       glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
 
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+      // The element buffer binding is VAO state, leave it bound
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, quad.ebo);
       glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
 
          // position attribute
@@ -162,14 +775,13 @@ void CreateRectangle()
          glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
          glEnableVertexAttribArray(2);
 
-      // Unbinding the EBO
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-      
-      // Unbinding the VBO
-      glBindBuffer(GL_ARRAY_BUFFER, 0);
-
    // Unbinding the VAO
    glBindVertexArray(0);
+
+   // Unbinding the VBO
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+   return quad;
 }
 
 void AddShader(GLuint program, const char* shaderSource, GLenum shaderType)
@@ -202,416 +814,1542 @@ void AddShader(GLuint program, const char* shaderSource, GLenum shaderType)
    {
       glGetShaderInfoLog(shader, sizeof(log), NULL, log);
       printf("Error: Compilation of shader of type %d failed, '%s'\n", shaderType, log);
+      glDeleteShader(shader);
       return;
    }
 
-   // Attach the shader to the shader program
+   // Attach the shader to the shader program, the program keeps it alive
    glAttachShader(program, shader);
+   glDeleteShader(shader);
 }
 
-void CompileShaderProgram()
+/* Program binary cache
+ *
+ * Linked programs are stored with glGetProgramBinary under a key hashed from
+ * the driver strings and the shader sources, so a new driver or an edited
+ * shader simply misses the cache. A binary the driver refuses is recompiled
+ * and overwritten. The directory comes from EXR_TONE_MAPPING_CACHE, then
+ * $XDG_CACHE_HOME/exr-tone-mapping, then ~/.cache/exr-tone-mapping; an empty
+ * EXR_TONE_MAPPING_CACHE disables the cache.
+ */
+typedef vector<pair<GLenum, const char*>> gl_shader_stages;
+
+string defaultProgramCacheDir() {
+   if (const char *dir = getenv("EXR_TONE_MAPPING_CACHE"))
+      return dir;
+   if (const char *xdg = getenv("XDG_CACHE_HOME"))
+      return string(xdg) + "/exr-tone-mapping";
+   if (const char *home = getenv("HOME"))
+      return string(home) + "/.cache/exr-tone-mapping";
+   return "";
+}
+
+// 64-bit FNV-1a, folded over several strings
+uint64_t hashProgramKey(uint64_t hash, const char *text) {
+   for (const unsigned char *c = (const unsigned char*)text; *c; ++c)
+      hash = (hash ^ *c) * 1099511628211ull;
+   return (hash ^ 0xff) * 1099511628211ull;
+}
+
+string programCachePath(const string &cache_dir, const char *name, const gl_shader_stages &stages) {
+   uint64_t hash = 14695981039346656037ull;
+   hash = hashProgramKey(hash, (const char*)glGetString(GL_VENDOR));
+   hash = hashProgramKey(hash, (const char*)glGetString(GL_RENDERER));
+   hash = hashProgramKey(hash, (const char*)glGetString(GL_VERSION));
+   for (const pair<GLenum, const char*> &stage : stages)
+      hash = hashProgramKey(hash, stage.second);
+
+   char key[17];
+   snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+   return cache_dir + "/" + name + "-" + key + ".bin";
+}
+
+// Returns a linked program from the cache file, or 0 on a miss
+GLuint LoadProgramBinary(const string &path) {
+   ifstream in(path, ios::binary);
+   GLenum format = 0;
+   if (!in.read((char*)&format, sizeof(format)))
+      return 0;
+   vector<char> binary((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+   if (binary.empty())
+      return 0;
+
+   GLuint program = glCreateProgram();
+   glProgramBinary(program, format, binary.data(), (GLsizei)binary.size());
+
+   GLint result = 0;
+   glGetProgramiv(program, GL_LINK_STATUS, &result);
+   if (!result) {
+      glDeleteProgram(program);
+      return 0;
+   }
+   return program;
+}
+
+void SaveProgramBinary(GLuint program, const string &cache_dir, const string &path) {
+   GLint length = 0;
+   glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+   if (length <= 0)
+      return;
+
+   GLenum format = 0;
+   vector<char> binary(length);
+   glGetProgramBinary(program, length, &length, &format, binary.data());
+
+   // Create the directory and its parent, write to a temporary and rename it
+   // into place so a concurrent run never reads half a binary
+   mkdir(cache_dir.substr(0, cache_dir.find_last_of('/')).c_str(), 0755);
+   mkdir(cache_dir.c_str(), 0755);
+   string temporary = path + "." + to_string(getpid());
+   ofstream out(temporary, ios::binary);
+   out.write((const char*)&format, sizeof(format));
+   out.write(binary.data(), length);
+   out.close();
+   // A failed write or rename must not leave the temporary in the cache
+   if (!out || rename(temporary.c_str(), path.c_str()) != 0)
+      unlink(temporary.c_str());
+}
+
+// Compiles and links a program from the given stages, going through the binary
+// cache when cache_dir is not empty. Returns 0 on failure.
+GLuint CreateProgram(const char *name, const gl_shader_stages &stages, const string &cache_dir = "")
 {
+   TraceScope trace("gl_program");
+   GLint binary_formats = 0;
+   glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binary_formats);
+   bool use_cache = !cache_dir.empty() && binary_formats > 0;
+
+   string path;
+   if (use_cache) {
+      path = programCachePath(cache_dir, name, stages);
+      if (GLuint program = LoadProgramBinary(path))
+         return program;
+   }
+
    // Create an empty shader program object
-   toneMappingShaderProgram = glCreateProgram();
+   GLuint program = glCreateProgram();
 
    // Check if it was created successfully
-   if (!toneMappingShaderProgram)
+   if (!program)
    {
       printf("Error: Generation of shader program failed!\n");
-      return;
+      return 0;
    }
 
-   // Attaching our vertex and fragment shaders to the shader program
-   AddShader(toneMappingShaderProgram, vShader, GL_VERTEX_SHADER);
-   AddShader(toneMappingShaderProgram, fShader, GL_FRAGMENT_SHADER);
+   for (const pair<GLenum, const char*> &stage : stages)
+      AddShader(program, stage.second, stage.first);
 
    // Setting up error logging objects
    GLint result = 0;
    GLchar log[1024] = { 0 };
 
    // Perform shader program linking
-   glLinkProgram(toneMappingShaderProgram);
+   if (use_cache)
+      glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+   glLinkProgram(program);
 
    // Find and log errors if any from the linking process done above
-   glGetProgramiv(toneMappingShaderProgram, GL_LINK_STATUS, &result);
+   glGetProgramiv(program, GL_LINK_STATUS, &result);
    if (!result)
    {
-      glGetProgramInfoLog(toneMappingShaderProgram, sizeof(log), NULL, log);
-      printf("Error: Linking of the shader program failed, '%s'\n", log);
-      return;
+      glGetProgramInfoLog(program, sizeof(log), NULL, log);
+      printf("Error: Linking of the shader program %s failed, '%s'\n", name, log);
+      glDeleteProgram(program);
+      return 0;
    }
 
-   // Perform shader program validation
-   glValidateProgram(toneMappingShaderProgram);
+   if (use_cache)
+      SaveProgramBinary(program, cache_dir, path);
 
-   // Find and log errors if any from the validation process done above
-   glGetProgramiv(toneMappingShaderProgram, GL_VALIDATE_STATUS, &result);
-   if (!result)
-   {
-      glGetProgramInfoLog(toneMappingShaderProgram, sizeof(log), NULL, log);
-      printf("Error: Shader program validation failed, '%s'", log);
-      return;
-   }
+   return program;
 }
 
-void LoadHDRTexture(int width, int height, Array2D<Rgba> &p) {
-   glGenTextures(1, &hdrTexture);
-   glBindTexture(GL_TEXTURE_2D, hdrTexture);
+// Function to save the rendered image to a file
+void gl_save_8bit_image(const char *filename, int width, int height) {
+    // Recycled buffer to read the pixels
+    shared_ptr<GLubyte> buffer = imageBufferPool().acquire<GLubyte>((size_t)width * height * 4);
+    GLubyte *pixels = buffer.get();
+
+    // Read the pixels from the framebuffer
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
 
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    // Drop alpha in place, the RGB triplets only ever move towards the front
+    for (size_t i = 0; i < (size_t)width * height; i++) {
+        pixels[i * 3] = pixels[i * 4];
+        pixels[i * 3 + 1] = pixels[i * 4 + 1];
+        pixels[i * 3 + 2] = pixels[i * 4 + 2];
+    }
 
-   color_rgba data[height][width];
+    writePPM8(filename, pixels, width, height);
+}
 
-   for (int j = 0; j < height; j++) {
-      for (int i = 0; i < width; i++) {
-         const Rgba& pixel = p[j][i];
-         data[j][i].r = pixel.r;
-         data[j][i].g = pixel.g;
-         data[j][i].b = pixel.b;
-         data[j][i].a = pixel.a;
+// Unpacks 2_10_10_10 words, as read back from the output framebuffer, into
+// 16-bit RGB samples and writes them as a 10-bit PPM, or rearranges them
+// straight into the words of a 10-bit DPX. Returns false when the file was not written.
+bool gl_write_10bit_pixels(const char *filename, const GLuint *pixels, int width, int height) {
+   TraceScope trace("unpack_10bit");
+   trace.setPixels((size_t)width * height);
+   if (outputContainer() == OUTPUT_CONTAINER_DPX) {
+      size_t count = (size_t)width * height;
+      shared_ptr<unsigned char> words = imageBufferPool().acquire<unsigned char>(count * 4);
+      for (size_t i = 0; i < count; i++) {
+         GLuint pixel = pixels[i];
+         putBigEndian32(words.get() + i * 4, (pixel & 0x3FF) << 22 | ((pixel >> 10) & 0x3FF) << 12 | ((pixel >> 20) & 0x3FF) << 2);
       }
+      dpx_encoding encoding = dpxEncoding(selectedToneCurve(TRANSFER_SRGB).transfer);
+      return writeImageFile(filename, dpxHeader(width, height, encoding), words.get(), count * 4);
+   }
+
+   shared_ptr<unsigned short> buffer = imageBufferPool().acquire<unsigned short>((size_t)width * height * 3);
+   unsigned short *rgb = buffer.get();
+   for (size_t i = 0; i < (size_t)width * height; i++) {
+      GLuint pixel = pixels[i];
+      rgb[i * 3] = (pixel >> 0) & 0x3FF;
+      rgb[i * 3 + 1] = (pixel >> 10) & 0x3FF;
+      rgb[i * 3 + 2] = (pixel >> 20) & 0x3FF;
    }
 
-   glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, width, height);
-   glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_FLOAT, data);
-   glBindTexture(GL_TEXTURE_2D, 0);
+   return writePPM16(filename, rgb, width, height, 1023);
 }
 
-void RunComputeShader(int width, int height)
+// Function to save the rendered image to a file
+bool gl_save_10bit_image(const char *filename, int width, int height) {
+   TraceScope trace("gl_readback");
+   trace.setBytes((size_t)width * height * sizeof(GLuint));
+
+   // Recycled buffer to read the pixels
+   shared_ptr<GLuint> pixels = imageBufferPool().acquire<GLuint>((size_t)width * height);
+
+   // Read the pixels from the framebuffer
+   glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV, pixels.get());
+
+   return gl_write_10bit_pixels(filename, pixels.get(), width, height);
+}
+
+// Compute workgroup dimensions of the conversion stage
+struct gl_workgroup_size
 {
-   // Create an empty shader program object
-   computeShaderProgram = glCreateProgram();
+   GLuint x, y;
+};
 
-   // Check if it was created successfully
-   if (!computeShaderProgram)
-   {
-      printf("Error: Generation of shader program failed!\n");
-      return;
-   }
+inline bool parseWorkgroupSize(const string &text, gl_workgroup_size &size) {
+   unsigned int x = 0, y = 0;
+   char separator = 0;
+   if (sscanf(text.c_str(), "%u%c%u", &x, &separator, &y) != 3 || separator != 'x' || !x || !y)
+      return false;
+   size.x = x;
+   size.y = y;
+   return true;
+}
 
-   // Attaching our vertex and fragment shaders to the shader program
-   AddShader(computeShaderProgram, cShader, GL_COMPUTE_SHADER);
+// Inserts #define lines right after the #version line of a shader
+string withShaderDefines(const char *source, const string &defines) {
+   string text = source;
+   size_t line_end = text.find('\n', text.find("#version"));
+   return text.insert(line_end + 1, defines);
+}
 
-   // Setting up error logging objects
-   GLint result = 0;
-   GLchar log[1024] = { 0 };
+// #define lines of the LUT shaders: the table layout of utils/tone_lut.h and
+// the shape of the curve
+string toneLutDefines(const tone_curve &curve) {
+   const tone_lut_selection &selection = toneLutSelection();
+   tone_operator_shape shape = toneLutShape(curve);
+   uint32_t min_bits, max_bits;
+   memcpy(&min_bits, &tone_lut_min_input, sizeof(min_bits));
+   memcpy(&max_bits, &tone_lut_max_input, sizeof(max_bits));
+
+   string defines = "#define TONE_LUT_SEGMENTS " + to_string(tone_lut_segments) +
+                    "\n#define TONE_LUT_ROW " + to_string(tone_lut_row) +
+                    "\n#define TONE_LUT_BINADES " + to_string(tone_lut_binades) +
+                    "\n#define TONE_LUT_MIN_EXPONENT " + to_string(tone_lut_min_exponent) +
+                    "\n#define TONE_LUT_MIN_BITS " + to_string(min_bits) + "u" +
+                    "\n#define TONE_LUT_MAX_BITS " + to_string(max_bits) + "u" +
+                    "\n#define TONE_LUT_SHAPER_MIN " + to_string(tone_lut_shaper_min) + "f" +
+                    "\n#define TONE_LUT_SHAPER_MAX " + to_string(tone_lut_shaper_max) + "f" +
+                    "\n#define TONE_LUT_CUBE_SIZE " + to_string(selection.cube_size) + "\n";
+   if (shape == TONE_SHAPE_LUMINANCE)
+      defines += "#define TONE_LUT_LUMINANCE\n";
+   else if (shape == TONE_SHAPE_PER_CHANNEL)
+      defines += "#define TONE_LUT_PER_CHANNEL\n";
+   else
+      defines += "#define TONE_LUT_GENERAL\n";
+
+   // The general cube has the grade composed in at bake time
+   if (shape == TONE_SHAPE_GENERAL || !selection.grade.empty())
+      defines += "#define TONE_LUT_CUBE\n";
+   if (shape == TONE_SHAPE_GENERAL && !selection.grade.empty())
+      defines += "#define TONE_LUT_GRADE\n";
+   return defines;
+}
 
-   // Perform shader program linking
-   glLinkProgram(computeShaderProgram);
+// The slice of the local operator with its constants and sources, nothing
+// when it is off
+string localToneFragmentSource() {
+   const local_tone_settings &local = localToneSettings();
+   if (!local.enabled)
+      return "";
+   return luminanceHistogramDefines() + localToneDefines(local) + glsl::luminance_histogram_source + "\n" +
+          glsl::local_tone_source + "\n" + fShaderLocal + "\n#define LOCAL_TONE\n";
+}
 
-   // Find and log errors if any from the linking process done above
-   glGetProgramiv(computeShaderProgram, GL_LINK_STATUS, &result);
-   if (!result)
-   {
-      glGetProgramInfoLog(computeShaderProgram, sizeof(log), NULL, log);
-      printf("Error: Linking of the shader program failed, '%s'\n", log);
-      return;
+// A prologue followed by toneMapPixel() for a curve, evaluated per pixel or
+// read from the baked tables
+string toneMapPixelSource(const char *prologue, const string &defines, const tone_curve &curve, bool lut) {
+   string curve_source = "\n" + toneCurveShaderSource(curve) + localToneFragmentSource();
+   if (lut)
+      return withShaderDefines(prologue, defines + toneLutDefines(curve)) + curve_source + fShaderLutCurve;
+   return withShaderDefines(prologue, defines) + curve_source + fShaderCurve;
+}
+
+// The tone mapping fragment shader for a curve
+string toneMappingFragmentShader(const tone_curve &curve, bool lut = false) {
+   return toneMapPixelSource(fShaderPrologue, "", curve, lut) + "\n" + fShaderMain;
+}
+
+// The compute shader writing a packed output file for a curve
+string packedOutputShader(const tone_curve &curve, bool lut, gl_pack_format format) {
+   const gl_pack_layout &layout = gl_pack_layouts[format];
+   string defines = "#define " + string(layout.define) + "\n#define PACK_MAXVAL " + to_string(layout.maxval) + ".0f\n";
+   return toneMapPixelSource(packPrologue, defines, curve, lut) + "\n" + packMain;
+}
+
+// The compute shader baking the tables of a curve
+string toneLutBakeShader(const tone_curve &curve) {
+   return withShaderDefines(lutBakePrologue, toneLutDefines(curve)) + "\n" + toneCurveShaderSource(curve) + lutBakeMain;
+}
+
+string workgroupDefines(gl_workgroup_size workgroup) {
+   return "#define LOCAL_SIZE_X " + to_string(workgroup.x) + "\n#define LOCAL_SIZE_Y " + to_string(workgroup.y) + "\n";
+}
+
+// The selected pyramid levels the mip chain of a frame can hold
+vector<int> glPyramidLevels(int width, int height) {
+   vector<int> levels;
+   for (int level : pyramidSettings().levels)
+      if ((max(width, height) >> level) > 0)
+         levels.push_back(level);
+   return levels;
+}
+
+// Where the full size image and every pyramid level go in the packed buffer
+struct gl_packed_image
+{
+   int level, width, height;
+   size_t first_word;
+};
+
+vector<gl_packed_image> glPackedImages(gl_pack_format format, int width, int height) {
+   vector<gl_packed_image> images = { { 0, width, height, 0 } };
+   size_t words = glPackedWords(format, width, height);
+   for (int level : glPyramidLevels(width, height)) {
+      gl_packed_image image = { level, 0, 0, words };
+      pyramidLevelSize(width, height, level, image.width, image.height);
+      words += glPackedWords(format, image.width, image.height);
+      images.push_back(image);
+   }
+   return images;
+}
+
+// Bytes of the packed buffer of a frame
+size_t glPackedBufferSize(gl_pack_format format, int width, int height) {
+   gl_packed_image last = glPackedImages(format, width, height).back();
+   return (last.first_word + glPackedWords(format, last.width, last.height)) * sizeof(GLuint);
+}
+
+// The suffix of GPU outputs, the 10-bit container unless a packing says otherwise
+inline string glOutputSuffix() {
+   if (glPackFormat() == GL_PACK_NONE)
+      return output10bitSuffix();
+   return gl_pack_layouts[glPackFormat()].suffix;
+}
+
+// Writes the packed files of a frame from its mapped or copied buffer
+bool writePackedImages(gl_pack_format format, const string &output, const void *bytes, int width, int height) {
+   const transfer_type transfer = selectedToneCurve(TRANSFER_SRGB).transfer;
+   bool written = true;
+   for (const gl_packed_image &image : glPackedImages(format, width, height)) {
+      string name = image.level ? pyramidOutputName(output, image.width, image.height) : output;
+      written &= writeImageFile(name.c_str(), glPackedHeader(format, image.width, image.height, transfer),
+                                (const char*)bytes + image.first_word * sizeof(GLuint), glPackedBytes(format, image.width, image.height));
    }
+   return written;
+}
 
-   // Perform shader program validation
-   glValidateProgram(computeShaderProgram);
+/* Persistent renderer
+ *
+ * Owns the EGL context, the linked programs, the quad and one set of frame
+ * targets per image size, so a sequence of frames only pays for upload,
+ * dispatch and readback. Targets for the last gl_pooled_sizes sizes are kept,
+ * the least recently used set is dropped beyond that.
+ */
+const size_t gl_pooled_sizes = 4;
+const int gl_pipeline_depth = 3;
+const int gl_upload_chunk_rows = 256;
+
+class GLRenderer
+{
+public:
+   explicit GLRenderer(egl_backend_type backend_type = EGL_BACKEND_AUTO, gl_workgroup_size workgroup = { 16, 16 },
+                       const string &cache_dir = defaultProgramCacheDir())
+      : workgroup(workgroup), cache_dir(cache_dir) {
+      backend = createEglBackend(backend_type);
+      if (!backend) {
+         fprintf(stderr, "Failed to set up an EGL backend\n");
+         return;
+      }
+      cout << "EGL backend: " << backend->name() << endl;
+
+      // GLES 3.1 only guarantees 128 invocations per workgroup
+      GLint max_invocations = 0, max_x = 0, max_y = 0;
+      glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &max_invocations);
+      glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &max_x);
+      glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 1, &max_y);
+      if ((GLint)(this->workgroup.x * this->workgroup.y) > max_invocations || (GLint)this->workgroup.x > max_x || (GLint)this->workgroup.y > max_y) {
+         fprintf(stderr, "Workgroup %ux%u exceeds the device limits, using 8x8\n", this->workgroup.x, this->workgroup.y);
+         this->workgroup = { 8, 8 };
+      }
+      convertShaderSource = withShaderDefines(cShader, workgroupDefines(this->workgroup));
+
+      // A packing replaces the quad and its render targets with one compute pass
+      const tone_curve curve = selectedToneCurve(TRANSFER_SRGB);
+      pack = glPackFormat();
+      if (pack == GL_PACK_NONE) {
+         toneMappingShaderSource = toneMappingFragmentShader(curve, toneLutSelection().enabled);
+         toneMappingShaderProgram = CreateProgram("tone-mapping", { { GL_VERTEX_SHADER, vShader }, { GL_FRAGMENT_SHADER, toneMappingShaderSource.c_str() } }, cache_dir);
+      } else {
+         packShaderSource = packedOutputShader(curve, toneLutSelection().enabled, pack);
+         string name = string("pack-") + gl_pack_layouts[pack].name;
+         packProgram = CreateProgram(name.c_str(), { { GL_COMPUTE_SHADER, packShaderSource.c_str() } }, cache_dir);
+      }
+      computeShaderProgram = CreateProgram("convert", { { GL_COMPUTE_SHADER, convertShaderSource.c_str() } }, cache_dir);
+      string histogram_source = "\n" + luminanceHistogramDefines() + statsHistogram + "\n" + glsl::luminance_histogram_source + "\n";
+      statsShaderSource = statsPrologue + histogram_source + statsMain;
+      statsShaderProgram = CreateProgram("stats", { { GL_COMPUTE_SHADER, statsShaderSource.c_str() } }, cache_dir);
+      statsFinalShaderSource = statsFinalPrologue + histogram_source + glsl::adaptation_source + "\n" +
+                               glsl::local_tone_source + "\n" + statsFinalMain;
+      statsFinalShaderProgram = CreateProgram("stats-final", { { GL_COMPUTE_SHADER, statsFinalShaderSource.c_str() } }, cache_dir);
+      if (!outputProgram() || !computeShaderProgram || !statsShaderProgram || !statsFinalShaderProgram)
+         return;
+
+      // Uniform block bindings are not part of a program binary, set them every time
+      glUniformBlockBinding(outputProgram(), glGetUniformBlockIndex(outputProgram(), "SceneStats"), 0);
+      packInvocationsLocation = glGetUniformLocation(packProgram, "invocations");
+      packFirstWordLocation = glGetUniformLocation(packProgram, "first_word");
+      partialCountLocation = glGetUniformLocation(statsFinalShaderProgram, "partial_count");
+      pixelCountLocation = glGetUniformLocation(statsFinalShaderProgram, "pixel_count");
+      adaptRateLocation = glGetUniformLocation(statsFinalShaderProgram, "adapt_rate");
+      hysteresisLocation = glGetUniformLocation(statsFinalShaderProgram, "hysteresis");
+      sampleStrideLocation = glGetUniformLocation(statsShaderProgram, "sample_stride");
+      collectHistogramLocation = glGetUniformLocation(statsShaderProgram, "collect_histogram");
+      finalCollectHistogramLocation = glGetUniformLocation(statsFinalShaderProgram, "collect_histogram");
+      whitePercentileLocation = glGetUniformLocation(statsFinalShaderProgram, "white_percentile");
+      localCompressionLocation = glGetUniformLocation(statsFinalShaderProgram, "local_compression");
+
+      if (pack == GL_PACK_NONE)
+         quad = CreateRectangle();
+
+      glGenBuffers(1, &sceneStatsBuffer);
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, sceneStatsBuffer);
+      glBufferData(GL_SHADER_STORAGE_BUFFER, 2 * sizeof(GLfloat), NULL, GL_DYNAMIC_COPY);
+
+      // Counting and last frame halves, the counting half starts cleared
+      const vector<GLuint> no_counts(2 * luminance_histogram_bins, 0);
+      glGenBuffers(1, &histogramBuffer);
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, histogramBuffer);
+      glBufferData(GL_SHADER_STORAGE_BUFFER, no_counts.size() * sizeof(GLuint), no_counts.data(), GL_DYNAMIC_COPY);
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+      if (toneLutSelection().enabled && !createToneLut(curve))
+         return;
+      if (localToneSettings().enabled && !createLocalTone())
+         return;
+      if (!pyramidSettings().levels.empty()) {
+         if (pyramidSettings().filter != PYRAMID_FILTER_BOX)
+            fprintf(stderr, "The GPU reduces the pyramid with the box filter\n");
+         pyramidShaderSource = withShaderDefines(pyramidShader, workgroupDefines(this->workgroup));
+         pyramidProgram = CreateProgram("pyramid", { { GL_COMPUTE_SHADER, pyramidShaderSource.c_str() } }, cache_dir);
+         if (!pyramidProgram)
+            return;
+      }
 
-   // Find and log errors if any from the validation process done above
-   glGetProgramiv(computeShaderProgram, GL_VALIDATE_STATUS, &result);
-   if (!result)
-   {
-      glGetProgramInfoLog(computeShaderProgram, sizeof(log), NULL, log);
-      printf("Error: Shader program validation failed, '%s'", log);
-      return;
+      gpuTimer.reset(new GpuTimer());
+      ready = true;
    }
 
-   glUseProgram(computeShaderProgram);
+   ~GLRenderer() {
+      if (!backend)
+         return;
+
+      for (frame_targets &targets : pool)
+         releaseTargets(targets);
+      if (ready) {
+         glDeleteVertexArrays(1, &quad.vao);
+         glDeleteBuffers(1, &quad.vbo);
+         glDeleteBuffers(1, &quad.ebo);
+         glDeleteBuffers(1, &sceneStatsBuffer);
+         glDeleteBuffers(1, &histogramBuffer);
+      }
+      glDeleteBuffers(1, &lutStateBuffer);
+      GLuint lut_textures[] = { toneTablesTexture, toneCubeTexture, gradeTexture };
+      glDeleteTextures(3, lut_textures);
+      glDeleteProgram(lutCheckProgram);
+      glDeleteProgram(lutBakeProgram);
+      glDeleteProgram(localSplatProgram);
+      glDeleteProgram(localBlurProgram);
+      glDeleteProgram(pyramidProgram);
+      glDeleteProgram(toneMappingShaderProgram);
+      glDeleteProgram(packProgram);
+      glDeleteProgram(computeShaderProgram);
+      glDeleteProgram(statsShaderProgram);
+      glDeleteProgram(statsFinalShaderProgram);
+      for (yuv_program &yuv : yuvPrograms)
+         glDeleteProgram(yuv.program);
+   }
 
-   /* Output texture for the compute shader */
-   glGenTextures(1, &convertedHdrTexture);
-   glBindTexture(GL_TEXTURE_2D, convertedHdrTexture);
+   bool valid() const { return ready; }
 
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+   // Output files of a packing, or 10-bit PPM read from the render targets
+   bool packed() const { return pack != GL_PACK_NONE; }
 
-   glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, width, height);
-   glBindTexture(GL_TEXTURE_2D, 0);
+   // Tone maps one frame into the output framebuffer of its size, which is
+   // left bound for readback
+   bool renderFrame(const Rgba *pixels, int width, int height) {
+      if (!uploadFrame(pixels, width, height))
+         return false;
 
-   /* Bind both input and output textures
-    * Note: In case of YUV data, upto 3 textures may need to be provided as inputs
-    * for multiple planes in the YUV data. In this case, the data is already in RGBA
-    * form, so given input is simply redirected to the ouput as it is.
-    */
-   glBindImageTexture(0, hdrTexture, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
-   glBindImageTexture(1, convertedHdrTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+      toneMapUploaded(width, height);
+      return true;
+   }
 
-   glDispatchCompute((unsigned int)width, (unsigned int)height, 1);
-   glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-}
+   // The three steps of renderFrame on their own, so they can be timed apart.
+   // Uploads one frame into the input texture of its size.
+   bool uploadFrame(const Rgba *pixels, int width, int height) {
+      if (!ready)
+         return false;
+
+      frame_targets &targets = targetsFor(width, height);
+      TraceScope trace("gl_upload");
+      trace.setBytes((size_t)width * height * sizeof(Rgba));
+      GpuTraceScope gpu_trace(gpuTimer.get(), "gl_upload", (size_t)width * height);
+
+      // Rgba is four tightly packed halfs, so the EXR buffer is uploaded as is
+      glBindTexture(GL_TEXTURE_2D, targets.hdrTexture);
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 8);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_HALF_FLOAT, pixels);
+      glBindTexture(GL_TEXTURE_2D, 0);
+      return true;
+   }
 
-// Function to save the rendered image to a file
-void gl_save_8bit_image(const char *filename, int width, int height) {
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        perror("Failed to open file for writing");
-        exit(EXIT_FAILURE);
-    }
+   // Tone maps the frame last uploaded at this size
+   void toneMapUploaded(int width, int height) {
+      dispatchFrame(targetsFor(width, height));
+   }
 
-    // Allocate buffer to read the pixels
-    GLubyte *pixels = (GLubyte*)malloc(width * height * 4);
-    if (!pixels) {
-        perror("Failed to allocate pixel buffer");
-        fclose(fp);
-        exit(EXIT_FAILURE);
-    }
+   // Reads the output framebuffer of this size back as 2_10_10_10 words
+   void readFrame(GLuint *pixels, int width, int height) {
+      TraceScope trace("gl_readback");
+      trace.setBytes((size_t)width * height * sizeof(GLuint));
+      glBindFramebuffer(GL_FRAMEBUFFER, targetsFor(width, height).outputFramebuffer);
+      glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV, pixels);
+   }
 
-    // Read the pixels from the framebuffer
-    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+   // Writes the last frame of this size and its pyramid levels. A packed
+   // buffer goes to disk as mapped; otherwise the render targets are read
+   // back and the full size output framebuffer is left bound.
+   bool saveFrame(int width, int height, const string &output) {
+      frame_targets &targets = targetsFor(width, height);
+      if (packed()) {
+         size_t size = glPackedBufferSize(pack, width, height);
+         TraceScope trace("gl_readback");
+         trace.setBytes(size);
+         glBindBuffer(GL_SHADER_STORAGE_BUFFER, targets.packedBuffer);
+         const void *bytes = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, size, GL_MAP_READ_BIT);
+         bool written = bytes && writePackedImages(pack, output, bytes, width, height);
+         if (bytes)
+            glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+         else
+            fprintf(stderr, "Failed to map the packed output of %s\n", output.c_str());
+         glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+         return written;
+      }
 
-    // Write the PPM header
-    fprintf(fp, "P6\n%d %d\n255\n", width, height);
+      bool written = gl_save_10bit_image(output.c_str(), width, height);
+      for (int level : glPyramidLevels(width, height)) {
+         int level_width, level_height;
+         pyramidLevelSize(width, height, level, level_width, level_height);
+         glBindFramebuffer(GL_FRAMEBUFFER, targets.levelFramebuffers[level]);
+         written &= gl_save_10bit_image(pyramidOutputName(output, level_width, level_height).c_str(), level_width, level_height);
+      }
+      glBindFramebuffer(GL_FRAMEBUFFER, targets.outputFramebuffer);
+      return written;
+   }
 
-    // Write pixel data to file
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            GLubyte *pixel = pixels + (y * width + x) * 4;
-            fwrite(pixel, 1, 3, fp);  // Only write RGB, skip A
-        }
-    }
+   // Copies the packed buffer of the last frame of this size, files in
+   // glPackedImages() order; this waits for the GPU
+   bool readPacked(void *bytes, int width, int height) {
+      size_t size = glPackedBufferSize(pack, width, height);
+      TraceScope trace("gl_readback");
+      trace.setBytes(size);
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, targetsFor(width, height).packedBuffer);
+      const void *mapped = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, size, GL_MAP_READ_BIT);
+      if (mapped) {
+         memcpy(bytes, mapped, size);
+         glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+      }
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+      return mapped != NULL;
+   }
 
-    fclose(fp);
-    free(pixels);
-}
+   // Decodes the file on a producer thread and uploads every chunk of rows as
+   // soon as it is ready, so decompression overlaps the upload of earlier rows
+   bool renderFile(RgbaInputFile &file) {
+      if (!ready)
+         return false;
+
+      ExrChunkReader reader(file);
+      int width = reader.width();
+      frame_targets &targets = targetsFor(width, reader.height());
+
+      glBindTexture(GL_TEXTURE_2D, targets.hdrTexture);
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 8);
+      {
+         TraceScope trace("gl_decode_upload");
+         trace.setPixels((size_t)width * reader.height());
+         GpuTraceScope gpu_trace(gpuTimer.get(), "gl_upload", (size_t)width * reader.height());
+
+         // glTexSubImage2D copies client memory before returning, so a chunk
+         // buffer can be handed back to the decoder right after
+         ChunkPrefetcher prefetcher(reader, lcm(gl_upload_chunk_rows, reader.rowGranularity()));
+         const Rgba *chunk;
+         int first_row, rows;
+         while (prefetcher.next(chunk, first_row, rows))
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first_row, width, rows, GL_RGBA, GL_HALF_FLOAT, chunk);
+      }
+      glBindTexture(GL_TEXTURE_2D, 0);
 
-// Function to save the rendered image to a file
-void gl_save_10bit_image(const char *filename, int width, int height) {   
-   // Allocate buffer to read the pixels
-   GLuint *pixels = (GLuint*)malloc(width * height * 4 * 4);
-   if (!pixels) {
-      perror("Failed to allocate pixel buffer");
-   //   fclose(fp);
-      exit(EXIT_FAILURE);
+      dispatchFrame(targets);
+      return true;
    }
 
-   // Read the pixels from the framebuffer
-   glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV, pixels);
+   // Converts a YUV frame to linear RGBA on the GPU and tone maps it like
+   // renderFrame does
+   bool renderYuvFrame(const yuv_frame &frame) {
+      if (!ready)
+         return false;
+
+      const yuv_program *yuv = yuvProgram(frame.format);
+      if (!yuv)
+         return false;
+
+      frame_targets &targets = targetsFor(frame.width, frame.height);
+      const yuv_format_layout &layout = yuv_layouts[frame.format];
+
+      // Plane textures are made on first use and follow the format of the size
+      if (targets.yuvFormat != (int)frame.format) {
+         glDeleteTextures(3, targets.yuvPlanes);
+         for (int p = 0; p < 3; ++p)
+            targets.yuvPlanes[p] = 0;
+
+         for (int p = 0; p < layout.plane_count; ++p) {
+            glGenTextures(1, &targets.yuvPlanes[p]);
+            glBindTexture(GL_TEXTURE_2D, targets.yuvPlanes[p]);
+            // Integer textures are only complete with GL_NEAREST
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexStorage2D(GL_TEXTURE_2D, 1, layout.planes[p].internal_format,
+                           yuvPlaneWidth(frame.format, p, frame.width), yuvPlaneHeight(frame.format, p, frame.height));
+         }
+         targets.yuvFormat = frame.format;
+      }
 
-   ofstream outputFile(filename);
-   outputFile << "P3\n" << width << ' ' << height << "\n1023\n";
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+      for (int p = 0; p < layout.plane_count; ++p) {
+         glActiveTexture(GL_TEXTURE0 + p);
+         glBindTexture(GL_TEXTURE_2D, targets.yuvPlanes[p]);
+         glPixelStorei(GL_UNPACK_ROW_LENGTH, frame.strides[p] / layout.planes[p].texel_bytes);
+         glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, yuvPlaneWidth(frame.format, p, frame.width), yuvPlaneHeight(frame.format, p, frame.height),
+                         layout.planes[p].format, layout.planes[p].type, frame.planes[p]);
+      }
+      glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+      float kr, kb, range[4], to_rec709[9];
+      yuvMatrixWeights(frame.matrix, kr, kb);
+      yuvRange(frame.format, frame.full_range, range);
+      yuvPrimariesToRec709(frame.matrix, to_rec709);
+
+      {
+         GpuTraceScope gpu_trace(gpuTimer.get(), "gl_yuv_convert", (size_t)frame.width * frame.height);
+         glUseProgram(yuv->program);
+         glUniform2f(yuv->krKbLocation, kr, kb);
+         glUniform4fv(yuv->rangeLocation, 1, range);
+         glUniformMatrix3fv(yuv->toRec709Location, 1, GL_FALSE, to_rec709);
+         glBindImageTexture(1, targets.convertedHdrTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+         glDispatchCompute((frame.width + workgroup.x - 1) / workgroup.x, (frame.height + workgroup.y - 1) / workgroup.y, 1);
+         glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+      }
 
-   // Write pixel data to file
-   for (int y = 0; y < height; y++) {
-      for (int x = 0; x < width; x++) {
-         GLuint *pixel = pixels + (y * width + x);
-         GLushort B = (*pixel >> 20) & 0x3FF;
-         GLushort G = (*pixel >> 10) & 0x3FF;
-         GLushort R = (*pixel >> 0) & 0x3FF;
+      glActiveTexture(GL_TEXTURE0);
+      toneMapConverted(targets);
+      return true;
+   }
 
-         outputFile << R << ' ' << G << ' ' << B << '\n';
+   /* Pipelined sequence mode
+    *
+    * Up to gl_pipeline_depth frames are in flight. While the GPU tone maps
+    * frame N, the host decodes frame N+1 straight into a mapped pixel unpack
+    * buffer, and frame N-2 is copied out of its pixel pack buffer once its
+    * fence has signalled. Unpacking and writing the PPM happen on the I/O
+    * thread. A frame that fails to decode is reported and skipped.
+    */
+   bool renderSequence(const vector<sequence_frame> &frames, const adaptation_settings &settings = adaptation_settings()) {
+      if (!ready)
+         return false;
+
+      // Running statistics from the first frame on
+      adaptation = settings;
+      sequence_index = 0;
+      statistics_primed = false;
+
+      WriteQueue writer;
+      pipeline_slot slots[gl_pipeline_depth] = {};
+      for (pipeline_slot &slot : slots) {
+         glGenBuffers(1, &slot.unpackBuffer);
+         glGenBuffers(1, &slot.packBuffer);
       }
+
+      // Frames the I/O thread failed to write, taken off the count once it drained
+      atomic<size_t> failed(0);
+      size_t written = 0, pixels = 0;
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+      for (size_t i = 0; i < frames.size(); ++i) {
+         pipeline_slot &slot = slots[i % gl_pipeline_depth];
+         if (slot.fence && retireSlot(slot, writer, failed)) {
+            ++written;
+            pixels += (size_t)slot.width * slot.height;
+         }
+
+         if (!decodeIntoSlot(slot, frames[i].input))
+            continue;
+
+         frame_targets &targets = targetsFor(slot.width, slot.height);
+
+         // Upload from the unpack buffer, the data pointer is an offset into it
+         {
+            GpuTraceScope gpu_trace(gpuTimer.get(), "gl_upload", (size_t)slot.width * slot.height);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.unpackBuffer);
+            glBindTexture(GL_TEXTURE_2D, targets.hdrTexture);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 8);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, slot.width, slot.height, GL_RGBA, GL_HALF_FLOAT, (void*)0);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+         }
+
+         // The pack buffer takes the packed files, or the readback of the render
+         // targets with the pyramid levels after the full size frame
+         GLsizeiptr output_size = (GLsizeiptr)slotBytes(slot);
+         glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.packBuffer);
+         if (slot.pack_capacity < output_size) {
+            glBufferData(GL_PIXEL_PACK_BUFFER, output_size, NULL, GL_STREAM_READ);
+            slot.pack_capacity = output_size;
+         }
+         glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+         dispatchFrame(targets, slot.packBuffer);
+
+         // Queue the readback, this does not wait for the GPU
+         if (!packed())
+            readTargets(targets, slot.packBuffer);
+
+         slot.output = frames[i].output;
+         slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+         glFlush();
+      }
+
+      // Retire what is still in flight, oldest first
+      for (size_t i = frames.size(); i < frames.size() + gl_pipeline_depth; ++i) {
+         pipeline_slot &slot = slots[i % gl_pipeline_depth];
+         if (slot.fence && retireSlot(slot, writer, failed)) {
+            ++written;
+            pixels += (size_t)slot.width * slot.height;
+         }
+      }
+      writer.drain();
+      written -= failed;
+
+      double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      cout << "Tone mapped " << written << " of " << frames.size() << " frames in " << seconds << "s ("
+           << written / seconds << " fps, " << pixels / 1e6 / seconds << " MP/s)" << endl;
+
+      for (pipeline_slot &slot : slots) {
+         glDeleteBuffers(1, &slot.unpackBuffer);
+         glDeleteBuffers(1, &slot.packBuffer);
+      }
+      adaptation = adaptation_settings();
+      return written == frames.size();
    }
 
-   outputFile.close();
-   free(pixels);
-}
+   // Maps the two statistics of the last frame, this waits for the GPU
+   bool sceneStatistics(float &max_brightness, float &avg_brightness) {
+      glBindBuffer(GL_UNIFORM_BUFFER, sceneStatsBuffer);
+      GLfloat *scene_stats = (GLfloat*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, 2 * sizeof(GLfloat), GL_MAP_READ_BIT);
+      if (scene_stats) {
+         avg_brightness = scene_stats[0];
+         max_brightness = scene_stats[1];
+         glUnmapBuffer(GL_UNIFORM_BUFFER);
+      }
+      glBindBuffer(GL_UNIFORM_BUFFER, 0);
+      return scene_stats != NULL;
+   }
 
-bool gl_render_scene(RgbaInputFile &file, int width, int height) {
-   // Open the DRM device
-   int drm_fd = open("/dev/dri/renderD128", O_RDWR);
-   if (drm_fd < 0) {
-      perror("Failed to open DRM device");
-      return EXIT_FAILURE;
-   }
-
-   // Create a GBM device
-   struct gbm_device *gbm = gbm_create_device(drm_fd);
-   if (!gbm) {
-      perror("Failed to create GBM device");
-      close(drm_fd);
-      return EXIT_FAILURE;
-   }
-
-   // Create a GBM surface
-   struct gbm_surface *surface = gbm_surface_create(gbm, width, height, GBM_FORMAT_XRGB2101010, GBM_BO_USE_RENDERING);
-   if (!surface) {
-      perror("Failed to create GBM surface");
-      gbm_device_destroy(gbm);
-      close(drm_fd);
-      return EXIT_FAILURE;
-   }
-
-   // Get an EGL display connection
-   EGLDisplay egl_display = eglGetDisplay(gbm);
-   if (egl_display == EGL_NO_DISPLAY) {
-      perror("Failed to get EGL display");
-      gbm_surface_destroy(surface);
-      gbm_device_destroy(gbm);
-      close(drm_fd);
-      return EXIT_FAILURE;
-   }
-
-   // Initialize the EGL display connection
-   if (!eglInitialize(egl_display, NULL, NULL)) {
-      perror("Failed to initialize EGL");
-      eglTerminate(egl_display);
-      gbm_surface_destroy(surface);
-      gbm_device_destroy(gbm);
-      close(drm_fd);
-      return EXIT_FAILURE;
-   }
-
-   // Choose an appropriate EGL configuration
-   EGLint config_attribs[] = {
-      EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
-      EGL_RED_SIZE, 10,
-      EGL_GREEN_SIZE, 10,
-      EGL_BLUE_SIZE, 10,
-      EGL_ALPHA_SIZE, 2,
-      EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
-      EGL_NONE
-   };
+   // Maps the luminance histogram of the last measured frame, all zero when
+   // none was collected; this waits for the GPU
+   bool luminanceHistogram(vector<uint32_t> &histogram) {
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, histogramBuffer);
+      const GLuint *counts = (const GLuint*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, luminance_histogram_bins * sizeof(GLuint),
+                                                             luminance_histogram_bins * sizeof(GLuint), GL_MAP_READ_BIT);
+      if (counts) {
+         histogram.assign(counts, counts + luminance_histogram_bins);
+         glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+      }
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+      return counts != NULL;
+   }
 
-   EGLConfig config;
-   EGLint num_configs;
-   if (!eglChooseConfig(egl_display, config_attribs, &config, 1, &num_configs)) {
-      perror("Failed to choose EGL config");
-      eglTerminate(egl_display);
-      gbm_surface_destroy(surface);
-      gbm_device_destroy(gbm);
-      close(drm_fd);
-      return EXIT_FAILURE;
-   }
-
-   if (!eglBindAPI(EGL_OPENGL_ES_API)) {
-         perror("Failed to OpenGL ES API");
-         eglTerminate(egl_display);
-         gbm_surface_destroy(surface);
-         gbm_device_destroy(gbm);
-         close(drm_fd);
-         return EXIT_FAILURE;
+private:
+   struct pipeline_slot
+   {
+      GLuint unpackBuffer, packBuffer;
+      GLsizeiptr unpack_capacity, pack_capacity;
+      GLsync fence;
+      int width, height;
+      string output;
    };
 
-   // Create an EGL context
-   EGLint context_attribs[] = {
-        EGL_CONTEXT_CLIENT_VERSION, 3,
-        EGL_NONE
+   // Bytes read back for a slot: the packed files, or 2_10_10_10 words of the
+   // full size frame and its pyramid levels
+   size_t slotBytes(const pipeline_slot &slot) const {
+      if (packed())
+         return glPackedBufferSize(pack, slot.width, slot.height);
+
+      size_t count = (size_t)slot.width * slot.height;
+      for (int level : glPyramidLevels(slot.width, slot.height)) {
+         int level_width, level_height;
+         pyramidLevelSize(slot.width, slot.height, level, level_width, level_height);
+         count += (size_t)level_width * level_height;
+      }
+      return count * sizeof(GLuint);
+   }
+
+   // Decodes an EXR file into the slot's unpack buffer, growing it if needed
+   bool decodeIntoSlot(pipeline_slot &slot, const string &input) {
+      TraceScope trace("exr_decode");
+      try {
+         traceFileRead(input.c_str());
+         RgbaInputFile file(input.c_str());
+         readEXRMetadata(file, slot.width, slot.height);
+         trace.setPixels((size_t)slot.width * slot.height);
+         trace.setBytes((size_t)slot.width * slot.height * sizeof(Rgba));
+
+         GLsizeiptr input_size = (GLsizeiptr)slot.width * slot.height * sizeof(Rgba);
+         glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.unpackBuffer);
+         if (slot.unpack_capacity < input_size) {
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, input_size, NULL, GL_STREAM_DRAW);
+            slot.unpack_capacity = input_size;
+         }
+
+         // The previous upload from this buffer finished before its fence signalled
+         Rgba *pixels = (Rgba*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, input_size,
+                                                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+         bool mapped = pixels != NULL;
+         if (mapped) {
+            try {
+               readPixels(file, pixels, slot.width, slot.height);
+            } catch (...) {
+               glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+               glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+               throw;
+            }
+            mapped = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+         }
+         glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+         if (!mapped)
+            fprintf(stderr, "Failed to map the unpack buffer for %s\n", input.c_str());
+         return mapped;
+      } catch (const exception &e) {
+         fprintf(stderr, "Failed to decode %s: %s\n", input.c_str(), e.what());
+         return false;
+      }
+   }
+
+   // Waits for the slot's frame, copies it out of the pack buffer and hands
+   // it to the I/O thread, which counts the frame into failed if it cannot
+   // write it. Returns false when the frame was lost before that.
+   bool retireSlot(pipeline_slot &slot, WriteQueue &writer, atomic<size_t> &failed) {
+      size_t size = slotBytes(slot);
+      TraceScope trace("gl_readback");
+      trace.setBytes(size);
+
+      GLenum status;
+      do {
+         status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000);
+      } while (status == GL_TIMEOUT_EXPIRED);
+      glDeleteSync(slot.fence);
+      slot.fence = 0;
+
+      if (status == GL_WAIT_FAILED) {
+         fprintf(stderr, "Failed to wait for %s\n", slot.output.c_str());
+         return false;
+      }
+
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.packBuffer);
+      const void *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+      if (!mapped) {
+         glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+         fprintf(stderr, "Failed to map the pack buffer for %s\n", slot.output.c_str());
+         return false;
+      }
+      // The copy lives in a pooled buffer that returns once the I/O thread wrote it
+      shared_ptr<GLuint> pixels = imageBufferPool().acquire<GLuint>(size / sizeof(GLuint));
+      memcpy(pixels.get(), mapped, size);
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+      int width = slot.width, height = slot.height;
+      string output = slot.output;
+      // Packed files are written as they are, render targets are unpacked first
+      if (packed()) {
+         gl_pack_format format = pack;
+         writer.push([pixels, width, height, output, format, &failed] {
+            if (!writePackedImages(format, output, pixels.get(), width, height))
+               ++failed;
+         });
+         return true;
+      }
+      writer.push([pixels, width, height, output, &failed] {
+         bool written = gl_write_10bit_pixels(output.c_str(), pixels.get(), width, height);
+         const GLuint *level_pixels = pixels.get() + (size_t)width * height;
+         for (int level : glPyramidLevels(width, height)) {
+            int level_width, level_height;
+            pyramidLevelSize(width, height, level, level_width, level_height);
+            written &= gl_write_10bit_pixels(pyramidOutputName(output, level_width, level_height).c_str(), level_pixels,
+                                             level_width, level_height);
+            level_pixels += (size_t)level_width * level_height;
+         }
+         if (!written)
+            ++failed;
+      });
+      return true;
+   }
+
+   struct yuv_program
+   {
+      GLuint program;
+      GLint krKbLocation, rangeLocation, toRec709Location;
    };
 
-   EGLContext context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, context_attribs);
-   if (context == EGL_NO_CONTEXT) {
-      perror("Failed to create EGL context");
-      eglTerminate(egl_display);
-      gbm_surface_destroy(surface);
-      gbm_device_destroy(gbm);
-      close(drm_fd);
-      return EXIT_FAILURE;
-   }
-
-   // Create an EGL window surface
-   EGLSurface egl_surface = eglCreateWindowSurface(egl_display, config, (EGLNativeWindowType)surface, NULL);
-   if (egl_surface == EGL_NO_SURFACE) {
-      perror("Failed to create EGL surface");
-      eglDestroyContext(egl_display, context);
-      eglTerminate(egl_display);
-      gbm_surface_destroy(surface);
-      gbm_device_destroy(gbm);
-      close(drm_fd);
-      return EXIT_FAILURE;
-   }
-
-   // Make the context and surface current
-   if (!eglMakeCurrent(egl_display, egl_surface, egl_surface, context)) {
-      perror("Failed to make EGL context current");
-      eglDestroySurface(egl_display, egl_surface);
-      eglDestroyContext(egl_display, context);
-      eglTerminate(egl_display);
-      gbm_surface_destroy(surface);
-      gbm_device_destroy(gbm);
-      close(drm_fd);
-      return EXIT_FAILURE;
-   }
-
-   // Set up the viewport
-   glViewport(0, 0, width, height);
-   CreateRectangle();
-   CompileShaderProgram();
-
-   Array2D<Rgba> hdr_pixels(height, width);
-   readPixels(file, hdr_pixels, width, height);
-   LoadHDRTexture(width, height, hdr_pixels);
-   RunComputeShader(width, height);
-
-   glBindTexture(GL_TEXTURE_2D, convertedHdrTexture);
-
-   /* Read the converted texture for avg scene brightness and max scene brightness */
-   GLfloat compute_converted_pixels[width * height * 4];
-   GLuint fbo;
-
-   glGenFramebuffers(1, &fbo); 
-   glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-   glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, convertedHdrTexture, 0);
-   glReadPixels(0, 0, width, height, GL_RGBA, GL_FLOAT, compute_converted_pixels);
-   glBindFramebuffer(GL_FRAMEBUFFER, 0);
-   glDeleteFramebuffers(1, &fbo);
-
-   double totalLuminance = 0.0;
-   float max_scene_brightness = std::numeric_limits<float>::min();
-
-   for (int i = 0; i < width * height * 4; i = i + 4)
+   // Builds the ingest program of a YUV format on first use
+   const yuv_program *yuvProgram(yuv_format format) {
+      yuv_program &yuv = yuvPrograms[format];
+      if (yuv.program)
+         return &yuv;
+
+      const yuv_format_layout &layout = yuv_layouts[format];
+      string source = withShaderDefines(yuvShader, workgroupDefines(workgroup) + "#define " + layout.define + "\n");
+      string name = string("yuv-") + layout.name;
+      yuv.program = CreateProgram(name.c_str(), { { GL_COMPUTE_SHADER, source.c_str() } }, cache_dir);
+      if (!yuv.program)
+         return NULL;
+
+      yuv.krKbLocation = glGetUniformLocation(yuv.program, "kr_kb");
+      yuv.rangeLocation = glGetUniformLocation(yuv.program, "range");
+      yuv.toRec709Location = glGetUniformLocation(yuv.program, "to_rec709");
+
+      // Plane p is sampled from texture unit p
+      const char *samplers[] = { "luma_plane", format == YUV_I420 ? "cb_plane" : "chroma_plane", "cr_plane" };
+      glUseProgram(yuv.program);
+      for (int p = 0; p < layout.plane_count; ++p)
+         glUniform1i(glGetUniformLocation(yuv.program, samplers[p]), p);
+      glUseProgram(0);
+      return &yuv;
+   }
+
+   struct frame_targets
    {
-      float lum = 0.2126f * compute_converted_pixels[i] +
-                  0.7152f * compute_converted_pixels[i + 1] +
-                  0.0722f * compute_converted_pixels[i + 2];
+      int width, height;
+      unsigned long last_used;
+      GLuint hdrTexture, convertedHdrTexture, outputTexture, outputFramebuffer, statsPartialsBuffer;
+      GLuint groups_x, groups_y;
+      GLuint yuvPlanes[3];
+      int yuvFormat;
+      GLuint localCellsBuffers[2], localGridTexture;   // zero without the local operator
+      GLint local_width, local_height;
+      int pyramid_depth;   // mip levels below the full size, 0 without a pyramid
+      GLuint levelTextures[pyramid_max_level + 1], levelFramebuffers[pyramid_max_level + 1];   // zero unless selected
+      GLuint packedBuffer;   // the output files of a packing, which has no render targets
+   };
+
+   frame_targets &targetsFor(int width, int height) {
+      ++frame_counter;
+      for (frame_targets &targets : pool) {
+         if (targets.width == width && targets.height == height) {
+            targets.last_used = frame_counter;
+            return targets;
+         }
+      }
+
+      if (pool.size() >= gl_pooled_sizes) {
+         vector<frame_targets>::iterator oldest = min_element(pool.begin(), pool.end(),
+            [](const frame_targets &a, const frame_targets &b) { return a.last_used < b.last_used; });
+         releaseTargets(*oldest);
+         pool.erase(oldest);
+      }
+
+      frame_targets targets;
+      targets.width = width;
+      targets.height = height;
+      targets.last_used = frame_counter;
+      targets.yuvPlanes[0] = targets.yuvPlanes[1] = targets.yuvPlanes[2] = 0;
+      targets.yuvFormat = -1;
+      targets.localCellsBuffers[0] = targets.localCellsBuffers[1] = targets.localGridTexture = 0;
+      targets.local_width = localGridSize(width);
+      targets.local_height = localGridSize(height);
+      vector<int> levels = glPyramidLevels(width, height);
+      targets.pyramid_depth = levels.empty() ? 0 : levels.back();
+      for (int level = 0; level <= pyramid_max_level; ++level)
+         targets.levelTextures[level] = targets.levelFramebuffers[level] = 0;
+
+      glGenTextures(1, &targets.hdrTexture);
+      glBindTexture(GL_TEXTURE_2D, targets.hdrTexture);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA16F, width, height);
+
+      // The quad maps texels 1:1 to pixels, and RGBA32F is not filterable on
+      // plain GLES 3.x, so sample with GL_NEAREST to keep the texture complete.
+      // Pyramid levels are drawn from its mip levels through the base level.
+      glGenTextures(1, &targets.convertedHdrTexture);
+      glBindTexture(GL_TEXTURE_2D, targets.convertedHdrTexture);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glTexStorage2D(GL_TEXTURE_2D, 1 + targets.pyramid_depth, GL_RGBA32F, width, height);
+
+      // Render into a 10-bit texture instead of a window surface, or pack the
+      // output files into a buffer
+      targets.outputTexture = targets.outputFramebuffer = targets.packedBuffer = 0;
+      if (packed()) {
+         glGenBuffers(1, &targets.packedBuffer);
+         glBindBuffer(GL_SHADER_STORAGE_BUFFER, targets.packedBuffer);
+         glBufferData(GL_SHADER_STORAGE_BUFFER, glPackedBufferSize(pack, width, height), NULL, GL_STREAM_READ);
+         glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+         levels.clear();
+      } else {
+         glGenTextures(1, &targets.outputTexture);
+         glBindTexture(GL_TEXTURE_2D, targets.outputTexture);
+         glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGB10_A2, width, height);
+         glBindTexture(GL_TEXTURE_2D, 0);
+
+         glGenFramebuffers(1, &targets.outputFramebuffer);
+         glBindFramebuffer(GL_FRAMEBUFFER, targets.outputFramebuffer);
+         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, targets.outputTexture, 0);
+         if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            fprintf(stderr, "Output framebuffer is incomplete\n");
+      }
+
+      // A 10-bit output per selected pyramid level
+      for (int level : levels) {
+         int level_width, level_height;
+         pyramidLevelSize(width, height, level, level_width, level_height);
+         glGenTextures(1, &targets.levelTextures[level]);
+         glBindTexture(GL_TEXTURE_2D, targets.levelTextures[level]);
+         glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGB10_A2, level_width, level_height);
+         glBindTexture(GL_TEXTURE_2D, 0);
+
+         glGenFramebuffers(1, &targets.levelFramebuffers[level]);
+         glBindFramebuffer(GL_FRAMEBUFFER, targets.levelFramebuffers[level]);
+         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, targets.levelTextures[level], 0);
+         if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            fprintf(stderr, "Pyramid framebuffer %d is incomplete\n", level);
+      }
+
+      // One partial per 16x16 tile for the statistics reduction
+      targets.groups_x = (width + 15) / 16;
+      targets.groups_y = (height + 15) / 16;
+      glGenBuffers(1, &targets.statsPartialsBuffer);
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, targets.statsPartialsBuffer);
+      glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)targets.groups_x * targets.groups_y * 2 * sizeof(GLfloat), NULL, GL_DYNAMIC_COPY);
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+      // Splatted and half blurred cells, then the slicing texture of the local operator
+      if (localSplatProgram) {
+         GLsizeiptr cells_size = (GLsizeiptr)targets.local_width * targets.local_height * local_grid_depth * 2 * sizeof(GLfloat);
+         glGenBuffers(2, targets.localCellsBuffers);
+         for (GLuint buffer : targets.localCellsBuffers) {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, cells_size, NULL, GL_DYNAMIC_COPY);
+         }
+         glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+         // RGBA32F is not filterable, the slice fetches the nodes itself
+         glGenTextures(1, &targets.localGridTexture);
+         glBindTexture(GL_TEXTURE_3D, targets.localGridTexture);
+         glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+         glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+         glTexStorage3D(GL_TEXTURE_3D, 1, GL_RGBA32F, local_grid_depth, targets.local_width, targets.local_height);
+         glBindTexture(GL_TEXTURE_3D, 0);
+      }
+
+      pool.push_back(targets);
+      return pool.back();
+   }
 
-      if (lum > max_scene_brightness)
-         max_scene_brightness = lum;
-      
-      totalLuminance += log(lum);
+   // Queues the readback of the render targets into a pack buffer, the full
+   // size frame first, then the pyramid levels
+   void readTargets(const frame_targets &targets, GLuint buffer) {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+      glReadPixels(0, 0, targets.width, targets.height, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV, (void*)0);
+      size_t offset = (size_t)targets.width * targets.height * sizeof(GLuint);
+      for (int level : glPyramidLevels(targets.width, targets.height)) {
+         int level_width, level_height;
+         pyramidLevelSize(targets.width, targets.height, level, level_width, level_height);
+         glBindFramebuffer(GL_FRAMEBUFFER, targets.levelFramebuffers[level]);
+         glReadPixels(0, 0, level_width, level_height, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV, (void*)offset);
+         offset += (size_t)level_width * level_height * sizeof(GLuint);
+      }
+      glBindFramebuffer(GL_FRAMEBUFFER, targets.outputFramebuffer);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
    }
 
-   float avg_scene_brightness = static_cast<float>(exp(totalLuminance / (width * height)));
-   cout << "Maximum Scene Brightness: " << max_scene_brightness << endl;
-   cout << "Average Scene Brightness: " << avg_scene_brightness << endl;
+   void releaseTargets(frame_targets &targets) {
+      glDeleteFramebuffers(1, &targets.outputFramebuffer);
+      GLuint textures[] = { targets.hdrTexture, targets.convertedHdrTexture, targets.outputTexture };
+      glDeleteTextures(3, textures);
+      glDeleteTextures(3, targets.yuvPlanes);
+      glDeleteBuffers(1, &targets.statsPartialsBuffer);
+      glDeleteBuffers(2, targets.localCellsBuffers);
+      glDeleteTextures(1, &targets.localGridTexture);
+      glDeleteFramebuffers(pyramid_max_level + 1, targets.levelFramebuffers);
+      glDeleteTextures(pyramid_max_level + 1, targets.levelTextures);
+      glDeleteBuffers(1, &targets.packedBuffer);
+   }
 
-   // Clear the window
-   glClearColor(0.3f, 0.5f, 0.6f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT);
+   // Converts the uploaded EXR frame and tone maps it, packing it into
+   // packed_output instead of the buffer of its targets when one is given
+   void dispatchFrame(frame_targets &targets, GLuint packed_output = 0) {
+      int width = targets.width, height = targets.height;
+
+      /* Bind both input and output textures
+       * The EXR data is already linear RGBA, so the input is copied to the
+       * output as it is. YUV frames take the yuvShader path in renderYuvFrame.
+       */
+      {
+         GpuTraceScope gpu_trace(gpuTimer.get(), "gl_convert", (size_t)width * height);
+         glUseProgram(computeShaderProgram);
+         glBindImageTexture(0, targets.hdrTexture, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA16F);
+         glBindImageTexture(1, targets.convertedHdrTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+         glDispatchCompute((width + workgroup.x - 1) / workgroup.x, (height + workgroup.y - 1) / workgroup.y, 1);
+         glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+      }
 
-      // Activate the required shader for drawing
-      glUseProgram(toneMappingShaderProgram);
-         // Bind the required object's VAO
-         glBindVertexArray(VAO);
-         glBindBuffer(GL_ARRAY_BUFFER, VBO);
-         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+      toneMapConverted(targets, packed_output);
+   }
 
-            // Perform the draw call to initialise the pipeline
+   // Reduces the statistics of the converted frame and draws it into the
+   // output framebuffer, which stays bound, then its pyramid levels into
+   // theirs. With a packing the frame and its levels go into a buffer instead.
+   void toneMapConverted(frame_targets &targets, GLuint packed_output = 0) {
+      int width = targets.width, height = targets.height;
+      traceCount("pixels_tone_mapped", (size_t)width * height);
+
+      // Frames between measurements of a sequence keep the last statistics
+      if (!statistics_primed || measuresStatistics(adaptation, sequence_index))
+         computeSceneStatistics(targets);
+      ++sequence_index;
+      if (lutBakeProgram)
+         bakeToneLut();
+      // The base layer is spatial, every frame needs its own
+      if (localSplatProgram)
+         buildLocalGrid(targets);
+      if (targets.pyramid_depth)
+         reducePyramid(targets);
+
+      // Feed the statistics to the tone mapping program straight from the GPU buffer
+      glBindBufferBase(GL_UNIFORM_BUFFER, 0, sceneStatsBuffer);
+      glUseProgram(outputProgram());
+      if (lutBakeProgram) {
+         glActiveTexture(GL_TEXTURE1);
+         glBindTexture(GL_TEXTURE_2D, toneTablesTexture);
+         glActiveTexture(GL_TEXTURE2);
+         glBindTexture(GL_TEXTURE_3D, toneCubeTexture);
+      }
+      if (localSplatProgram) {
+         glActiveTexture(GL_TEXTURE4);
+         glBindTexture(GL_TEXTURE_3D, targets.localGridTexture);
+      }
+      glActiveTexture(GL_TEXTURE0);
+
+      if (packed())
+         packOutput(targets, packed_output ? packed_output : targets.packedBuffer);
+      else
+         drawOutput(targets);
+      glUseProgram(0);
+   }
+
+   // Draws the frame and every selected pyramid level into their render
+   // targets, sampling a level as the base level of the converted texture
+   void drawOutput(frame_targets &targets) {
+      GpuTraceScope gpu_trace(gpuTimer.get(), "gl_draw", (size_t)targets.width * targets.height);
+      glBindTexture(GL_TEXTURE_2D, targets.convertedHdrTexture);
+      glBindVertexArray(quad.vao);
+
+      glBindFramebuffer(GL_FRAMEBUFFER, targets.outputFramebuffer);
+      glViewport(0, 0, targets.width, targets.height);
+      glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+
+      if (targets.pyramid_depth) {
+         for (int level : glPyramidLevels(targets.width, targets.height)) {
+            int level_width, level_height;
+            pyramidLevelSize(targets.width, targets.height, level, level_width, level_height);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+            glUniform1f(localLevelScaleLocation, (GLfloat)(1 << level));
+            glBindFramebuffer(GL_FRAMEBUFFER, targets.levelFramebuffers[level]);
+            glViewport(0, 0, level_width, level_height);
             glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+         }
+
+         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+         glUniform1f(localLevelScaleLocation, 1.0f);
+         glBindFramebuffer(GL_FRAMEBUFFER, targets.outputFramebuffer);
+         glViewport(0, 0, targets.width, targets.height);
+      }
+      glBindVertexArray(0);
+   }
+
+   // Tone maps the frame and every selected pyramid level straight into the
+   // bytes of their output files, see packMain
+   void packOutput(const frame_targets &targets, GLuint buffer) {
+      GpuTraceScope gpu_trace(gpuTimer.get(), "gl_pack", (size_t)targets.width * targets.height);
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, buffer);
+
+      for (const gl_packed_image &image : glPackedImages(pack, targets.width, targets.height)) {
+         // Wide enough a grid for 8K frames within the guaranteed 65535 groups per axis
+         size_t invocations = glPackInvocations(pack, image.width, image.height);
+         GLuint groups = (GLuint)((invocations + 63) / 64);
+         GLuint groups_x = min(groups, 1024u), groups_y = (groups + groups_x - 1) / groups_x;
+
+         glBindImageTexture(0, targets.convertedHdrTexture, image.level, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+         glUniform1ui(packInvocationsLocation, (GLuint)invocations);
+         glUniform1ui(packFirstWordLocation, (GLuint)image.first_word);
+         glUniform1f(localLevelScaleLocation, (GLfloat)(1 << image.level));
+         glDispatchCompute(groups_x, groups_y, 1);
+      }
+      glUniform1f(localLevelScaleLocation, 1.0f);
+      glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT | GL_PIXEL_BUFFER_BARRIER_BIT);
+   }
+
+   // Fills the mip chain of the converted frame down to the deepest selected level
+   void reducePyramid(frame_targets &targets) {
+      GpuTraceScope gpu_trace(gpuTimer.get(), "gl_pyramid", (size_t)targets.width * targets.height / 3);
+
+      glUseProgram(pyramidProgram);
+      for (int level = 1; level <= targets.pyramid_depth; ++level) {
+         int level_width, level_height;
+         pyramidLevelSize(targets.width, targets.height, level, level_width, level_height);
+         glBindImageTexture(0, targets.convertedHdrTexture, level - 1, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+         glBindImageTexture(1, targets.convertedHdrTexture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+         glDispatchCompute((level_width + workgroup.x - 1) / workgroup.x, (level_height + workgroup.y - 1) / workgroup.y, 1);
+         glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+      }
+      glUseProgram(0);
+   }
+
+   // Reduces the converted texture to the log-average and white luminance,
+   // leaving them in sceneStatsBuffer for the tone mapping pass. In a
+   // sequence they are sampled with the stride and adapted there.
+   void computeSceneStatistics(const frame_targets &targets) {
+      const histogram_settings &histogram = histogramSettings();
+      bool collect = collectsHistogram(histogram);
+      int stride = adaptation.stats_stride;
+      GLuint grid_x = (targets.width + stride - 1) / stride, grid_y = (targets.height + stride - 1) / stride;
+      GLuint groups_x = (grid_x + 15) / 16, groups_y = (grid_y + 15) / 16;
+      GpuTraceScope gpu_trace(gpuTimer.get(), "gl_statistics", (size_t)grid_x * grid_y);
+
+      // Pass 1: one partial per 16x16 tile of samples
+      glUseProgram(statsShaderProgram);
+      glUniform1i(sampleStrideLocation, stride);
+      glUniform1i(collectHistogramLocation, collect);
+      glBindImageTexture(0, targets.convertedHdrTexture, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, targets.statsPartialsBuffer);
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, histogramBuffer);
+      glDispatchCompute(groups_x, groups_y, 1);
+      glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+      // Pass 2: fold the partials in a single workgroup, the first
+      // measurement replaces whatever the buffer held
+      glUseProgram(statsFinalShaderProgram);
+      glUniform1ui(partialCountLocation, groups_x * groups_y);
+      glUniform1f(pixelCountLocation, (GLfloat)grid_x * grid_y);
+      glUniform1f(adaptRateLocation, statistics_primed ? adaptationRate(adaptation, adaptation.stats_interval) : 1.0f);
+      glUniform1f(hysteresisLocation, adaptation.hysteresis);
+      glUniform1i(finalCollectHistogramLocation, collect);
+      glUniform1f(whitePercentileLocation, histogram.white_percentile);
+      glUniform1f(localCompressionLocation, localToneSettings().enabled ? localToneSettings().compression : 1.0f);
+      statistics_primed = true;
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, sceneStatsBuffer);
+      glDispatchCompute(1, 1, 1);
+      glMemoryBarrier(GL_UNIFORM_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+      glUseProgram(0);
+   }
+
+   // Builds the LUT programs and textures. The grade of a per channel or
+   // luminance curve is uploaded once as the cube; a general curve gets its
+   // cube from the bake, which samples the grade from its own texture.
+   bool createToneLut(const tone_curve &curve) {
+      const tone_lut_selection &selection = toneLutSelection();
+      bool grade = !selection.grade.empty();
+      bakeCube = toneLutShape(curve) == TONE_SHAPE_GENERAL;
+
+      lutBakeShaderSource = toneLutBakeShader(curve);
+      lutCheckProgram = CreateProgram("lut-check", { { GL_COMPUTE_SHADER, lutCheckShader } }, cache_dir);
+      lutBakeProgram = CreateProgram("lut-bake", { { GL_COMPUTE_SHADER, lutBakeShaderSource.c_str() } }, cache_dir);
+      if (!lutCheckProgram || !lutBakeProgram)
+         return false;
+
+      // One invocation per table entry and per cube node
+      size_t invocations = tone_lut_table_size + (bakeCube ? (size_t)selection.cube_size * selection.cube_size * selection.cube_size : 0);
+      glUseProgram(lutCheckProgram);
+      glUniform1ui(glGetUniformLocation(lutCheckProgram, "bake_groups"), (GLuint)((invocations + 63) / 64));
+      glUseProgram(lutBakeProgram);
+      glUniform1i(glGetUniformLocation(lutBakeProgram, "grade_cube"), 3);
+      glUseProgram(outputProgram());
+      glUniform1i(glGetUniformLocation(outputProgram(), "toneTables"), 1);
+      glUniform1i(glGetUniformLocation(outputProgram(), "toneCube"), 2);
+      glUseProgram(0);
+
+      // Nothing baked yet, then an indirect dispatch of x by 1 by 1 groups
+      GLuint state[5] = { 0, 0, 0, 1, 1 };
+      glGenBuffers(1, &lutStateBuffer);
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, lutStateBuffer);
+      glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(state), state, GL_DYNAMIC_COPY);
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+      glGenTextures(1, &toneTablesTexture);
+      glBindTexture(GL_TEXTURE_2D, toneTablesTexture);
+      glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32F, tone_lut_row, 2 * tone_lut_binades);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glBindTexture(GL_TEXTURE_2D, 0);
+
+      if (bakeCube || grade)
+         toneCubeTexture = createCubeTexture(bakeCube ? selection.cube_size : selection.grade_size, bakeCube ? NULL : selection.grade.data());
+      if (bakeCube && grade)
+         gradeTexture = createCubeTexture(selection.grade_size, selection.grade.data());
+      return true;
+   }
+
+   // Builds the programs of the local operator, the grids come with the frame targets
+   bool createLocalTone() {
+      string constants = "\n" + luminanceHistogramDefines() + localToneDefines(localToneSettings()) +
+                         glsl::luminance_histogram_source + "\n";
+      localSplatShaderSource = localSplatPrologue + constants + localSplatMain;
+      localSplatProgram = CreateProgram("local-splat", { { GL_COMPUTE_SHADER, localSplatShaderSource.c_str() } }, cache_dir);
+      localBlurProgram = CreateProgram("local-blur", { { GL_COMPUTE_SHADER, localBlurShader } }, cache_dir);
+      if (!localSplatProgram || !localBlurProgram)
+         return false;
+
+      localGridSizeLocation = glGetUniformLocation(localBlurProgram, "grid_size");
+      localAxisLocation = glGetUniformLocation(localBlurProgram, "axis");
+      localScaleLocation = glGetUniformLocation(localBlurProgram, "scale");
+      glUseProgram(outputProgram());
+      glUniform1i(glGetUniformLocation(outputProgram(), "local_grid"), 4);
+      localLevelScaleLocation = glGetUniformLocation(outputProgram(), "local_scale");
+      glUniform1f(localLevelScaleLocation, 1.0f);
+      glUseProgram(0);
+      return true;
+   }
+
+   // Splats the converted frame into the bilateral grid of its size and blurs
+   // it into the slicing texture: z, then x, then y, as the CPU
+   void buildLocalGrid(const frame_targets &targets) {
+      GLuint width = targets.local_width, height = targets.local_height;
+      GLuint cells = width * height * local_grid_depth;
+      GpuTraceScope gpu_trace(gpuTimer.get(), "gl_local_grid", (size_t)targets.width * targets.height);
+
+      glUseProgram(localSplatProgram);
+      glBindImageTexture(0, targets.convertedHdrTexture, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, targets.localCellsBuffers[0]);
+      glDispatchCompute(width, height, 1);
+      glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+      glUseProgram(localBlurProgram);
+      glUniform3i(localGridSizeLocation, local_grid_depth, width, height);
+      glBindImageTexture(0, targets.localGridTexture, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+      for (int axis = 0; axis < 3; ++axis) {
+         glUniform1i(localAxisLocation, axis);
+         glUniform1f(localScaleLocation, axis == 2 ? 1.0f / (local_grid_cell * local_grid_cell) : 1.0f);
+         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, targets.localCellsBuffers[axis & 1]);
+         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, targets.localCellsBuffers[~axis & 1]);
+         glDispatchCompute((cells + 63) / 64, 1, 1);
+         glMemoryBarrier(axis == 2 ? GL_TEXTURE_FETCH_BARRIER_BIT : GL_SHADER_STORAGE_BARRIER_BIT);
+      }
+      glUseProgram(0);
+   }
+
+   // RGBA16F 3-D texture, filtered linearly, with optional RGBA float nodes
+   GLuint createCubeTexture(int size, const float *nodes) {
+      GLuint texture;
+      glGenTextures(1, &texture);
+      glBindTexture(GL_TEXTURE_3D, texture);
+      glTexStorage3D(GL_TEXTURE_3D, 1, GL_RGBA16F, size, size, size);
+      if (nodes)
+         glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, size, size, size, GL_RGBA, GL_FLOAT, nodes);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+      glBindTexture(GL_TEXTURE_3D, 0);
+      return texture;
+   }
+
+   // Rebakes the tables on the GPU when the scene maximum changed; the check
+   // leaves an empty indirect dispatch otherwise
+   void bakeToneLut() {
+      GpuTraceScope gpu_trace(gpuTimer.get(), "gl_lut_bake", 0);
+      glBindBufferBase(GL_UNIFORM_BUFFER, 0, sceneStatsBuffer);
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, lutStateBuffer);
+
+      glUseProgram(lutCheckProgram);
+      glDispatchCompute(1, 1, 1);
+      glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+      glUseProgram(lutBakeProgram);
+      glBindImageTexture(0, toneTablesTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+      if (bakeCube)
+         glBindImageTexture(1, toneCubeTexture, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+      if (gradeTexture) {
+         glActiveTexture(GL_TEXTURE3);
+         glBindTexture(GL_TEXTURE_3D, gradeTexture);
+         glActiveTexture(GL_TEXTURE0);
+      }
+      glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, lutStateBuffer);
+      glDispatchComputeIndirect(2 * sizeof(GLuint));
+      glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+      glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 
-         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-         glBindBuffer(GL_ARRAY_BUFFER, 0);
-            
-         // Unbinding just for completeness
-         glBindVertexArray(0);
-      // Deactivating shaders for completeness
       glUseProgram(0);
+   }
+
+   // Declared first so the context outlives every GL object released above
+   unique_ptr<EglBackend> backend;
+   unique_ptr<GpuTimer> gpuTimer;
+   bool ready = false;
+
+   gl_workgroup_size workgroup;
+   string cache_dir;
+   string convertShaderSource, toneMappingShaderSource, statsShaderSource, statsFinalShaderSource, lutBakeShaderSource;
+   string localSplatShaderSource, pyramidShaderSource, packShaderSource;
+   yuv_program yuvPrograms[3] = {};
+
+   GLuint toneMappingShaderProgram = 0, computeShaderProgram = 0, statsShaderProgram = 0, statsFinalShaderProgram = 0;
+   GLint partialCountLocation = -1, pixelCountLocation = -1, adaptRateLocation = -1, hysteresisLocation = -1;
+   GLint sampleStrideLocation = -1, collectHistogramLocation = -1, finalCollectHistogramLocation = -1, whitePercentileLocation = -1;
+   GLint localCompressionLocation = -1;
+   GLuint sceneStatsBuffer = 0, histogramBuffer = 0;
+   gl_quad quad = {};
+
+   // Packed output, which replaces the tone mapping program, the quad and the render targets
+   gl_pack_format pack = GL_PACK_NONE;
+   GLuint packProgram = 0;
+   GLint packInvocationsLocation = -1, packFirstWordLocation = -1;
+
+   // The program writing the output, drawing or packing
+   GLuint outputProgram() const { return packProgram ? packProgram : toneMappingShaderProgram; }
+
+   // LUT mode, all zero when the curve is evaluated per pixel
+   GLuint lutCheckProgram = 0, lutBakeProgram = 0, lutStateBuffer = 0;
+   GLuint toneTablesTexture = 0, toneCubeTexture = 0, gradeTexture = 0;
+   bool bakeCube = false;
+
+   // Local operator, all zero when it is off
+   GLuint localSplatProgram = 0, localBlurProgram = 0;
+   GLint localGridSizeLocation = -1, localAxisLocation = -1, localScaleLocation = -1, localLevelScaleLocation = -1;
+
+   // Output pyramid, zero without one
+   GLuint pyramidProgram = 0;
+
+   vector<frame_targets> pool;
+   unsigned long frame_counter = 0;
+
+   // Running statistics of the current sequence
+   adaptation_settings adaptation;
+   size_t sequence_index = 0;
+   bool statistics_primed = false;
+};
+
+bool gl_render_scene(RgbaInputFile &file, int width, int height, egl_backend_type backend_type = EGL_BACKEND_AUTO,
+                     gl_workgroup_size workgroup = { 16, 16 }) {
+   GLRenderer renderer(backend_type, workgroup);
+   if (!renderer.valid())
+      return false;
 
-   // Swap the buffers to display the rendered image
-   eglSwapBuffers(egl_display, egl_surface);
+   if (!renderer.renderFile(file))
+      return false;
 
    // Save the rendered image to a file
-   gl_save_10bit_image("reinhard-extended-chapel-with-gamma-correction-10bit.ppm", width, height);
+   bool written = renderer.saveFrame(width, height, string("reinhard-extended-chapel-with-gamma-correction") + glOutputSuffix());
+
+   // The two statistics are the only values read back, for the log
+   float max_brightness = 0.0f, avg_brightness = 0.0f;
+   if (renderer.sceneStatistics(max_brightness, avg_brightness)) {
+      cout << "Maximum Scene Brightness: " << max_brightness << endl;
+      cout << "Average Scene Brightness: " << avg_brightness << endl;
+      exportSelectedToneLut(selectedToneCurve(TRANSFER_SRGB), max_brightness, avg_brightness);
+   }
+   vector<uint32_t> histogram;
+   if (collectsHistogram(histogramSettings()) && renderer.luminanceHistogram(histogram))
+      exportSelectedHistogram(histogram);
+
+   return written;
+}
+
+// Tone maps a sequence of EXR files with the pipelined renderer
+bool gl_render_sequence(const vector<sequence_frame> &frames, egl_backend_type backend_type = EGL_BACKEND_AUTO,
+                        gl_workgroup_size workgroup = { 16, 16 }, const adaptation_settings &adaptation = adaptation_settings()) {
+   GLRenderer renderer(backend_type, workgroup);
+   return renderer.valid() && renderer.renderSequence(frames, adaptation);
+}
+
+// Tone maps the first frame of a raw, tightly packed YUV file
+bool gl_render_yuv_file(const string &input, const string &output, yuv_format format, yuv_matrix matrix, bool full_range,
+                        int width, int height, egl_backend_type backend_type = EGL_BACKEND_AUTO, gl_workgroup_size workgroup = { 16, 16 }) {
+   vector<char> data(yuvFrameSize(format, width, height));
+   ifstream in(input, ios::binary);
+   if (!in.read(data.data(), data.size())) {
+      fprintf(stderr, "Failed to read a %dx%d %s frame from %s\n", width, height, yuv_layouts[format].name, input.c_str());
+      return false;
+   }
 
-   glDeleteVertexArrays(1, &VAO);
-   glDeleteBuffers(1, &VBO);
-   glDeleteBuffers(1, &EBO);
+   GLRenderer renderer(backend_type, workgroup);
+   if (!renderer.valid() || !renderer.renderYuvFrame(packedYuvFrame(data.data(), format, matrix, full_range, width, height)))
+      return false;
 
-   // Clean up
-   eglDestroySurface(egl_display, egl_surface);
-   eglDestroyContext(egl_display, context);
-   eglTerminate(egl_display);
-   gbm_surface_destroy(surface);
-   gbm_device_destroy(gbm);
-   close(drm_fd);
+   bool written = renderer.saveFrame(width, height, output);
 
-   return EXIT_SUCCESS;
+   float max_brightness = 0.0f, avg_brightness = 0.0f;
+   if (renderer.sceneStatistics(max_brightness, avg_brightness)) {
+      cout << "Maximum Scene Brightness: " << max_brightness << endl;
+      cout << "Average Scene Brightness: " << avg_brightness << endl;
+      exportSelectedToneLut(selectedToneCurve(TRANSFER_SRGB), max_brightness, avg_brightness);
+   }
+   vector<uint32_t> histogram;
+   if (collectsHistogram(histogramSettings()) && renderer.luminanceHistogram(histogram))
+      exportSelectedHistogram(histogram);
+   return written;
 }
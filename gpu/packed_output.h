@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+
+#include "../utils/output_container.h"
+
+using namespace std;
+
+/* Packed GPU output
+ *
+ * With a packing selected the renderer skips the quad and the 10-bit render
+ * target: one compute pass tone maps the converted frame and writes the
+ * payload of the output file, byte for byte, into a shader storage buffer.
+ * Readback is then the file minus its header, written to disk as mapped.
+ *
+ *  - ppm8:  binary PPM, maxval 255, four pixels per invocation
+ *  - ppm10: binary PPM, maxval 1023 in big endian words, like the draw path
+ *  - ppm16: binary PPM, maxval 65535
+ *  - dpx10: 10-bit DPX in packing method A, three pixels per invocation
+ *
+ * Every invocation writes three whole words, so the buffer of an image is
+ * padded up to twelve bytes; only the file's bytes are written out. Words
+ * are assembled for a little endian host, which all GLES targets are.
+ */
+enum gl_pack_format
+{
+   GL_PACK_NONE,   // draw into the 10-bit render target
+   GL_PACK_PPM8,
+   GL_PACK_PPM10,
+   GL_PACK_PPM16,
+   GL_PACK_DPX10
+};
+
+struct gl_pack_layout
+{
+   const char *name;
+   const char *define;
+   const char *suffix;      // of sequence, batch and YUV outputs
+   int maxval;
+   int bytes_per_pixel;
+   int pixels_per_invocation;
+};
+
+const int gl_pack_words_per_invocation = 3;
+
+// Indexed by gl_pack_format
+static const gl_pack_layout gl_pack_layouts[] = {
+   { "draw", "", "-10bit.ppm", 1023, 6, 0 },
+   { "ppm8", "PACK_PPM8", "-8bit.ppm", 255, 3, 4 },
+   { "ppm10", "PACK_PPM16", "-10bit.ppm", 1023, 6, 2 },
+   { "ppm16", "PACK_PPM16", "-16bit.ppm", 65535, 6, 2 },
+   { "dpx10", "PACK_DPX10", "-10bit.dpx", 1023, 4, 3 },
+};
+
+inline gl_pack_format &glPackFormat() {
+   static gl_pack_format format = GL_PACK_NONE;
+   return format;
+}
+
+inline bool selectGlPackFormat(const string &name) {
+   for (int f = 0; f <= GL_PACK_DPX10; ++f) {
+      if (name == gl_pack_layouts[f].name) {
+         glPackFormat() = (gl_pack_format)f;
+         return true;
+      }
+   }
+   return false;
+}
+
+// Invocations of the pack pass for an image
+inline size_t glPackInvocations(gl_pack_format format, int width, int height) {
+   size_t per_invocation = gl_pack_layouts[format].pixels_per_invocation;
+   return ((size_t)width * height + per_invocation - 1) / per_invocation;
+}
+
+// Words the pack pass writes for an image, padding included
+inline size_t glPackedWords(gl_pack_format format, int width, int height) {
+   return glPackInvocations(format, width, height) * gl_pack_words_per_invocation;
+}
+
+// Payload bytes of the output file
+inline size_t glPackedBytes(gl_pack_format format, int width, int height) {
+   return (size_t)width * height * gl_pack_layouts[format].bytes_per_pixel;
+}
+
+// The file header of an image, DPX records the transfer the frame was encoded with
+inline string glPackedHeader(gl_pack_format format, int width, int height, transfer_type transfer) {
+   if (format == GL_PACK_DPX10)
+      return dpxHeader(width, height, dpxEncoding(transfer));
+   return ppmHeader(width, height, gl_pack_layouts[format].maxval);
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+
+#include <GLES3/gl31.h>
+
+using namespace std;
+
+/* YUV frame layouts accepted by the compute ingest stage
+ *
+ *  - NV12: 8-bit Y plane, then one plane of interleaved CbCr at half resolution
+ *  - P010: as NV12 with 16-bit words holding 10-bit samples in the high bits
+ *  - I420: 8-bit Y plane, then separate Cb and Cr planes at half resolution
+ *
+ * Odd widths and heights round the chroma planes up.
+ */
+enum yuv_format
+{
+   YUV_NV12,
+   YUV_P010,
+   YUV_I420
+};
+
+enum yuv_matrix
+{
+   YUV_BT709,
+   YUV_BT2020
+};
+
+struct yuv_plane_layout
+{
+   GLenum internal_format, format, type;
+   int texel_bytes;
+   int subsampling;
+};
+
+struct yuv_format_layout
+{
+   const char *name;
+   const char *define;
+   int bit_depth;
+   int plane_count;
+   yuv_plane_layout planes[3];
+};
+
+// Indexed by yuv_format
+static const yuv_format_layout yuv_layouts[] = {
+   { "nv12", "YUV_NV12", 8, 2, {
+      { GL_R8, GL_RED, GL_UNSIGNED_BYTE, 1, 1 },
+      { GL_RG8, GL_RG, GL_UNSIGNED_BYTE, 2, 2 } } },
+   { "p010", "YUV_P010", 10, 2, {
+      { GL_R16UI, GL_RED_INTEGER, GL_UNSIGNED_SHORT, 2, 1 },
+      { GL_RG16UI, GL_RG_INTEGER, GL_UNSIGNED_SHORT, 4, 2 } } },
+   { "i420", "YUV_I420", 8, 3, {
+      { GL_R8, GL_RED, GL_UNSIGNED_BYTE, 1, 1 },
+      { GL_R8, GL_RED, GL_UNSIGNED_BYTE, 1, 2 },
+      { GL_R8, GL_RED, GL_UNSIGNED_BYTE, 1, 2 } } },
+};
+
+// One frame in host memory. Plane pointers and strides (in bytes) follow the
+// plane order of the format's layout.
+struct yuv_frame
+{
+   yuv_format format;
+   yuv_matrix matrix;
+   bool full_range;
+   int width, height;
+   const void *planes[3];
+   int strides[3];
+};
+
+inline bool parseYuvFormat(const string &name, yuv_format &format) {
+   for (int f = 0; f < 3; ++f) {
+      if (name == yuv_layouts[f].name) {
+         format = (yuv_format)f;
+         return true;
+      }
+   }
+   return false;
+}
+
+inline bool parseYuvMatrix(const string &name, yuv_matrix &matrix) {
+   if (name == "bt709")
+      matrix = YUV_BT709;
+   else if (name == "bt2020")
+      matrix = YUV_BT2020;
+   else
+      return false;
+   return true;
+}
+
+inline int yuvPlaneWidth(yuv_format format, int plane, int width) {
+   int s = yuv_layouts[format].planes[plane].subsampling;
+   return (width + s - 1) / s;
+}
+
+inline int yuvPlaneHeight(yuv_format format, int plane, int height) {
+   int s = yuv_layouts[format].planes[plane].subsampling;
+   return (height + s - 1) / s;
+}
+
+// Size in bytes of a tightly packed frame
+inline size_t yuvFrameSize(yuv_format format, int width, int height) {
+   size_t size = 0;
+   for (int p = 0; p < yuv_layouts[format].plane_count; ++p)
+      size += (size_t)yuvPlaneWidth(format, p, width) * yuvPlaneHeight(format, p, height) * yuv_layouts[format].planes[p].texel_bytes;
+   return size;
+}
+
+// Describes a tightly packed frame starting at data, planes back to back
+inline yuv_frame packedYuvFrame(const void *data, yuv_format format, yuv_matrix matrix, bool full_range, int width, int height) {
+   yuv_frame frame = { format, matrix, full_range, width, height, { NULL, NULL, NULL }, { 0, 0, 0 } };
+   const unsigned char *plane = (const unsigned char*)data;
+   for (int p = 0; p < yuv_layouts[format].plane_count; ++p) {
+      frame.planes[p] = plane;
+      frame.strides[p] = yuvPlaneWidth(format, p, width) * yuv_layouts[format].planes[p].texel_bytes;
+      plane += (size_t)frame.strides[p] * yuvPlaneHeight(format, p, height);
+   }
+   return frame;
+}
+
+// Kr and Kb of the matrix
+inline void yuvMatrixWeights(yuv_matrix matrix, float &kr, float &kb) {
+   if (matrix == YUV_BT2020) {
+      kr = 0.2627f;
+      kb = 0.0593f;
+   } else {
+      kr = 0.2126f;
+      kb = 0.0722f;
+   }
+}
+
+// Linear RGB in the primaries of the matrix to Rec.709 primaries, column
+// major; BT.2020 uses the inverse of ITU-R BT.2087, BT.709 the identity
+inline void yuvPrimariesToRec709(yuv_matrix matrix, float m[9]) {
+   static const float identity[9] = { 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f };
+   static const float bt2020[9] = { 1.660491002f, -0.124550474f, -0.018150764f,
+                                    -0.587641138f, 1.132899897f, -0.100578898f,
+                                    -0.072849864f, -0.008349423f, 1.118729662f };
+   memcpy(m, matrix == YUV_BT2020 ? bt2020 : identity, sizeof(bt2020));
+}
+
+// Code value offset and reciprocal scale for luma, then chroma, so that
+// (code - offset) * scale gives Y in [0, 1] and Cb, Cr in [-0.5, 0.5]
+inline void yuvRange(yuv_format format, bool full_range, float range[4]) {
+   int shift = yuv_layouts[format].bit_depth - 8;
+   float max_code = (float)((1 << yuv_layouts[format].bit_depth) - 1);
+
+   range[0] = full_range ? 0.0f : (float)(16 << shift);
+   range[1] = 1.0f / (full_range ? max_code : (float)(219 << shift));
+   range[2] = (float)(128 << shift);
+   range[3] = 1.0f / (full_range ? max_code : (float)(224 << shift));
+}
@@ -0,0 +1,148 @@
+#include "hdrtonemap.h"
+
+#include "../utils/thread_pool.h"
+#include "../cpu/cpu_tone_map.h"
+
+/* ToneMapper
+ *
+ * The statistics and tone mapping passes of cpu_tone_map.h over a caller's
+ * view, with the instance's own curve, tables and pool in place of the
+ * command line selections and the process wide pool. Bands have the
+ * engine's cpu_band_rows layout and merge in band order, so a frame gives
+ * the same codes as the file paths with the same curve.
+ */
+struct ToneMapper::state
+{
+   string error;
+   tone_curve curve = cpu_default_tone_curve;
+   tone_lut_selection selection;
+   unique_ptr<ThreadPool> pool;
+   tone_lut lut;
+   scene_statistics stats = { NAN, NAN, {}, NULL };
+};
+
+// Whether the view is half RGBA at eight bytes a pixel, the layout the
+// kernels take, so its rows can be handed over in place
+static bool isRgbaView(const hdr_image_view &view) {
+   const char *base = (const char *)view.channels[0];
+   for (int c = 1; c < 4; ++c)
+      if ((const char *)view.channels[c] != base + c * sizeof(half))
+         return false;
+   return view.type == HDR_SAMPLE_HALF && view.pixel_stride == sizeof(Rgba) &&
+          (uintptr_t)base % alignof(Rgba) == 0 && view.row_stride % alignof(Rgba) == 0;
+}
+
+// Largest finite half; float input is clamped to it so the scene maximum
+// of the statistics stays finite
+const float half_max = 65504.0f;
+
+static inline half toHalf(float v) {
+   return half(min(max(v, -half_max), half_max));
+}
+
+static inline float sampleAt(const hdr_image_view &view, const char *channel, size_t offset) {
+   if (view.type == HDR_SAMPLE_HALF)
+      return *(const half *)(channel + offset);
+   return *(const float *)(channel + offset);
+}
+
+// Row y of the view as the kernels' pixels: the caller's memory when it is
+// already in their layout, otherwise converted into row
+static const Rgba *viewRow(const hdr_image_view &view, bool in_place, int y, vector<Rgba> &row) {
+   const size_t row_offset = (size_t)y * view.row_stride;
+   if (in_place)
+      return (const Rgba *)((const char *)view.channels[0] + row_offset);
+
+   const char *r = (const char *)view.channels[0], *g = (const char *)view.channels[1];
+   const char *b = (const char *)view.channels[2], *a = (const char *)view.channels[3];
+   row.resize(view.width);
+   for (int x = 0; x < view.width; ++x) {
+      size_t offset = row_offset + (size_t)x * view.pixel_stride;
+      row[x].r = toHalf(sampleAt(view, r, offset));
+      row[x].g = toHalf(sampleAt(view, g, offset));
+      row[x].b = toHalf(sampleAt(view, b, offset));
+      row[x].a = a ? toHalf(sampleAt(view, a, offset)) : half(1.0f);
+   }
+   return row.data();
+}
+
+static bool isUsableView(const hdr_image_view &view) {
+   const size_t sample = view.type == HDR_SAMPLE_HALF ? sizeof(half) : sizeof(float);
+   return view.width > 0 && view.height > 0 && view.channels[0] && view.channels[1] && view.channels[2] &&
+          view.pixel_stride >= (ptrdiff_t)sample && view.row_stride >= view.pixel_stride * view.width;
+}
+
+ToneMapper::ToneMapper(const tone_mapper_options &options) : impl(new state()) {
+   if (!parseToneOperator(options.tone_operator, impl->curve.op))
+      impl->error = "unknown tone operator " + options.tone_operator;
+   else if (!parseTransferFunction(options.transfer, impl->curve.transfer))
+      impl->error = "unknown transfer function " + options.transfer;
+   else if (options.cube_size < 2 || options.cube_size > 129)
+      impl->error = "cube size out of range: " + to_string(options.cube_size);
+   impl->selection.enabled = options.lut;
+   impl->selection.cube_size = options.cube_size;
+   impl->pool.reset(new ThreadPool(options.threads));
+}
+
+ToneMapper::~ToneMapper() = default;
+
+bool ToneMapper::ready() const {
+   return impl->error.empty();
+}
+
+const string &ToneMapper::error() const {
+   return impl->error;
+}
+
+float ToneMapper::maxBrightness() const {
+   return impl->stats.max_brightness;
+}
+
+float ToneMapper::averageBrightness() const {
+   return impl->stats.avg_brightness;
+}
+
+bool ToneMapper::toneMap(const hdr_image_view &input, const hdr_output_view &output) {
+   if (!ready() || !isUsableView(input) || (!output.rgb_8bit && !output.rgb_10bit))
+      return false;
+
+   const int width = input.width, height = input.height;
+   const ptrdiff_t stride_8bit = output.row_stride_8bit ? output.row_stride_8bit : width * 3;
+   const ptrdiff_t stride_10bit = output.row_stride_10bit ? output.row_stride_10bit : width * 3 * sizeof(unsigned short);
+   if (stride_8bit < width * 3 || stride_10bit < width * 3 * (ptrdiff_t)sizeof(unsigned short) ||
+       stride_10bit % sizeof(unsigned short))
+      return false;
+
+   const bool in_place = isRgbaView(input);
+   const size_t bands = (height + cpu_band_rows - 1) / cpu_band_rows;
+   auto forEachViewBand = [&](const function<void(size_t, int, int, vector<Rgba> &)> &fn) {
+      impl->pool->parallelFor(bands, [&](size_t band) {
+         vector<Rgba> row;
+         fn(band, (int)band * cpu_band_rows, min(height, ((int)band + 1) * cpu_band_rows), row);
+      });
+   };
+
+   vector<luminance_partial> partials(bands);
+   forEachViewBand([&](size_t band, int first_row, int last_row, vector<Rgba> &row) {
+      luminance_partial partial = { 0.0, std::numeric_limits<float>::min(), {} };
+      for (int y = first_row; y < last_row; ++y)
+         cpuKernels().log_luminance(viewRow(input, in_place, y, row), width, partial.log_sum, partial.max, NULL);
+      partials[band] = move(partial);
+   });
+
+   statistics_accumulator acc(false);
+   mergeLuminancePartials(partials, acc);
+   scene_statistics &stats = impl->stats;
+   stats.max_brightness = acc.max;
+   stats.avg_brightness = static_cast<float>(exp(acc.log_sum / ((double)width * height)));
+
+   const tone_map_row_function tone_map_row = toneMapRowFunction(impl->curve, impl->selection, stats, width, impl->lut);
+   forEachViewBand([&](size_t, int first_row, int last_row, vector<Rgba> &row) {
+      for (int y = first_row; y < last_row; ++y) {
+         unsigned char *row_8bit = output.rgb_8bit ? output.rgb_8bit + y * stride_8bit : NULL;
+         unsigned short *row_10bit = output.rgb_10bit ? (unsigned short *)((char *)output.rgb_10bit + y * stride_10bit) : NULL;
+         tone_map_row(viewRow(input, in_place, y, row), row_8bit, row_10bit);
+      }
+   });
+   return true;
+}
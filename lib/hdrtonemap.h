@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+/* libhdrtonemap
+ *
+ * The CPU engine as a library, for programs that already hold their frames
+ * in memory. A ToneMapper reads the caller's pixels through a strided view
+ * and writes interleaved RGB straight into the caller's output rows: half
+ * RGBA input is read in place, anything else is converted a row at a time
+ * on the thread that maps it, and no frame sized buffer is ever allocated.
+ *
+ * An instance keeps its own curve, baked tables and threads, and touches no
+ * global settings and no GL state, so independent instances can run on as
+ * many threads at once. A single instance is not reentrant.
+ *
+ * This header only needs the standard library; link libhdrtonemap.a with
+ * -lOpenEXR -lImath -pthread.
+ */
+enum hdr_sample_type { HDR_SAMPLE_HALF, HDR_SAMPLE_FLOAT };
+
+/* Input pixels in caller memory. Strides are in bytes and shared by all
+ * channels, so an interleaved image has its channels two or four bytes
+ * apart within a pixel, and a planar one has a pixel stride of one sample.
+ * The alpha channel may be NULL, it is then taken as one. */
+struct hdr_image_view
+{
+   hdr_sample_type type;
+   int width, height;
+   const void *channels[4];   // R, G, B, A
+   ptrdiff_t pixel_stride, row_stride;
+};
+
+// Interleaved RGBA, rows row_stride bytes apart, or packed without one
+inline hdr_image_view hdrInterleavedView(hdr_sample_type type, const void *rgba, int width, int height,
+                                         ptrdiff_t row_stride = 0) {
+   const ptrdiff_t sample = type == HDR_SAMPLE_HALF ? 2 : 4;
+   const char *base = (const char *)rgba;
+   return { type, width, height, { base, base + sample, base + 2 * sample, base + 3 * sample },
+            4 * sample, row_stride ? row_stride : width * 4 * sample };
+}
+
+// One plane per channel, all with the same row stride; alpha may be NULL
+inline hdr_image_view hdrPlanarView(hdr_sample_type type, const void *r, const void *g, const void *b, const void *a,
+                                    int width, int height, ptrdiff_t row_stride = 0) {
+   const ptrdiff_t sample = type == HDR_SAMPLE_HALF ? 2 : 4;
+   return { type, width, height, { r, g, b, a }, sample, row_stride ? row_stride : width * sample };
+}
+
+/* Output rows in caller memory, interleaved RGB of the view's size: 8-bit
+ * codes, and 10-bit codes in the low bits of native unsigned shorts. Either
+ * buffer may be NULL; a row stride of 0 means packed rows. */
+struct hdr_output_view
+{
+   unsigned char *rgb_8bit = NULL;
+   ptrdiff_t row_stride_8bit = 0;
+   unsigned short *rgb_10bit = NULL;
+   ptrdiff_t row_stride_10bit = 0;
+};
+
+/* The curve by the names of the command line's --operator and --transfer
+ * options. lut bakes it into tables like --lut, cube_size is --lut-size, the
+ * size of the cube general curves bake to. threads is the number of threads
+ * an instance maps a frame with, the calling one included, so the default
+ * runs entirely on the caller's thread. */
+struct tone_mapper_options
+{
+   std::string tone_operator = "reinhard-extended";
+   std::string transfer = "gamma22";
+   bool lut = false;
+   int cube_size = 33;
+   unsigned int threads = 1;
+};
+
+class ToneMapper
+{
+public:
+   explicit ToneMapper(const tone_mapper_options &options = tone_mapper_options());
+   ~ToneMapper();
+
+   ToneMapper(const ToneMapper &) = delete;
+   ToneMapper &operator=(const ToneMapper &) = delete;
+
+   // False when the options name an unknown curve; error() tells which
+   bool ready() const;
+   const std::string &error() const;
+
+   // Measures the frame and tone maps it into output. Returns false without
+   // writing anything when the instance or the views are not usable.
+   bool toneMap(const hdr_image_view &input, const hdr_output_view &output);
+
+   // Scene statistics of the last frame mapped
+   float maxBrightness() const;
+   float averageBrightness() const;
+
+private:
+   struct state;
+   std::unique_ptr<state> impl;
+};
@@ -7,21 +7,213 @@
 #include <fcntl.h>
 
 #include "utils/io.h"
+#include "utils/thread_pool.h"
 #include "cpu/cpu_hdr.h"
 #include "gpu/opengles_hdr.h"
 
-int main() {
+int main(int argc, char *argv[]) {
    int width, height;
    float maxSceneLuminance;
+   bool use_cpu = false;
+   bool verify = false;
+   size_t stream_budget_mb = 0;
+   int decode_threads = 0;
+   egl_backend_type egl_backend = EGL_BACKEND_AUTO;
+   vector<sequence_frame> sequence;
+   gl_workgroup_size workgroup = { 16, 16 };
+   string yuv_input;
+   yuv_format yuv_fmt = YUV_NV12;
+   yuv_matrix yuv_mat = YUV_BT709;
+   bool yuv_full_range = false;
+   int yuv_width = 0, yuv_height = 0;
+   string input = "tests/memorial.exr";
+   vector<string> batch_inputs;
+   string output_dir;
+   unsigned int batch_workers = 2;
+   bool force = false;
+   string trace_path, report_path;
 
-   // RgbaInputFile cpu_file("tests/memorial.exr");
-   // readEXRMetadata(cpu_file, width, height);
-   // cpu_render_scene(cpu_file, width, height);
+   for (int i = 1; i < argc; ++i) {
+      string arg = argv[i];
+      if (arg == "--cpu")
+         use_cpu = true;
+      else if (arg == "--verify")
+         verify = true;
+      else if (arg == "--stream" && i + 1 < argc && atol(argv[i + 1]) > 0)
+         stream_budget_mb = atol(argv[++i]);
+      else if (arg == "--decode-threads" && i + 1 < argc)
+         decode_threads = max(0, atoi(argv[++i]));
+      else if (arg == "--threads" && i + 1 < argc)
+         setCpuThreadCount(atoi(argv[++i]));
+      else if (arg == "--kernels" && i + 1 < argc && selectCpuKernels(argv[i + 1]))
+         ++i;
+      else if (arg == "--operator" && i + 1 < argc && selectToneOperator(argv[i + 1]))
+         ++i;
+      else if (arg == "--transfer" && i + 1 < argc && selectTransferFunction(argv[i + 1]))
+         ++i;
+      else if (arg == "--lut")
+         toneLutSelection().enabled = true;
+      else if (arg == "--lut-size" && i + 1 < argc && atoi(argv[i + 1]) >= 2 && atoi(argv[i + 1]) <= 129)
+         toneLutSelection().cube_size = atoi(argv[++i]);
+      else if (arg == "--cube" && i + 1 < argc && selectGradeCube(argv[i + 1]))
+         ++i;
+      else if (arg == "--export-cube" && i + 1 < argc)
+         toneLutSelection().export_path = argv[++i];
+      else if (arg == "--adapt" && i + 1 < argc && atof(argv[i + 1]) > 0.0) {
+         adaptationSettings().enabled = true;
+         adaptationSettings().frames = atof(argv[++i]);
+      }
+      else if (arg == "--hysteresis" && i + 1 < argc && atof(argv[i + 1]) >= 0.0)
+         adaptationSettings().hysteresis = atof(argv[++i]);
+      else if (arg == "--stats-stride" && i + 1 < argc && atoi(argv[i + 1]) > 0)
+         adaptationSettings().stats_stride = atoi(argv[++i]);
+      else if (arg == "--stats-interval" && i + 1 < argc && atoi(argv[i + 1]) > 0)
+         adaptationSettings().stats_interval = atoi(argv[++i]);
+      else if (arg == "--local")
+         localToneSettings().enabled = true;
+      else if (arg == "--local-compression" && i + 1 < argc && atof(argv[i + 1]) > 0.0 && atof(argv[i + 1]) <= 1.0)
+         localToneSettings().compression = atof(argv[++i]);
+      else if (arg == "--local-detail" && i + 1 < argc && atof(argv[i + 1]) > 0.0)
+         localToneSettings().detail = atof(argv[++i]);
+      else if (arg == "--gl-pack" && i + 1 < argc && selectGlPackFormat(argv[i + 1]))
+         ++i;
+      else if (arg == "--container" && i + 1 < argc && selectOutputContainer(argv[i + 1]))
+         ++i;
+      else if (arg == "--pyramid" && i + 1 < argc && selectPyramidLevels(argv[i + 1]))
+         ++i;
+      else if (arg == "--pyramid-filter" && i + 1 < argc && selectPyramidFilter(argv[i + 1]))
+         ++i;
+      else if (arg == "--white-percentile" && i + 1 < argc && atof(argv[i + 1]) > 0.0 && atof(argv[i + 1]) <= 100.0)
+         histogramSettings().white_percentile = atof(argv[++i]);
+      else if (arg == "--histogram" && i + 1 < argc)
+         histogramSettings().export_path = argv[++i];
+      else if (arg == "--egl" && i + 1 < argc && parseEglBackendType(argv[i + 1], egl_backend))
+         ++i;
+      else if (arg == "--workgroup" && i + 1 < argc && parseWorkgroupSize(argv[i + 1], workgroup))
+         ++i;
+      else if (arg == "--yuv" && i + 3 < argc && parseYuvFormat(argv[i + 1], yuv_fmt) &&
+               sscanf(argv[i + 2], "%dx%d", &yuv_width, &yuv_height) == 2 && yuv_width > 0 && yuv_height > 0) {
+         yuv_input = argv[i + 3];
+         i += 3;
+      }
+      else if (arg == "--yuv-matrix" && i + 1 < argc && parseYuvMatrix(argv[i + 1], yuv_mat))
+         ++i;
+      else if (arg == "--full-range")
+         yuv_full_range = true;
+      else if (arg == "--input" && i + 1 < argc)
+         input = argv[++i];
+      else if (arg == "--jobs" && i + 1 < argc && atoi(argv[i + 1]) > 0)
+         batch_workers = atoi(argv[++i]);
+      else if (arg == "--output-dir" && i + 1 < argc)
+         output_dir = argv[++i];
+      else if (arg == "--force")
+         force = true;
+      else if (arg == "--trace" && i + 1 < argc)
+         trace_path = argv[++i];
+      else if (arg == "--report" && i + 1 < argc)
+         report_path = argv[++i];
+      else if (arg == "--batch" && i + 1 < argc) {
+         // Files, directories, quoted globs or @list files up to the next option
+         while (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0)
+            batch_inputs.push_back(argv[++i]);
+      }
+      else if (arg == "--sequence" && i + 1 < argc) {
+         // Every remaining argument is an input frame, written next to it as
+         // <name>-10bit.ppm or .dpx, or with the suffix of the GPU packing
+         for (++i; i < argc; ++i) {
+            string input = argv[i];
+            size_t extension = input.rfind(".exr");
+            string stem = extension == string::npos ? input : input.substr(0, extension);
+            sequence.push_back({ input, stem + (use_cpu ? output10bitSuffix() : glOutputSuffix()) });
+         }
+      }
+      else {
+         cerr << "Usage: " << argv[0] << " [--cpu [--stream MB] [--verify]] [--threads N] [--decode-threads N] [--kernels auto|scalar|avx2|avx512|neon] [--egl auto|gbm|device|surfaceless] [--workgroup WxH]" << endl
+              << "       [--gl-pack draw|ppm8|ppm10|ppm16|dpx10] [--container ppm|dpx]" << endl
+              << "       [--input file.exr] [--yuv nv12|p010|i420 WxH frame.yuv [--yuv-matrix bt709|bt2020] [--full-range]] [--sequence frame.exr...]" << endl
+              << "       [--adapt FRAMES] [--hysteresis STOPS] [--stats-stride N] [--stats-interval N] [--white-percentile P] [--histogram FILE]" << endl
+              << "       [--jobs N] [--output-dir DIR] [--force] [--batch file.exr|dir|'glob'|@list...]" << endl
+              << "       [--operator reinhard|reinhard-extended|aces|hable|agx|exposure] [--transfer linear|gamma22|srgb|pq|hlg]" << endl
+              << "       [--lut [--lut-size N]] [--cube grade.cube] [--export-cube curve.cube]" << endl
+              << "       [--local [--local-compression C] [--local-detail D]] [--pyramid LEVELS [--pyramid-filter box|lanczos]]" << endl
+              << "       [--trace chrome-trace.json] [--report stages.json]" << endl;
+         return EXIT_FAILURE;
+      }
+   }
 
-   RgbaInputFile gpu_file("tests/memorial.exr");
-   readEXRMetadata(gpu_file, width, height);
-   gl_render_scene(gpu_file, width, height);
+   // A PPM packing cannot write the DPX container
+   if (outputContainer() == OUTPUT_CONTAINER_DPX && !use_cpu && glPackFormat() != GL_PACK_NONE &&
+       glPackFormat() != GL_PACK_DPX10) {
+      cerr << "--container dpx takes --gl-pack draw or dpx10" << endl;
+      return EXIT_FAILURE;
+   }
 
-   return EXIT_SUCCESS;
-}
+   // The reference path is Reinhard extended with gamma 2.2 over the plain
+   // scene maximum, anything else would not compare like for like
+   if (verify) {
+      if (!use_cpu || stream_budget_mb || !sequence.empty() || !batch_inputs.empty()) {
+         cerr << "--verify takes --cpu on a single in-memory image" << endl;
+         return EXIT_FAILURE;
+      }
+      toneCurveSelection() = tone_curve_selection();
+      toneLutSelection().enabled = false;
+      histogramSettings().white_percentile = 100.0f;
+      localToneSettings().enabled = false;
+   }
+
+   // Must happen before any file is opened, files take the count at construction
+   setExrDecodeThreads(decode_threads);
+
+   // Stage timings and counters, written on the way out
+   TraceOutput trace_output(trace_path, report_path);
+
+   if (!batch_inputs.empty()) {
+      // Outputs are <output dir or input dir>/<name>-8bit.ppm and -10bit.ppm or .dpx, the GPU
+      // writes only the latter, or the file of its packing
+      vector<string> suffixes = { use_cpu ? output10bitSuffix() : glOutputSuffix() };
+      if (use_cpu)
+         suffixes.insert(suffixes.begin(), "-8bit.ppm");
+
+      vector<batch_job> jobs = planBatchJobs(batch_inputs, output_dir, suffixes, force);
+      if (jobs.empty())
+         return EXIT_SUCCESS;
+      if (use_cpu)
+         return cpu_render_batch(jobs, batch_workers) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+      // One GL context serves the whole batch, decode and write overlap the GPU in the sequence pipeline
+      vector<sequence_frame> frames;
+      for (const batch_job &job : jobs)
+         frames.push_back({ job.input, job.output_stem + glOutputSuffix() });
+      return gl_render_sequence(frames, egl_backend, workgroup) ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
 
+   if (!sequence.empty()) {
+      if (use_cpu)
+         return cpu_render_sequence(sequence, adaptationSettings()) ? EXIT_SUCCESS : EXIT_FAILURE;
+      return gl_render_sequence(sequence, egl_backend, workgroup, adaptationSettings()) ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
+
+   if (use_cpu && stream_budget_mb) {
+      // Bounded memory: the image is never resident as a whole
+      string output_10bit = "reinhard-extended-chapel-with-gamma-correction" + output10bitSuffix();
+      return cpu_render_streaming(input.c_str(), "reinhard-extended-chapel-with-gamma-correction-8bit.ppm",
+                                  output_10bit.c_str(), stream_budget_mb << 20) ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
+
+   if (use_cpu) {
+      RgbaInputFile cpu_file(input.c_str());
+      readEXRMetadata(cpu_file, width, height);
+      return cpu_render_scene(cpu_file, width, height, verify) ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
+
+   if (!yuv_input.empty()) {
+      size_t extension = yuv_input.rfind('.');
+      string stem = extension == string::npos ? yuv_input : yuv_input.substr(0, extension);
+      return gl_render_yuv_file(yuv_input, stem + glOutputSuffix(), yuv_fmt, yuv_mat, yuv_full_range,
+                                yuv_width, yuv_height, egl_backend, workgroup) ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
+
+   RgbaInputFile gpu_file(input.c_str());
+   readEXRMetadata(gpu_file, width, height);
+   return gl_render_scene(gpu_file, width, height, egl_backend, workgroup) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
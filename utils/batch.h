@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <glob.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+/* Batch driver
+ *
+ * Turns command line inputs into a list of jobs and runs them on a small set
+ * of file workers. Several files are in flight at once so the decode of one
+ * (disk and OpenEXR decompression) overlaps the compute of another on the
+ * shared CPU pool. Jobs whose outputs are newer than their input are skipped.
+ */
+struct batch_job
+{
+   string input;
+   string output_stem;    // outputs are <output_stem><suffix>
+};
+
+inline bool hasExrExtension(const string &path) {
+   if (path.size() < 4)
+      return false;
+   string extension = path.substr(path.size() - 4);
+   transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+   return extension == ".exr";
+}
+
+// Expands every argument: a directory contributes its *.exr entries, a pattern
+// with wildcards is globbed, @file reads one path per line, anything else is
+// taken as a file. Directory and glob results are sorted, duplicates dropped.
+inline vector<string> expandBatchInputs(const vector<string> &args) {
+   vector<string> inputs;
+
+   for (const string &arg : args) {
+      struct stat info;
+
+      if (arg.size() > 1 && arg[0] == '@') {
+         ifstream list(arg.substr(1));
+         if (!list)
+            fprintf(stderr, "Failed to read file list %s\n", arg.c_str() + 1);
+         for (string line; getline(list, line);) {
+            if (!line.empty() && line[0] != '#')
+               inputs.push_back(line);
+         }
+      } else if (arg.find_first_of("*?[") != string::npos) {
+         glob_t matches;
+         if (glob(arg.c_str(), 0, NULL, &matches) == 0) {
+            for (size_t i = 0; i < matches.gl_pathc; ++i)
+               inputs.push_back(matches.gl_pathv[i]);
+         }
+         globfree(&matches);
+      } else if (stat(arg.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+         vector<string> entries;
+         if (DIR *dir = opendir(arg.c_str())) {
+            while (struct dirent *entry = readdir(dir)) {
+               if (hasExrExtension(entry->d_name))
+                  entries.push_back(arg + "/" + entry->d_name);
+            }
+            closedir(dir);
+         }
+         sort(entries.begin(), entries.end());
+         inputs.insert(inputs.end(), entries.begin(), entries.end());
+      } else {
+         inputs.push_back(arg);
+      }
+   }
+
+   // A file named twice, say by a directory and a glob, is processed once
+   vector<string> unique_inputs;
+   for (const string &input : inputs) {
+      if (find(unique_inputs.begin(), unique_inputs.end(), input) == unique_inputs.end())
+         unique_inputs.push_back(input);
+   }
+   return unique_inputs;
+}
+
+// <output_dir>/<name without extension>, or next to the input without output_dir
+inline string batchOutputStem(const string &input, const string &output_dir) {
+   size_t slash = input.find_last_of('/');
+   size_t dot = input.find_last_of('.');
+   string stem = (dot == string::npos || (slash != string::npos && dot < slash)) ? input : input.substr(0, dot);
+
+   if (output_dir.empty())
+      return stem;
+   return output_dir + "/" + (slash == string::npos ? stem : stem.substr(slash + 1));
+}
+
+// True when every output exists and was modified no earlier than the input
+inline bool outputsUpToDate(const string &input, const string &stem, const vector<string> &suffixes) {
+   struct stat source, target;
+   if (stat(input.c_str(), &source) != 0)
+      return false;
+
+   for (const string &suffix : suffixes) {
+      if (stat((stem + suffix).c_str(), &target) != 0 || target.st_mtime < source.st_mtime)
+         return false;
+   }
+   return true;
+}
+
+inline vector<batch_job> planBatchJobs(const vector<string> &args, const string &output_dir,
+                                       const vector<string> &suffixes, bool force) {
+   vector<batch_job> jobs;
+   size_t skipped = 0;
+
+   for (const string &input : expandBatchInputs(args)) {
+      string stem = batchOutputStem(input, output_dir);
+      if (!force && outputsUpToDate(input, stem, suffixes))
+         ++skipped;
+      else
+         jobs.push_back({ input, stem });
+   }
+
+   if (!output_dir.empty())
+      mkdir(output_dir.c_str(), 0755);
+
+   printf("Batch: %zu files to process, %zu up to date\n", jobs.size(), skipped);
+   return jobs;
+}
+
+// Runs job(worker, index) for every index. Workers pull the next index as
+// they finish, so long and short files balance out.
+template <typename Job>
+void runBatchJobs(size_t count, unsigned int workers, Job job) {
+   workers = max(1u, min<unsigned int>(workers, count));
+   atomic<size_t> next_job(0);
+
+   auto worker_loop = [&](unsigned int worker) {
+      for (size_t i = next_job++; i < count; i = next_job++)
+         job(worker, i);
+   };
+
+   vector<thread> threads;
+   for (unsigned int w = 1; w < workers; ++w)
+      threads.emplace_back(worker_loop, w);
+   worker_loop(0);
+
+   for (thread &t : threads)
+      t.join();
+}
+
+inline void reportBatchThroughput(size_t files, size_t failed, double megapixels, double seconds) {
+   printf("Batch: %zu files (%zu failed), %.1f MP in %.2fs: %.2f files/s, %.1f MP/s\n",
+          files, failed, megapixels, seconds, files / seconds, megapixels / seconds);
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include <sys/mman.h>
+
+using namespace std;
+
+/* Image buffer pool
+ *
+ * Frames of a sequence or a batch come in a handful of sizes. Released buffers
+ * are kept per size class and handed out again, so steady-state processing
+ * stops paying for fresh pages: no allocator round trip, no page faults, no
+ * zeroing by the kernel. A size class is the byte size rounded up to 64, which
+ * lets formats of the same footprint share buffers. Contents of a recycled
+ * buffer are whatever its previous user left.
+ *
+ * Every buffer is 64-byte aligned for the SIMD kernels. Buffers of 2 MiB and
+ * more are aligned to 2 MiB and marked for transparent huge pages, which cuts
+ * TLB misses and page faults on large frames. At most max_free buffers of
+ * each class are retained, and at most max_bytes over all classes: past the
+ * budget, buffers of the least recently used classes go back to the system
+ * first, so a batch over many plate sizes only keeps the sizes still in use.
+ *
+ * acquire() returns a shared_ptr whose deleter returns the memory, so buffers
+ * can be captured by the write queue's jobs and outlive the pool object.
+ */
+const size_t buffer_pool_alignment = 64;
+const size_t buffer_pool_huge_page = 2 << 20;
+const size_t buffer_pool_default_budget = (size_t)1 << 30;
+
+class BufferPool
+{
+public:
+   explicit BufferPool(size_t max_free = 8, size_t max_bytes = buffer_pool_default_budget)
+      : state(make_shared<pool_state>()) {
+      state->max_free = max_free;
+      state->max_bytes = max_bytes;
+   }
+
+   template <typename T>
+   shared_ptr<T> acquire(size_t count) {
+      size_t bytes = max((count * sizeof(T) + buffer_pool_alignment - 1) / buffer_pool_alignment, (size_t)1) * buffer_pool_alignment;
+      shared_ptr<pool_state> owner = state;
+      return shared_ptr<T>((T*)state->take(bytes), [owner, bytes](T *buffer) { owner->give(buffer, bytes); });
+   }
+
+   // Frees every buffer that is not handed out
+   void trim() {
+      lock_guard<mutex> guard(state->lock);
+      state->release();
+   }
+
+   // Bytes held by buffers that are not handed out
+   size_t cachedBytes() const {
+      lock_guard<mutex> guard(state->lock);
+      return state->cached_bytes;
+   }
+
+private:
+   struct size_class
+   {
+      vector<void*> buffers;
+      uint64_t last_use = 0;
+   };
+
+   struct pool_state
+   {
+      mutex lock;
+      map<size_t, size_class> free_buffers;
+      size_t max_free = 8;
+      size_t max_bytes = buffer_pool_default_budget;
+      size_t cached_bytes = 0;
+      uint64_t clock = 0;   // stamps the last take or give of a class
+
+      ~pool_state() { release(); }
+
+      void *take(size_t bytes) {
+         {
+            lock_guard<mutex> guard(lock);
+            auto found = free_buffers.find(bytes);
+            if (found != free_buffers.end()) {
+               void *buffer = found->second.buffers.back();
+               found->second.buffers.pop_back();
+               found->second.last_use = ++clock;
+               cached_bytes -= bytes;
+               if (found->second.buffers.empty())
+                  free_buffers.erase(found);
+               return buffer;
+            }
+         }
+         return allocate(bytes);
+      }
+
+      void give(void *buffer, size_t bytes) {
+         vector<void*> evicted;
+         {
+            lock_guard<mutex> guard(lock);
+            size_class &returned = free_buffers[bytes];
+            returned.last_use = ++clock;
+            if (returned.buffers.size() >= max_free || bytes > max_bytes) {
+               evicted.push_back(buffer);
+               if (returned.buffers.empty())
+                  free_buffers.erase(bytes);
+            } else {
+               returned.buffers.push_back(buffer);
+               cached_bytes += bytes;
+               evictOver(max_bytes, evicted);
+            }
+         }
+         for (void *stale : evicted)
+            free(stale);
+      }
+
+      // Takes buffers of the least recently used classes out until at most
+      // budget bytes are cached; the caller frees them outside the lock
+      void evictOver(size_t budget, vector<void*> &evicted) {
+         while (cached_bytes > budget) {
+            auto oldest = free_buffers.begin();
+            for (auto it = free_buffers.begin(); it != free_buffers.end(); ++it)
+               if (it->second.last_use < oldest->second.last_use)
+                  oldest = it;
+            evicted.push_back(oldest->second.buffers.back());
+            oldest->second.buffers.pop_back();
+            cached_bytes -= oldest->first;
+            if (oldest->second.buffers.empty())
+               free_buffers.erase(oldest);
+         }
+      }
+
+      void release() {
+         for (auto &size_class : free_buffers) {
+            for (void *buffer : size_class.second.buffers)
+               free(buffer);
+         }
+         free_buffers.clear();
+         cached_bytes = 0;
+      }
+   };
+
+   static void *allocate(size_t bytes) {
+      bool huge = bytes >= buffer_pool_huge_page;
+      void *buffer = NULL;
+      if (posix_memalign(&buffer, huge ? buffer_pool_huge_page : buffer_pool_alignment, bytes) != 0)
+         throw bad_alloc();
+#ifdef MADV_HUGEPAGE
+      if (huge)
+         madvise(buffer, bytes, MADV_HUGEPAGE);
+#endif
+      return buffer;
+   }
+
+   shared_ptr<pool_state> state;
+};
+
+// Shared pool for frame sized buffers of the CPU and GPU paths
+inline BufferPool &imageBufferPool() {
+   static BufferPool pool;
+   return pool;
+}
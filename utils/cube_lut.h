@@ -0,0 +1,202 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* .cube colour lookup tables
+ *
+ * Reads and writes the Adobe / Resolve text format: a 1-D table, a 3-D table
+ * or a 1-D shaper followed by a 3-D table. Sizes come from LUT_1D_SIZE and
+ * LUT_3D_SIZE, input ranges from DOMAIN_MIN / DOMAIN_MAX (Adobe, per channel)
+ * or LUT_1D_INPUT_RANGE / LUT_3D_INPUT_RANGE (Resolve). 3-D entries are
+ * listed with red changing fastest. Tables hold RGB triples.
+ */
+struct cube_lut
+{
+   string title;
+
+   int size_1d = 0;
+   float min_1d[3] = { 0.0f, 0.0f, 0.0f }, max_1d[3] = { 1.0f, 1.0f, 1.0f };
+   vector<float> table_1d;
+
+   int size_3d = 0;
+   float min_3d[3] = { 0.0f, 0.0f, 0.0f }, max_3d[3] = { 1.0f, 1.0f, 1.0f };
+   vector<float> table_3d;
+};
+
+inline bool readCubeFile(const char *filename, cube_lut &lut) {
+   ifstream in(filename);
+   if (!in) {
+      fprintf(stderr, "Failed to open %s\n", filename);
+      return false;
+   }
+
+   lut = cube_lut();
+   bool domain_set = false;
+   float domain_min[3] = { 0.0f, 0.0f, 0.0f }, domain_max[3] = { 1.0f, 1.0f, 1.0f };
+   vector<float> values;
+   string line;
+   int line_number = 0;
+
+   while (getline(in, line)) {
+      ++line_number;
+      size_t start = line.find_first_not_of(" \t\r");
+      if (start == string::npos || line[start] == '#')
+         continue;
+
+      istringstream fields(line);
+      string keyword;
+      fields >> keyword;
+      bool ok = true;
+
+      if (keyword == "TITLE") {
+         size_t open = line.find('"'), close = line.rfind('"');
+         if (open != string::npos && close > open)
+            lut.title = line.substr(open + 1, close - open - 1);
+      }
+      else if (keyword == "LUT_1D_SIZE")
+         ok = (bool)(fields >> lut.size_1d) && lut.size_1d >= 2 && lut.size_1d <= 65536;
+      else if (keyword == "LUT_3D_SIZE")
+         ok = (bool)(fields >> lut.size_3d) && lut.size_3d >= 2 && lut.size_3d <= 256;
+      else if (keyword == "DOMAIN_MIN") {
+         ok = (bool)(fields >> domain_min[0] >> domain_min[1] >> domain_min[2]);
+         domain_set = true;
+      }
+      else if (keyword == "DOMAIN_MAX") {
+         ok = (bool)(fields >> domain_max[0] >> domain_max[1] >> domain_max[2]);
+         domain_set = true;
+      }
+      else if (keyword == "LUT_1D_INPUT_RANGE" || keyword == "LUT_3D_INPUT_RANGE") {
+         float lo, hi;
+         ok = (bool)(fields >> lo >> hi);
+         float *range_min = keyword[4] == '1' ? lut.min_1d : lut.min_3d;
+         float *range_max = keyword[4] == '1' ? lut.max_1d : lut.max_3d;
+         for (int c = 0; c < 3; ++c) {
+            range_min[c] = lo;
+            range_max[c] = hi;
+         }
+      }
+      else if (isdigit((unsigned char)line[start]) || line[start] == '-' || line[start] == '+' || line[start] == '.') {
+         istringstream row(line);
+         float r, g, b;
+         ok = (bool)(row >> r >> g >> b);
+         values.push_back(r);
+         values.push_back(g);
+         values.push_back(b);
+      }
+      // Other keywords are vendor extensions and are ignored
+
+      if (!ok) {
+         fprintf(stderr, "%s:%d: malformed line\n", filename, line_number);
+         return false;
+      }
+   }
+
+   size_t entries_1d = (size_t)lut.size_1d, entries_3d = (size_t)lut.size_3d * lut.size_3d * lut.size_3d;
+   if (!lut.size_1d && !lut.size_3d) {
+      fprintf(stderr, "%s: no LUT_1D_SIZE or LUT_3D_SIZE\n", filename);
+      return false;
+   }
+   if (values.size() != (entries_1d + entries_3d) * 3) {
+      fprintf(stderr, "%s: expected %zu entries, found %zu\n", filename, entries_1d + entries_3d, values.size() / 3);
+      return false;
+   }
+
+   // DOMAIN_* belongs to the single table of an Adobe file
+   if (domain_set) {
+      float *range_min = lut.size_3d ? lut.min_3d : lut.min_1d, *range_max = lut.size_3d ? lut.max_3d : lut.max_1d;
+      for (int c = 0; c < 3; ++c) {
+         range_min[c] = domain_min[c];
+         range_max[c] = domain_max[c];
+      }
+   }
+
+   lut.table_1d.assign(values.begin(), values.begin() + entries_1d * 3);
+   lut.table_3d.assign(values.begin() + entries_1d * 3, values.end());
+   return true;
+}
+
+inline bool writeCubeFile(const char *filename, const cube_lut &lut) {
+   FILE *out = fopen(filename, "w");
+   if (!out) {
+      perror("Failed to write the LUT");
+      return false;
+   }
+
+   if (!lut.title.empty())
+      fprintf(out, "TITLE \"%s\"\n", lut.title.c_str());
+
+   if (lut.size_1d && lut.size_3d) {
+      // Shaper plus cube, Resolve's layout; its ranges are the same for every channel
+      fprintf(out, "LUT_1D_SIZE %d\nLUT_1D_INPUT_RANGE %.7g %.7g\n", lut.size_1d, lut.min_1d[0], lut.max_1d[0]);
+      fprintf(out, "LUT_3D_SIZE %d\nLUT_3D_INPUT_RANGE %.7g %.7g\n", lut.size_3d, lut.min_3d[0], lut.max_3d[0]);
+   }
+   else {
+      const float *range_min = lut.size_3d ? lut.min_3d : lut.min_1d, *range_max = lut.size_3d ? lut.max_3d : lut.max_1d;
+      fprintf(out, lut.size_3d ? "LUT_3D_SIZE %d\n" : "LUT_1D_SIZE %d\n", lut.size_3d ? lut.size_3d : lut.size_1d);
+      fprintf(out, "DOMAIN_MIN %.7g %.7g %.7g\nDOMAIN_MAX %.7g %.7g %.7g\n",
+              range_min[0], range_min[1], range_min[2], range_max[0], range_max[1], range_max[2]);
+   }
+
+   for (size_t i = 0; i < lut.table_1d.size(); i += 3)
+      fprintf(out, "%.7f %.7f %.7f\n", lut.table_1d[i], lut.table_1d[i + 1], lut.table_1d[i + 2]);
+   for (size_t i = 0; i < lut.table_3d.size(); i += 3)
+      fprintf(out, "%.7f %.7f %.7f\n", lut.table_3d[i], lut.table_3d[i + 1], lut.table_3d[i + 2]);
+
+   bool ok = !ferror(out);
+   fclose(out);
+   return ok;
+}
+
+// Position of v in a table of size entries spanning [lo, hi]: first index and fraction
+inline void cubeLutPosition(float v, float lo, float hi, int size, int &index, float &fraction) {
+   float position = (v - lo) / (hi - lo) * (size - 1);
+   position = position > 0.0f ? (position < size - 1 ? position : size - 1) : 0.0f;
+   index = min((int)position, size - 2);
+   fraction = position - index;
+}
+
+// Applies the 1-D table per channel and then the 3-D table, both interpolated linearly
+inline void sampleCubeLut(const cube_lut &lut, const float in[3], float out[3]) {
+   float v[3] = { in[0], in[1], in[2] };
+
+   if (lut.size_1d) {
+      for (int c = 0; c < 3; ++c) {
+         int i;
+         float f;
+         cubeLutPosition(v[c], lut.min_1d[c], lut.max_1d[c], lut.size_1d, i, f);
+         v[c] = lut.table_1d[i * 3 + c] + f * (lut.table_1d[(i + 1) * 3 + c] - lut.table_1d[i * 3 + c]);
+      }
+   }
+
+   if (lut.size_3d) {
+      int n = lut.size_3d, i[3];
+      float f[3];
+      for (int c = 0; c < 3; ++c)
+         cubeLutPosition(v[c], lut.min_3d[c], lut.max_3d[c], n, i[c], f[c]);
+
+      for (int c = 0; c < 3; ++c) {
+         auto at = [&](int dr, int dg, int db) {
+            return lut.table_3d[(((size_t)(i[2] + db) * n + (i[1] + dg)) * n + (i[0] + dr)) * 3 + c];
+         };
+         float c00 = at(0, 0, 0) + f[0] * (at(1, 0, 0) - at(0, 0, 0));
+         float c10 = at(0, 1, 0) + f[0] * (at(1, 1, 0) - at(0, 1, 0));
+         float c01 = at(0, 0, 1) + f[0] * (at(1, 0, 1) - at(0, 0, 1));
+         float c11 = at(0, 1, 1) + f[0] * (at(1, 1, 1) - at(0, 1, 1));
+         float c0 = c00 + f[1] * (c10 - c00), c1 = c01 + f[1] * (c11 - c01);
+         out[c] = c0 + f[2] * (c1 - c0);
+      }
+   }
+   else {
+      for (int c = 0; c < 3; ++c)
+         out[c] = v[c];
+   }
+}
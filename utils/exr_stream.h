@@ -0,0 +1,200 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <OpenEXR/ImfRgbaFile.h>
+#include <OpenEXR/ImfTiledRgbaFile.h>
+#include <OpenEXR/ImfTestFile.h>
+#include <OpenEXR/ImfThreading.h>
+
+#include "trace.h"
+
+using namespace OPENEXR_IMF_NAMESPACE;
+using namespace IMATH_NAMESPACE;
+using namespace std;
+
+// Worker threads OpenEXR uses to decompress line buffers and tiles. Files
+// opened afterwards pick the count up as their default; 0 means one per core.
+inline void setExrDecodeThreads(unsigned int threads) {
+   if (threads == 0)
+      threads = max(1u, thread::hardware_concurrency());
+   setGlobalThreadCount(threads);
+}
+
+/* Chunked EXR reader
+ *
+ * Reads a band of rows of the data window into a caller buffer of
+ * width x rows tightly packed Rgba, so an image never has to be resident as
+ * a whole. Scanline files are read with RgbaInputFile::readPixels over the
+ * band, tiled files with TiledRgbaInputFile::readTiles over whole tile rows.
+ * For tiled files first_row and rows must be multiples of rowGranularity()
+ * (except at the bottom edge), otherwise tiles would spill outside the buffer.
+ */
+class ExrChunkReader
+{
+public:
+   explicit ExrChunkReader(const char *filename) {
+      traceFileRead(filename);
+      if (isTiledOpenExrFile(filename)) {
+         owned_tiled.reset(new TiledRgbaInputFile(filename));
+         tiled = owned_tiled.get();
+         dw = tiled->dataWindow();
+      } else {
+         owned_scanline.reset(new RgbaInputFile(filename));
+         scanline = owned_scanline.get();
+         dw = scanline->dataWindow();
+      }
+   }
+
+   // Reads through a file the caller already opened
+   explicit ExrChunkReader(RgbaInputFile &file) : scanline(&file), dw(file.dataWindow()) {
+      traceFileRead(file.fileName());
+   }
+
+   int width() const { return dw.max.x - dw.min.x + 1; }
+   int height() const { return dw.max.y - dw.min.y + 1; }
+   bool isTiled() const { return tiled != NULL; }
+
+   // Chunks should start and span multiples of this many rows
+   int rowGranularity() const { return tiled ? (int)tiled->tileYSize() : 1; }
+
+   // Reads rows [first_row, first_row + rows) counted from the top of the data window
+   void readRows(Rgba *buffer, int first_row, int rows) {
+      TraceScope trace("exr_decode");
+      trace.setPixels((size_t)width() * rows);
+      trace.setBytes((size_t)width() * rows * sizeof(Rgba));
+
+      Rgba *base = buffer - dw.min.x - (ptrdiff_t)(dw.min.y + first_row) * width();
+
+      if (tiled) {
+         int tile_rows = tiled->tileYSize();
+         tiled->setFrameBuffer(base, 1, width());
+         tiled->readTiles(0, tiled->numXTiles() - 1, first_row / tile_rows, (first_row + rows - 1) / tile_rows);
+      } else {
+         scanline->setFrameBuffer(base, 1, width());
+         scanline->readPixels(dw.min.y + first_row, dw.min.y + first_row + rows - 1);
+      }
+   }
+
+private:
+   unique_ptr<RgbaInputFile> owned_scanline;
+   unique_ptr<TiledRgbaInputFile> owned_tiled;
+   RgbaInputFile *scanline = NULL;
+   TiledRgbaInputFile *tiled = NULL;
+   Box2i dw;
+};
+
+/* Decode/compute overlap
+ *
+ * A producer thread decodes the chunks of an ExrChunkReader in order while
+ * the caller works on the chunks already decoded. Chunks either go to a ring
+ * of depth buffers, where a buffer is only reused once the caller has moved
+ * past it, or straight into a caller-provided width x height destination.
+ * Decode errors are rethrown from next() on the caller's thread.
+ */
+class ChunkPrefetcher
+{
+public:
+   ChunkPrefetcher(ExrChunkReader &reader, int chunk_rows, int depth = 2)
+      : reader(reader), chunk_rows(chunk_rows), destination(NULL) {
+      ring.resize(max(depth, 2));
+      for (vector<Rgba> &buffer : ring)
+         buffer.resize((size_t)reader.width() * chunk_rows);
+      start();
+   }
+
+   ChunkPrefetcher(ExrChunkReader &reader, int chunk_rows, Rgba *destination)
+      : reader(reader), chunk_rows(chunk_rows), destination(destination) {
+      start();
+   }
+
+   ~ChunkPrefetcher() {
+      {
+         lock_guard<mutex> guard(state_lock);
+         stopping = true;
+      }
+      progress.notify_all();
+      producer.join();
+   }
+
+   ChunkPrefetcher(const ChunkPrefetcher&) = delete;
+   ChunkPrefetcher &operator=(const ChunkPrefetcher&) = delete;
+
+   // Waits for the next chunk and hands it out, releasing the previous one.
+   // Returns false after the last chunk.
+   bool next(const Rgba *&pixels, int &first_row, int &rows) {
+      unique_lock<mutex> guard(state_lock);
+      released = handed_out;
+      progress.notify_all();
+
+      progress.wait(guard, [this] { return decoded > handed_out || error || handed_out == chunk_count; });
+      if (decoded <= handed_out) {
+         if (error)
+            rethrow_exception(error);
+         return false;
+      }
+
+      int chunk = handed_out++;
+      pixels = chunkBuffer(chunk);
+      first_row = chunk * chunk_rows;
+      rows = min(chunk_rows, reader.height() - first_row);
+      return true;
+   }
+
+private:
+   void start() {
+      chunk_count = (reader.height() + chunk_rows - 1) / chunk_rows;
+      producer = thread(&ChunkPrefetcher::produce, this);
+   }
+
+   Rgba *chunkBuffer(int chunk) {
+      if (destination)
+         return destination + (size_t)chunk * chunk_rows * reader.width();
+      return ring[chunk % ring.size()].data();
+   }
+
+   void produce() {
+      for (int chunk = 0; chunk < chunk_count; ++chunk) {
+         {
+            // Ring buffers are free once the caller released the chunk that used them
+            unique_lock<mutex> guard(state_lock);
+            progress.wait(guard, [&] { return stopping || destination || chunk - released < (int)ring.size(); });
+            if (stopping)
+               return;
+         }
+
+         try {
+            int first_row = chunk * chunk_rows;
+            reader.readRows(chunkBuffer(chunk), first_row, min(chunk_rows, reader.height() - first_row));
+         } catch (...) {
+            lock_guard<mutex> guard(state_lock);
+            error = current_exception();
+            progress.notify_all();
+            return;
+         }
+
+         lock_guard<mutex> guard(state_lock);
+         decoded = chunk + 1;
+         progress.notify_all();
+      }
+   }
+
+   ExrChunkReader &reader;
+   int chunk_rows, chunk_count = 0;
+   Rgba *destination;
+   vector<vector<Rgba>> ring;
+
+   int decoded = 0, handed_out = 0, released = 0;
+   bool stopping = false;
+   exception_ptr error;
+
+   mutex state_lock;
+   condition_variable progress;
+   thread producer;
+};
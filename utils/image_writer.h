@@ -0,0 +1,248 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "buffer_pool.h"
+#include "trace.h"
+
+using namespace std;
+
+/* Binary image writers
+ *
+ * Every writer formats the header into a string, prepares the payload in one
+ * contiguous buffer and hands both to the kernel with writev, so a file costs
+ * one system call in the common case instead of one formatted integer per
+ * channel.
+ */
+
+// Writes every part, looping only on short writes
+bool writeParts(int fd, struct iovec *part, int remaining_parts) {
+   while (remaining_parts > 0) {
+      ssize_t written = writev(fd, part, remaining_parts);
+      if (written < 0) {
+         perror("Failed to write image");
+         return false;
+      }
+
+      while (remaining_parts > 0 && (size_t)written >= part->iov_len) {
+         written -= part->iov_len;
+         ++part;
+         --remaining_parts;
+      }
+      if (remaining_parts > 0) {
+         part->iov_base = (char*)part->iov_base + written;
+         part->iov_len -= written;
+      }
+   }
+   return true;
+}
+
+// Writes header and payload back to back
+bool writeImageFile(const char *filename, const string &header, const void *data, size_t size) {
+   TraceScope trace("write_image");
+   trace.setBytes(header.size() + size);
+   traceCount("bytes_written", header.size() + size);
+
+   int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) {
+      perror("Failed to open file for writing");
+      return false;
+   }
+
+   struct iovec parts[2] = {
+      { (void*)header.data(), header.size() },
+      { (void*)data, size }
+   };
+   bool written = writeParts(fd, parts, 2);
+
+   close(fd);
+   return written;
+}
+
+string ppmHeader(int width, int height, int maxval) {
+   return "P6\n" + to_string(width) + " " + to_string(height) + "\n" + to_string(maxval) + "\n";
+}
+
+// Swaps 16-bit samples to the most significant byte first order of PPM
+void toBigEndian16(const unsigned short *samples, size_t count, unsigned char *bytes) {
+   for (size_t i = 0; i < count; ++i) {
+      bytes[i * 2] = samples[i] >> 8;
+      bytes[i * 2 + 1] = samples[i] & 0xff;
+   }
+}
+
+/* DPX (SMPTE 268M) with one element of 10-bit RGB, filled to 32-bit words
+ * with packing method A: a big endian word per pixel, red in the top ten
+ * bits and two bits of padding at the bottom. The header is the 2048 bytes
+ * of the generic and industry headers, the image data follows directly.
+ * Fields that are not set are zero, the reference quantities undefined.
+ */
+struct dpx_encoding
+{
+   unsigned char transfer;       // transfer characteristic code
+   unsigned char colorimetric;   // colorimetric specification code
+   string description;           // of the image element, 31 characters at most
+};
+
+const uint32_t dpx_header_size = 2048;
+
+inline void putBigEndian16(unsigned char *bytes, uint16_t value) {
+   bytes[0] = value >> 8;
+   bytes[1] = value & 0xff;
+}
+
+inline void putBigEndian32(unsigned char *bytes, uint32_t value) {
+   bytes[0] = value >> 24;
+   bytes[1] = (value >> 16) & 0xff;
+   bytes[2] = (value >> 8) & 0xff;
+   bytes[3] = value & 0xff;
+}
+
+string dpxHeader(int width, int height, const dpx_encoding &encoding) {
+   string header(dpx_header_size, '\0');
+   unsigned char *file = (unsigned char*)&header[0];
+   uint64_t file_size = dpx_header_size + (uint64_t)width * height * 4;
+
+   // File information
+   memcpy(file, "SDPX", 4);
+   putBigEndian32(file + 4, dpx_header_size);   // offset to the image data
+   memcpy(file + 8, "V2.0", 4);
+   putBigEndian32(file + 16, (uint32_t)min(file_size, (uint64_t)UINT32_MAX));
+   putBigEndian32(file + 20, 1);      // ditto key: a new frame
+   putBigEndian32(file + 24, 1664);   // generic header: file, image and orientation
+   putBigEndian32(file + 28, 384);    // industry header: film and television
+   memcpy(file + 160, "exr-tone-mapping", 16);
+   putBigEndian32(file + 660, UINT32_MAX);   // not encrypted
+
+   // Image information, left to right and top to bottom
+   unsigned char *image = file + 768;
+   putBigEndian16(image + 2, 1);
+   putBigEndian32(image + 4, width);
+   putBigEndian32(image + 8, height);
+
+   unsigned char *element = image + 12;
+   putBigEndian32(element + 8, UINT32_MAX);
+   putBigEndian32(element + 12, 1023);
+   putBigEndian32(element + 16, UINT32_MAX);
+   element[20] = 50;   // RGB
+   element[21] = encoding.transfer;
+   element[22] = encoding.colorimetric;
+   element[23] = 10;
+   putBigEndian16(element + 24, 1);   // method A
+   putBigEndian32(element + 28, dpx_header_size);
+   memcpy(element + 40, encoding.description.data(), min(encoding.description.size(), (size_t)31));
+   return header;
+}
+
+// Packs interleaved 10-bit RGB samples into big endian method A words
+void packDpx10(const unsigned short *rgb, size_t pixels, unsigned char *bytes) {
+   for (size_t i = 0; i < pixels; ++i) {
+      uint32_t word = (uint32_t)rgb[i * 3] << 22 | (uint32_t)rgb[i * 3 + 1] << 12 | (uint32_t)rgb[i * 3 + 2] << 2;
+      putBigEndian32(bytes + i * 4, word);
+   }
+}
+
+/* Incremental writer for images produced a band at a time: the header goes
+ * out on construction, rows are appended in order. Errors are reported once
+ * and make every later append fail. */
+class ImageStreamWriter
+{
+public:
+   ImageStreamWriter(const char *filename, const string &header) {
+      fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) {
+         perror("Failed to open file for writing");
+         return;
+      }
+      append(header.data(), header.size());
+   }
+
+   ~ImageStreamWriter() {
+      if (fd >= 0)
+         close(fd);
+   }
+
+   ImageStreamWriter(const ImageStreamWriter&) = delete;
+   ImageStreamWriter &operator=(const ImageStreamWriter&) = delete;
+
+   bool ok() const { return fd >= 0; }
+
+   bool append(const void *data, size_t size) {
+      if (fd < 0)
+         return false;
+
+      TraceScope trace("write_image");
+      trace.setBytes(size);
+      traceCount("bytes_written", size);
+
+      struct iovec part = { (void*)data, size };
+      if (!writeParts(fd, &part, 1)) {
+         close(fd);
+         fd = -1;
+      }
+      return fd >= 0;
+   }
+
+   // 16-bit samples, swapped through a scratch buffer that is reused across calls
+   bool appendBigEndian16(const unsigned short *samples, size_t count) {
+      scratch.resize(count * 2);
+      toBigEndian16(samples, count, scratch.data());
+      return append(scratch.data(), scratch.size());
+   }
+
+   // Pixels of 10-bit RGB as DPX words, through the same scratch buffer
+   bool appendDpx10(const unsigned short *rgb, size_t pixels) {
+      scratch.resize(pixels * 4);
+      packDpx10(rgb, pixels, scratch.data());
+      return append(scratch.data(), scratch.size());
+   }
+
+private:
+   int fd = -1;
+   vector<unsigned char> scratch;
+};
+
+// Binary P6, 8 bits per channel, interleaved RGB
+bool writePPM8(const char *filename, const unsigned char *rgb, int width, int height) {
+   return writeImageFile(filename, ppmHeader(width, height, 255), rgb, (size_t)width * height * 3);
+}
+
+// Binary P6 with maxval above 255: two bytes per channel, most significant first
+bool writePPM16(const char *filename, const unsigned short *rgb, int width, int height, int maxval = 1023) {
+   size_t samples = (size_t)width * height * 3;
+   shared_ptr<unsigned char> payload = imageBufferPool().acquire<unsigned char>(samples * 2);
+   toBigEndian16(rgb, samples, payload.get());
+
+   return writeImageFile(filename, ppmHeader(width, height, maxval), payload.get(), samples * 2);
+}
+
+// DPX with 10-bit RGB samples, see dpxHeader()
+bool writeDPX10(const char *filename, const unsigned short *rgb, int width, int height, const dpx_encoding &encoding) {
+   size_t pixels = (size_t)width * height;
+   shared_ptr<unsigned char> payload = imageBufferPool().acquire<unsigned char>(pixels * 4);
+   packDpx10(rgb, pixels, payload.get());
+
+   return writeImageFile(filename, dpxHeader(width, height, encoding), payload.get(), pixels * 4);
+}
+
+// Little-endian PFM (negative scale) for float debug dumps. PFM stores rows
+// bottom to top, rgb is top to bottom like every other buffer here.
+bool writePFM(const char *filename, const float *rgb, int width, int height) {
+   size_t row_floats = (size_t)width * 3;
+   vector<float> payload(row_floats * height);
+
+   for (int y = 0; y < height; ++y)
+      memcpy(&payload[(size_t)(height - 1 - y) * row_floats], rgb + (size_t)y * row_floats, row_floats * sizeof(float));
+
+   string header = "PF\n" + to_string(width) + " " + to_string(height) + "\n-1.0\n";
+   return writeImageFile(filename, header, payload.data(), payload.size() * sizeof(float));
+}
@@ -19,11 +19,17 @@ void readEXRMetadata(RgbaInputFile &file, int &width, int &height) {
    // cout << "Width: " << width << ", Height: " << height << endl;
 }
 
-void readPixels(RgbaInputFile &file, Array2D<Rgba> &p, int width, int height) {
+// Reads the whole data window into a tightly packed width x height buffer,
+// which may be host memory or a mapped pixel unpack buffer
+void readPixels(RgbaInputFile &file, Rgba *p, int width, int height) {
    const Box2i& dw = file.dataWindow();
 
    // Assuming the file contains RGBA channels
    // Read pixel data
-   file.setFrameBuffer(&p[0][0] - dw.min.x - dw.min.y * width, 1, width);
+   file.setFrameBuffer(p - dw.min.x - dw.min.y * width, 1, width);
    file.readPixels(dw.min.y, dw.max.y);
 }
+
+void readPixels(RgbaInputFile &file, Array2D<Rgba> &p, int width, int height) {
+   readPixels(file, &p[0][0], width, height);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+
+#include "tone_operators.h"
+#include "luminance_histogram.h"
+
+using namespace std;
+
+/* Local tone mapping
+ *
+ * A Durand style base / detail split of the log2 luminance, with the base
+ * layer taken from a bilateral grid instead of a full radius bilateral
+ * filter, so the cost follows the grid size and not the filter radius:
+ *
+ *  - splat: every pixel adds its log2 luminance and a weight of one to the
+ *    nearest cell of a grid with local_grid_cell pixels per cell in x and y
+ *    and one stop per cell in luminance, over the histogram range
+ *    [2^-24, 2^16];
+ *  - blur: a separable [1 4 6 4 1] / 16 pass along each axis of the grid;
+ *  - slice: the base of a pixel is the trilinear interpolation of the blurred
+ *    sums divided by that of the weights at its position and luminance.
+ *
+ * The base is compressed toward the log-average and the detail kept, which
+ * becomes a per-pixel exposure gain applied before the selected global curve.
+ * That curve then sees the compressed white point, see localToneWhite().
+ * Both paths build the grid on the fly: the CPU in cpu/cpu_local.h, the GPU
+ * with a splat and a blur compute pass and the slice in the tone mapping
+ * shader. The exposure is shared with the shaders, see HDR_SHADER_SOURCE.
+ */
+const int local_grid_cell = 16;
+const int local_grid_depth = 40 + 1;
+const float local_grid_min_log2 = (float)luminance_histogram_min_exponent;
+
+struct local_tone_settings
+{
+   bool enabled = false;
+   float compression = 0.5f;   // of the base contrast around the log-average, 1 keeps it
+   float detail = 1.0f;        // gain of the detail layer
+};
+
+inline local_tone_settings &localToneSettings() {
+   static local_tone_settings settings;
+   return settings;
+}
+
+// Cells along an image axis: cell i gathers the pixels nearest to i * local_grid_cell
+inline int localGridSize(int pixels) {
+   return max(2, (pixels - 1 + local_grid_cell / 2) / local_grid_cell + 1);
+}
+
+HDR_SHADER_SOURCE(local_tone_source,
+   // Exposure of a pixel in stops from its log2 luminance and the log2 base
+   // around it: the base moves toward the anchor by compression, the detail scales
+   HDR_INLINE float localToneExposure(float log_lum, float base, float anchor, float compression, float detail) {
+      return (compression - 1.0f) * (base - anchor) + (detail - 1.0f) * (log_lum - base);
+   }
+
+   // White point after the compression, the brightest pixel taken as its own base
+   HDR_INLINE float localToneWhite(float white, float anchor, float compression) {
+      return exp2(anchor + compression * (log2(white) - anchor));
+   }
+)
+
+// #define lines of the grid layout and the settings for the shaders
+inline string localToneDefines(const local_tone_settings &settings) {
+   char defines[256];
+   snprintf(defines, sizeof(defines),
+            "#define LOCAL_GRID_CELL %d\n"
+            "#define LOCAL_GRID_DEPTH %d\n"
+            "#define LOCAL_GRID_MIN_LOG2 %.9ef\n"
+            "#define LOCAL_COMPRESSION %.9ef\n"
+            "#define LOCAL_DETAIL %.9ef\n",
+            local_grid_cell, local_grid_depth, local_grid_min_log2, settings.compression, settings.detail);
+   return defines;
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "tone_operators.h"
+
+using namespace std;
+
+/* Robust scene statistics
+ *
+ * The log-average and maximum take every pixel's luminance through
+ * safeLuminance() first: zero, negative and NaN luminances count as the
+ * smallest one, 2^-24, and infinities as the largest half, so a few bad pixels
+ * move the statistics a little instead of turning the frame into NaN.
+ *
+ * In the same pass the luminances can be counted into a log2 histogram of
+ * eight bins per stop over [2^-24, 2^16), indexed like the tone LUT by the
+ * exponent and the top three mantissa bits, so binning is a shift. The
+ * histogram gives the white point as a percentile of the luminances, which a
+ * handful of hot pixels cannot drag up the way they do the absolute maximum,
+ * and is written out for auto exposure. The CPU merges per-band histograms in
+ * band order, the GPU counts with shared memory atomics per workgroup and adds
+ * the workgroup counts to a global buffer.
+ *
+ * The binning and the percentile search are shared with the GPU reduction,
+ * see HDR_SHADER_SOURCE.
+ */
+const int luminance_histogram_min_exponent = -24;
+const int luminance_histogram_bins_per_stop = 8;
+const int luminance_histogram_bins = 40 * luminance_histogram_bins_per_stop;
+const float statistics_min_luminance = 0x1p-24f;
+const float statistics_max_luminance = 65504.0f;
+
+struct histogram_settings
+{
+   float white_percentile = 100.0f;   // 100 keeps the absolute maximum
+   string export_path;
+};
+
+inline histogram_settings &histogramSettings() {
+   static histogram_settings settings;
+   return settings;
+}
+
+// Whether the statistics passes have to count the histogram
+inline bool collectsHistogram(const histogram_settings &settings) {
+   return settings.white_percentile < 100.0f || !settings.export_path.empty();
+}
+
+HDR_SHADER_SOURCE(luminance_histogram_source,
+   // Luminance as the statistics take it, NaN compares false and becomes the minimum
+   HDR_INLINE float safeLuminance(float lum) {
+      return lum > statistics_min_luminance ? min(lum, statistics_max_luminance) : statistics_min_luminance;
+   }
+
+   // Bin of a safe luminance: its exponent and top three mantissa bits
+   HDR_INLINE int luminanceBin(float lum) {
+      return min(int(floatBitsToUint(lum) >> 20) - (127 + luminance_histogram_min_exponent) * 8,
+                 luminance_histogram_bins - 1);
+   }
+
+   // Lower edge of a bin, the upper edge of the one before
+   HDR_INLINE float luminanceBinEdge(int bin) {
+      return exp2(float(bin / 8 + luminance_histogram_min_exponent)) * (1.0f + float(bin % 8) * 0.125f);
+   }
+
+   // Luminance below which percent of the counted pixels lie, interpolated
+   // linearly inside its bin
+   HDR_INLINE float histogramPercentile(const uint histogram[luminance_histogram_bins], float percent) {
+      float total = 0.0f;
+      for (int i = 0; i < luminance_histogram_bins; ++i)
+         total += float(histogram[i]);
+
+      float target = total * percent / 100.0f;
+      float below = 0.0f;
+      for (int i = 0; i < luminance_histogram_bins; ++i) {
+         float count = float(histogram[i]);
+         if (count > 0.0f && below + count >= target) {
+            float lo = luminanceBinEdge(i);
+            return lo + (luminanceBinEdge(i + 1) - lo) * (target - below) / count;
+         }
+         below += count;
+      }
+      return statistics_max_luminance;
+   }
+)
+
+// The constants above for the shaders that include luminance_histogram_source
+inline string luminanceHistogramDefines() {
+   char defines[512];
+   snprintf(defines, sizeof(defines),
+            "const int luminance_histogram_min_exponent = %d;\n"
+            "const int luminance_histogram_bins = %d;\n"
+            "const float statistics_min_luminance = %.9ef;\n"
+            "const float statistics_max_luminance = %.9ef;\n",
+            luminance_histogram_min_exponent, luminance_histogram_bins,
+            statistics_min_luminance, statistics_max_luminance);
+   return defines;
+}
+
+// White point of the selected percentile, never above the measured maximum
+inline float histogramWhite(const histogram_settings &settings, const uint32_t *histogram, float max_luminance) {
+   if (settings.white_percentile >= 100.0f || !histogram)
+      return max_luminance;
+   return min(glsl::histogramPercentile(histogram, settings.white_percentile), max_luminance);
+}
+
+// One line per non-empty bin: lower edge in log2, lower edge, count
+inline bool writeLuminanceHistogram(const string &filename, const uint32_t *histogram) {
+   FILE *out = fopen(filename.c_str(), "w");
+   if (!out) {
+      perror("Failed to write the histogram");
+      return false;
+   }
+
+   fprintf(out, "# log2_luminance luminance pixels\n");
+   for (int i = 0; i < luminance_histogram_bins; ++i) {
+      if (!histogram[i])
+         continue;
+      float edge = glsl::luminanceBinEdge(i);
+      fprintf(out, "%.4f %.7g %u\n", log2(edge), edge, histogram[i]);
+   }
+
+   bool ok = !ferror(out);
+   fclose(out);
+   return ok;
+}
+
+// Writes the histogram of a frame to the selected path, if there is one
+inline void exportSelectedHistogram(const vector<uint32_t> &histogram) {
+   const string &path = histogramSettings().export_path;
+   if (path.empty() || histogram.size() != (size_t)luminance_histogram_bins)
+      return;
+
+   if (writeLuminanceHistogram(path, histogram.data()))
+      printf("Luminance histogram written to %s\n", path.c_str());
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+
+#include "image_writer.h"
+#include "tone_operators.h"
+
+using namespace std;
+
+/* Container of the 10-bit outputs
+ *
+ *  - ppm: binary P6 with maxval 1023, two big endian bytes per sample
+ *  - dpx: DPX with 10-bit RGB in packing method A, see dpxHeader()
+ *
+ * The 8-bit outputs and the clamped reference images stay PPM. A DPX file
+ * records the transfer function and primaries of its frame: linear and the
+ * Rec.709 primaries have their SMPTE 268M codes, every other transfer is
+ * marked user defined and named in the element description, as readers do
+ * not agree on the codes later revisions added for BT.2020 and BT.2100.
+ */
+enum output_container { OUTPUT_CONTAINER_PPM, OUTPUT_CONTAINER_DPX };
+
+inline output_container &outputContainer() {
+   static output_container container = OUTPUT_CONTAINER_PPM;
+   return container;
+}
+
+inline bool selectOutputContainer(const string &name) {
+   if (name == "ppm")
+      outputContainer() = OUTPUT_CONTAINER_PPM;
+   else if (name == "dpx")
+      outputContainer() = OUTPUT_CONTAINER_DPX;
+   else
+      return false;
+   return true;
+}
+
+// -10bit.ppm or -10bit.dpx, appended to the stem of a 10-bit output
+inline string output10bitSuffix() {
+   return outputContainer() == OUTPUT_CONTAINER_DPX ? "-10bit.dpx" : "-10bit.ppm";
+}
+
+inline dpx_encoding dpxEncoding(transfer_type transfer) {
+   const transfer_info &info = transfer_functions[transfer];
+   dpx_encoding encoding;
+   encoding.transfer = transfer == TRANSFER_LINEAR ? 2 : 0;
+   encoding.colorimetric = info.primaries == OUTPUT_PRIMARIES_REC709 ? 6 : 0;
+   encoding.description = string(info.name) + (info.primaries == OUTPUT_PRIMARIES_BT2020 ? " BT.2020" : " Rec.709");
+   return encoding;
+}
+
+// Header of a 10-bit output encoded with transfer, in the selected container
+inline string output10bitHeader(int width, int height, transfer_type transfer) {
+   if (outputContainer() == OUTPUT_CONTAINER_DPX)
+      return dpxHeader(width, height, dpxEncoding(transfer));
+   return ppmHeader(width, height, 1023);
+}
+
+// Writes interleaved 10-bit RGB encoded with transfer in the selected container
+inline bool write10bitOutput(const char *filename, const unsigned short *rgb, int width, int height,
+                             transfer_type transfer) {
+   if (outputContainer() == OUTPUT_CONTAINER_DPX)
+      return writeDPX10(filename, rgb, width, height, dpxEncoding(transfer));
+   return writePPM16(filename, rgb, width, height, 1023);
+}
+
+// Appends pixels of 10-bit RGB to a stream started with output10bitHeader()
+inline bool append10bitOutput(ImageStreamWriter &writer, const unsigned short *rgb, size_t pixels) {
+   if (outputContainer() == OUTPUT_CONTAINER_DPX)
+      return writer.appendDpx10(rgb, pixels);
+   return writer.appendBigEndian16(rgb, pixels * 3);
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* Output pyramid
+ *
+ * Proxies of every output, made in the same run as the full resolution image
+ * instead of decoding and tone mapping the plate once per size. Level n is
+ * 1/2^n of the full size, rounded down like a mip chain, and is reduced from
+ * level n - 1 in scene linear light, so every level goes through the tone
+ * curve and the transfer function once, with the statistics of the full
+ * image. The CPU reduces rows as the file decodes, see cpu/cpu_pyramid.h;
+ * the GPU fills the mip levels of the converted frame with a compute pass
+ * and draws each one into its own output.
+ *
+ * A level is written next to its full size output as <name>-<w>x<h>.<ext>.
+ */
+enum pyramid_filter { PYRAMID_FILTER_BOX, PYRAMID_FILTER_LANCZOS };
+
+const int pyramid_max_level = 8;
+
+struct pyramid_settings
+{
+   vector<int> levels;   // ascending, none without a pyramid
+   pyramid_filter filter = PYRAMID_FILTER_BOX;
+};
+
+inline pyramid_settings &pyramidSettings() {
+   static pyramid_settings settings;
+   return settings;
+}
+
+// Takes a comma separated list of levels, 1 for half size, 2 for quarter size, ...
+inline bool selectPyramidLevels(const string &text) {
+   vector<int> levels;
+   stringstream list(text);
+   for (string item; getline(list, item, ',');) {
+      int level = atoi(item.c_str());
+      if (level < 1 || level > pyramid_max_level)
+         return false;
+      levels.push_back(level);
+   }
+   if (levels.empty())
+      return false;
+
+   sort(levels.begin(), levels.end());
+   levels.erase(unique(levels.begin(), levels.end()), levels.end());
+   pyramidSettings().levels = levels;
+   return true;
+}
+
+inline bool selectPyramidFilter(const string &name) {
+   if (name == "box")
+      pyramidSettings().filter = PYRAMID_FILTER_BOX;
+   else if (name == "lanczos")
+      pyramidSettings().filter = PYRAMID_FILTER_LANCZOS;
+   else
+      return false;
+   return true;
+}
+
+// Deepest level the chain has to be reduced to, 0 without a pyramid
+inline int pyramidDepth(const pyramid_settings &settings) {
+   return settings.levels.empty() ? 0 : settings.levels.back();
+}
+
+// Size of a level, never below one pixel
+inline void pyramidLevelSize(int width, int height, int level, int &level_width, int &level_height) {
+   level_width = max(1, width >> level);
+   level_height = max(1, height >> level);
+}
+
+// <name>-<w>x<h>.<ext> for a full size output name
+inline string pyramidOutputName(const string &output, int level_width, int level_height) {
+   size_t slash = output.find_last_of('/');
+   size_t dot = output.find_last_of('.');
+   if (dot == string::npos || (slash != string::npos && dot < slash))
+      dot = output.size();
+   return output.substr(0, dot) + "-" + to_string(level_width) + "x" + to_string(level_height) + output.substr(dot);
+}
+
+/* Lanczos-2 taps of a 2:1 reduction. Output pixel i sits between source
+ * pixels 2i and 2i + 1, so the eight taps 2i - 3 .. 2i + 4 are the same for
+ * every pixel and are normalized once. */
+const int pyramid_lanczos_taps = 8;
+
+inline const float *pyramidLanczosWeights() {
+   static const vector<float> weights = [] {
+      vector<float> w(pyramid_lanczos_taps);
+      float sum = 0.0f;
+      for (int t = 0; t < pyramid_lanczos_taps; ++t) {
+         // Distance from the output centre in output pixels
+         double x = (t - 3.5) / 2.0;
+         double px = M_PI * x;
+         w[t] = x == 0.0 ? 1.0f : (float)(2.0 * sin(px) * sin(px / 2.0) / (px * px));
+         sum += w[t];
+      }
+      for (float &weight : w)
+         weight /= sum;
+      return w;
+   }();
+   return weights.data();
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+#include "tone_operators.h"
+
+using namespace std;
+
+/* Image sequences
+ *
+ * Frames of a sequence are tone mapped in order with running statistics, so
+ * the exposure follows the scene instead of jumping with every frame:
+ *
+ *  - adaptation moves the log2 average and maximum toward each new
+ *    measurement exponentially, with a time constant in frames;
+ *  - hysteresis is a dead band in stops around the adapted value, changes
+ *    inside it are ignored and larger ones only adapt by their excess, so
+ *    noise in the statistics never reaches the output;
+ *  - the statistics can be measured on every stride-th pixel of every
+ *    stride-th row, and only on every interval-th frame, the frames between
+ *    reusing the last reduction.
+ *
+ * adaptLog() is shared with the GPU reduction, see HDR_SHADER_SOURCE.
+ */
+struct sequence_frame
+{
+   string input;
+   string output;
+};
+
+struct adaptation_settings
+{
+   bool enabled = false;
+   float frames = 8.0f;       // time constant
+   float hysteresis = 0.1f;   // stops
+   int stats_stride = 1;
+   int stats_interval = 1;
+};
+
+inline adaptation_settings &adaptationSettings() {
+   static adaptation_settings settings;
+   return settings;
+}
+
+HDR_SHADER_SOURCE(adaptation_source,
+   // One step of an adapted log2 value toward the measured one: only the part
+   // of the difference beyond the dead band moves it, by rate
+   HDR_INLINE float adaptLog(float current, float target, float rate, float hysteresis) {
+      float difference = target - current;
+      return current + rate * (difference - clamp(difference, -hysteresis, hysteresis));
+   }
+)
+
+// Weight of a measurement that stands for elapsed frames, 1 when adaptation is off
+inline float adaptationRate(const adaptation_settings &settings, int elapsed) {
+   return settings.enabled ? 1.0f - exp(-elapsed / settings.frames) : 1.0f;
+}
+
+// Whether frame index of a sequence measures its statistics
+inline bool measuresStatistics(const adaptation_settings &settings, size_t index) {
+   return index % settings.stats_interval == 0;
+}
+
+// Running statistics of a sequence on the host, in log2
+struct adaptation_state
+{
+   bool primed = false;
+   float log_avg = 0.0f, log_max = 0.0f;
+};
+
+// Folds one measurement in and returns the adapted statistics in place. The
+// first measurement is taken as it is.
+inline void adaptStatistics(adaptation_state &state, const adaptation_settings &settings,
+                            float &max_brightness, float &avg_brightness) {
+   float log_avg = log2(avg_brightness), log_max = log2(max(max_brightness, 1e-9f));
+   if (!state.primed || !settings.enabled) {
+      state.log_avg = log_avg;
+      state.log_max = log_max;
+      state.primed = true;
+      return;
+   }
+
+   float rate = adaptationRate(settings, settings.stats_interval);
+   state.log_avg = glsl::adaptLog(state.log_avg, log_avg, rate, settings.hysteresis);
+   state.log_max = glsl::adaptLog(state.log_max, log_max, rate, settings.hysteresis);
+   avg_brightness = exp2(state.log_avg);
+   max_brightness = exp2(state.log_max);
+}
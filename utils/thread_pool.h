@@ -0,0 +1,169 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/* Work-stealing thread pool
+ *
+ * parallelFor() hands out task indices in contiguous blocks, one block per
+ * queue. Every thread drains its own queue from the front and, once empty,
+ * steals from the back of the others. The calling thread takes part in the
+ * work, so a pool of size 1 runs everything inline. Calls must not be nested.
+ */
+class ThreadPool
+{
+public:
+   explicit ThreadPool(unsigned int workers) {
+      if (workers == 0)
+         workers = 1;
+
+      for (unsigned int i = 0; i < workers; ++i)
+         queues.emplace_back(new TaskQueue());
+
+      // Queue 0 belongs to the calling thread
+      for (unsigned int i = 1; i < workers; ++i)
+         threads.emplace_back(&ThreadPool::workerLoop, this, i);
+   }
+
+   ~ThreadPool() {
+      {
+         lock_guard<mutex> guard(state_lock);
+         stopping = true;
+      }
+      work_available.notify_all();
+
+      for (thread &t : threads)
+         t.join();
+   }
+
+   unsigned int size() const { return queues.size(); }
+
+   void parallelFor(size_t count, const function<void(size_t)> &fn) {
+      if (count == 0)
+         return;
+
+      if (queues.size() == 1) {
+         for (size_t i = 0; i < count; ++i)
+            fn(i);
+         return;
+      }
+
+      lock_guard<mutex> serial(dispatch_lock);
+      task = &fn;
+      pending = count;
+
+      size_t block = (count + queues.size() - 1) / queues.size();
+      for (size_t q = 0; q < queues.size(); ++q) {
+         lock_guard<mutex> guard(queues[q]->lock);
+         for (size_t i = q * block; i < min(count, (q + 1) * block); ++i)
+            queues[q]->tasks.push_back(i);
+      }
+
+      {
+         lock_guard<mutex> guard(state_lock);
+         ++generation;
+      }
+      work_available.notify_all();
+
+      drain(0);
+
+      unique_lock<mutex> guard(state_lock);
+      work_done.wait(guard, [this] { return pending == 0; });
+      task = nullptr;
+   }
+
+private:
+   struct TaskQueue
+   {
+      mutex lock;
+      deque<size_t> tasks;
+   };
+
+   bool popOwn(size_t q, size_t &index) {
+      lock_guard<mutex> guard(queues[q]->lock);
+      if (queues[q]->tasks.empty())
+         return false;
+      index = queues[q]->tasks.front();
+      queues[q]->tasks.pop_front();
+      return true;
+   }
+
+   bool steal(size_t thief, size_t &index) {
+      for (size_t offset = 1; offset < queues.size(); ++offset) {
+         TaskQueue &victim = *queues[(thief + offset) % queues.size()];
+         lock_guard<mutex> guard(victim.lock);
+         if (!victim.tasks.empty()) {
+            index = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+         }
+      }
+      return false;
+   }
+
+   void drain(size_t q) {
+      size_t index;
+      while (popOwn(q, index) || steal(q, index)) {
+         (*task)(index);
+
+         if (pending.fetch_sub(1) == 1) {
+            lock_guard<mutex> guard(state_lock);
+            work_done.notify_all();
+         }
+      }
+   }
+
+   void workerLoop(size_t q) {
+      unsigned long seen = 0;
+
+      for (;;) {
+         {
+            unique_lock<mutex> guard(state_lock);
+            work_available.wait(guard, [&] { return stopping || generation != seen; });
+            if (stopping)
+               return;
+            seen = generation;
+         }
+         drain(q);
+      }
+   }
+
+   vector<unique_ptr<TaskQueue>> queues;
+   vector<thread> threads;
+
+   mutex dispatch_lock;
+   mutex state_lock;
+   condition_variable work_available;
+   condition_variable work_done;
+
+   const function<void(size_t)> *task = nullptr;
+   atomic<size_t> pending { 0 };
+   unsigned long generation = 0;
+   bool stopping = false;
+};
+
+// Shared pool used by the CPU tone mapping path, sized to the machine unless overridden
+inline unique_ptr<ThreadPool> &cpuThreadPoolInstance() {
+   static unique_ptr<ThreadPool> pool;
+   return pool;
+}
+
+inline void setCpuThreadCount(unsigned int workers) {
+   if (workers == 0)
+      workers = thread::hardware_concurrency();
+   cpuThreadPoolInstance().reset(new ThreadPool(workers));
+}
+
+inline ThreadPool &cpuThreadPool() {
+   if (!cpuThreadPoolInstance())
+      setCpuThreadCount(0);
+   return *cpuThreadPoolInstance();
+}
@@ -0,0 +1,332 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "tone_operators.h"
+#include "cube_lut.h"
+
+using namespace std;
+
+/* Baked tone curves
+ *
+ * Once the scene statistics are known the whole curve is a fixed function.
+ * It is baked from the operator and transfer policies into tables, and the
+ * pixel loop only interpolates:
+ *
+ *    luminance   c * scale[L * exposure], then channel[] (the transfer)
+ *    per channel channel[c * exposure] (transfer of the operator)
+ *    general     channel[c * exposure] (a log2 shaper), then a 3-D cube
+ *
+ * followed by an optional display grade cube, applied to the encoded output.
+ * A transfer to other primaries mixes the channels after the operator. The
+ * matrix commutes with a luminance scale, so that shape converts the scaled
+ * colour before the channel table; per channel curves bake as general.
+ * Exposure stays outside the tables, so a new log average never rebuilds
+ * them; only the scene maximum or a new curve does.
+ *
+ * The 1-D tables are indexed by the bits of the input float: every binade
+ * from 2^-32 to 2^16 holds tone_lut_segments linear segments, so the lookup is
+ * a shift and a mask, no log, and the relative spacing is the same for deep
+ * shadows and highlights. Each row repeats the first value of the next one so
+ * the right end of a segment never crosses rows. The GPU uses the same
+ * layout, the channel rows followed by the scale rows.
+ */
+const int tone_lut_segments = 256;
+const int tone_lut_row = tone_lut_segments + 1;
+const int tone_lut_min_exponent = -32;
+const int tone_lut_binades = 48;
+const size_t tone_lut_table_size = (size_t)tone_lut_row * tone_lut_binades;
+
+// log2 range of the exposed input covered by the general shape's cube, AgX's
+// own log encoding with a little margin
+const float tone_lut_shaper_min = -13.0f;
+const float tone_lut_shaper_max = 5.0f;
+
+const int tone_lut_default_cube_size = 33;
+
+struct tone_lut
+{
+   tone_curve curve = { TONE_OPERATOR_COUNT, TRANSFER_COUNT };
+   tone_operator_shape shape = TONE_SHAPE_GENERAL;
+   output_primaries primaries = OUTPUT_PRIMARIES_REC709;   // the luminance shape converts to them
+   float white = NAN;
+
+   vector<float> channel, scale;
+
+   // RGBA nodes, red fastest: the baked general curve with the grade composed
+   // in, or the grade alone for the other shapes. Empty when there is neither.
+   int cube_size = 0;
+   vector<float> cube;
+};
+
+// Smallest and largest inputs the tables resolve, 2^-32 and just below 2^16;
+// everything else is clamped
+const float tone_lut_min_input = 0x1p-32f;
+const float tone_lut_max_input = 0x1.fffffep15f;
+
+// Input value at a table entry
+inline float toneLutInput(int row, int column) {
+   return ldexp(1.0f + (float)column / tone_lut_segments, row + tone_lut_min_exponent);
+}
+
+inline float sampleToneTable(const float *table, float x) {
+   x = x > tone_lut_min_input ? (x < tone_lut_max_input ? x : tone_lut_max_input) : tone_lut_min_input;
+
+   uint32_t bits;
+   memcpy(&bits, &x, sizeof(bits));
+   int row = (int)(bits >> 23) - (127 + tone_lut_min_exponent);
+   int column = (bits >> 15) & (tone_lut_segments - 1);
+   float fraction = (bits & 0x7fff) * (1.0f / 32768.0f);
+
+   const float *entry = table + row * tone_lut_row + column;
+   return entry[0] + fraction * (entry[1] - entry[0]);
+}
+
+// Trilinear lookup of an RGBA cube of size nodes per side over [0, 1]
+inline void sampleToneCube(const float *cube, int size, const float in[3], float out[3]) {
+   int i[3];
+   float f[3];
+   for (int c = 0; c < 3; ++c)
+      cubeLutPosition(in[c], 0.0f, 1.0f, size, i[c], f[c]);
+
+   size_t base = (((size_t)i[2] * size + i[1]) * size + i[0]) * 4;
+   size_t dr = 4, dg = (size_t)size * 4, db = (size_t)size * size * 4;
+   for (int c = 0; c < 3; ++c) {
+      const float *p = cube + base + c;
+      float c00 = p[0] + f[0] * (p[dr] - p[0]);
+      float c10 = p[dg] + f[0] * (p[dg + dr] - p[dg]);
+      float c01 = p[db] + f[0] * (p[db + dr] - p[db]);
+      float c11 = p[db + dg] + f[0] * (p[db + dg + dr] - p[db + dg]);
+      float c0 = c00 + f[1] * (c10 - c00), c1 = c01 + f[1] * (c11 - c01);
+      out[c] = c0 + f[2] * (c1 - c0);
+   }
+}
+
+// One pixel through the baked curve, before clamping and quantization
+inline void sampleToneLut(const tone_lut &lut, float exposure, const float in[3], float out[3]) {
+   float v[3] = { in[0] * exposure, in[1] * exposure, in[2] * exposure };
+   if (lut.shape == TONE_SHAPE_LUMINANCE) {
+      float factor = sampleToneTable(lut.scale.data(), (0.2126f * in[0] + 0.7152f * in[1] + 0.0722f * in[2]) * exposure);
+      for (int c = 0; c < 3; ++c)
+         v[c] = in[c] * factor;
+      if (lut.primaries == OUTPUT_PRIMARIES_BT2020) {
+         glsl::vec3 converted = glsl::rec709ToRec2020(glsl::vec3(v[0], v[1], v[2]));
+         v[0] = converted.r;
+         v[1] = converted.g;
+         v[2] = converted.b;
+      }
+   }
+   for (int c = 0; c < 3; ++c)
+      out[c] = sampleToneTable(lut.channel.data(), v[c]);
+
+   if (lut.cube_size) {
+      float graded[3];
+      sampleToneCube(lut.cube.data(), lut.cube_size, out, graded);
+      memcpy(out, graded, sizeof(graded));
+   }
+}
+
+// The display grade as an RGBA cube over [0, 1], resampled from a .cube file
+inline vector<float> displayGradeCube(const cube_lut &grade, int size) {
+   vector<float> cube((size_t)size * size * size * 4);
+   float *node = cube.data();
+   for (int b = 0; b < size; ++b) {
+      for (int g = 0; g < size; ++g) {
+         for (int r = 0; r < size; ++r, node += 4) {
+            float in[3] = { (float)r / (size - 1), (float)g / (size - 1), (float)b / (size - 1) };
+            sampleCubeLut(grade, in, node);
+            node[3] = 1.0f;
+         }
+      }
+   }
+   return cube;
+}
+
+// The shape a curve bakes as, on the CPU and the GPU
+inline tone_operator_shape toneLutShape(const tone_curve &curve) {
+   tone_operator_shape shape = tone_operators[curve.op].shape;
+   if (shape == TONE_SHAPE_PER_CHANNEL && transfer_functions[curve.transfer].primaries != OUTPUT_PRIMARIES_REC709)
+      return TONE_SHAPE_GENERAL;
+   return shape;
+}
+
+/* Baking, one instantiation per operator and transfer function. The tables
+ * take already exposed input, so the operators run with an exposure of 1. */
+template <class Operator, class Transfer>
+void bakeToneLut(tone_lut &lut, float white, const vector<float> &grade, int grade_size, int cube_size) {
+   const glsl::ToneParams params = { 1.0f, white };
+   lut.shape = Operator::shape;
+   if (lut.shape == TONE_SHAPE_PER_CHANNEL && Transfer::primaries != OUTPUT_PRIMARIES_REC709)
+      lut.shape = TONE_SHAPE_GENERAL;
+   lut.primaries = Transfer::primaries;
+   lut.channel.resize(tone_lut_table_size);
+   lut.scale.clear();
+   if (lut.shape == TONE_SHAPE_LUMINANCE)
+      lut.scale.resize(tone_lut_table_size);
+
+   for (int row = 0; row < tone_lut_binades; ++row) {
+      for (int column = 0; column < tone_lut_row; ++column) {
+         float x = toneLutInput(row, column);
+         size_t entry = (size_t)row * tone_lut_row + column;
+         if (lut.shape == TONE_SHAPE_LUMINANCE) {
+            lut.channel[entry] = Transfer::encode(x);
+            lut.scale[entry] = Operator::apply(glsl::vec3(x), params).r / x;
+         }
+         else if (lut.shape == TONE_SHAPE_PER_CHANNEL)
+            lut.channel[entry] = Transfer::encode(Operator::apply(glsl::vec3(x), params).r);
+         else
+            lut.channel[entry] = glsl::clamp((log2(x) - tone_lut_shaper_min) / (tone_lut_shaper_max - tone_lut_shaper_min), 0.0f, 1.0f);
+      }
+   }
+
+   if (lut.shape != TONE_SHAPE_GENERAL) {
+      lut.cube_size = grade.empty() ? 0 : grade_size;
+      lut.cube = grade;
+      return;
+   }
+
+   // Every node of the general cube runs the whole curve at its shaper input
+   lut.cube_size = cube_size;
+   lut.cube.resize((size_t)cube_size * cube_size * cube_size * 4);
+   float *node = lut.cube.data();
+   for (int b = 0; b < cube_size; ++b) {
+      for (int g = 0; g < cube_size; ++g) {
+         for (int r = 0; r < cube_size; ++r, node += 4) {
+            int index[3] = { r, g, b };
+            float x[3];
+            for (int c = 0; c < 3; ++c)
+               x[c] = exp2(tone_lut_shaper_min + (tone_lut_shaper_max - tone_lut_shaper_min) * index[c] / (cube_size - 1));
+            glsl::vec3 y = Transfer::toPrimaries(Operator::apply(glsl::vec3(x[0], x[1], x[2]), params));
+            float encoded[3] = { Transfer::encode(y.r), Transfer::encode(y.g), Transfer::encode(y.b) };
+            if (!grade.empty()) {
+               for (int c = 0; c < 3; ++c)
+                  encoded[c] = glsl::clamp(encoded[c], 0.0f, 1.0f);
+               sampleToneCube(grade.data(), grade_size, encoded, node);
+            }
+            else
+               memcpy(node, encoded, sizeof(encoded));
+            node[3] = 1.0f;
+         }
+      }
+   }
+}
+
+typedef void (*tone_lut_baker)(tone_lut &lut, float white, const vector<float> &grade, int grade_size, int cube_size);
+
+#define HDR_LUT_BAKER(id, Transfer) bakeToneLut<Operator, Transfer>,
+#define HDR_OPERATOR_LUT_BAKERS(id, Operator) toneLutBakersFor<Operator>(),
+
+template <class Operator>
+const tone_lut_baker *toneLutBakersFor() {
+   static const tone_lut_baker bakers[] = { HDR_TRANSFER_FUNCTIONS(HDR_LUT_BAKER) };
+   return bakers;
+}
+
+/* LUT mode, set from the command line: on or off, the cube size of general
+ * curves, the display grade and where to export the baked curve */
+struct tone_lut_selection
+{
+   bool enabled = false;
+   int cube_size = tone_lut_default_cube_size;
+   vector<float> grade;
+   int grade_size = 0;
+   string export_path;
+};
+
+inline tone_lut_selection &toneLutSelection() {
+   static tone_lut_selection selection;
+   return selection;
+}
+
+// Loads a .cube file as the display grade and turns the LUT mode on
+inline bool selectGradeCube(const char *filename) {
+   cube_lut grade;
+   if (!readCubeFile(filename, grade))
+      return false;
+
+   tone_lut_selection &selection = toneLutSelection();
+   selection.grade_size = grade.size_3d ? grade.size_3d : tone_lut_default_cube_size;
+   selection.grade = displayGradeCube(grade, selection.grade_size);
+   selection.enabled = true;
+   return true;
+}
+
+// Bakes lut for curve and the scene maximum unless it already holds them,
+// returns whether it was rebuilt. The grade and cube size of a selection
+// never change while lut is in use.
+inline bool updateToneLut(tone_lut &lut, const tone_curve &curve, float white,
+                          const tone_lut_selection &selection = toneLutSelection()) {
+   if (lut.curve == curve && lut.white == white)
+      return false;
+
+   static const tone_lut_baker *const by_operator[] = { HDR_TONE_OPERATORS(HDR_OPERATOR_LUT_BAKERS) };
+   by_operator[curve.op][curve.transfer](lut, white, selection.grade, selection.grade_size, selection.cube_size);
+   lut.curve = curve;
+   lut.white = white;
+   return true;
+}
+
+/* Export as a shaper plus cube .cube file, which carries scene linear input.
+ * The shaper maps [0, range] onto log2(x + offset), exposed, where the offset
+ * is one shaper step: the shaper's own linear interpolation stays accurate
+ * near black and the first cube node is zero. The range reaches the scene
+ * maximum, so highlights are not clipped by the file. Every cube node holds
+ * the baked curve at its input. */
+inline bool exportToneLut(const char *filename, const tone_lut &lut, float exposure) {
+   const int shaper_size = 65536, cube_size = 65;
+   const float exposed_range = exp2(max(tone_lut_shaper_max, ceil(log2(lut.white * exposure))));
+   const float range = exposed_range / exposure, offset = exposed_range / (shaper_size - 1);
+   const float log_min = log2(offset), log_span = log2(exposed_range + offset) - log_min;
+
+   cube_lut out;
+   out.title = string(tone_operators[lut.curve.op].name) + " " + transfer_functions[lut.curve.transfer].name;
+   out.size_1d = shaper_size;
+   out.size_3d = cube_size;
+   for (int c = 0; c < 3; ++c) {
+      out.min_1d[c] = 0.0f;
+      out.max_1d[c] = range;
+   }
+
+   out.table_1d.resize(shaper_size * 3);
+   for (int i = 0; i < shaper_size; ++i) {
+      float x = exposed_range * i / (shaper_size - 1);
+      float u = glsl::clamp((log2(x + offset) - log_min) / log_span, 0.0f, 1.0f);
+      out.table_1d[i * 3] = out.table_1d[i * 3 + 1] = out.table_1d[i * 3 + 2] = u;
+   }
+
+   out.table_3d.resize((size_t)cube_size * cube_size * cube_size * 3);
+   float *node = out.table_3d.data();
+   for (int b = 0; b < cube_size; ++b) {
+      for (int g = 0; g < cube_size; ++g) {
+         for (int r = 0; r < cube_size; ++r, node += 3) {
+            int index[3] = { r, g, b };
+            float in[3];
+            for (int c = 0; c < 3; ++c)
+               in[c] = (exp2(log_min + log_span * index[c] / (cube_size - 1)) - offset) / exposure;
+            sampleToneLut(lut, exposure, in, node);
+            for (int c = 0; c < 3; ++c)
+               node[c] = glsl::clamp(node[c], 0.0f, 1.0f);
+         }
+      }
+   }
+
+   if (!writeCubeFile(filename, out))
+      return false;
+   printf("Tone curve written to %s\n", filename);
+   return true;
+}
+
+// Writes the selected curve for these statistics when an export was asked for
+inline void exportSelectedToneLut(const tone_curve &curve, float max_brightness, float avg_brightness) {
+   const string &path = toneLutSelection().export_path;
+   if (path.empty())
+      return;
+
+   tone_lut lut;
+   updateToneLut(lut, curve, max_brightness);
+   exportToneLut(path.c_str(), lut, 0.18f / avg_brightness);
+}
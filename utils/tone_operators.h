@@ -0,0 +1,401 @@
+#pragma once
+
+#include <cmath>
+#include <cstring>
+#include <string>
+
+using namespace std;
+
+/* Tone mapping operators
+ *
+ * Every curve is written once, in the common subset of C++ and GLSL ES 3.00,
+ * against the small vec3 / mat3 shim below. HDR_TONE_OPERATOR and
+ * HDR_TRANSFER_FUNCTION compile that text as C++ in namespace glsl and keep
+ * it as a string for the fragment shader, so both paths run the same
+ * formula. Each definition also becomes a policy type: the CPU instantiates
+ * one row kernel per operator and transfer function, with the curve inlined
+ * into the pixel loop, and the runtime choice is made once per image.
+ *
+ * An operator maps linear scene colour to linear display colour,
+ * vec3 f(vec3 color, ToneParams p), with p.exposure = 0.18 / log average and
+ * p.white = the scene maximum. A transfer function encodes one display
+ * channel, float f(float v); results are clamped to [0, 1] when quantized.
+ * It also names the primaries of its signal: Rec.709 like the input, or
+ * BT.2020, which the display colour is converted to before encoding.
+ * Rules for the shared text: float literals with an f suffix, .r .g .b
+ * component access, no swizzles, helpers defined before their use, every
+ * function qualified HDR_INLINE.
+ *
+ * The shape of an operator tells the LUT engine how to bake it:
+ * per channel, f(c)_i = f(vec3(c_i))_i; a luminance scale,
+ * f(c) = c * f(vec3(L))_r / L with L the Rec.709 luminance; or general.
+ *
+ * To add a curve, define it with HDR_TONE_OPERATOR and append it to
+ * HDR_TONE_OPERATORS.
+ */
+enum tone_operator_shape { TONE_SHAPE_PER_CHANNEL, TONE_SHAPE_LUMINANCE, TONE_SHAPE_GENERAL };
+enum output_primaries { OUTPUT_PRIMARIES_REC709, OUTPUT_PRIMARIES_BT2020 };
+
+namespace glsl
+{
+
+typedef unsigned int uint;
+
+struct vec3
+{
+   float r, g, b;
+
+   vec3() : r(0.0f), g(0.0f), b(0.0f) {}
+   explicit vec3(float v) : r(v), g(v), b(v) {}
+   vec3(float r, float g, float b) : r(r), g(g), b(b) {}
+};
+
+// Column major like GLSL: the first three values are the first column
+struct mat3
+{
+   vec3 c0, c1, c2;
+
+   mat3(float m00, float m01, float m02, float m10, float m11, float m12, float m20, float m21, float m22)
+      : c0(m00, m01, m02), c1(m10, m11, m12), c2(m20, m21, m22) {}
+};
+
+inline vec3 operator+(vec3 a, vec3 b) { return vec3(a.r + b.r, a.g + b.g, a.b + b.b); }
+inline vec3 operator-(vec3 a, vec3 b) { return vec3(a.r - b.r, a.g - b.g, a.b - b.b); }
+inline vec3 operator*(vec3 a, vec3 b) { return vec3(a.r * b.r, a.g * b.g, a.b * b.b); }
+inline vec3 operator/(vec3 a, vec3 b) { return vec3(a.r / b.r, a.g / b.g, a.b / b.b); }
+inline vec3 operator+(vec3 a, float s) { return vec3(a.r + s, a.g + s, a.b + s); }
+inline vec3 operator-(vec3 a, float s) { return vec3(a.r - s, a.g - s, a.b - s); }
+inline vec3 operator*(vec3 a, float s) { return vec3(a.r * s, a.g * s, a.b * s); }
+inline vec3 operator/(vec3 a, float s) { return vec3(a.r / s, a.g / s, a.b / s); }
+inline vec3 operator+(float s, vec3 a) { return vec3(s + a.r, s + a.g, s + a.b); }
+inline vec3 operator-(float s, vec3 a) { return vec3(s - a.r, s - a.g, s - a.b); }
+inline vec3 operator*(float s, vec3 a) { return vec3(s * a.r, s * a.g, s * a.b); }
+inline vec3 operator/(float s, vec3 a) { return vec3(s / a.r, s / a.g, s / a.b); }
+inline vec3 operator*(const mat3 &m, vec3 v) { return m.c0 * v.r + m.c1 * v.g + m.c2 * v.b; }
+
+inline float dot(vec3 a, vec3 b) { return a.r * b.r + a.g * b.g + a.b * b.b; }
+inline float max(float a, float b) { return a > b ? a : b; }
+inline float min(float a, float b) { return a < b ? a : b; }
+inline int min(int a, int b) { return a < b ? a : b; }
+inline float clamp(float v, float lo, float hi) { return min(max(v, lo), hi); }
+inline vec3 max(vec3 v, float s) { return vec3(max(v.r, s), max(v.g, s), max(v.b, s)); }
+inline vec3 min(vec3 v, float s) { return vec3(min(v.r, s), min(v.g, s), min(v.b, s)); }
+inline vec3 clamp(vec3 v, float lo, float hi) { return vec3(clamp(v.r, lo, hi), clamp(v.g, lo, hi), clamp(v.b, lo, hi)); }
+inline float pow(float x, float y) { return std::pow(x, y); }
+inline vec3 pow(vec3 x, vec3 y) { return vec3(std::pow(x.r, y.r), std::pow(x.g, y.g), std::pow(x.b, y.b)); }
+inline float sqrt(float x) { return std::sqrt(x); }
+inline float log(float x) { return std::log(x); }
+inline float log2(float x) { return std::log2(x); }
+inline float exp2(float x) { return std::exp2(x); }
+inline vec3 log2(vec3 x) { return vec3(std::log2(x.r), std::log2(x.g), std::log2(x.b)); }
+inline uint floatBitsToUint(float x) { uint bits; memcpy(&bits, &x, sizeof(bits)); return bits; }
+
+}
+
+// Qualifies every function of the shared text: inline in C++, so a program
+// and libhdrtonemap.a each keep their own copy, and defined away by the
+// prelude each shader string starts with
+#define HDR_INLINE inline
+#define HDR_SHADER_PRELUDE "\n#define HDR_INLINE\n"
+
+// Compiles the code as C++ in namespace glsl and keeps its text as a string
+#define HDR_SHADER_SOURCE(source_name, ...) \
+   namespace glsl { __VA_ARGS__ const char source_name[] = HDR_SHADER_PRELUDE #__VA_ARGS__; }
+
+#define HDR_TONE_OPERATOR(Policy, operator_name, function_name, operator_shape, ...) \
+   namespace glsl { __VA_ARGS__ } \
+   struct Policy \
+   { \
+      static constexpr const char *name = operator_name; \
+      static constexpr tone_operator_shape shape = operator_shape; \
+      static constexpr const char *function = #function_name; \
+      static constexpr const char *source = HDR_SHADER_PRELUDE #__VA_ARGS__; \
+      static glsl::vec3 apply(glsl::vec3 color, const glsl::ToneParams &params) { return glsl::function_name(color, params); } \
+   };
+
+#define HDR_TRANSFER_FUNCTION(Policy, transfer_name, function_name, signal_primaries, ...) \
+   namespace glsl { __VA_ARGS__ } \
+   struct Policy \
+   { \
+      static constexpr const char *name = transfer_name; \
+      static constexpr const char *function = #function_name; \
+      static constexpr const char *source = HDR_SHADER_PRELUDE #__VA_ARGS__; \
+      static constexpr output_primaries primaries = signal_primaries; \
+      static float encode(float v) { return glsl::function_name(v); } \
+      static glsl::vec3 toPrimaries(glsl::vec3 color) { \
+         return primaries == OUTPUT_PRIMARIES_BT2020 ? glsl::rec709ToRec2020(color) : color; \
+      } \
+   };
+
+HDR_SHADER_SOURCE(tone_common_source,
+   struct ToneParams
+   {
+      float exposure;
+      float white;
+   };
+
+   HDR_INLINE float luminance(vec3 color) {
+      return dot(vec3(0.2126f, 0.7152f, 0.0722f), color);
+   }
+
+   // Linear Rec.709 to BT.2020 primaries (ITU-R BT.2087), D65 on both sides
+   HDR_INLINE vec3 rec709ToRec2020(vec3 color) {
+      mat3 m = mat3(0.627403896f, 0.069097289f, 0.016391439f,
+                    0.329283038f, 0.919540395f, 0.088013308f,
+                    0.043313066f, 0.011362316f, 0.895595253f);
+      return m * color;
+   }
+)
+
+/* Operators */
+
+// Reinhard, Lout = L / (1 + L) on the exposed luminance. Like the extended
+// operator the compression factor is applied to the unexposed colour.
+HDR_TONE_OPERATOR(ReinhardOperator, "reinhard", reinhard, TONE_SHAPE_LUMINANCE,
+   HDR_INLINE vec3 reinhard(vec3 color, ToneParams p) {
+      float scaled = luminance(color) * p.exposure;
+      return color * (1.0f / (1.0f + scaled));
+   }
+)
+
+// Reinhard extended, Lout = L (1 + L / Lwhite^2) / (1 + L); the factor
+// Lout / L is written so that black pixels do not divide by zero
+HDR_TONE_OPERATOR(ReinhardExtendedOperator, "reinhard-extended", reinhardExtended, TONE_SHAPE_LUMINANCE,
+   HDR_INLINE vec3 reinhardExtended(vec3 color, ToneParams p) {
+      float scaled = luminance(color) * p.exposure;
+      float whiteness = 1.0f / (p.white * p.white);
+      return color * ((1.0f + scaled * whiteness) / (1.0f + scaled));
+   }
+)
+
+// Narkowicz's fit of the ACES reference rendering transform, per channel
+HDR_TONE_OPERATOR(AcesFilmicOperator, "aces", acesFilmic, TONE_SHAPE_PER_CHANNEL,
+   HDR_INLINE vec3 acesFilmic(vec3 color, ToneParams p) {
+      vec3 x = color * p.exposure;
+      return clamp((x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f), 0.0f, 1.0f);
+   }
+)
+
+// Hable's Uncharted 2 curve with its exposure bias of 2 and linear white at 11.2
+HDR_TONE_OPERATOR(HableFilmicOperator, "hable", hableFilmic, TONE_SHAPE_PER_CHANNEL,
+   HDR_INLINE vec3 hablePartial(vec3 x) {
+      const float A = 0.15f;
+      const float B = 0.50f;
+      const float C = 0.10f;
+      const float D = 0.20f;
+      const float E = 0.02f;
+      const float F = 0.30f;
+      return (x * (A * x + C * B) + D * E) / (x * (A * x + B) + D * F) - E / F;
+   }
+
+   HDR_INLINE vec3 hableFilmic(vec3 color, ToneParams p) {
+      const float white = 11.2f;
+      return hablePartial(color * (2.0f * p.exposure)) / hablePartial(vec3(white));
+   }
+)
+
+// AgX base look: inset to the AgX primaries, log2 encode over [-12.47, 4.03]
+// stops, the sigmoid polynomial fit, outset, and back to linear
+HDR_TONE_OPERATOR(AgxOperator, "agx", agx, TONE_SHAPE_GENERAL,
+   HDR_INLINE vec3 agxContrast(vec3 x) {
+      vec3 x2 = x * x;
+      vec3 x4 = x2 * x2;
+      return 15.5f * x4 * x2 - 40.14f * x4 * x + 31.96f * x4 - 6.868f * x2 * x + 0.4298f * x2 + 0.1191f * x - 0.00232f;
+   }
+
+   HDR_INLINE vec3 agx(vec3 color, ToneParams p) {
+      const float min_ev = -12.47393f;
+      const float max_ev = 4.026069f;
+      mat3 inset = mat3(0.842479062253094f, 0.0423282422610123f, 0.0423756549057051f,
+                        0.0784335999999992f, 0.878468636469772f, 0.0784336f,
+                        0.0792237451477643f, 0.0791661274605434f, 0.879142973793104f);
+      mat3 outset = mat3(1.19687900512017f, -0.0528968517574562f, -0.0529716355144438f,
+                         -0.0980208811401368f, 1.15190312990417f, -0.0980434501171241f,
+                         -0.0990297440797205f, -0.0989611768448433f, 1.15107367264116f);
+
+      vec3 x = inset * max(color * p.exposure, 1e-10f);
+      x = (clamp(log2(x), min_ev, max_ev) - min_ev) / (max_ev - min_ev);
+      x = outset * agxContrast(x);
+      return pow(max(x, 0.0f), vec3(2.2f));
+   }
+)
+
+// Exposure only, everything above white clips
+HDR_TONE_OPERATOR(ExposureOperator, "exposure", exposureOnly, TONE_SHAPE_PER_CHANNEL,
+   HDR_INLINE vec3 exposureOnly(vec3 color, ToneParams p) {
+      return color * p.exposure;
+   }
+)
+
+/* Output transfer functions */
+
+HDR_TRANSFER_FUNCTION(LinearTransfer, "linear", encodeLinear, OUTPUT_PRIMARIES_REC709,
+   HDR_INLINE float encodeLinear(float v) {
+      return v;
+   }
+)
+
+// Pure power law, the original CPU path
+HDR_TRANSFER_FUNCTION(Gamma22Transfer, "gamma22", encodeGamma22, OUTPUT_PRIMARIES_REC709,
+   HDR_INLINE float encodeGamma22(float v) {
+      return pow(max(v, 0.0f), 1.0f / 2.2f);
+   }
+)
+
+// Piecewise sRGB (IEC 61966-2-1), the original GPU path
+HDR_TRANSFER_FUNCTION(SrgbTransfer, "srgb", encodeSrgb, OUTPUT_PRIMARIES_REC709,
+   HDR_INLINE float encodeSrgb(float v) {
+      if (v <= 0.0031308f)
+         return v * 12.92f;
+      return 1.055f * pow(v, 1.0f / 2.4f) - 0.055f;
+   }
+)
+
+// HDR10: the SMPTE ST 2084 inverse EOTF on BT.2020 primaries. Display white
+// 1.0 is put at 1000 cd/m2, the usual HDR10 mastering peak, of the 10000 the
+// curve spans.
+HDR_TRANSFER_FUNCTION(PqTransfer, "pq", encodePq, OUTPUT_PRIMARIES_BT2020,
+   HDR_INLINE float encodePq(float v) {
+      const float m1 = 0.1593017578125f;
+      const float m2 = 78.84375f;
+      const float c1 = 0.8359375f;
+      const float c2 = 18.8515625f;
+      const float c3 = 18.6875f;
+      float y = pow(max(v, 0.0f) * 0.1f, m1);
+      return pow((c1 + c2 * y) / (1.0f + c3 * y), m2);
+   }
+)
+
+// Hybrid log-gamma OETF of ITU-R BT.2100 on BT.2020 primaries, display white
+// 1.0 at the nominal peak signal
+HDR_TRANSFER_FUNCTION(HlgTransfer, "hlg", encodeHlg, OUTPUT_PRIMARIES_BT2020,
+   HDR_INLINE float encodeHlg(float v) {
+      const float a = 0.17883277f;
+      const float b = 0.28466892f;
+      const float c = 0.55991073f;
+      float e = max(v, 0.0f);
+      if (e <= 1.0f / 12.0f)
+         return sqrt(3.0f * e);
+      return a * log(12.0f * e - b) + c;
+   }
+)
+
+/* Registry: X(enum, policy) in enum order */
+#define HDR_TONE_OPERATORS(X) \
+   X(TONE_OPERATOR_REINHARD, ReinhardOperator) \
+   X(TONE_OPERATOR_REINHARD_EXTENDED, ReinhardExtendedOperator) \
+   X(TONE_OPERATOR_ACES, AcesFilmicOperator) \
+   X(TONE_OPERATOR_HABLE, HableFilmicOperator) \
+   X(TONE_OPERATOR_AGX, AgxOperator) \
+   X(TONE_OPERATOR_EXPOSURE, ExposureOperator)
+
+#define HDR_TRANSFER_FUNCTIONS(X) \
+   X(TRANSFER_LINEAR, LinearTransfer) \
+   X(TRANSFER_GAMMA22, Gamma22Transfer) \
+   X(TRANSFER_SRGB, SrgbTransfer) \
+   X(TRANSFER_PQ, PqTransfer) \
+   X(TRANSFER_HLG, HlgTransfer)
+
+#define HDR_REGISTRY_ENUM(id, Policy) id,
+#define HDR_REGISTRY_INFO(id, Policy) { Policy::name, Policy::function, Policy::source, Policy::primaries },
+#define HDR_REGISTRY_OPERATOR_INFO(id, Policy) { Policy::name, Policy::function, Policy::source, Policy::shape },
+
+enum tone_operator_type { HDR_TONE_OPERATORS(HDR_REGISTRY_ENUM) TONE_OPERATOR_COUNT };
+enum transfer_type { HDR_TRANSFER_FUNCTIONS(HDR_REGISTRY_ENUM) TRANSFER_COUNT };
+
+struct curve_info
+{
+   const char *name;
+   const char *function;  // GLSL entry point
+   const char *source;    // GLSL definition
+};
+
+struct transfer_info : curve_info
+{
+   output_primaries primaries;
+};
+
+struct tone_operator_info : curve_info
+{
+   tone_operator_shape shape;
+};
+
+const tone_operator_info tone_operators[] = { HDR_TONE_OPERATORS(HDR_REGISTRY_OPERATOR_INFO) };
+const transfer_info transfer_functions[] = { HDR_TRANSFER_FUNCTIONS(HDR_REGISTRY_INFO) };
+
+struct tone_curve
+{
+   tone_operator_type op;
+   transfer_type transfer;
+};
+
+inline bool operator==(const tone_curve &a, const tone_curve &b) {
+   return a.op == b.op && a.transfer == b.transfer;
+}
+
+inline bool operator!=(const tone_curve &a, const tone_curve &b) {
+   return !(a == b);
+}
+
+inline bool parseToneOperator(const string &name, tone_operator_type &op) {
+   for (int i = 0; i < TONE_OPERATOR_COUNT; ++i) {
+      if (name == tone_operators[i].name) {
+         op = (tone_operator_type)i;
+         return true;
+      }
+   }
+   return false;
+}
+
+inline bool parseTransferFunction(const string &name, transfer_type &transfer) {
+   for (int i = 0; i < TRANSFER_COUNT; ++i) {
+      if (name == transfer_functions[i].name) {
+         transfer = (transfer_type)i;
+         return true;
+      }
+   }
+   return false;
+}
+
+// GLSL defining the curve's functions plus TONE_OPERATOR and ENCODE_TRANSFER
+// naming its entry points, and OUTPUT_BT2020 when the display colour is
+// converted before encoding, for a shader that already set the float precision
+inline string toneCurveShaderSource(const tone_curve &curve) {
+   const tone_operator_info &op = tone_operators[curve.op];
+   const transfer_info &transfer = transfer_functions[curve.transfer];
+   return string(glsl::tone_common_source) + "\n" + op.source + "\n" + transfer.source + "\n" +
+          "#define TONE_OPERATOR " + op.function + "\n#define ENCODE_TRANSFER " + transfer.function + "\n" +
+          (transfer.primaries == OUTPUT_PRIMARIES_BT2020 ? "#define OUTPUT_BT2020\n" : "");
+}
+
+/* Selected curve, set from the command line. The operator defaults to
+ * Reinhard extended; without an explicit transfer function every path keeps
+ * its own default (gamma 2.2 on the CPU, sRGB on the GPU). */
+struct tone_curve_selection
+{
+   tone_operator_type op = TONE_OPERATOR_REINHARD_EXTENDED;
+   bool transfer_set = false;
+   transfer_type transfer = TRANSFER_GAMMA22;
+};
+
+inline tone_curve_selection &toneCurveSelection() {
+   static tone_curve_selection selection;
+   return selection;
+}
+
+inline bool selectToneOperator(const string &name) {
+   return parseToneOperator(name, toneCurveSelection().op);
+}
+
+inline bool selectTransferFunction(const string &name) {
+   tone_curve_selection &selection = toneCurveSelection();
+   if (!parseTransferFunction(name, selection.transfer))
+      return false;
+   selection.transfer_set = true;
+   return true;
+}
+
+inline tone_curve selectedToneCurve(transfer_type path_default) {
+   const tone_curve_selection &selection = toneCurveSelection();
+   return { selection.op, selection.transfer_set ? selection.transfer : path_default };
+}
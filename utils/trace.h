@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+/* Stage timing and counters
+ *
+ * TraceScope records the wall-clock time of a stage on the calling thread,
+ * traceCount() adds to a named counter (bytes read, bytes written, pixels).
+ * Everything is off unless enableTracing() was called: a disabled scope is a
+ * load of one flag, no clock read, no allocation. GPU durations arrive through
+ * traceGpuEvent() from the GL timer queries.
+ *
+ * At exit the events are written either as Chrome trace format
+ * (chrome://tracing, Perfetto) or as a per-stage summary with the counters
+ * and the peak RSS.
+ */
+struct trace_event
+{
+   const char *name;
+   const char *category;
+   long long start_us, duration_us;
+   int thread;
+   size_t pixels, bytes;
+};
+
+struct trace_state
+{
+   atomic<bool> enabled{ false };
+   chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+   mutex lock;
+   vector<trace_event> events;
+   map<string, unsigned long long> counters;
+   atomic<int> next_thread{ 0 };
+};
+
+inline trace_state &traceState() {
+   static trace_state state;
+   return state;
+}
+
+inline bool tracingEnabled() {
+   return traceState().enabled.load(memory_order_relaxed);
+}
+
+inline void enableTracing() {
+   traceState().enabled = true;
+}
+
+inline long long traceNow() {
+   return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - traceState().origin).count();
+}
+
+// Small stable id per thread, the GPU timeline uses -1
+inline int traceThread() {
+   thread_local int id = traceState().next_thread++;
+   return id;
+}
+
+inline void traceRecord(const trace_event &event) {
+   trace_state &state = traceState();
+   lock_guard<mutex> guard(state.lock);
+   state.events.push_back(event);
+}
+
+inline void traceCount(const char *counter, unsigned long long amount) {
+   if (!tracingEnabled())
+      return;
+   trace_state &state = traceState();
+   lock_guard<mutex> guard(state.lock);
+   state.counters[counter] += amount;
+}
+
+// A GPU duration measured by a timer query, placed at the CPU time it was submitted
+inline void traceGpuEvent(const char *name, long long submitted_us, long long duration_us, size_t pixels) {
+   traceRecord({ name, "gpu", submitted_us, duration_us, -1, pixels, 0 });
+}
+
+class TraceScope
+{
+public:
+   explicit TraceScope(const char *name, const char *category = "cpu")
+      : name(name), category(category), start(tracingEnabled() ? traceNow() : -1) {}
+
+   ~TraceScope() {
+      if (start >= 0)
+         traceRecord({ name, category, start, traceNow() - start, traceThread(), pixels, bytes });
+   }
+
+   TraceScope(const TraceScope&) = delete;
+   TraceScope &operator=(const TraceScope&) = delete;
+
+   void setPixels(size_t count) { pixels = count; }
+   void setBytes(size_t count) { bytes = count; }
+
+private:
+   const char *name, *category;
+   long long start;
+   size_t pixels = 0, bytes = 0;
+};
+
+inline size_t peakResidentBytes() {
+   struct rusage usage;
+   getrusage(RUSAGE_SELF, &usage);
+   return (size_t)usage.ru_maxrss * 1024;
+}
+
+// Chrome trace format: complete events per thread, the GPU on its own track
+inline bool writeChromeTrace(const char *filename) {
+   FILE *out = fopen(filename, "w");
+   if (!out) {
+      perror("Failed to write the trace");
+      return false;
+   }
+
+   trace_state &state = traceState();
+   lock_guard<mutex> guard(state.lock);
+
+   fprintf(out, "{\"traceEvents\":[\n");
+   fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1000,\"args\":{\"name\":\"GPU\"}}");
+   for (const trace_event &event : state.events) {
+      fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,"
+                   "\"args\":{\"pixels\":%zu,\"bytes\":%zu}}",
+              event.name, event.category, event.thread < 0 ? 1000 : event.thread,
+              event.start_us, event.duration_us, event.pixels, event.bytes);
+   }
+   fprintf(out, "\n],\"otherData\":{\"peak_rss_bytes\":%zu", peakResidentBytes());
+   for (const auto &counter : state.counters)
+      fprintf(out, ",\"%s\":%llu", counter.first.c_str(), counter.second);
+   fprintf(out, "}}\n");
+
+   fclose(out);
+   return true;
+}
+
+// Per-stage totals, counters and peak RSS
+inline bool writeTraceReport(const char *filename) {
+   FILE *out = fopen(filename, "w");
+   if (!out) {
+      perror("Failed to write the report");
+      return false;
+   }
+
+   struct stage_total
+   {
+      size_t calls = 0, pixels = 0, bytes = 0;
+      long long total_us = 0, max_us = 0;
+   };
+
+   trace_state &state = traceState();
+   lock_guard<mutex> guard(state.lock);
+
+   map<pair<string, string>, stage_total> stages;
+   for (const trace_event &event : state.events) {
+      stage_total &total = stages[{ event.category, event.name }];
+      ++total.calls;
+      total.pixels += event.pixels;
+      total.bytes += event.bytes;
+      total.total_us += event.duration_us;
+      total.max_us = max(total.max_us, event.duration_us);
+   }
+
+   fprintf(out, "{\n  \"wall_seconds\": %.6f,\n  \"peak_rss_bytes\": %zu,\n  \"stages\": [",
+           traceNow() / 1e6, peakResidentBytes());
+   bool first = true;
+   for (const auto &stage : stages) {
+      const stage_total &total = stage.second;
+      fprintf(out, "%s\n    { \"category\": \"%s\", \"name\": \"%s\", \"calls\": %zu, \"total_ms\": %.3f, \"max_ms\": %.3f, "
+                   "\"pixels\": %zu, \"bytes\": %zu }",
+              first ? "" : ",", stage.first.first.c_str(), stage.first.second.c_str(), total.calls,
+              total.total_us / 1e3, total.max_us / 1e3, total.pixels, total.bytes);
+      first = false;
+   }
+   fprintf(out, "\n  ],\n  \"counters\": {");
+   first = true;
+   for (const auto &counter : state.counters) {
+      fprintf(out, "%s\n    \"%s\": %llu", first ? "" : ",", counter.first.c_str(), counter.second);
+      first = false;
+   }
+   fprintf(out, "\n  }\n}\n");
+
+   fclose(out);
+   return true;
+}
+
+// Adds the size of a file about to be read to the bytes_read counter
+inline void traceFileRead(const char *filename) {
+   struct stat info;
+   if (tracingEnabled() && filename && stat(filename, &info) == 0)
+      traceCount("bytes_read", info.st_size);
+}
+
+// Turns tracing on when either path is set and writes the files when it goes
+// out of scope, so every return path of a driver produces them
+class TraceOutput
+{
+public:
+   TraceOutput(const string &trace_path, const string &report_path)
+      : trace_path(trace_path), report_path(report_path) {
+      if (!trace_path.empty() || !report_path.empty())
+         enableTracing();
+   }
+
+   ~TraceOutput() {
+      if (!trace_path.empty())
+         writeChromeTrace(trace_path.c_str());
+      if (!report_path.empty())
+         writeTraceReport(report_path.c_str());
+   }
+
+   TraceOutput(const TraceOutput&) = delete;
+   TraceOutput &operator=(const TraceOutput&) = delete;
+
+private:
+   string trace_path, report_path;
+};
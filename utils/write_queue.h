@@ -0,0 +1,78 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+/* Background I/O thread
+ *
+ * Jobs run one at a time, in submission order, on a dedicated thread so file
+ * writes never stall the thread that drives the GPU. push() blocks once
+ * max_pending jobs are queued, which bounds the memory held by frames that
+ * are waiting to be written. The destructor drains the queue.
+ */
+class WriteQueue
+{
+public:
+   explicit WriteQueue(size_t max_pending = 4) : max_pending(max_pending ? max_pending : 1) {
+      worker = thread(&WriteQueue::workerLoop, this);
+   }
+
+   ~WriteQueue() {
+      {
+         lock_guard<mutex> guard(state_lock);
+         stopping = true;
+      }
+      job_available.notify_all();
+      worker.join();
+   }
+
+   void push(function<void()> job) {
+      unique_lock<mutex> guard(state_lock);
+      slot_available.wait(guard, [this] { return jobs.size() < max_pending; });
+      jobs.push_back(move(job));
+      job_available.notify_one();
+   }
+
+   // Waits until every job pushed so far has run
+   void drain() {
+      unique_lock<mutex> guard(state_lock);
+      idle.wait(guard, [this] { return jobs.empty() && !busy; });
+   }
+
+private:
+   void workerLoop() {
+      unique_lock<mutex> guard(state_lock);
+      for (;;) {
+         job_available.wait(guard, [this] { return stopping || !jobs.empty(); });
+         if (jobs.empty())
+            return;
+
+         function<void()> job = move(jobs.front());
+         jobs.pop_front();
+         busy = true;
+         slot_available.notify_one();
+
+         guard.unlock();
+         job();
+         guard.lock();
+
+         busy = false;
+         if (jobs.empty())
+            idle.notify_all();
+      }
+   }
+
+   size_t max_pending;
+   deque<function<void()>> jobs;
+   bool busy = false;
+   bool stopping = false;
+
+   mutex state_lock;
+   condition_variable job_available, slot_available, idle;
+   thread worker;
+};